@@ -0,0 +1,244 @@
+/*
+ * battery.c
+ *
+ *  Continuous ADC battery monitor, see battery.h.
+ */
+
+#include <string.h>
+#include "battery.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_adc_cal.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define DMA_BUF_COUNT   (4)
+#define DMA_BUF_LEN     (256)       // samples per DMA buffer
+#define RAW_FRAC_BITS   (4)         // filter keeps sub-LSB resolution
+
+static const char* tag = "battery";
+
+static battery_config_t config;
+static esp_adc_cal_characteristics_t adc_chars;
+
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static battery_reading_t ring[BATTERY_RING_LEN];
+static size_t ring_head = 0;
+static size_t ring_count = 0;
+
+static TaskHandle_t task_handle;
+static esp_timer_handle_t timer;
+
+static struct {
+	uint32_t low_mv;
+	uint32_t high_mv;
+	battery_cb_t cb;
+	void* arg;
+	bool low;
+	bool known;
+} subscribers[BATTERY_MAX_SUBSCRIBERS];
+static size_t subscriber_count = 0;
+
+static void check_efuse(void)
+{
+	ESP_LOGI(tag, "eFuse Two Point: %s",
+			esp_adc_cal_check_efuse(ESP_ADC_CAL_VAL_EFUSE_TP) == ESP_OK ? "Supported" : "NOT supported");
+	ESP_LOGI(tag, "eFuse Vref: %s",
+			esp_adc_cal_check_efuse(ESP_ADC_CAL_VAL_EFUSE_VREF) == ESP_OK ? "Supported" : "NOT supported");
+}
+
+static void print_char_val_type(esp_adc_cal_value_t val_type)
+{
+	if (val_type == ESP_ADC_CAL_VAL_EFUSE_TP)
+		ESP_LOGI(tag, "Characterized using Two Point Value");
+	else if (val_type == ESP_ADC_CAL_VAL_EFUSE_VREF)
+		ESP_LOGI(tag, "Characterized using eFuse Vref");
+	else
+		ESP_LOGI(tag, "Characterized using Default Vref");
+}
+
+static void notify(const battery_reading_t* r)
+{
+	for (size_t i = 0; i < subscriber_count; i++) {
+		bool low = subscribers[i].low;
+		if (r->battery_mv < subscribers[i].low_mv)
+			low = true;
+		else if (r->battery_mv > subscribers[i].high_mv)
+			low = false;
+		if (subscribers[i].known && low == subscribers[i].low)
+			continue;
+		subscribers[i].low = low;
+		subscribers[i].known = true;
+		subscribers[i].cb(r, low, subscribers[i].arg);
+	}
+}
+
+static void store(uint32_t filtered)
+{
+	battery_reading_t r;
+	r.time_us = esp_timer_get_time();
+	r.raw = filtered >> RAW_FRAC_BITS;
+	r.adc_mv = esp_adc_cal_raw_to_voltage(r.raw, &adc_chars);
+	r.battery_mv = r.adc_mv * config.scale;
+
+	portENTER_CRITICAL(&lock);
+	ring[ring_head] = r;
+	ring_head = (ring_head + 1) % BATTERY_RING_LEN;
+	if (ring_count < BATTERY_RING_LEN)
+		ring_count++;
+	portEXIT_CRITICAL(&lock);
+
+	notify(&r);
+}
+
+static void timer_cb(void* arg)
+{
+	xTaskNotifyGive(task_handle);
+}
+
+// the DMA fills buffers in the background, this only sums what arrived
+static void battery_task(void* arg)
+{
+	static uint16_t buf[DMA_BUF_LEN];
+	uint32_t sum = 0;
+	uint32_t count = 0;
+	uint32_t filtered = 0;
+	bool primed = false;
+
+	while (1) {
+		// periodic mode: sleep until the timer, then run the ADC for one block
+		if (config.period_ms && count == 0) {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			i2s_adc_enable(config.i2s);
+		}
+
+		size_t bytes = 0;
+		if (i2s_read(config.i2s, buf, sizeof(buf), &bytes, portMAX_DELAY) != ESP_OK)
+			continue;
+
+		for (size_t i = 0; i < bytes / sizeof(buf[0]); i++) {
+			// upper 4 bits carry the channel number
+			sum += buf[i] & 0x0FFF;
+			if (++count < config.decimation)
+				continue;
+
+			uint32_t block = ((uint64_t)sum << RAW_FRAC_BITS) / count;
+			if (primed) {
+				filtered += ((int32_t)block - (int32_t)filtered) >> config.filter_shift;
+			} else {
+				filtered = block;
+				primed = true;
+			}
+			store(filtered);
+			sum = 0;
+			count = 0;
+			if (config.period_ms) {
+				// the rest of the buffer and whatever the DMA already
+				// queued is stale by the next period, read it all away
+				i2s_adc_disable(config.i2s);
+				while (i2s_read(config.i2s, buf, sizeof(buf), &bytes, 0) == ESP_OK && bytes > 0)
+					;
+				break;
+			}
+		}
+	}
+}
+
+esp_err_t battery_init(const battery_config_t* cfg)
+{
+	// sums of 12 bit codes must not overflow 32 bits
+	if (cfg == NULL || cfg->decimation == 0 || cfg->decimation > (1 << 20))
+		return ESP_ERR_INVALID_ARG;
+	if (task_handle != NULL)
+		return ESP_ERR_INVALID_STATE;
+	config = *cfg;
+
+	check_efuse();
+	esp_adc_cal_value_t val_type = esp_adc_cal_characterize(ADC_UNIT_1, config.atten,
+			ADC_WIDTH_BIT_12, config.default_vref, &adc_chars);
+	print_char_val_type(val_type);
+
+	const i2s_config_t i2s_config = {
+		.mode = I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN,
+		.sample_rate = config.sample_rate,
+		.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
+		.channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,
+		.communication_format = I2S_COMM_FORMAT_I2S_MSB,
+		.intr_alloc_flags = 0,
+		.dma_buf_count = DMA_BUF_COUNT,
+		.dma_buf_len = DMA_BUF_LEN,
+		.use_apll = false,
+	};
+	esp_err_t err = i2s_driver_install(config.i2s, &i2s_config, 0, NULL);
+	if (err == ESP_OK)
+		err = i2s_set_adc_mode(ADC_UNIT_1, config.channel);
+	if (err == ESP_OK)
+		err = adc1_config_channel_atten(config.channel, config.atten);
+	if (err == ESP_OK && config.period_ms == 0)
+		err = i2s_adc_enable(config.i2s);
+	if (err != ESP_OK)
+		return err;
+
+	// low priority, readings are only ever consumed from the cache
+	xTaskCreate(battery_task, "battery", 2048, NULL, 1, &task_handle);
+
+	if (config.period_ms) {
+		const esp_timer_create_args_t timer_args = {
+			.callback = timer_cb,
+			.name = "battery",
+		};
+		err = esp_timer_create(&timer_args, &timer);
+		if (err == ESP_OK)
+			err = esp_timer_start_periodic(timer, config.period_ms * 1000ULL);
+		if (err != ESP_OK)
+			return err;
+		// first reading straight away rather than one period in
+		xTaskNotifyGive(task_handle);
+	}
+
+	ESP_LOGI(tag, "sampling ADC1 channel %d at %u Hz, %u samples per reading, %s",
+			config.channel, config.sample_rate, config.decimation,
+			config.period_ms ? "periodic" : "continuous");
+	return ESP_OK;
+}
+
+esp_err_t battery_subscribe(uint32_t low_mv, uint32_t high_mv, battery_cb_t cb, void* arg)
+{
+	if (cb == NULL || high_mv < low_mv)
+		return ESP_ERR_INVALID_ARG;
+	if (subscriber_count >= BATTERY_MAX_SUBSCRIBERS)
+		return ESP_ERR_NO_MEM;
+
+	// fill the slot before publishing the count, the task reads without locking
+	subscribers[subscriber_count].low_mv = low_mv;
+	subscribers[subscriber_count].high_mv = high_mv;
+	subscribers[subscriber_count].cb = cb;
+	subscribers[subscriber_count].arg = arg;
+	subscribers[subscriber_count].known = false;
+	portENTER_CRITICAL(&lock);
+	subscriber_count++;
+	portEXIT_CRITICAL(&lock);
+	return ESP_OK;
+}
+
+bool battery_latest(battery_reading_t* out)
+{
+	bool valid;
+	portENTER_CRITICAL(&lock);
+	valid = ring_count > 0;
+	if (valid)
+		*out = ring[(ring_head + BATTERY_RING_LEN - 1) % BATTERY_RING_LEN];
+	portEXIT_CRITICAL(&lock);
+	return valid;
+}
+
+size_t battery_history(battery_reading_t* out, size_t max)
+{
+	portENTER_CRITICAL(&lock);
+	size_t n = ring_count < max ? ring_count : max;
+	size_t start = (ring_head + BATTERY_RING_LEN - n) % BATTERY_RING_LEN;
+	for (size_t i = 0; i < n; i++)
+		out[i] = ring[(start + i) % BATTERY_RING_LEN];
+	portEXIT_CRITICAL(&lock);
+	return n;
+}
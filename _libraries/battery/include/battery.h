@@ -0,0 +1,74 @@
+/*
+ * battery.h
+ *
+ *  Battery voltage monitor. ADC1 runs in continuous mode through the I2S
+ *  DMA, a driver task reduces each DMA buffer into a running sum and emits
+ *  one calibrated reading per decimation block, so callers only ever read
+ *  the cached value and no one spins on adc1_get_raw().
+ *
+ *  With a period set, a low priority timer takes one block per period and
+ *  the ADC is idle in between. Initialise once per application; every
+ *  module then shares the same readings through battery_latest() or a
+ *  threshold subscription.
+ */
+
+#ifndef BATTERY_H_
+#define BATTERY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "driver/adc.h"
+#include "driver/i2s.h"
+
+#define BATTERY_RING_LEN        (32)
+#define BATTERY_MAX_SUBSCRIBERS (4)
+
+typedef struct {
+	i2s_port_t i2s;             // only I2S0 can drive the ADC
+	adc1_channel_t channel;
+	adc_atten_t atten;
+	uint32_t default_vref;      // mV, used when eFuse holds no calibration
+	float scale;                // divider ratio back to battery volts
+	uint32_t sample_rate;       // Hz
+	uint32_t decimation;        // samples averaged into one reading
+	uint8_t filter_shift;       // readings are smoothed by 1 / 2^filter_shift
+	uint32_t period_ms;         // one reading per period, 0 samples continuously
+} battery_config_t;
+
+#define BATTERY_CONFIG_DEFAULT() {      \
+	.i2s = I2S_NUM_0,                   \
+	.channel = ADC1_CHANNEL_6,          \
+	.atten = ADC_ATTEN_DB_0,            \
+	.default_vref = 1100,               \
+	.scale = 23.14f,                    \
+	.sample_rate = 20000,               \
+	.decimation = 8192,                 \
+	.filter_shift = 2,                  \
+	.period_ms = 1000,                  \
+}
+
+typedef struct {
+	int64_t time_us;            // esp_timer time of the reading
+	uint32_t raw;               // filtered ADC code, 12 bit
+	uint32_t adc_mv;            // at the pin
+	uint32_t battery_mv;        // before the divider
+} battery_reading_t;
+
+// called from the battery task when a subscription changes state, and once
+// with the first reading so the subscriber knows where it starts
+typedef void (*battery_cb_t)(const battery_reading_t* reading, bool low, void* arg);
+
+esp_err_t battery_init(const battery_config_t* cfg);
+
+// low below low_mv, cleared again only above high_mv
+esp_err_t battery_subscribe(uint32_t low_mv, uint32_t high_mv, battery_cb_t cb, void* arg);
+
+// most recent reading, false until the first decimation block completes
+bool battery_latest(battery_reading_t* out);
+
+// copies up to max of the newest readings, oldest first, returns the count
+size_t battery_history(battery_reading_t* out, size_t max);
+
+#endif /* BATTERY_H_ */
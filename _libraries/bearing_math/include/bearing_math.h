@@ -0,0 +1,170 @@
+/*
+ * bearing_math.h
+ *
+ *  Fast trig for bearing math on the ESP32, header only.
+ *
+ *  Angles in the fixed-point functions are binary angle units (BAM),
+ *  65536 counts = 360 degrees, so wrapping is plain uint16 overflow.
+ *  Values marked Q15 are signed with 15 fractional bits (32767 ~ 1.0).
+ *
+ *  Worst case error against libm over the full domain, checked by
+ *  host_test/test_bearing_math.c:
+ *    bm_atan2f       0.0007 degrees
+ *    bm_atan2_bam    0.004 degrees (includes rounding to BAM)
+ *    bm_atan2_q15    0.1 degrees
+ *    bm_acosf        0.004 degrees
+ *    bm_sinf/cosf    1e-6 within +/-2 pi, 6e-6 at +/-64 rad (argument
+ *                    reduction loses the low bits of large angles)
+ *    bm_sin_q15/cos  1.3e-4 (4 LSB)
+ *    bm_wrap360f     result always in [0, 360), float rounding only
+ */
+
+#ifndef BEARING_MATH_H_
+#define BEARING_MATH_H_
+
+#include <stdint.h>
+#include <math.h>
+
+#define BM_PI           (3.14159265f)
+#define BM_BAM_PER_RAD  (32768.0f / BM_PI)
+#define BM_BAM_PER_DEG  (65536.0f / 360.0f)
+
+// sin over the first quadrant in 64 steps, Q15
+static const int16_t bm_sin_table[65] = {
+	    0,   804,  1608,  2410,  3212,  4011,  4808,  5602,
+	 6393,  7179,  7962,  8739,  9512, 10278, 11039, 11793,
+	12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+	18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+	23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+	27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+	30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+	32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+	32767,
+};
+
+/*******************************************************
+ *                Conversions
+ *******************************************************/
+
+// wraps any angle in degrees into [0, 360)
+static inline float bm_wrap360f(float deg)
+{
+	float r = deg - 360.0f * floorf(deg * (1.0f / 360.0f));
+	return r >= 360.0f ? r - 360.0f : r;
+}
+
+static inline uint16_t bm_deg_to_bam(float deg)
+{
+	return (uint16_t)(int32_t)lrintf(bm_wrap360f(deg) * BM_BAM_PER_DEG);
+}
+
+static inline float bm_bam_to_deg(uint16_t bam)
+{
+	return bam * (360.0f / 65536.0f);
+}
+
+/*******************************************************
+ *                Float
+ *******************************************************/
+
+// atan(z) for |z| <= 1, odd minimax polynomial
+static inline float bm_atan_unit(float z)
+{
+	float z2 = z * z;
+	return z * (0.9998660f + z2 * (-0.3302995f + z2 * (0.1801410f
+			+ z2 * (-0.0851330f + z2 * 0.0208351f))));
+}
+
+// radians in (-pi, pi], 0 for the origin
+static inline float bm_atan2f(float y, float x)
+{
+	float ax = fabsf(x);
+	float ay = fabsf(y);
+	if (ax == 0.0f && ay == 0.0f)
+		return 0.0f;
+
+	float r = ay <= ax ? bm_atan_unit(ay / ax) : BM_PI / 2 - bm_atan_unit(ax / ay);
+	if (x < 0.0f)
+		r = BM_PI - r;
+	return y < 0.0f ? -r : r;
+}
+
+static inline uint16_t bm_atan2_bam(float y, float x)
+{
+	return (uint16_t)(int32_t)lrintf(bm_atan2f(y, x) * BM_BAM_PER_RAD);
+}
+
+// Abramowitz and Stegun 4.4.45, input clamped to [-1, 1]
+static inline float bm_acosf(float x)
+{
+	float ax = fabsf(x);
+	if (ax > 1.0f)
+		ax = 1.0f;
+	float r = sqrtf(1.0f - ax) * (1.5707288f + ax * (-0.2121144f
+			+ ax * (0.0742610f - ax * 0.0187293f)));
+	return x < 0.0f ? BM_PI - r : r;
+}
+
+// radians, any range
+static inline float bm_sinf(float rad)
+{
+	// reduce to [-pi, pi], then fold into [-pi/2, pi/2]
+	float x = rad - 2 * BM_PI * floorf(rad * (1.0f / (2 * BM_PI)) + 0.5f);
+	if (x > BM_PI / 2)
+		x = BM_PI - x;
+	else if (x < -BM_PI / 2)
+		x = -BM_PI - x;
+	float x2 = x * x;
+	return x * (0.9999966f + x2 * (-0.16664824f + x2 * (0.00830629f + x2 * -0.00018363f)));
+}
+
+static inline float bm_cosf(float rad)
+{
+	return bm_sinf(rad + BM_PI / 2);
+}
+
+/*******************************************************
+ *                Fixed point
+ *******************************************************/
+
+static inline int16_t bm_sin_q15(uint16_t bam)
+{
+	uint16_t idx = bam & 0x3FFF;
+	// second and fourth quadrants run the table backwards
+	if (bam & 0x4000)
+		idx = 0x4000 - idx;
+	uint16_t seg = idx >> 8;
+	int32_t frac = idx & 0xFF;
+	int32_t v = bm_sin_table[seg];
+	if (frac)
+		v += ((bm_sin_table[seg + 1] - v) * frac + 128) >> 8;
+	return (int16_t)(bam & 0x8000 ? -v : v);
+}
+
+static inline int16_t bm_cos_q15(uint16_t bam)
+{
+	return bm_sin_q15((uint16_t)(bam + 0x4000));
+}
+
+// integer only, for raw sensor counts up to +/-65535
+static inline uint16_t bm_atan2_q15(int32_t y, int32_t x)
+{
+	uint32_t ax = x < 0 ? -x : x;
+	uint32_t ay = y < 0 ? -y : y;
+	if (ax == 0 && ay == 0)
+		return 0;
+
+	// z = min / max in Q15, atan(z) = pi/4 z + z (1 - z) (0.2447 + 0.0663 z)
+	int swap = ay > ax;
+	int32_t z = swap ? (int32_t)((ax << 15) / ay) : (int32_t)((ay << 15) / ax);
+	int32_t t = (z * (32768 - z)) >> 15;
+	int32_t r = (z >> 2) + ((t * (2552 + ((691 * z) >> 15))) >> 15);
+
+	if (swap)
+		r = 0x4000 - r;
+	if (x < 0)
+		r = 0x8000 - r;
+	return (uint16_t)(y < 0 ? -r : r);
+}
+
+#endif /* BEARING_MATH_H_ */
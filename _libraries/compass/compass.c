@@ -0,0 +1,233 @@
+/*
+ * compass.c
+ *
+ *  LIS2MDL driver, see compass.h.
+ */
+
+#include <string.h>
+#include "compass.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#define LIS2MDL_ADDRESS     0b0011110
+#define LIS2MDL_WHO_AM_I    0x4F
+#define LIS2MDL_ID          0x40
+#define LIS2MDL_CFG_REG_A   0x60
+#define LIS2MDL_CFG_REG_B   0x61
+#define LIS2MDL_CFG_REG_C   0x62
+#define LIS2MDL_OUTX_L_REG  0x68
+
+#define CFG_A_COMP_TEMP_EN  0x80
+#define CFG_A_MD_CONTINUOUS 0x00
+#define CFG_C_DRDY_ON_PIN   0x01
+#define CFG_C_BDU           0x10
+
+static const char* tag = "compass";
+
+static const uint32_t odr_period_ms[] = {100, 50, 20, 10};
+
+static compass_config_t config;
+static SemaphoreHandle_t drdy_sem;
+// burst read of all six output registers, built once and reused
+static i2c_cmd_handle_t read_cmd;
+static uint8_t raw[6];
+
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static compass_sample_t ring[COMPASS_RING_LEN];
+static size_t ring_head = 0;
+static size_t ring_count = 0;
+
+static struct {
+	compass_cb_t cb;
+	void* arg;
+} subscribers[COMPASS_MAX_SUBSCRIBERS];
+static size_t subscriber_count = 0;
+
+static esp_err_t write_reg(uint8_t reg, uint8_t value)
+{
+	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+	i2c_master_start(cmd);
+	i2c_master_write_byte(cmd, (LIS2MDL_ADDRESS << 1) | I2C_MASTER_WRITE, 1);
+	i2c_master_write_byte(cmd, reg, 1);
+	i2c_master_write_byte(cmd, value, 1);
+	i2c_master_stop(cmd);
+	esp_err_t err = i2c_master_cmd_begin(config.port, cmd, pdMS_TO_TICKS(100));
+	i2c_cmd_link_delete(cmd);
+	return err;
+}
+
+static esp_err_t read_reg(uint8_t reg, uint8_t* value)
+{
+	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+	i2c_master_start(cmd);
+	i2c_master_write_byte(cmd, (LIS2MDL_ADDRESS << 1) | I2C_MASTER_WRITE, 1);
+	i2c_master_write_byte(cmd, reg, 1);
+	i2c_master_start(cmd);
+	i2c_master_write_byte(cmd, (LIS2MDL_ADDRESS << 1) | I2C_MASTER_READ, 1);
+	i2c_master_read_byte(cmd, value, I2C_MASTER_NACK);
+	i2c_master_stop(cmd);
+	esp_err_t err = i2c_master_cmd_begin(config.port, cmd, pdMS_TO_TICKS(100));
+	i2c_cmd_link_delete(cmd);
+	return err;
+}
+
+static void IRAM_ATTR drdy_isr(void* arg)
+{
+	BaseType_t woken = pdFALSE;
+	xSemaphoreGiveFromISR(drdy_sem, &woken);
+	if (woken == pdTRUE)
+		portYIELD_FROM_ISR();
+}
+
+static void publish(const compass_sample_t* sample)
+{
+	portENTER_CRITICAL(&lock);
+	ring[ring_head] = *sample;
+	ring_head = (ring_head + 1) % COMPASS_RING_LEN;
+	if (ring_count < COMPASS_RING_LEN)
+		ring_count++;
+	portEXIT_CRITICAL(&lock);
+
+	for (size_t i = 0; i < subscriber_count; i++)
+		subscribers[i].cb(sample, subscribers[i].arg);
+}
+
+static void compass_task(void* arg)
+{
+	// DRDY only rises again once the outputs are read, so a lost edge
+	// would stall the sensor; fall back to reading after a few periods
+	TickType_t timeout = pdMS_TO_TICKS(3 * odr_period_ms[config.odr]);
+
+	while (1) {
+		if (xSemaphoreTake(drdy_sem, timeout) != pdTRUE)
+			ESP_LOGD(tag, "DRDY timeout, reading anyway");
+
+		esp_err_t err = i2c_master_cmd_begin(config.port, read_cmd, pdMS_TO_TICKS(100));
+		if (err != ESP_OK) {
+			ESP_LOGW(tag, "read failed: %s", esp_err_to_name(err));
+			continue;
+		}
+
+		compass_sample_t sample = {
+			.time_us = esp_timer_get_time(),
+			.x = (int16_t)(raw[1] << 8 | raw[0]),
+			.y = (int16_t)(raw[3] << 8 | raw[2]),
+			.z = (int16_t)(raw[5] << 8 | raw[4]),
+		};
+		publish(&sample);
+	}
+}
+
+esp_err_t compass_init(const compass_config_t* cfg)
+{
+	config = *cfg;
+
+	i2c_config_t conf = {
+		.mode = I2C_MODE_MASTER,
+		.sda_io_num = config.sda,
+		.scl_io_num = config.scl,
+		.sda_pullup_en = GPIO_PULLUP_ENABLE,
+		.scl_pullup_en = GPIO_PULLUP_ENABLE,
+		.master.clk_speed = config.clk_speed,
+	};
+	esp_err_t err = i2c_param_config(config.port, &conf);
+	if (err == ESP_OK)
+		err = i2c_driver_install(config.port, I2C_MODE_MASTER, 0, 0, 0);
+	if (err != ESP_OK)
+		return err;
+
+	uint8_t id = 0;
+	err = read_reg(LIS2MDL_WHO_AM_I, &id);
+	if (err != ESP_OK)
+		return err;
+	if (id != LIS2MDL_ID) {
+		ESP_LOGE(tag, "unexpected WHO_AM_I 0x%02x", id);
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	// continuous mode with temperature compensation at the requested rate
+	err = write_reg(LIS2MDL_CFG_REG_A, CFG_A_COMP_TEMP_EN | (config.odr << 2) | CFG_A_MD_CONTINUOUS);
+	if (err == ESP_OK)
+		err = write_reg(LIS2MDL_CFG_REG_B, 0x07);
+	// DRDY on the INT pin, block updates so the six bytes come from one sample
+	if (err == ESP_OK)
+		err = write_reg(LIS2MDL_CFG_REG_C, CFG_C_DRDY_ON_PIN | CFG_C_BDU);
+	if (err != ESP_OK)
+		return err;
+
+	read_cmd = i2c_cmd_link_create();
+	i2c_master_start(read_cmd);
+	i2c_master_write_byte(read_cmd, (LIS2MDL_ADDRESS << 1) | I2C_MASTER_WRITE, 1);
+	i2c_master_write_byte(read_cmd, LIS2MDL_OUTX_L_REG + 0x80, 1); // 0x80 = auto increment
+	i2c_master_start(read_cmd);
+	i2c_master_write_byte(read_cmd, (LIS2MDL_ADDRESS << 1) | I2C_MASTER_READ, 1);
+	i2c_master_read(read_cmd, raw, sizeof(raw), I2C_MASTER_LAST_NACK);
+	i2c_master_stop(read_cmd);
+
+	drdy_sem = xSemaphoreCreateBinary();
+	if (drdy_sem == NULL)
+		return ESP_ERR_NO_MEM;
+
+	gpio_config_t io_conf = {
+		.pin_bit_mask = 1ULL << config.drdy,
+		.mode = GPIO_MODE_INPUT,
+		.intr_type = GPIO_INTR_POSEDGE,
+	};
+	err = gpio_config(&io_conf);
+	if (err != ESP_OK)
+		return err;
+	// the ISR service may already be installed by another driver
+	err = gpio_install_isr_service(0);
+	if (err != ESP_OK && err != ESP_ERR_INVALID_STATE)
+		return err;
+	err = gpio_isr_handler_add(config.drdy, drdy_isr, NULL);
+	if (err != ESP_OK)
+		return err;
+
+	// subscribers run on this stack and may log floats
+	if (xTaskCreate(compass_task, "compass", 4096, NULL, 6, NULL) != pdPASS)
+		return ESP_ERR_NO_MEM;
+	ESP_LOGI(tag, "LIS2MDL running at %d ms per sample", odr_period_ms[config.odr]);
+	return ESP_OK;
+}
+
+esp_err_t compass_subscribe(compass_cb_t cb, void* arg)
+{
+	if (cb == NULL)
+		return ESP_ERR_INVALID_ARG;
+	if (subscriber_count >= COMPASS_MAX_SUBSCRIBERS)
+		return ESP_ERR_NO_MEM;
+
+	// fill the slot before publishing the count, the task reads without locking
+	subscribers[subscriber_count].cb = cb;
+	subscribers[subscriber_count].arg = arg;
+	portENTER_CRITICAL(&lock);
+	subscriber_count++;
+	portEXIT_CRITICAL(&lock);
+	return ESP_OK;
+}
+
+bool compass_latest(compass_sample_t* out)
+{
+	bool valid;
+	portENTER_CRITICAL(&lock);
+	valid = ring_count > 0;
+	if (valid)
+		*out = ring[(ring_head + COMPASS_RING_LEN - 1) % COMPASS_RING_LEN];
+	portEXIT_CRITICAL(&lock);
+	return valid;
+}
+
+size_t compass_history(compass_sample_t* out, size_t max)
+{
+	portENTER_CRITICAL(&lock);
+	size_t n = ring_count < max ? ring_count : max;
+	size_t start = (ring_head + COMPASS_RING_LEN - n) % COMPASS_RING_LEN;
+	for (size_t i = 0; i < n; i++)
+		out[i] = ring[(start + i) % COMPASS_RING_LEN];
+	portEXIT_CRITICAL(&lock);
+	return n;
+}
@@ -0,0 +1,226 @@
+/*
+ * compass_cal.c
+ *
+ *  Ellipse fit and heading computation, see compass_cal.h.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "compass_cal.h"
+#include "bearing_math.h"
+#include "nvs.h"
+
+#define NVS_NAMESPACE "compass"
+#define NVS_KEY       "cal"
+
+#define SECTORS_REQUIRED 6
+
+void compass_cal_identity(compass_cal_t* cal)
+{
+	memset(cal, 0, sizeof(*cal));
+	cal->version = COMPASS_CAL_VERSION;
+	for (int i = 0; i < 3; i++)
+		cal->soft[i][i] = 1.0f;
+	compass_cal_update(cal);
+}
+
+void compass_cal_update(compass_cal_t* cal)
+{
+	float sp = bm_sinf(cal->pitch), cp = bm_cosf(cal->pitch);
+	float sr = bm_sinf(cal->roll), cr = bm_cosf(cal->roll);
+	// rows of the tilt rotation that produce the horizontal components
+	const float tilt[2][3] = {
+		{cp, 0.0f, sp},
+		{sr * sp, cr, -sr * cp},
+	};
+
+	for (int i = 0; i < 2; i++) {
+		for (int j = 0; j < 3; j++) {
+			float v = 0.0f;
+			for (int k = 0; k < 3; k++)
+				v += tilt[i][k] * cal->soft[k][j];
+			cal->xform[i][j] = v;
+		}
+	}
+}
+
+void compass_cal_begin(compass_cal_fit_t* fit)
+{
+	memset(fit, 0, sizeof(*fit));
+}
+
+void compass_cal_add(compass_cal_fit_t* fit, const compass_sample_t* sample)
+{
+	double x = sample->x, y = sample->y;
+	// conic a x^2 + b xy + c y^2 + d x + e y = 1
+	const double v[5] = {x * x, x * y, y * y, x, y};
+
+	for (int i = 0; i < 5; i++) {
+		for (int j = i; j < 5; j++)
+			fit->ata[i][j] += v[i] * v[j];
+		fit->atb[i] += v[i];
+	}
+
+	if (fit->count > 0) {
+		double mx = fit->sum[0] / fit->count, my = fit->sum[1] / fit->count;
+		int sector = (int)floor((atan2(y - my, x - mx) + M_PI) / (M_PI / 4));
+		fit->sectors[sector & 7]++;
+	}
+
+	fit->sum[0] += x;
+	fit->sum[1] += y;
+	fit->sum[2] += sample->z;
+	fit->count++;
+}
+
+// solves the symmetric normal equations by Gaussian elimination
+static esp_err_t solve5(const compass_cal_fit_t* fit, double out[5])
+{
+	double m[5][6];
+	for (int i = 0; i < 5; i++) {
+		for (int j = 0; j < 5; j++)
+			m[i][j] = j >= i ? fit->ata[i][j] : fit->ata[j][i];
+		m[i][5] = fit->atb[i];
+	}
+
+	for (int col = 0; col < 5; col++) {
+		int pivot = col;
+		for (int row = col + 1; row < 5; row++)
+			if (fabs(m[row][col]) > fabs(m[pivot][col]))
+				pivot = row;
+		if (fabs(m[pivot][col]) < 1e-12)
+			return ESP_ERR_INVALID_STATE;
+		if (pivot != col) {
+			for (int j = 0; j < 6; j++) {
+				double t = m[col][j];
+				m[col][j] = m[pivot][j];
+				m[pivot][j] = t;
+			}
+		}
+		for (int row = col + 1; row < 5; row++) {
+			double f = m[row][col] / m[col][col];
+			for (int j = col; j < 6; j++)
+				m[row][j] -= f * m[col][j];
+		}
+	}
+
+	for (int row = 4; row >= 0; row--) {
+		double v = m[row][5];
+		for (int j = row + 1; j < 5; j++)
+			v -= m[row][j] * out[j];
+		out[row] = v / m[row][row];
+	}
+	return ESP_OK;
+}
+
+// sectors holding at least min samples
+static int sectors_covered(const compass_cal_fit_t* fit, uint32_t min)
+{
+	int covered = 0;
+	for (int i = 0; i < 8; i++)
+		if (fit->sectors[i] >= min)
+			covered++;
+	return covered;
+}
+
+bool compass_cal_covered(const compass_cal_fit_t* fit)
+{
+	return fit->count >= COMPASS_CAL_MIN_SAMPLES
+			&& sectors_covered(fit, COMPASS_CAL_MIN_SAMPLES / 8) == 8;
+}
+
+esp_err_t compass_cal_finish(const compass_cal_fit_t* fit, compass_cal_t* cal)
+{
+	if (fit->count < COMPASS_CAL_MIN_SAMPLES)
+		return ESP_ERR_INVALID_SIZE;
+	if (sectors_covered(fit, 1) < SECTORS_REQUIRED)
+		return ESP_ERR_INVALID_SIZE;
+
+	double p[5];
+	esp_err_t err = solve5(fit, p);
+	if (err != ESP_OK)
+		return err;
+
+	// quadratic form A and centre -A^-1 [d e] / 2
+	double a = p[0], b = p[1] / 2, c = p[2];
+	double det = a * c - b * b;
+	if (det == 0.0)
+		return ESP_ERR_INVALID_STATE;
+	double cx = -(c * p[3] - b * p[4]) / (2 * det);
+	double cy = -(a * p[4] - b * p[3]) / (2 * det);
+
+	// (v - centre)^T A (v - centre) = k, normalise so the form equals 1
+	double k = 1.0 + a * cx * cx + 2 * b * cx * cy + c * cy * cy;
+	a /= k;
+	b /= k;
+	c /= k;
+	det = a * c - b * b;
+	if (a <= 0.0 || det <= 0.0)
+		return ESP_ERR_INVALID_STATE;
+
+	// W = sqrt(A) scaled so the circle keeps the ellipse's mean radius
+	double s = sqrt(det);
+	double t = sqrt(a + c + 2 * s);
+	double radius = 1.0 / sqrt(s);
+	double w00 = (a + s) / t * radius;
+	double w01 = b / t * radius;
+	double w11 = (c + s) / t * radius;
+
+	cal->version = COMPASS_CAL_VERSION;
+	cal->offset[0] = (float)cx;
+	cal->offset[1] = (float)cy;
+	cal->offset[2] = 0.0f;
+	memset(cal->soft, 0, sizeof(cal->soft));
+	cal->soft[0][0] = (float)w00;
+	cal->soft[0][1] = (float)w01;
+	cal->soft[1][0] = (float)w01;
+	cal->soft[1][1] = (float)w11;
+	cal->soft[2][2] = 1.0f;
+	compass_cal_update(cal);
+	return ESP_OK;
+}
+
+esp_err_t compass_cal_save(const compass_cal_t* cal)
+{
+	nvs_handle handle;
+	esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+	if (err != ESP_OK)
+		return err;
+	err = nvs_set_blob(handle, NVS_KEY, cal, sizeof(*cal));
+	if (err == ESP_OK)
+		err = nvs_commit(handle);
+	nvs_close(handle);
+	return err;
+}
+
+esp_err_t compass_cal_load(compass_cal_t* cal)
+{
+	nvs_handle handle;
+	esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+	if (err != ESP_OK)
+		return err;
+	size_t size = sizeof(*cal);
+	err = nvs_get_blob(handle, NVS_KEY, cal, &size);
+	nvs_close(handle);
+	if (err != ESP_OK)
+		return err;
+	if (size != sizeof(*cal) || cal->version != COMPASS_CAL_VERSION)
+		return ESP_ERR_NVS_NOT_FOUND;
+	compass_cal_update(cal);
+	return ESP_OK;
+}
+
+uint16_t compass_heading(const compass_cal_t* cal, const compass_sample_t* sample)
+{
+	float v[3] = {
+		sample->x - cal->offset[0],
+		sample->y - cal->offset[1],
+		sample->z - cal->offset[2],
+	};
+	float xh = cal->xform[0][0] * v[0] + cal->xform[0][1] * v[1] + cal->xform[0][2] * v[2];
+	float yh = cal->xform[1][0] * v[0] + cal->xform[1][1] * v[1] + cal->xform[1][2] * v[2];
+
+	float bearing = bm_atan2f(yh, xh) + cal->declination;
+	// radians to binary angle, the int32 cast wraps negative bearings
+	return (uint16_t)(int32_t)lrintf(bearing * BM_BAM_PER_RAD);
+}
@@ -0,0 +1,60 @@
+/*
+ * compass.h
+ *
+ *  LIS2MDL magnetometer driver. The sensor runs in continuous mode and
+ *  raises DRDY when a sample is ready; a driver task reads all three axes
+ *  in one burst, keeps the most recent samples in a ring buffer and hands
+ *  each one to the subscribers, so readers never wait on the I2C bus.
+ */
+
+#ifndef COMPASS_H_
+#define COMPASS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "driver/gpio.h"
+#include "driver/i2c.h"
+
+#define COMPASS_RING_LEN        (32)
+#define COMPASS_MAX_SUBSCRIBERS (4)
+
+// output data rates, values are the CFG_REG_A ODR field
+typedef enum {
+	COMPASS_ODR_10HZ = 0,
+	COMPASS_ODR_20HZ = 1,
+	COMPASS_ODR_50HZ = 2,
+	COMPASS_ODR_100HZ = 3,
+} compass_odr_t;
+
+typedef struct {
+	i2c_port_t port;
+	gpio_num_t sda;
+	gpio_num_t scl;
+	uint32_t clk_speed;
+	gpio_num_t drdy;            // LIS2MDL INT/DRDY output
+	compass_odr_t odr;
+} compass_config_t;
+
+typedef struct {
+	int64_t time_us;            // esp_timer time the sample was read
+	int16_t x;
+	int16_t y;
+	int16_t z;
+} compass_sample_t;
+
+// called from the compass task for every new sample, keep it short; the
+// task has 4 KB of stack
+typedef void (*compass_cb_t)(const compass_sample_t* sample, void* arg);
+
+esp_err_t compass_init(const compass_config_t* cfg);
+esp_err_t compass_subscribe(compass_cb_t cb, void* arg);
+
+// most recent sample, false until the first one arrives
+bool compass_latest(compass_sample_t* out);
+
+// copies up to max of the newest samples, oldest first, returns the count
+size_t compass_history(compass_sample_t* out, size_t max);
+
+#endif /* COMPASS_H_ */
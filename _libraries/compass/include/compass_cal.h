@@ -0,0 +1,63 @@
+/*
+ * compass_cal.h
+ *
+ *  Hard/soft-iron calibration and heading computation for the LIS2MDL.
+ *
+ *  The turret only turns about its vertical axis, so a calibration sweep
+ *  traces an ellipse in the sensor X/Y plane. Fitting that ellipse gives
+ *  the hard-iron offset (its centre) and the soft-iron correction (the
+ *  transform that makes it a circle). Z cannot be observed this way, so its
+ *  offset stays at zero; the fixed tilt of the mount is entered as pitch
+ *  and roll since the tower has no accelerometer.
+ */
+
+#ifndef COMPASS_CAL_H_
+#define COMPASS_CAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "compass.h"
+
+#define COMPASS_CAL_VERSION     (1)
+#define COMPASS_CAL_MIN_SAMPLES (32)
+
+typedef struct {
+	uint32_t version;
+	float offset[3];            // hard-iron offset, raw counts
+	float soft[3][3];           // soft-iron correction, applied after the offset
+	float pitch;                // mount tilt, radians
+	float roll;
+	float declination;          // magnetic to true north, radians, east positive
+	// derived by compass_cal_update(), tilt and soft-iron combined
+	float xform[2][3];
+} compass_cal_t;
+
+// streaming least-squares accumulator for the calibration sweep
+typedef struct {
+	double ata[5][5];
+	double atb[5];
+	uint32_t count;
+	// samples per 45 degree sector around the running mean, to check coverage
+	uint32_t sectors[8];
+	double sum[3];
+} compass_cal_fit_t;
+
+void compass_cal_identity(compass_cal_t* cal);
+void compass_cal_update(compass_cal_t* cal);
+
+void compass_cal_begin(compass_cal_fit_t* fit);
+void compass_cal_add(compass_cal_fit_t* fit, const compass_sample_t* sample);
+// every sector has a share of the samples, the sweep can stop
+bool compass_cal_covered(const compass_cal_fit_t* fit);
+// fits the ellipse into cal, keeping its tilt and declination
+esp_err_t compass_cal_finish(const compass_cal_fit_t* fit, compass_cal_t* cal);
+
+// persist to / restore from NVS, nvs_flash_init() must have been called
+esp_err_t compass_cal_save(const compass_cal_t* cal);
+esp_err_t compass_cal_load(compass_cal_t* cal);
+
+// bearing clockwise from true north, binary angle (65536 = 360 degrees)
+uint16_t compass_heading(const compass_cal_t* cal, const compass_sample_t* sample);
+
+#endif /* COMPASS_CAL_H_ */
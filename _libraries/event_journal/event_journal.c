@@ -0,0 +1,330 @@
+/*
+ * event_journal.c
+ *
+ *  Flash ring of event records, see event_journal.h.
+ */
+
+#include <string.h>
+#include "event_journal.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#define BLANK       (0xFFFFFFFF)
+
+static const char* tag = "event_journal";
+
+typedef struct {
+	uint32_t seq;               // journal sequence, BLANK in an erased slot
+	event_record_t event;
+	uint16_t crc;               // over seq and event
+	uint32_t sent;              // BLANK while pending, 0 once delivered
+	uint8_t unused[EVENT_JOURNAL_SLOT_SIZE - 44];
+} __attribute__((packed)) slot_t;
+
+_Static_assert(sizeof(slot_t) == EVENT_JOURNAL_SLOT_SIZE, "journal slot size");
+
+#define SLOT_USED   (offsetof(slot_t, unused))
+#define SLOT_CRC    (offsetof(slot_t, crc))
+
+static event_journal_config_t config;
+static const esp_partition_t* part;
+static SemaphoreHandle_t lock;
+
+static uint32_t slot_count;
+static uint32_t sector_slots;
+static uint32_t head = 0;       // next sequence to write
+static uint32_t tail = 0;       // oldest pending sequence
+static uint32_t cursor = 0;     // next to send, those from tail up to here are handed off
+static uint32_t erased_end = 0; // slots from head up to here are blank
+
+static event_journal_stats_t stats;
+static uint64_t append_total_us = 0;
+
+static size_t offset(uint32_t seq)
+{
+	return (seq % slot_count) * EVENT_JOURNAL_SLOT_SIZE;
+}
+
+static esp_err_t read_slot(uint32_t seq, slot_t* s)
+{
+	return esp_partition_read(part, offset(seq), s, SLOT_USED);
+}
+
+static bool slot_valid(const slot_t* s)
+{
+	return s->seq != BLANK && event_crc16(s, SLOT_CRC) == s->crc;
+}
+
+static bool slot_blank(const slot_t* s)
+{
+	const uint8_t* p = (const uint8_t*) s;
+	for (size_t i = 0; i < SLOT_USED; i++)
+		if (p[i] != 0xFF)
+			return false;
+	return true;
+}
+
+// erases the next batch of sectors, head sits on a sector boundary here
+static esp_err_t erase_ahead(void)
+{
+	uint32_t sector = (head % slot_count) / sector_slots;
+	uint32_t sectors = slot_count / sector_slots;
+	uint32_t n = config.erase_batch;
+	if (n > sectors - sector)
+		n = sectors - sector;
+
+	esp_err_t err = esp_partition_erase_range(part, sector * SPI_FLASH_SEC_SIZE, n * SPI_FLASH_SEC_SIZE);
+	if (err != ESP_OK)
+		return err;
+	stats.erases += n;
+	erased_end = head + n * sector_slots;
+
+	// anything older than one lap behind the erased range is gone
+	if (erased_end > slot_count && tail < erased_end - slot_count) {
+		stats.dropped += erased_end - slot_count - tail;
+		ESP_LOGW(tag, "dropped %u undelivered events", erased_end - slot_count - tail);
+		tail = erased_end - slot_count;
+		if (cursor < tail)
+			cursor = tail;
+	}
+	return ESP_OK;
+}
+
+esp_err_t event_journal_init(const event_journal_config_t* cfg)
+{
+	if (part != NULL)
+		return ESP_ERR_INVALID_STATE;
+	if (cfg->erase_batch == 0)
+		return ESP_ERR_INVALID_ARG;
+
+	const esp_partition_t* p = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, cfg->label);
+	if (p == NULL) {
+		ESP_LOGE(tag, "no partition %s", cfg->label);
+		return ESP_ERR_NOT_FOUND;
+	}
+	if (p->size < 2 * SPI_FLASH_SEC_SIZE || p->size % SPI_FLASH_SEC_SIZE)
+		return ESP_ERR_INVALID_SIZE;
+
+	config = *cfg;
+	part = p;
+	lock = xSemaphoreCreateMutex();
+	if (lock == NULL) {
+		part = NULL;
+		return ESP_ERR_NO_MEM;
+	}
+	slot_count = part->size / EVENT_JOURNAL_SLOT_SIZE;
+	sector_slots = SPI_FLASH_SEC_SIZE / EVENT_JOURNAL_SLOT_SIZE;
+	memset(&stats, 0, sizeof(stats));
+
+	// the newest valid slot says where the writer stopped
+	slot_t s;
+	bool found = false;
+	uint32_t newest = 0;
+	for (uint32_t i = 0; i < slot_count; i++) {
+		esp_err_t err = esp_partition_read(part, i * EVENT_JOURNAL_SLOT_SIZE, &s, SLOT_USED);
+		if (err != ESP_OK)
+			return err;
+		if (slot_valid(&s) && s.seq % slot_count == i) {
+			if (!found || s.seq > newest)
+				newest = s.seq;
+			found = true;
+		} else if (!slot_blank(&s)) {
+			stats.corrupt++;
+		}
+	}
+
+	head = found ? newest + 1 : 0;
+	// records run back contiguously from the head, and with deliveries
+	// marked out of order a pending one can sit behind delivered ones
+	tail = head;
+	for (uint32_t seq = head; seq > 0 && head - seq < slot_count; seq--) {
+		if (read_slot(seq - 1, &s) != ESP_OK || !slot_valid(&s) || s.seq != seq - 1)
+			break;
+		if (s.sent == BLANK)
+			tail = seq - 1;
+	}
+	cursor = tail;
+
+	// the rest of the head's sector was erased with it, past a torn write
+	erased_end = 0;
+	if (found && head % sector_slots) {
+		erased_end = (head / sector_slots + 1) * sector_slots;
+		while (head < erased_end && read_slot(head, &s) == ESP_OK && !slot_blank(&s))
+			head++;
+	}
+
+	ESP_LOGI(tag, "%s: %u slots, next %u, %u pending, %u corrupt",
+			part->label, slot_count, head, head - tail, stats.corrupt);
+	return ESP_OK;
+}
+
+esp_err_t event_journal_append(const event_record_t* ev)
+{
+	if (part == NULL)
+		return ESP_ERR_INVALID_STATE;
+
+	slot_t s;
+	memset(&s, 0xFF, sizeof(s));
+	s.event = *ev;
+
+	xSemaphoreTake(lock, portMAX_DELAY);
+	int64_t start = esp_timer_get_time();
+	esp_err_t err = ESP_OK;
+	if (head >= erased_end)
+		err = erase_ahead();
+	if (err == ESP_OK) {
+		s.seq = head;
+		s.crc = event_crc16(&s, SLOT_CRC);
+		err = esp_partition_write(part, offset(head), &s, SLOT_USED);
+	}
+	if (err == ESP_OK) {
+		head++;
+		stats.appended++;
+		stats.bytes_written += SLOT_USED;
+		uint32_t us = esp_timer_get_time() - start;
+		append_total_us += us;
+		if (us > stats.append_max_us)
+			stats.append_max_us = us;
+	}
+	xSemaphoreGive(lock);
+
+	if (err != ESP_OK)
+		ESP_LOGE(tag, "append failed: %s", esp_err_to_name(err));
+	return err;
+}
+
+// moves the tail past delivered and unreadable records, called with the lock
+static void advance_tail(void)
+{
+	slot_t s;
+	while (tail < cursor) {
+		if (read_slot(tail, &s) == ESP_OK && slot_valid(&s) && s.seq == tail && s.sent == BLANK)
+			break;
+		tail++;
+	}
+}
+
+// called with the lock, the record must be one handed off
+static esp_err_t mark_sent(uint32_t seq)
+{
+	const uint32_t sent = 0;
+	esp_err_t err = esp_partition_write(part, offset(seq) + offsetof(slot_t, sent), &sent, sizeof(sent));
+	if (err == ESP_OK) {
+		stats.bytes_written += sizeof(sent);
+		stats.replayed++;
+	} else {
+		ESP_LOGE(tag, "marking %u sent failed: %s", seq, esp_err_to_name(err));
+	}
+	return err;
+}
+
+// hands records from the cursor to send or hand_off, marking the first's
+// at once
+static int replay(event_journal_send_t send, event_journal_hand_off_t hand_off, void* arg, int max)
+{
+	if (part == NULL)
+		return 0;
+
+	int count = 0;
+	slot_t s;
+	while (count < max) {
+		xSemaphoreTake(lock, portMAX_DELAY);
+		uint32_t seq = cursor;
+		esp_err_t err = seq == head ? ESP_ERR_NOT_FOUND : read_slot(seq, &s);
+		xSemaphoreGive(lock);
+		if (err != ESP_OK)
+			break;
+
+		// sent without the lock, the writer may lap the record meanwhile;
+		// one delivered before a retry rewound the cursor is not sent again
+		bool ok = slot_valid(&s) && s.seq == seq;
+		bool due = ok && s.sent == BLANK;
+		if (due && (send ? send(&s.event, arg) : hand_off(&s.event, seq, arg)) != ESP_OK)
+			break;
+
+		xSemaphoreTake(lock, portMAX_DELAY);
+		if (cursor == seq) {
+			if (!ok)
+				stats.corrupt++;
+			// unmarked, the record stays pending and is sent again later
+			if (due && send)
+				err = mark_sent(seq);
+			if (err == ESP_OK) {
+				count += due;
+				cursor++;
+				advance_tail();
+			}
+		}
+		xSemaphoreGive(lock);
+		if (err != ESP_OK)
+			break;
+	}
+	return count;
+}
+
+int event_journal_replay(event_journal_send_t send, void* arg, int max)
+{
+	return replay(send, NULL, arg, max);
+}
+
+int event_journal_hand_off(event_journal_hand_off_t hand_off, void* arg, int max)
+{
+	return replay(NULL, hand_off, arg, max);
+}
+
+esp_err_t event_journal_delivered(uint32_t seq)
+{
+	if (part == NULL)
+		return ESP_ERR_INVALID_STATE;
+	slot_t s;
+	xSemaphoreTake(lock, portMAX_DELAY);
+	// a record dropped by the writer is gone already
+	esp_err_t err = seq < tail || seq >= cursor ? ESP_ERR_NOT_FOUND : read_slot(seq, &s);
+	if (err == ESP_OK && (!slot_valid(&s) || s.seq != seq))
+		err = ESP_ERR_NOT_FOUND;
+	if (err == ESP_OK && s.sent == BLANK)
+		err = mark_sent(seq);
+	if (err == ESP_OK)
+		advance_tail();
+	xSemaphoreGive(lock);
+	return err;
+}
+
+void event_journal_retry(uint32_t seq)
+{
+	if (part == NULL)
+		return;
+	xSemaphoreTake(lock, portMAX_DELAY);
+	if (seq >= tail && seq < cursor)
+		cursor = seq;
+	xSemaphoreGive(lock);
+}
+
+uint32_t event_journal_pending(void)
+{
+	if (part == NULL)
+		return 0;
+	xSemaphoreTake(lock, portMAX_DELAY);
+	uint32_t pending = head - tail;
+	xSemaphoreGive(lock);
+	return pending;
+}
+
+void event_journal_stats(event_journal_stats_t* out)
+{
+	if (part == NULL) {
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+	xSemaphoreTake(lock, portMAX_DELAY);
+	*out = stats;
+	out->slots = slot_count;
+	out->pending = head - tail;
+	out->append_avg_us = stats.appended ? append_total_us / stats.appended : 0;
+	out->sector_cycles = head / slot_count;
+	xSemaphoreGive(lock);
+}
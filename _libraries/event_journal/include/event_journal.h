@@ -0,0 +1,85 @@
+/*
+ * event_journal.h
+ *
+ *  Append-only event journal on a dedicated flash partition. Each event
+ *  record takes one fixed 64 byte slot carrying a journal sequence and a
+ *  CRC, and sequence n always lives in slot n modulo the slot count, so
+ *  the ring writes every sector in turn and wears the partition evenly.
+ *  Sectors are erased a batch at a time just ahead of the writer; pending
+ *  records in an erased sector are counted as dropped.
+ *
+ *  Records stay pending until event_journal_replay() hands them, oldest
+ *  first, to a sender that accepts them. Delivery is marked by clearing a
+ *  word in the slot, which NOR flash allows without an erase, so a reset
+ *  during an outage replays from where it stopped. A sender that only
+ *  learns of delivery later takes records with event_journal_hand_off()
+ *  and reports each one with event_journal_delivered(); until then the
+ *  record stays pending, and is sent again after a reset.
+ */
+
+#ifndef EVENT_JOURNAL_H_
+#define EVENT_JOURNAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "event_record.h"
+
+#define EVENT_JOURNAL_SLOT_SIZE     (64)
+
+typedef struct {
+	const char* label;          // data partition holding the journal
+	uint32_t erase_batch;       // sectors erased together ahead of the writer
+} event_journal_config_t;
+
+#define EVENT_JOURNAL_CONFIG_DEFAULT() {    \
+	.label = "events",                      \
+	.erase_batch = 2,                       \
+}
+
+typedef struct {
+	uint32_t slots;             // capacity of the partition
+	uint32_t pending;           // written and not yet delivered
+	uint32_t appended;          // since init
+	uint32_t replayed;
+	uint32_t dropped;           // overwritten before delivery
+	uint32_t corrupt;           // slots failing CRC at init
+	uint32_t erases;            // sectors erased since init
+	uint32_t bytes_written;
+	uint32_t append_avg_us;
+	uint32_t append_max_us;     // includes any erase on the way
+	uint32_t sector_cycles;     // erase cycles per sector over the partition's life
+} event_journal_stats_t;
+
+// accepts one record, anything but ESP_OK stops the replay and leaves the
+// record pending
+typedef esp_err_t (*event_journal_send_t)(const event_record_t* ev, void* arg);
+
+// takes one record, seq names it to event_journal_delivered() and
+// event_journal_retry(); anything but ESP_OK stops the hand off
+typedef esp_err_t (*event_journal_hand_off_t)(const event_record_t* ev, uint32_t seq, void* arg);
+
+// scans the partition and resumes after the newest record
+esp_err_t event_journal_init(const event_journal_config_t* cfg);
+
+esp_err_t event_journal_append(const event_record_t* ev);
+
+// delivers up to max pending records in order, returns the number accepted
+int event_journal_replay(event_journal_send_t send, void* arg, int max);
+
+// hands up to max records on in order without marking them, each is
+// handed off once unless a retry rewinds to it; returns the number taken
+int event_journal_hand_off(event_journal_hand_off_t hand_off, void* arg, int max);
+
+// marks a handed off record delivered, in any order; ESP_ERR_NOT_FOUND if
+// the writer has dropped it meanwhile
+esp_err_t event_journal_delivered(uint32_t seq);
+
+// hands records off again from seq on, skipping those delivered since
+void event_journal_retry(uint32_t seq);
+
+uint32_t event_journal_pending(void);
+
+void event_journal_stats(event_journal_stats_t* out);
+
+#endif /* EVENT_JOURNAL_H_ */
@@ -0,0 +1,74 @@
+/*
+ * event_record.h
+ *
+ *  Binary event record shared by the tower controller, the mesh and the
+ *  external UI. The struct is packed little-endian and is its own wire
+ *  format, so a received buffer is used in place through
+ *  event_record_view() and a record is sent straight from the struct
+ *  after event_record_seal(). Bump EVENT_RECORD_VERSION on any layout
+ *  change; readers reject versions they do not know. On a serial link
+ *  each record goes behind two sync bytes and its length, so a reader
+ *  that starts mid-stream or loses bytes finds the next one.
+ */
+
+#ifndef EVENT_RECORD_H_
+#define EVENT_RECORD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define EVENT_RECORD_VERSION    (1)
+
+// status bits
+#define EVENT_LOW_VOLTAGE       (1 << 0)
+#define EVENT_FIRE              (1 << 1)    // bearing is valid
+#define EVENT_FAULT             (1 << 2)
+#define EVENT_TIME_VALID        (1 << 3)    // time_us is disciplined UTC
+#define EVENT_POSITION_VALID    (1 << 4)
+
+#define EVENT_TEMP_UNKNOWN      (INT16_MIN)
+
+// serial framing: sync, sync, length, record
+#define EVENT_FRAME_SYNC_1      (0xE5)
+#define EVENT_FRAME_SYNC_2      (0x7C)
+#define EVENT_FRAME_HDR_LEN     (3)
+#define EVENT_FRAME_LEN         (EVENT_FRAME_HDR_LEN + sizeof(event_record_t))
+
+typedef struct {
+	uint8_t version;
+	uint8_t status;             // EVENT_* bits
+	uint32_t sequence;          // per node, for ordering and duplicates
+	uint32_t node;              // low four bytes of the station MAC
+	int64_t time_us;            // UTC microseconds since 1970
+	int32_t latitude;           // degrees x 1e7
+	int32_t longitude;
+	uint16_t bearing;           // BAM, clockwise from north
+	int16_t peak_temp;          // 0.1 degrees C, EVENT_TEMP_UNKNOWN if not measured
+	uint16_t battery_mv;
+	uint16_t crc;               // CRC-16/CCITT of everything above
+} __attribute__((packed)) event_record_t;
+
+_Static_assert(sizeof(event_record_t) == 34, "event_record_t is a wire format");
+
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF)
+uint16_t event_crc16(const void* data, size_t len);
+
+// node id from the station MAC, its low four bytes big end first
+uint32_t event_node_id(const uint8_t mac[6]);
+
+// stamps version and CRC, the struct is then ready to send as is
+void event_record_seal(event_record_t* rec);
+
+// validates a received buffer and returns it as a record, NULL if it is not one
+const event_record_t* event_record_view(const void* buf, size_t len);
+
+// writes a sealed record behind its frame header, returns the bytes used or 0 if it does not fit
+size_t event_record_frame(const event_record_t* rec, uint8_t* buf, size_t cap);
+
+// looks for the next framed record in a receive buffer and sets *used to
+// the bytes the caller can drop; returns the record in place, or NULL if
+// none is complete yet, in which case *used of 0 means wait for more bytes
+const event_record_t* event_record_unframe(const uint8_t* buf, size_t len, size_t* used);
+
+#endif /* EVENT_RECORD_H_ */
@@ -0,0 +1,307 @@
+/*
+ * gps.c
+ *
+ *  Event driven GPS UART driver, see gps.h.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "gps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#define RX_BUF_SIZE     (1024)
+#define EVENT_QUEUE_LEN (16)
+#define PATTERN_QUEUE   (16)
+#define ACK_TIMEOUT_MS  (1000)
+#define CFG_ATTEMPTS    (3)
+
+// CFG-PRT protocol mask bits
+#define PROTO_UBX       (0x01)
+#define PROTO_NMEA      (0x02)
+
+static const char* tag = "gps";
+
+static gps_config_t config;
+static QueueHandle_t uart_queue;
+static nmea_parser_t parser;
+static ubx_decoder_t ubx;
+static bool use_ubx = false;
+static uint8_t line[UBX_MAX_PAYLOAD + UBX_FRAME_OVERHEAD];
+
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static nmea_fix_t published;
+static bool have_fix = false;
+
+static struct {
+	gps_cb_t cb;
+	void* arg;
+} subscribers[GPS_MAX_SUBSCRIBERS];
+static size_t subscriber_count = 0;
+
+// time and date move every second, only the rest counts as a change
+#define FIX_COMPARE_START   offsetof(nmea_fix_t, valid)
+#define FIX_COMPARE_LEN     (sizeof(nmea_fix_t) - FIX_COMPARE_START)
+
+static void publish(uint32_t updated)
+{
+	bool changed = !have_fix || memcmp((uint8_t*)&parser.fix + FIX_COMPARE_START,
+			(uint8_t*)&published + FIX_COMPARE_START, FIX_COMPARE_LEN) != 0;
+
+	portENTER_CRITICAL(&lock);
+	memcpy(&published, &parser.fix, sizeof(published));
+	have_fix = true;
+	portEXIT_CRITICAL(&lock);
+
+	if (!changed)
+		return;
+	for (size_t i = 0; i < subscriber_count; i++)
+		subscribers[i].cb(&published, updated, subscribers[i].arg);
+}
+
+// reads through the line feed at pos and parses whatever completed
+static void read_line(int pos)
+{
+	uint32_t updated = 0;
+	int remaining = pos + 1;
+
+	while (remaining > 0) {
+		int chunk = remaining < (int)sizeof(line) ? remaining : (int)sizeof(line);
+		int len = uart_read_bytes(config.port, line, chunk, pdMS_TO_TICKS(100));
+		if (len <= 0)
+			break;
+		updated |= nmea_feed(&parser, line, len);
+		remaining -= len;
+	}
+
+	if (updated)
+		publish(updated);
+}
+
+// binary data has no line ends, so UBX is decoded as it arrives
+static void read_ubx(size_t size)
+{
+	uint32_t updated = 0;
+
+	while (size > 0) {
+		int chunk = size < sizeof(line) ? size : sizeof(line);
+		int len = uart_read_bytes(config.port, line, chunk, pdMS_TO_TICKS(100));
+		if (len <= 0)
+			break;
+		size -= len;
+
+		for (int off = 0; off < len; ) {
+			bool complete;
+			off += ubx_feed(&ubx, line + off, len - off, &complete);
+			if (complete && ubx.msg_class == UBX_CLASS_NAV && ubx.msg_id == UBX_NAV_PVT
+					&& ubx_nav_pvt_to_fix(ubx.payload, ubx.len, &parser.fix)) {
+				// NAV-PVT carries everything RMC and GGA would
+				updated |= NMEA_RMC | NMEA_GGA;
+			}
+		}
+	}
+
+	if (updated)
+		publish(updated);
+}
+
+// own buffer, this is also called from outside the GPS task
+static void ubx_send(uint8_t msg_class, uint8_t msg_id, const uint8_t* payload, uint16_t len)
+{
+	uint8_t frame[UBX_MAX_PAYLOAD + UBX_FRAME_OVERHEAD];
+	size_t n = ubx_build(frame, sizeof(frame), msg_class, msg_id, payload, len);
+	uart_write_bytes(config.port, (const char*)frame, n);
+	uart_wait_tx_done(config.port, pdMS_TO_TICKS(100));
+}
+
+static bool ubx_wait_ack(uint8_t msg_class, uint8_t msg_id)
+{
+	TickType_t start = xTaskGetTickCount();
+
+	while (xTaskGetTickCount() - start < pdMS_TO_TICKS(ACK_TIMEOUT_MS)) {
+		int len = uart_read_bytes(config.port, line, sizeof(line), pdMS_TO_TICKS(50));
+		for (int off = 0; off < len; ) {
+			bool complete;
+			off += ubx_feed(&ubx, line + off, len - off, &complete);
+			if (complete && ubx.msg_class == UBX_CLASS_ACK && ubx.len >= 2
+					&& ubx.payload[0] == msg_class && ubx.payload[1] == msg_id)
+				return ubx.msg_id == UBX_ACK_ACK;
+		}
+	}
+	return false;
+}
+
+// CFG-PRT on UART1, 8N1 at baud with the given protocol masks
+static void ubx_port(uint32_t baud, uint8_t in_proto, uint8_t out_proto)
+{
+	uint8_t prt[20] = {0};
+	prt[0] = 1;
+	prt[4] = 0xD0;
+	prt[5] = 0x08;
+	prt[8] = baud & 0xFF;
+	prt[9] = (baud >> 8) & 0xFF;
+	prt[10] = (baud >> 16) & 0xFF;
+	prt[11] = baud >> 24;
+	prt[12] = in_proto;
+	prt[14] = out_proto;
+	ubx_send(UBX_CLASS_CFG, UBX_CFG_PRT, prt, sizeof(prt));
+}
+
+static bool ubx_configure(void)
+{
+	// UBX only in both directions, at the new rate
+	ubx_port(config.ubx_baud_rate, PROTO_UBX, PROTO_UBX);
+
+	// the receiver switches straight away, its ACK goes out at the new rate
+	uart_set_baudrate(config.port, config.ubx_baud_rate);
+	uart_flush_input(config.port);
+
+	// CFG-MSG: NAV-PVT once per navigation solution
+	const uint8_t msg[3] = {UBX_CLASS_NAV, UBX_NAV_PVT, 1};
+	for (int i = 0; i < CFG_ATTEMPTS; i++) {
+		ubx_send(UBX_CLASS_CFG, UBX_CFG_MSG, msg, sizeof(msg));
+		if (!ubx_wait_ack(UBX_CLASS_CFG, UBX_CFG_MSG))
+			continue;
+		// CFG-CFG: keep port and message setup in battery backed RAM so the
+		// receiver comes back in UBX mode after being powered down
+		const uint8_t save[12] = {0, 0, 0, 0, 0x03, 0, 0, 0, 0, 0, 0, 0};
+		ubx_send(UBX_CLASS_CFG, UBX_CFG_CFG, save, sizeof(save));
+		ubx_wait_ack(UBX_CLASS_CFG, UBX_CFG_CFG);
+		return true;
+	}
+
+	// a lost ACK does not mean CFG-PRT was lost, so put the receiver back
+	// on NMEA at the old rate before the host follows it there
+	ubx_port(config.baud_rate, PROTO_UBX | PROTO_NMEA, PROTO_NMEA);
+	uart_set_baudrate(config.port, config.baud_rate);
+	uart_flush_input(config.port);
+	return false;
+}
+
+static void gps_task(void* arg)
+{
+	uart_event_t event;
+
+	while (1) {
+		if (xQueueReceive(uart_queue, &event, portMAX_DELAY) != pdTRUE)
+			continue;
+
+		switch (event.type) {
+		case UART_PATTERN_DET: {
+			int pos = uart_pattern_pop_pos(config.port);
+			if (pos < 0) {
+				// pattern queue overran, positions are lost, start clean
+				uart_flush_input(config.port);
+			} else {
+				read_line(pos);
+			}
+			break;
+		}
+		case UART_DATA:
+			// in NMEA mode data waits in the ring buffer for its line feed
+			if (use_ubx)
+				read_ubx(event.size);
+			break;
+		case UART_FIFO_OVF:
+		case UART_BUFFER_FULL:
+			ESP_LOGW(tag, "rx overflow, flushing");
+			uart_flush_input(config.port);
+			uart_pattern_queue_reset(config.port, PATTERN_QUEUE);
+			xQueueReset(uart_queue);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+esp_err_t gps_init(const gps_config_t* cfg)
+{
+	config = *cfg;
+	nmea_init(&parser);
+	ubx_init(&ubx);
+
+	uart_config_t uart_config = {
+		.baud_rate = config.baud_rate,
+		.data_bits = UART_DATA_8_BITS,
+		.parity = UART_PARITY_DISABLE,
+		.stop_bits = UART_STOP_BITS_1,
+		.flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+	};
+	esp_err_t err = uart_param_config(config.port, &uart_config);
+	if (err == ESP_OK)
+		err = uart_set_pin(config.port, config.tx_pin, config.rx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+	if (err == ESP_OK)
+		err = uart_driver_install(config.port, RX_BUF_SIZE, 0, EVENT_QUEUE_LEN, &uart_queue, 0);
+	if (err != ESP_OK)
+		return err;
+
+	if (config.ubx_baud_rate) {
+		use_ubx = ubx_configure();
+		if (!use_ubx)
+			ESP_LOGW(tag, "no UBX acknowledge, staying on NMEA");
+	}
+
+	if (!use_ubx) {
+		// one event per line feed, no idle time needed around it
+		uart_enable_pattern_det_intr(config.port, '\n', 1, 10000, 0, 0);
+		uart_pattern_queue_reset(config.port, PATTERN_QUEUE);
+	}
+
+	xTaskCreate(gps_task, "gps", 3072, NULL, 5, NULL);
+	ESP_LOGI(tag, "receiving %s on UART%d at %d baud", use_ubx ? "UBX" : "NMEA",
+			config.port, use_ubx ? config.ubx_baud_rate : config.baud_rate);
+	return ESP_OK;
+}
+
+esp_err_t gps_subscribe(gps_cb_t cb, void* arg)
+{
+	if (cb == NULL)
+		return ESP_ERR_INVALID_ARG;
+	if (subscriber_count >= GPS_MAX_SUBSCRIBERS)
+		return ESP_ERR_NO_MEM;
+
+	subscribers[subscriber_count].cb = cb;
+	subscribers[subscriber_count].arg = arg;
+	portENTER_CRITICAL(&lock);
+	subscriber_count++;
+	portEXIT_CRITICAL(&lock);
+	return ESP_OK;
+}
+
+bool gps_latest(nmea_fix_t* out)
+{
+	portENTER_CRITICAL(&lock);
+	bool valid = have_fix;
+	if (valid)
+		memcpy(out, &published, sizeof(*out));
+	portEXIT_CRITICAL(&lock);
+	return valid;
+}
+
+bool gps_using_ubx(void)
+{
+	return use_ubx;
+}
+
+esp_err_t gps_ubx_send(uint8_t msg_class, uint8_t msg_id, const uint8_t* payload, uint16_t len)
+{
+	if (!use_ubx)
+		return ESP_ERR_INVALID_STATE;
+	if (len > UBX_MAX_PAYLOAD)
+		return ESP_ERR_INVALID_SIZE;
+	ubx_send(msg_class, msg_id, payload, len);
+	return ESP_OK;
+}
+
+void gps_stats(nmea_stats_t* nmea, ubx_stats_t* ubx_out)
+{
+	portENTER_CRITICAL(&lock);
+	if (nmea)
+		*nmea = parser.stats;
+	if (ubx_out)
+		*ubx_out = ubx.stats;
+	portEXIT_CRITICAL(&lock);
+}
@@ -0,0 +1,317 @@
+/*
+ * gps_manager.c
+ *
+ *  GPS duty cycling and NVS position cache, see gps_manager.h.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "gps_manager.h"
+#include "ubx.h"
+#include "nvs.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp32/clk.h"
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+
+#define NVS_NAMESPACE   "gps"
+#define NVS_KEY         "cache"
+#define POLL_MS         (1000)
+#define WARMUP_MS       (1000)      // receiver boot before it takes aiding
+#define AID_ACCURACY_CM (1000)      // the tower has not moved, 10 m is generous
+#define AID_LATENCY_US  (50000)     // the time is taken on receipt, allow for the UART
+#define HAVE_POSITION   (1 << 0)
+#define IDLE            (1 << 1)    // receiver off or in backup until the next refresh
+#define RTC_MAGIC       (0x6B5C0FF5)
+
+static const char* tag = "gps_manager";
+
+static gps_manager_config_t config;
+static EventGroupHandle_t events;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static gps_cache_t cache;
+static gps_manager_stats_t stats;
+static TaskHandle_t task;
+
+// RTC slow memory, the refresh schedule carries over deep sleep;
+// times are esp_clk_rtc_time(), which keeps counting while asleep
+static RTC_DATA_ATTR uint32_t rtc_magic;
+static RTC_DATA_ATTR uint64_t off_until_us;
+
+// microseconds until the refresh is due, 0 once it is or when nothing is known
+static uint64_t until_due(void)
+{
+	if (esp_reset_reason() != ESP_RST_DEEPSLEEP || rtc_magic != RTC_MAGIC)
+		return 0;
+	uint64_t now = esp_clk_rtc_time();
+	return now < off_until_us ? off_until_us - now : 0;
+}
+
+static esp_err_t cache_load(gps_cache_t* out)
+{
+	nvs_handle handle;
+	esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+	if (err != ESP_OK)
+		return err;
+	size_t size = sizeof(*out);
+	err = nvs_get_blob(handle, NVS_KEY, out, &size);
+	nvs_close(handle);
+	if (err != ESP_OK)
+		return err;
+	if (size != sizeof(*out) || out->version != GPS_CACHE_VERSION)
+		return ESP_ERR_NVS_NOT_FOUND;
+	return ESP_OK;
+}
+
+static esp_err_t cache_save(const gps_cache_t* in)
+{
+	nvs_handle handle;
+	esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+	if (err != ESP_OK)
+		return err;
+	err = nvs_set_blob(handle, NVS_KEY, in, sizeof(*in));
+	if (err == ESP_OK)
+		err = nvs_commit(handle);
+	nvs_close(handle);
+	return err;
+}
+
+static void put_i32(uint8_t* p, int32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+// pdMS_TO_TICKS() multiplies in 32 bits, long waits are worked out here and
+// capped short of portMAX_DELAY, which would never end
+static TickType_t ms_to_ticks(uint64_t ms)
+{
+	uint64_t ticks = ms * configTICK_RATE_HZ / 1000;
+	return ticks < portMAX_DELAY ? ticks : portMAX_DELAY - 1;
+}
+
+// MGA-INI-TIME_UTC, the held UTC with its error bound; time and position
+// together are what lets the receiver hot start
+static void send_time(void)
+{
+	int64_t utc_us, error_us;
+	if (config.utc_time == NULL || !config.utc_time(&utc_us, &error_us) || utc_us <= 0)
+		return;
+	error_us += AID_LATENCY_US;
+
+	time_t seconds = utc_us / 1000000;
+	struct tm t;
+	gmtime_r(&seconds, &t);
+	uint8_t payload[24] = {0x10, 0x00, 0x00, (uint8_t)-128};   // on receipt, leap seconds unknown
+	payload[4] = t.tm_year + 1900;
+	payload[5] = (t.tm_year + 1900) >> 8;
+	payload[6] = t.tm_mon + 1;
+	payload[7] = t.tm_mday;
+	payload[8] = t.tm_hour;
+	payload[9] = t.tm_min;
+	payload[10] = t.tm_sec;
+	put_i32(payload + 12, (utc_us % 1000000) * 1000);
+	uint32_t acc_s = error_us / 1000000 < UINT16_MAX ? error_us / 1000000 : UINT16_MAX;
+	payload[16] = acc_s;
+	payload[17] = acc_s >> 8;
+	put_i32(payload + 20, (error_us % 1000000) * 1000);
+	gps_ubx_send(UBX_CLASS_MGA, UBX_MGA_INI, payload, sizeof(payload));
+}
+
+// MGA-INI-POS_LLH, hands the receiver the cached position so it only has
+// to search for the satellites visible from there
+static void send_aiding(void)
+{
+	send_time();
+
+	gps_cache_t c;
+	if (!gps_manager_position(&c))
+		return;
+
+	uint8_t payload[20] = {0x01, 0x00};
+	put_i32(payload + 4, c.latitude);
+	put_i32(payload + 8, c.longitude);
+	put_i32(payload + 12, (int32_t)(c.altitude * 100.0f));
+	put_i32(payload + 16, AID_ACCURACY_CM);
+	gps_ubx_send(UBX_CLASS_MGA, UBX_MGA_INI, payload, sizeof(payload));
+}
+
+static void power_on(void)
+{
+	xEventGroupClearBits(events, IDLE);
+	if (config.power_pin != GPS_NO_POWER_PIN) {
+		gpio_set_level(config.power_pin, 1);
+	} else {
+		// UART activity wakes a receiver in backup early, the poll itself is lost
+		gps_ubx_send(UBX_CLASS_NAV, UBX_NAV_PVT, NULL, 0);
+	}
+	vTaskDelay(pdMS_TO_TICKS(WARMUP_MS));
+	send_aiding();
+}
+
+static void power_off(void)
+{
+	if (config.power_pin != GPS_NO_POWER_PIN) {
+		gpio_set_level(config.power_pin, 0);
+	} else {
+		// RXM-PMREQ: backup mode for the refresh interval, keeps RTC and ephemeris
+		uint8_t payload[8] = {0};
+		uint64_t ms = config.refresh_interval_s * 1000ULL;
+		put_i32(payload, ms < UINT32_MAX ? ms : UINT32_MAX);
+		payload[4] = 0x02;
+		if (gps_ubx_send(UBX_CLASS_RXM, UBX_RXM_PMREQ, payload, sizeof(payload)) != ESP_OK)
+			ESP_LOGW(tag, "receiver not in UBX mode, left running");
+	}
+
+	off_until_us = esp_clk_rtc_time() + config.refresh_interval_s * 1000000ULL;
+	rtc_magic = RTC_MAGIC;
+	// a refresh asked for while this one ran has been served
+	ulTaskNotifyTake(pdTRUE, 0);
+	xEventGroupSetBits(events, IDLE);
+}
+
+// waits for a valid fix newer than anything seen before the wake
+static bool wait_for_fix(nmea_fix_t* fix)
+{
+	nmea_fix_t before;
+	bool had = gps_latest(&before);
+	int64_t start = esp_timer_get_time();
+
+	for (uint32_t waited = 0; waited < config.fix_timeout_s * 1000; waited += POLL_MS) {
+		vTaskDelay(pdMS_TO_TICKS(POLL_MS));
+		if (!gps_latest(fix) || !fix->valid || fix->quality == 0)
+			continue;
+		if (had && memcmp(&fix->time, &before.time, sizeof(fix->time)) == 0
+				&& memcmp(&fix->date, &before.date, sizeof(fix->date)) == 0)
+			continue;
+		stats.last_ttf_ms = (esp_timer_get_time() - start) / 1000;
+		return true;
+	}
+	return false;
+}
+
+static void manager_task(void* arg)
+{
+	// started after a deep sleep in the middle of an off period, finish it
+	uint64_t wait_us = until_due();
+	if (wait_us) {
+		xEventGroupSetBits(events, IDLE);
+		ulTaskNotifyTake(pdTRUE, ms_to_ticks(wait_us / 1000));
+	}
+
+	while (1) {
+		stats.wakes++;
+		power_on();
+
+		nmea_fix_t fix;
+		if (wait_for_fix(&fix)) {
+			stats.fixes++;
+			gps_cache_t c = {
+				.version = GPS_CACHE_VERSION,
+				.latitude = fix.latitude,
+				.longitude = fix.longitude,
+				.altitude = fix.altitude,
+				.date = fix.date,
+				.time = fix.time,
+			};
+			portENTER_CRITICAL(&lock);
+			cache = c;
+			portEXIT_CRITICAL(&lock);
+			xEventGroupSetBits(events, HAVE_POSITION);
+
+			esp_err_t err = cache_save(&c);
+			if (err != ESP_OK)
+				ESP_LOGW(tag, "cache save failed (%s)", esp_err_to_name(err));
+			ESP_LOGI(tag, "fix in %u ms, %.7f, %.7f", stats.last_ttf_ms,
+					nmea_deg(c.latitude), nmea_deg(c.longitude));
+
+			// stay up long enough to collect fresh ephemeris
+			vTaskDelay(ms_to_ticks(config.on_time_s * 1000ULL));
+		} else {
+			stats.timeouts++;
+			ESP_LOGW(tag, "no fix after %u s", config.fix_timeout_s);
+		}
+
+		power_off();
+		ulTaskNotifyTake(pdTRUE, ms_to_ticks(config.refresh_interval_s * 1000ULL));
+	}
+}
+
+esp_err_t gps_manager_start(const gps_manager_config_t* cfg)
+{
+	if (cfg == NULL || cfg->refresh_interval_s == 0)
+		return ESP_ERR_INVALID_ARG;
+	config = *cfg;
+
+	events = xEventGroupCreate();
+	if (events == NULL)
+		return ESP_ERR_NO_MEM;
+
+	if (cache_load(&cache) == ESP_OK) {
+		xEventGroupSetBits(events, HAVE_POSITION);
+		ESP_LOGI(tag, "cached position %.7f, %.7f from %04u-%02u-%02u",
+				nmea_deg(cache.latitude), nmea_deg(cache.longitude),
+				cache.date.year, cache.date.month, cache.date.day);
+	}
+
+	if (config.power_pin != GPS_NO_POWER_PIN) {
+		gpio_set_direction(config.power_pin, GPIO_MODE_OUTPUT);
+		gpio_set_level(config.power_pin, 1);
+	}
+
+	esp_err_t err = gps_init(&config.gps);
+	if (err != ESP_OK)
+		return err;
+
+	if (xTaskCreate(manager_task, "gps_manager", 3072, NULL, 4, &task) != pdPASS)
+		return ESP_ERR_NO_MEM;
+	return ESP_OK;
+}
+
+bool gps_manager_due(void)
+{
+	return until_due() == 0;
+}
+
+void gps_manager_refresh(void)
+{
+	if (task)
+		xTaskNotifyGive(task);
+}
+
+bool gps_manager_wait_idle(uint32_t timeout_ms)
+{
+	if (events == NULL)
+		return true;
+	return xEventGroupWaitBits(events, IDLE, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms)) & IDLE;
+}
+
+bool gps_manager_position(gps_cache_t* out)
+{
+	if (events == NULL || !(xEventGroupGetBits(events) & HAVE_POSITION))
+		return false;
+	portENTER_CRITICAL(&lock);
+	*out = cache;
+	portEXIT_CRITICAL(&lock);
+	return true;
+}
+
+bool gps_manager_wait(gps_cache_t* out, uint32_t timeout_ms)
+{
+	if (events == NULL)
+		return false;
+	xEventGroupWaitBits(events, HAVE_POSITION, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms));
+	return gps_manager_position(out);
+}
+
+void gps_manager_stats(gps_manager_stats_t* out)
+{
+	*out = stats;
+}
@@ -0,0 +1,46 @@
+/*
+ * gps.h
+ *
+ *  UART driver for the GPS receiver. The UART raises a pattern event on
+ *  every line feed, so each NMEA sentence is parsed as soon as its last
+ *  byte arrives. Subscribers are only called when the fix content changes.
+ *
+ *  With ubx_baud_rate set, the receiver is first switched to binary UBX
+ *  output of NAV-PVT only at that rate. If it does not acknowledge (not a
+ *  u-blox part, or wiring problems) the driver stays on NMEA.
+ */
+
+#ifndef GPS_H_
+#define GPS_H_
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "driver/uart.h"
+#include "nmea.h"
+#include "ubx.h"
+
+#define GPS_MAX_SUBSCRIBERS (4)
+
+typedef struct {
+	uart_port_t port;
+	int baud_rate;
+	int rx_pin;
+	int tx_pin;
+	int ubx_baud_rate;          // 0 to stay on NMEA
+} gps_config_t;
+
+// called from the GPS task, updated holds the NMEA_* bits that changed the fix
+typedef void (*gps_cb_t)(const nmea_fix_t* fix, uint32_t updated, void* arg);
+
+esp_err_t gps_init(const gps_config_t* cfg);
+esp_err_t gps_subscribe(gps_cb_t cb, void* arg);
+
+// copy of the current fix, false until a sentence has been parsed
+bool gps_latest(nmea_fix_t* out);
+bool gps_using_ubx(void);
+// sends a UBX message, only once the receiver is in UBX mode
+esp_err_t gps_ubx_send(uint8_t msg_class, uint8_t msg_id, const uint8_t* payload, uint16_t len);
+// either pointer may be NULL
+void gps_stats(nmea_stats_t* nmea, ubx_stats_t* ubx);
+
+#endif /* GPS_H_ */
@@ -0,0 +1,77 @@
+/*
+ * gps_manager.h
+ *
+ *  Duty cycles the GPS receiver on stationary towers. A fix is taken at
+ *  boot and cached in NVS along with the time it was taken; the receiver
+ *  is then powered down (or put in backup mode over UBX) and only woken
+ *  every refresh interval to keep time and ephemeris current. On every
+ *  wake the cached position and the application's held UTC time are sent
+ *  as aiding so the receiver hot starts.
+ *
+ *  The schedule is kept in RTC memory. An application that deep sleeps
+ *  asks gps_manager_due() after each wake, since a receiver in backup
+ *  mode comes back on by itself when the PMREQ period ends and stays on
+ *  until the manager sends it back, and waits for gps_manager_wait_idle()
+ *  before sleeping again.
+ */
+
+#ifndef GPS_MANAGER_H_
+#define GPS_MANAGER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "gps.h"
+
+#define GPS_CACHE_VERSION   (1)
+#define GPS_NO_POWER_PIN    (-1)
+
+// the UTC microseconds since 1970 the application holds, and a bound on
+// their error; false when it has none
+typedef bool (*gps_utc_cb_t)(int64_t* utc_us, int64_t* error_us);
+
+typedef struct {
+	gps_config_t gps;
+	int power_pin;              // receiver supply enable, GPS_NO_POWER_PIN to use UBX backup mode
+	uint32_t fix_timeout_s;     // longest wait for a fix on each wake
+	uint32_t on_time_s;         // stay on after the fix to refresh ephemeris
+	uint32_t refresh_interval_s;
+	gps_utc_cb_t utc_time;      // time aiding on each wake, NULL for position only
+} gps_manager_config_t;
+
+typedef struct {
+	uint32_t version;
+	int32_t latitude;           // degrees x 1e7
+	int32_t longitude;
+	float altitude;             // metres above mean sea level
+	nmea_date_t date;           // UTC the position was cached
+	nmea_time_t time;
+} gps_cache_t;
+
+typedef struct {
+	uint32_t wakes;
+	uint32_t fixes;
+	uint32_t timeouts;
+	uint32_t last_ttf_ms;       // time to fix on the last wake
+} gps_manager_stats_t;
+
+esp_err_t gps_manager_start(const gps_manager_config_t* cfg);
+
+// the off period has run out, or nothing is known about it; callable before start
+bool gps_manager_due(void);
+
+// ends the off period now, e.g. when the clock needs the PPS again
+void gps_manager_refresh(void);
+
+// blocks until the receiver is off or in backup again, false on timeout
+bool gps_manager_wait_idle(uint32_t timeout_ms);
+
+// cached position, valid straight after boot when NVS holds one
+bool gps_manager_position(gps_cache_t* out);
+
+// blocks until a position is known, false on timeout
+bool gps_manager_wait(gps_cache_t* out, uint32_t timeout_ms);
+
+void gps_manager_stats(gps_manager_stats_t* out);
+
+#endif /* GPS_MANAGER_H_ */
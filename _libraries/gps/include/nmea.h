@@ -0,0 +1,99 @@
+/*
+ * nmea.h
+ *
+ *  NMEA 0183 parser for the GPS receiver. Takes raw UART chunks of any
+ *  size, assembles sentences in a fixed buffer, checks the *hh checksum,
+ *  splits fields in place and dispatches on the sentence type. Results
+ *  accumulate into one typed fix. Nothing is allocated.
+ *
+ *  Understood sentences: RMC, GGA, GSA, VTG and ZDA from any talker
+ *  (GP, GN, GL, GA, ...).
+ *
+ *  Numbers are parsed with integer arithmetic only. Coordinates are kept
+ *  as degrees x 1e7 (about 1 cm resolution), use nmea_deg() when a
+ *  floating point value is actually needed.
+ */
+
+#ifndef NMEA_H_
+#define NMEA_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define NMEA_MAX_SENTENCE   (82)
+#define NMEA_MAX_FIELDS     (24)
+#define NMEA_MAX_SATS       (12)
+
+// bit per sentence type, returned by nmea_feed()
+#define NMEA_RMC    (1 << 0)
+#define NMEA_GGA    (1 << 1)
+#define NMEA_GSA    (1 << 2)
+#define NMEA_VTG    (1 << 3)
+#define NMEA_ZDA    (1 << 4)
+
+typedef struct {
+	uint8_t hour;
+	uint8_t minute;
+	uint8_t second;
+	uint16_t millis;
+} nmea_time_t;
+
+typedef struct {
+	uint8_t day;
+	uint8_t month;
+	uint16_t year;
+} nmea_date_t;
+
+typedef struct {
+	nmea_time_t time;           // UTC, RMC/GGA/ZDA
+	nmea_date_t date;           // RMC/ZDA
+	bool valid;                 // RMC status A
+	int32_t latitude;           // degrees x 1e7, north positive
+	int32_t longitude;          // degrees x 1e7, east positive
+	float speed_knots;          // RMC/VTG
+	float course;               // degrees true, RMC/VTG
+	uint8_t quality;            // GGA fix quality, 0 = none
+	uint8_t satellites;         // GGA satellites in use
+	float altitude;             // GGA, metres above mean sea level
+	float geoid_sep;            // GGA, metres
+	uint8_t fix_mode;           // GSA, 1 = none, 2 = 2D, 3 = 3D
+	uint8_t sat_ids[NMEA_MAX_SATS];
+	float pdop;
+	float hdop;
+	float vdop;
+} nmea_fix_t;
+
+typedef struct {
+	uint32_t sentences;         // checksum good and handled
+	uint32_t checksum_errors;
+	uint32_t overflows;         // longer than NMEA_MAX_SENTENCE
+	uint32_t unknown;           // valid, but not a type we parse
+} nmea_stats_t;
+
+typedef struct {
+	char buf[NMEA_MAX_SENTENCE + 1];
+	size_t len;
+	bool in_sentence;
+	nmea_fix_t fix;
+	nmea_stats_t stats;
+} nmea_parser_t;
+
+void nmea_init(nmea_parser_t* parser);
+
+#define NMEA_MAX_LATITUDE   (90)
+#define NMEA_MAX_LONGITUDE  (180)
+
+// ddmm.mmmmm (or dddmm.mmmmm) and hemisphere to degrees x 1e7, false past
+// max_degrees, one of the limits above
+bool nmea_coordinate(const char* value, char hemisphere, int max_degrees, int32_t* out);
+
+static inline double nmea_deg(int32_t e7)
+{
+	return e7 * 1e-7;
+}
+
+// consumes a chunk, returns the NMEA_* bits of the sentences it completed
+uint32_t nmea_feed(nmea_parser_t* parser, const uint8_t* data, size_t len);
+
+#endif /* NMEA_H_ */
@@ -0,0 +1,73 @@
+/*
+ * ubx.h
+ *
+ *  u-blox UBX binary protocol: a streaming frame decoder with Fletcher
+ *  checksum validation, a frame builder for configuration messages and
+ *  conversion of NAV-PVT into the same fix the NMEA parser produces.
+ */
+
+#ifndef UBX_H_
+#define UBX_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "nmea.h"
+
+#define UBX_SYNC_1          (0xB5)
+#define UBX_SYNC_2          (0x62)
+#define UBX_MAX_PAYLOAD     (100)
+#define UBX_FRAME_OVERHEAD  (8)
+
+#define UBX_CLASS_NAV       (0x01)
+#define UBX_CLASS_RXM       (0x02)
+#define UBX_CLASS_ACK       (0x05)
+#define UBX_CLASS_CFG       (0x06)
+#define UBX_CLASS_MGA       (0x13)
+
+#define UBX_NAV_PVT         (0x07)
+#define UBX_ACK_NAK         (0x00)
+#define UBX_ACK_ACK         (0x01)
+#define UBX_CFG_PRT         (0x00)
+#define UBX_CFG_MSG         (0x01)
+#define UBX_CFG_CFG         (0x09)
+#define UBX_RXM_PMREQ       (0x41)
+#define UBX_MGA_INI         (0x40)
+
+#define UBX_NAV_PVT_LEN     (92)
+
+typedef struct {
+	uint32_t frames;            // checksum good
+	uint32_t checksum_errors;
+	uint32_t oversize;          // payload longer than UBX_MAX_PAYLOAD
+} ubx_stats_t;
+
+typedef struct {
+	uint8_t state;
+	uint8_t msg_class;
+	uint8_t msg_id;
+	uint16_t len;
+	uint16_t pos;
+	uint8_t ck_a;
+	uint8_t ck_b;
+	uint8_t payload[UBX_MAX_PAYLOAD];
+	ubx_stats_t stats;
+} ubx_decoder_t;
+
+void ubx_init(ubx_decoder_t* dec);
+
+/*
+ * Consumes bytes until a frame completes. Returns the number of bytes
+ * used; *complete is set when dec holds a valid frame, which stays
+ * readable until the next call.
+ */
+size_t ubx_feed(ubx_decoder_t* dec, const uint8_t* data, size_t len, bool* complete);
+
+// writes a frame into out, returns its length or 0 if out is too small
+size_t ubx_build(uint8_t* out, size_t size, uint8_t msg_class, uint8_t msg_id,
+		const uint8_t* payload, uint16_t len);
+
+// fills fix from a NAV-PVT payload, false if the payload is too short
+bool ubx_nav_pvt_to_fix(const uint8_t* payload, uint16_t len, nmea_fix_t* fix);
+
+#endif /* UBX_H_ */
@@ -0,0 +1,317 @@
+/*
+ * nmea.c
+ *
+ *  NMEA 0183 parser, see nmea.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "nmea.h"
+
+// more whole digits than any field has, and far from int64 overflow
+#define MAX_INT_DIGITS  (9)
+
+typedef void (*nmea_handler_t)(nmea_fix_t* fix, char** field, int count);
+
+/*******************************************************
+ *                Field helpers
+ *******************************************************/
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+static bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+// -1 unless both characters are digits
+static int two_digits(const char* s)
+{
+	if (!is_digit(s[0]) || !is_digit(s[1]))
+		return -1;
+	return (s[0] - '0') * 10 + (s[1] - '0');
+}
+
+// decimal with optional sign, keeps up to 7 fractional digits
+static bool parse_decimal(const char* s, int64_t* mantissa, int* decimals)
+{
+	bool negative = *s == '-';
+	if (*s == '-' || *s == '+')
+		s++;
+	if (!*s)
+		return false;
+
+	int64_t m = 0;
+	int d = -1;
+	int whole = 0;
+	for (; *s; s++) {
+		if (*s == '.' && d < 0) {
+			d = 0;
+		} else if (is_digit(*s)) {
+			if (d >= 7)
+				continue;
+			if (d < 0 && ++whole > MAX_INT_DIGITS)
+				return false;
+			m = m * 10 + (*s - '0');
+			if (d >= 0)
+				d++;
+		} else {
+			return false;
+		}
+	}
+	*mantissa = negative ? -m : m;
+	*decimals = d < 0 ? 0 : d;
+	return true;
+}
+
+static const int32_t powers_of_ten[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000};
+
+static float parse_float(const char* s, float fallback)
+{
+	int64_t m;
+	int d;
+	if (!parse_decimal(s, &m, &d))
+		return fallback;
+	return (float)m / powers_of_ten[d];
+}
+
+// whole number in [0, max], fallback for anything else
+static int parse_uint(const char* s, int max, int fallback)
+{
+	int64_t m;
+	int d;
+	if (*s == '-' || !parse_decimal(s, &m, &d) || d != 0 || m > max)
+		return fallback;
+	return (int)m;
+}
+
+// hhmmss.sss
+static void parse_time(const char* s, nmea_time_t* t)
+{
+	if (strlen(s) < 6)
+		return;
+	int hour = two_digits(s);
+	int minute = two_digits(s + 2);
+	int second = two_digits(s + 4);
+	if (hour < 0 || minute < 0 || second < 0)
+		return;
+	t->hour = hour;
+	t->minute = minute;
+	t->second = second;
+	t->millis = 0;
+	if (s[6] == '.') {
+		int scale = 100;
+		for (const char* p = s + 7; is_digit(*p) && scale > 0; p++, scale /= 10)
+			t->millis += (*p - '0') * scale;
+	}
+}
+
+bool nmea_coordinate(const char* value, char hemisphere, int max_degrees, int32_t* out)
+{
+	int64_t m;
+	int d;
+	if (*value == '-' || !parse_decimal(value, &m, &d))
+		return false;
+
+	// m is dddmm.mmmmm scaled by 10^d, split off whole degrees
+	int64_t scale = powers_of_ten[d];
+	int64_t degrees = m / (100 * scale);
+	int64_t minutes = m - degrees * 100 * scale;
+	if (degrees > max_degrees || minutes >= 60 * scale)
+		return false;
+
+	// minutes x 1e7 / 60, rounded to nearest
+	int64_t e7 = degrees * 10000000 + (minutes * (10000000 / scale) + 30) / 60;
+	if (e7 > max_degrees * 10000000LL)
+		return false;
+	*out = (int32_t)(hemisphere == 'S' || hemisphere == 'W' ? -e7 : e7);
+	return true;
+}
+
+/*******************************************************
+ *                Sentence handlers
+ *******************************************************/
+
+// $--RMC,time,status,lat,N,lon,E,knots,course,ddmmyy,magvar,E[,mode]
+static void parse_rmc(nmea_fix_t* fix, char** f, int n)
+{
+	if (n < 10)
+		return;
+	parse_time(f[1], &fix->time);
+	fix->valid = f[2][0] == 'A';
+	if (fix->valid) {
+		nmea_coordinate(f[3], f[4][0], NMEA_MAX_LATITUDE, &fix->latitude);
+		nmea_coordinate(f[5], f[6][0], NMEA_MAX_LONGITUDE, &fix->longitude);
+	}
+	fix->speed_knots = parse_float(f[7], fix->speed_knots);
+	fix->course = parse_float(f[8], fix->course);
+	if (strlen(f[9]) == 6) {
+		int day = two_digits(f[9]);
+		int month = two_digits(f[9] + 2);
+		int year = two_digits(f[9] + 4);
+		if (day >= 0 && month >= 0 && year >= 0) {
+			fix->date.day = day;
+			fix->date.month = month;
+			fix->date.year = 2000 + year;
+		}
+	}
+}
+
+// $--GGA,time,lat,N,lon,E,quality,sats,hdop,alt,M,sep,M,age,station
+static void parse_gga(nmea_fix_t* fix, char** f, int n)
+{
+	if (n < 12)
+		return;
+	parse_time(f[1], &fix->time);
+	fix->quality = parse_uint(f[6], UINT8_MAX, 0);
+	if (fix->quality) {
+		nmea_coordinate(f[2], f[3][0], NMEA_MAX_LATITUDE, &fix->latitude);
+		nmea_coordinate(f[4], f[5][0], NMEA_MAX_LONGITUDE, &fix->longitude);
+	}
+	fix->satellites = parse_uint(f[7], UINT8_MAX, 0);
+	fix->hdop = parse_float(f[8], fix->hdop);
+	fix->altitude = parse_float(f[9], fix->altitude);
+	fix->geoid_sep = parse_float(f[11], fix->geoid_sep);
+}
+
+// $--GSA,mode,fix,sv1..sv12,pdop,hdop,vdop
+static void parse_gsa(nmea_fix_t* fix, char** f, int n)
+{
+	if (n < 18)
+		return;
+	fix->fix_mode = parse_uint(f[2], UINT8_MAX, 0);
+	for (int i = 0; i < NMEA_MAX_SATS; i++)
+		fix->sat_ids[i] = parse_uint(f[3 + i], UINT8_MAX, 0);
+	fix->pdop = parse_float(f[15], fix->pdop);
+	fix->hdop = parse_float(f[16], fix->hdop);
+	fix->vdop = parse_float(f[17], fix->vdop);
+}
+
+// $--VTG,course,T,magcourse,M,knots,N,kmh,K[,mode]
+static void parse_vtg(nmea_fix_t* fix, char** f, int n)
+{
+	if (n < 9)
+		return;
+	fix->course = parse_float(f[1], fix->course);
+	fix->speed_knots = parse_float(f[5], fix->speed_knots);
+}
+
+// $--ZDA,time,dd,mm,yyyy,zone_h,zone_m
+static void parse_zda(nmea_fix_t* fix, char** f, int n)
+{
+	if (n < 5)
+		return;
+	parse_time(f[1], &fix->time);
+	int day = parse_uint(f[2], 31, -1);
+	int month = parse_uint(f[3], 12, -1);
+	int year = parse_uint(f[4], 9999, -1);
+	if (day >= 0 && month >= 0 && year >= 0) {
+		fix->date.day = day;
+		fix->date.month = month;
+		fix->date.year = year;
+	}
+}
+
+static const struct {
+	char type[4];
+	uint32_t bit;
+	nmea_handler_t handler;
+} handlers[] = {
+	{"RMC", NMEA_RMC, parse_rmc},
+	{"GGA", NMEA_GGA, parse_gga},
+	{"GSA", NMEA_GSA, parse_gsa},
+	{"VTG", NMEA_VTG, parse_vtg},
+	{"ZDA", NMEA_ZDA, parse_zda},
+};
+
+/*******************************************************
+ *                Sentence assembly
+ *******************************************************/
+
+// buf holds "$...*hh" without the line ending
+static uint32_t process(nmea_parser_t* p)
+{
+	char* star = memchr(p->buf, '*', p->len);
+	if (star == NULL || star + 3 != p->buf + p->len) {
+		p->stats.checksum_errors++;
+		return 0;
+	}
+
+	uint8_t sum = 0;
+	for (char* c = p->buf + 1; c < star; c++)
+		sum ^= (uint8_t)*c;
+	int hi = hex_value(star[1]), lo = hex_value(star[2]);
+	if (hi < 0 || lo < 0 || sum != (hi << 4 | lo)) {
+		p->stats.checksum_errors++;
+		return 0;
+	}
+	*star = '\0';
+
+	// split in place, fields point into buf
+	char* field[NMEA_MAX_FIELDS];
+	int count = 0;
+	field[count++] = p->buf + 1;
+	for (char* c = p->buf + 1; *c && count < NMEA_MAX_FIELDS; c++) {
+		if (*c == ',') {
+			*c = '\0';
+			field[count++] = c + 1;
+		}
+	}
+
+	// address is a two letter talker followed by the type
+	if (strlen(field[0]) != 5) {
+		p->stats.unknown++;
+		return 0;
+	}
+	for (size_t i = 0; i < sizeof(handlers) / sizeof(handlers[0]); i++) {
+		if (memcmp(field[0] + 2, handlers[i].type, 3) == 0) {
+			handlers[i].handler(&p->fix, field, count);
+			p->stats.sentences++;
+			return handlers[i].bit;
+		}
+	}
+	p->stats.unknown++;
+	return 0;
+}
+
+void nmea_init(nmea_parser_t* parser)
+{
+	memset(parser, 0, sizeof(*parser));
+}
+
+uint32_t nmea_feed(nmea_parser_t* p, const uint8_t* data, size_t len)
+{
+	uint32_t updated = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		char c = (char)data[i];
+
+		if (c == '$') {
+			// a new start always resynchronises, even mid-sentence
+			p->buf[0] = c;
+			p->len = 1;
+			p->in_sentence = true;
+		} else if (!p->in_sentence) {
+			continue;
+		} else if (c == '\r' || c == '\n') {
+			p->buf[p->len] = '\0';
+			p->in_sentence = false;
+			updated |= process(p);
+		} else if (p->len < NMEA_MAX_SENTENCE) {
+			p->buf[p->len++] = c;
+		} else {
+			p->stats.overflows++;
+			p->in_sentence = false;
+		}
+	}
+	return updated;
+}
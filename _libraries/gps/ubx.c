@@ -0,0 +1,180 @@
+/*
+ * ubx.c
+ *
+ *  UBX frame decoder and builder, see ubx.h.
+ *
+ *  Frame: B5 62 class id len_lo len_hi payload[len] ck_a ck_b, with the
+ *  8-bit Fletcher checksum taken over class through the payload.
+ */
+
+#include <string.h>
+#include "ubx.h"
+
+enum {
+	WAIT_SYNC_1,
+	WAIT_SYNC_2,
+	READ_CLASS,
+	READ_ID,
+	READ_LEN_LO,
+	READ_LEN_HI,
+	READ_PAYLOAD,
+	READ_CK_A,
+	READ_CK_B,
+};
+
+static inline void checksum(ubx_decoder_t* dec, uint8_t b)
+{
+	dec->ck_a += b;
+	dec->ck_b += dec->ck_a;
+}
+
+static inline uint16_t u16(const uint8_t* p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static inline uint32_t u32(const uint8_t* p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void ubx_init(ubx_decoder_t* dec)
+{
+	memset(dec, 0, sizeof(*dec));
+}
+
+size_t ubx_feed(ubx_decoder_t* dec, const uint8_t* data, size_t len, bool* complete)
+{
+	*complete = false;
+
+	for (size_t i = 0; i < len; i++) {
+		uint8_t b = data[i];
+
+		switch (dec->state) {
+		case WAIT_SYNC_1:
+			if (b == UBX_SYNC_1)
+				dec->state = WAIT_SYNC_2;
+			break;
+		case WAIT_SYNC_2:
+			dec->state = b == UBX_SYNC_2 ? READ_CLASS : b == UBX_SYNC_1 ? WAIT_SYNC_2 : WAIT_SYNC_1;
+			dec->ck_a = 0;
+			dec->ck_b = 0;
+			break;
+		case READ_CLASS:
+			dec->msg_class = b;
+			checksum(dec, b);
+			dec->state = READ_ID;
+			break;
+		case READ_ID:
+			dec->msg_id = b;
+			checksum(dec, b);
+			dec->state = READ_LEN_LO;
+			break;
+		case READ_LEN_LO:
+			dec->len = b;
+			checksum(dec, b);
+			dec->state = READ_LEN_HI;
+			break;
+		case READ_LEN_HI:
+			dec->len |= b << 8;
+			checksum(dec, b);
+			dec->pos = 0;
+			if (dec->len > UBX_MAX_PAYLOAD) {
+				dec->stats.oversize++;
+				dec->state = WAIT_SYNC_1;
+			} else {
+				dec->state = dec->len ? READ_PAYLOAD : READ_CK_A;
+			}
+			break;
+		case READ_PAYLOAD:
+			dec->payload[dec->pos++] = b;
+			checksum(dec, b);
+			if (dec->pos == dec->len)
+				dec->state = READ_CK_A;
+			break;
+		case READ_CK_A:
+			dec->state = b == dec->ck_a ? READ_CK_B : WAIT_SYNC_1;
+			if (dec->state == WAIT_SYNC_1)
+				dec->stats.checksum_errors++;
+			break;
+		case READ_CK_B:
+			dec->state = WAIT_SYNC_1;
+			if (b != dec->ck_b) {
+				dec->stats.checksum_errors++;
+				break;
+			}
+			dec->stats.frames++;
+			*complete = true;
+			return i + 1;
+		}
+	}
+	return len;
+}
+
+size_t ubx_build(uint8_t* out, size_t size, uint8_t msg_class, uint8_t msg_id,
+		const uint8_t* payload, uint16_t len)
+{
+	if (size < (size_t)len + UBX_FRAME_OVERHEAD)
+		return 0;
+
+	out[0] = UBX_SYNC_1;
+	out[1] = UBX_SYNC_2;
+	out[2] = msg_class;
+	out[3] = msg_id;
+	out[4] = len & 0xFF;
+	out[5] = len >> 8;
+	if (len)
+		memcpy(out + 6, payload, len);
+
+	uint8_t ck_a = 0, ck_b = 0;
+	for (size_t i = 2; i < (size_t)len + 6; i++) {
+		ck_a += out[i];
+		ck_b += ck_a;
+	}
+	out[len + 6] = ck_a;
+	out[len + 7] = ck_b;
+	return len + UBX_FRAME_OVERHEAD;
+}
+
+bool ubx_nav_pvt_to_fix(const uint8_t* p, uint16_t len, nmea_fix_t* fix)
+{
+	if (len < UBX_NAV_PVT_LEN)
+		return false;
+
+	uint8_t valid = p[11];
+	int32_t nano = (int32_t)u32(p + 16);
+	uint8_t fix_type = p[20];
+	bool fix_ok = p[21] & 0x01;
+
+	if (valid & 0x01) {
+		fix->date.year = u16(p + 4);
+		fix->date.month = p[6];
+		fix->date.day = p[7];
+	}
+	if (valid & 0x02) {
+		fix->time.hour = p[8];
+		fix->time.minute = p[9];
+		fix->time.second = p[10];
+		// nano is signed, a negative fraction belongs to the previous second
+		fix->time.millis = nano > 0 ? nano / 1000000 : 0;
+	}
+
+	fix->valid = fix_ok && (fix_type == 2 || fix_type == 3);
+	fix->quality = fix->valid ? 1 : 0;
+	fix->fix_mode = fix->valid ? fix_type : 1;
+	fix->satellites = p[23];
+	if (fix->valid) {
+		// NAV-PVT already reports degrees x 1e7
+		fix->longitude = (int32_t)u32(p + 24);
+		fix->latitude = (int32_t)u32(p + 28);
+	}
+	int32_t height = (int32_t)u32(p + 32);
+	int32_t msl = (int32_t)u32(p + 36);
+	fix->altitude = msl / 1000.0f;
+	fix->geoid_sep = (height - msl) / 1000.0f;
+	// mm/s to knots, 1e-5 degrees to degrees
+	fix->speed_knots = (int32_t)u32(p + 60) * 0.00194384f;
+	fix->course = (int32_t)u32(p + 64) * 1e-5f;
+	fix->pdop = u16(p + 76) * 0.01f;
+	return true;
+}
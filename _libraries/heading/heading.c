@@ -0,0 +1,85 @@
+/*
+ * heading.c
+ *
+ *  Complementary filter between the stepper step count and the compass.
+ *
+ *  Between compass readings the heading is dead-reckoned from the step
+ *  count. Each compass reading nudges the mount offset (the bearing of
+ *  step 0) by a fraction of the residual. A residual of whole steps that
+ *  persists over several readings is a stall rather than noise, so the
+ *  step count itself is corrected instead of the offset.
+ */
+
+#include <stdlib.h>
+#include "heading.h"
+
+static heading_bam_t steps_to_bam(const heading_est_t* est, int32_t steps)
+{
+	int32_t rev = est->cfg.rev_steps;
+	int32_t wrapped = steps % rev;
+	return (heading_bam_t)(((int64_t)wrapped * HEADING_BAM_FULL + rev / 2) / rev);
+}
+
+// rounds to the nearest step, half away from zero
+static int32_t bam_to_steps(const heading_est_t* est, int16_t bam)
+{
+	int64_t scaled = (int64_t)bam * est->cfg.rev_steps;
+	if (scaled >= 0)
+		return (int32_t)((scaled + HEADING_BAM_FULL / 2) / HEADING_BAM_FULL);
+	return -(int32_t)((-scaled + HEADING_BAM_FULL / 2) / HEADING_BAM_FULL);
+}
+
+void heading_init(heading_est_t* est, const heading_config_t* cfg)
+{
+	est->cfg = *cfg;
+	est->step_count = 0;
+	est->offset = 0;
+	est->synced = false;
+	est->miss_run = 0;
+	est->residual = 0;
+	est->missed_steps = 0;
+}
+
+void heading_step(heading_est_t* est, int32_t steps)
+{
+	est->step_count += steps;
+}
+
+heading_bam_t heading_get(const heading_est_t* est)
+{
+	return (heading_bam_t)((est->offset >> 16) + steps_to_bam(est, est->step_count));
+}
+
+int32_t heading_compass(heading_est_t* est, heading_bam_t measured)
+{
+	// first reading defines where step 0 points
+	if (!est->synced) {
+		est->offset = (uint32_t)(heading_bam_t)(measured - steps_to_bam(est, est->step_count)) << 16;
+		est->synced = true;
+		est->residual = 0;
+		return 0;
+	}
+
+	est->residual = (int16_t)(measured - heading_get(est));
+	int32_t lost = bam_to_steps(est, est->residual);
+
+	if (abs(lost) < est->cfg.miss_threshold) {
+		est->miss_run = 0;
+		est->offset += (uint32_t)(((int32_t)est->residual * 65536) >> est->cfg.gain_shift);
+		return 0;
+	}
+
+	// hold the offset while a possible stall is confirmed
+	if (++est->miss_run < est->cfg.miss_samples)
+		return 0;
+
+	est->miss_run = 0;
+	est->step_count += lost;
+	est->missed_steps += abs(lost);
+	return lost;
+}
+
+int32_t heading_steps_to(const heading_est_t* est, heading_bam_t bearing)
+{
+	return bam_to_steps(est, (int16_t)(bearing - heading_get(est)));
+}
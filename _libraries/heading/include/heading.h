@@ -0,0 +1,62 @@
+/*
+ * heading.h
+ *
+ *  Heading estimator for the camera turret. Fuses the stepper step count
+ *  (fast, but open-loop) with compass readings (absolute, but noisy) so the
+ *  sweep can command absolute bearings without re-homing the motor.
+ */
+
+#ifndef HEADING_H_
+#define HEADING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Angles are binary angle units (BAM): 65536 counts = 360 degrees, so
+ * wrap-around is handled by ordinary 16 bit integer overflow. Use
+ * bm_deg_to_bam() and bm_bam_to_deg() from bearing_math.h to convert.
+ */
+typedef uint16_t heading_bam_t;
+
+#define HEADING_BAM_FULL         (65536L)
+
+typedef struct {
+	int32_t rev_steps;          // motor steps per turret revolution
+	uint8_t gain_shift;         // filter gain is 1 / 2^gain_shift per compass reading
+	int32_t miss_threshold;     // residual, in whole steps, treated as lost steps
+	uint8_t miss_samples;       // consecutive readings over threshold before re-syncing
+} heading_config_t;
+
+#define HEADING_CONFIG_DEFAULT() { \
+	.rev_steps = 200,               \
+	.gain_shift = 3,                \
+	.miss_threshold = 2,            \
+	.miss_samples = 2,              \
+}
+
+typedef struct {
+	heading_config_t cfg;
+	int32_t step_count;         // motor position in steps, not wrapped
+	uint32_t offset;            // bearing of step 0, BAM in the upper 16 bits
+	bool synced;                // at least one compass reading was applied
+	uint8_t miss_run;           // consecutive readings over the threshold
+	int16_t residual;           // last compass minus predicted heading, BAM
+	uint32_t missed_steps;      // total steps corrected since init
+} heading_est_t;
+
+void heading_init(heading_est_t* est, const heading_config_t* cfg);
+
+// dead-reckoning update, call with the signed number of steps just issued
+void heading_step(heading_est_t* est, int32_t steps);
+
+// correction from an absolute compass bearing, returns steps re-synced (0 if none)
+int32_t heading_compass(heading_est_t* est, heading_bam_t measured);
+
+// current bearing the camera faces, clockwise from north
+heading_bam_t heading_get(const heading_est_t* est);
+
+// signed steps along the shortest path to face an absolute bearing
+int32_t heading_steps_to(const heading_est_t* est, heading_bam_t bearing);
+
+#endif /* HEADING_H_ */
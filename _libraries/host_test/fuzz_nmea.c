@@ -0,0 +1,126 @@
+/*
+ * fuzz_nmea.c
+ *
+ *  Feeds the NMEA parser mutated copies of the receiver log. Most mutants
+ *  get a correct checksum so they reach the field parsers instead of
+ *  stopping at the checksum. Built with the address and undefined
+ *  behaviour sanitizers, see Makefile, so an overflow fails the run.
+ */
+
+#include <stdlib.h>
+#include "nmea.h"
+#include "nmea_log.h"
+#include "host_test.h"
+
+#define EPOCHS 20
+#define CASES  200000
+
+static char log_buf[EPOCHS * 512];
+static size_t log_len;
+
+static uint32_t rng = 2463534242u;
+
+static uint32_t next(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+// a sentence body from the log, without '$' and "*hh\r\n"
+static size_t pick(char* out)
+{
+	size_t start = next() % log_len;
+	while (log_buf[start] != '$')
+		start = (start + 1) % log_len;
+	size_t n = 0;
+	for (const char* c = log_buf + start + 1; *c != '*'; c++)
+		out[n++] = *c;
+	out[n] = '\0';
+	return n;
+}
+
+static size_t mutate(char* s, size_t n, size_t cap)
+{
+	static const char alphabet[] = "0123456789.,-+*$NSEWAVMTK\r\n\0xyz";
+	int edits = 1 + next() % 4;
+
+	for (int e = 0; e < edits; e++) {
+		size_t at = n ? next() % n : 0;
+		switch (next() % 5) {
+		case 0:
+			s[at] = alphabet[next() % (sizeof(alphabet) - 1)];
+			break;
+		case 1:
+			s[at] = (char)next();
+			break;
+		case 2:
+			n = at;
+			break;
+		case 3: {
+			// a run of digits, long enough to overflow a careless parser
+			size_t run = 1 + next() % 40;
+			if (n + run >= cap)
+				break;
+			memmove(s + at + run, s + at, n - at);
+			for (size_t i = 0; i < run; i++)
+				s[at + i] = '0' + next() % 10;
+			n += run;
+			break;
+		}
+		case 4:
+			if (n && at < n - 1) {
+				memmove(s + at, s + at + 1, n - at - 1);
+				n--;
+			}
+			break;
+		}
+	}
+	s[n] = '\0';
+	return n;
+}
+
+int main(int argc, char** argv)
+{
+	log_len = nmea_log(log_buf, EPOCHS);
+
+	nmea_parser_t p;
+	nmea_init(&p);
+	char body[160], wire[200];
+	uint32_t handled = 0;
+
+	for (int i = 0; i < CASES; i++) {
+		size_t n = mutate(body, pick(body), 120);
+		size_t len;
+		if (next() % 8) {
+			// the body may hold a NUL now, checksum what is left of it
+			len = nmea_log_put(wire, 0, body);
+		} else {
+			wire[0] = '$';
+			memcpy(wire + 1, body, n);
+			len = n + 1;
+			wire[len++] = '\n';
+		}
+		uint32_t before = p.stats.sentences;
+		for (size_t at = 0, chunk; at < len; at += chunk) {
+			chunk = 1 + next() % 32;
+			if (chunk > len - at)
+				chunk = len - at;
+			nmea_feed(&p, (const uint8_t*)wire + at, chunk);
+		}
+		handled += p.stats.sentences - before;
+
+		CHECK(p.len <= NMEA_MAX_SENTENCE);
+		CHECK(p.fix.latitude >= -1810000000 && p.fix.latitude <= 1810000000);
+		CHECK(p.fix.longitude >= -1810000000 && p.fix.longitude <= 1810000000);
+		CHECK(p.fix.time.hour <= 99 && p.fix.time.minute <= 99 && p.fix.time.second <= 99);
+		CHECK(p.fix.time.millis <= 999);
+		if (host_failures)
+			break;
+	}
+
+	printf("fuzz_nmea: %d cases, %u reached a handler, %u checksum errors, %u overflows\n",
+			CASES, handled, p.stats.checksum_errors, p.stats.overflows);
+	return host_done("fuzz_nmea");
+}
@@ -0,0 +1,52 @@
+/*
+ * host_test.h
+ *
+ *  Checks and timing for the host tests, see Makefile.
+ */
+
+#ifndef HOST_TEST_H_
+#define HOST_TEST_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+static int host_failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		host_failures++; \
+	} \
+} while (0)
+
+#define CHECK_NEAR(a, b, tol) do { \
+	double a_ = (a), b_ = (b); \
+	if (!(fabs(a_ - b_) <= (tol))) { \
+		fprintf(stderr, "%s:%d: %s = %g, expected %g +/- %g\n", __FILE__, __LINE__, #a, a_, b_, (double)(tol)); \
+		host_failures++; \
+	} \
+} while (0)
+
+static inline double host_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// benchmarks only run when asked, `make bench` passes "bench"
+static inline bool host_bench(int argc, char** argv)
+{
+	return argc > 1 && strcmp(argv[1], "bench") == 0;
+}
+
+static inline int host_done(const char* name)
+{
+	printf("%s: %s\n", name, host_failures ? "FAILED" : "ok");
+	return host_failures != 0;
+}
+
+#endif /* HOST_TEST_H_ */
@@ -0,0 +1,62 @@
+/*
+ * nmea_log.h
+ *
+ *  A receiver log for the NMEA tests, one second per epoch in the order a
+ *  NEO-6M sends its default set (RMC, VTG, GGA, GSA, GSV, GLL). The
+ *  sentences are written from templates so the position, time and
+ *  checksums move on every epoch.
+ */
+
+#ifndef NMEA_LOG_H_
+#define NMEA_LOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// appends "$body*hh\r\n", returns the new length
+static inline size_t nmea_log_put(char* out, size_t len, const char* body)
+{
+	uint8_t sum = 0;
+	for (const char* c = body; *c; c++)
+		sum ^= (uint8_t)*c;
+	return len + sprintf(out + len, "$%s*%02X\r\n", body, sum);
+}
+
+// epochs of the log into out, returns its length; out needs 512 bytes per epoch
+static inline size_t nmea_log(char* out, int epochs)
+{
+	size_t len = 0;
+	char body[96];
+
+	for (int i = 0; i < epochs; i++) {
+		int t = 12 * 3600 + 34 * 60 + i;
+		int hh = t / 3600 % 24, mm = t / 60 % 60, ss = t % 60;
+		// a slow drift north-east from 35 12.34567 N, 120 39.87654 W
+		long lat = 1234567 + i * 7;
+		long lon = 3987654 - i * 11;
+		char lat_s[16], lon_s[16], time_s[16];
+		sprintf(lat_s, "35%02ld.%05ld", lat / 100000, lat % 100000);
+		sprintf(lon_s, "120%02ld.%05ld", lon / 100000, lon % 100000);
+		sprintf(time_s, "%02d%02d%02d.00", hh, mm, ss);
+
+		sprintf(body, "GPRMC,%s,A,%s,N,%s,W,0.%03d,%d.%02d,191026,,,A",
+				time_s, lat_s, lon_s, 100 + i % 50, 40 + i % 20, i % 100);
+		len = nmea_log_put(out, len, body);
+		sprintf(body, "GPVTG,%d.%02d,T,,M,0.%03d,N,0.%03d,K,A",
+				40 + i % 20, i % 100, 100 + i % 50, 185 + i % 90);
+		len = nmea_log_put(out, len, body);
+		sprintf(body, "GPGGA,%s,%s,N,%s,W,1,%02d,0.92,%d.%d,M,-32.1,M,,",
+				time_s, lat_s, lon_s, 7 + i % 3, 94 + i % 5, i % 10);
+		len = nmea_log_put(out, len, body);
+		len = nmea_log_put(out, len, "GPGSA,A,3,02,05,12,13,15,18,24,25,,,,,1.71,0.92,1.44");
+		len = nmea_log_put(out, len, "GPGSV,3,1,11,02,38,304,30,05,21,246,27,12,79,048,38,13,17,180,25");
+		len = nmea_log_put(out, len, "GPGSV,3,2,11,15,50,080,33,18,15,123,24,24,42,067,35,25,59,261,36");
+		len = nmea_log_put(out, len, "GPGSV,3,3,11,26,03,332,,29,09,042,19,31,01,201,");
+		sprintf(body, "GPGLL,%s,N,%s,W,%s,A,A", lat_s, lon_s, time_s);
+		len = nmea_log_put(out, len, body);
+	}
+	return len;
+}
+
+#endif /* NMEA_LOG_H_ */
@@ -0,0 +1,326 @@
+/*
+ * sim_mesh_outbox.c
+ *
+ *  A mesh of 50 to 300 nodes in a tree of fanout 6, each running its own
+ *  copy of the mesh outbox on a simulated millisecond clock. Every node
+ *  queues the firmware's heartbeat, a light message and a ping, once a
+ *  second, and now and then a node raises an alarm. Parents fold their
+ *  children's packets into their own outbox as relays, a hop takes
+ *  HOP_MS. For each size this prints the packets per second reaching the
+ *  root against the messages per second it would take unbatched, the
+ *  heartbeat and alarm latency end to end, and anything lost.
+ *
+ *  The outbox keeps its state in statics, so its source is included and
+ *  each node's share is swapped in around every call.
+ */
+
+#include <stdlib.h>
+#include "esp_timer.h"
+
+static int64_t sim_us;
+#define esp_timer_get_time() (sim_us)
+
+#include "../../wifi_mesh_transceiver/main/mesh_outbox.c"
+#include "event_record.h"
+#include "host_test.h"
+
+#define FANOUT          (6)
+#define HOP_MS          (4)
+#define RUN_MS          (60000)
+#define DRAIN_MS        (20000)
+#define ALARM_EVERY_MS  (5000)
+#define MAX_NODES       (300)
+#define FLIGHT_LEN      (1024)
+#define MAX_LATENCY_MS  (30000)
+#define LIGHT_LEN       (6)         // sizeof(mesh_light_ctl_t)
+#define PING_LEN        (8)
+
+int host_notified;
+
+typedef struct {
+	class_queue_t queues[MESH_CLASS_MAX];
+	size_t queued_bytes;
+	int drr_next;
+	mesh_addr_t parent;
+	bool has_parent;
+	mesh_outbox_stats_t stats;
+} outbox_state_t;
+
+typedef struct {
+	outbox_state_t outbox;
+	int parent;
+	int layer;                  // the root is layer 1
+	uint32_t phase_ms;          // heartbeat offset within the second
+	uint32_t next_ms;           // next task pass, a put brings it forward
+} node_t;
+
+typedef struct {
+	uint32_t at_ms;
+	int from;
+	int to;
+	uint16_t len;
+	uint8_t data[MESH_OUTBOX_MTU];
+} packet_t;
+
+static node_t nodes[MAX_NODES];
+static int node_count;
+static int current;             // whose outbox the statics hold
+
+static packet_t flight[FLIGHT_LEN];
+static int flight_head, flight_used;
+
+static struct {
+	uint32_t frames;            // packets reaching the root in the window
+	uint32_t msgs;
+	uint32_t heartbeats;        // sent and received over the whole run
+	uint32_t received;
+	uint32_t refused;           // puts and relays the outbox turned away
+	uint32_t alarm_max_ms;
+	uint32_t latency[MAX_LATENCY_MS + 1];
+} sim;
+
+static uint32_t rng = 88172645;
+
+static uint32_t next_rand(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static uint32_t sim_ms(void)
+{
+	return sim_us / 1000;
+}
+
+static mesh_addr_t addr_of(int n)
+{
+	mesh_addr_t a = {{0x24, 0x0A, 0xC4, 0x00, n >> 8, n & 0xFF}};
+	return a;
+}
+
+static void load(int n)
+{
+	const outbox_state_t* o = &nodes[n].outbox;
+	memcpy(s_queues, o->queues, sizeof(s_queues));
+	s_queued_bytes = o->queued_bytes;
+	s_drr_next = o->drr_next;
+	s_parent = o->parent;
+	s_has_parent = o->has_parent;
+	s_stats = o->stats;
+	current = n;
+	host_notified = 0;
+}
+
+static void save(void)
+{
+	node_t* node = &nodes[current];
+	outbox_state_t* o = &node->outbox;
+	memcpy(o->queues, s_queues, sizeof(s_queues));
+	o->queued_bytes = s_queued_bytes;
+	o->drr_next = s_drr_next;
+	o->parent = s_parent;
+	o->has_parent = s_has_parent;
+	o->stats = s_stats;
+	if (host_notified)
+		node->next_ms = sim_ms();
+}
+
+esp_err_t esp_mesh_send(const mesh_addr_t* to, const mesh_data_t* data, int flag, const mesh_opt_t opt[], int opt_count)
+{
+	CHECK(flight_used < FLIGHT_LEN);
+	if (flight_used == FLIGHT_LEN)
+		return ESP_FAIL;
+	packet_t* p = &flight[(flight_head + flight_used++) % FLIGHT_LEN];
+	p->at_ms = sim_ms() + HOP_MS;
+	p->from = current;
+	p->to = nodes[current].parent;
+	p->len = data->size;
+	memcpy(p->data, data->data, data->size);
+	return ESP_OK;
+}
+
+int esp_mesh_get_layer(void)
+{
+	return nodes[current].layer;
+}
+
+// the first four payload bytes carry the time the message was queued
+static void put_stamped(uint8_t type, uint8_t flags, uint16_t len)
+{
+	uint8_t payload[sizeof(event_record_t)] = {0};
+	uint32_t ms = sim_ms();
+	memcpy(payload, &ms, sizeof(ms));
+	if (mesh_outbox_put(type, flags, payload, len) != ESP_OK)
+		sim.refused++;
+}
+
+static void at_root(const packet_t* p, bool window)
+{
+	size_t off = 0;
+	mesh_frame_hdr_t hdr;
+	const uint8_t* payload;
+	if (window)
+		sim.frames++;
+	while ((payload = mesh_frame_next(p->data, p->len, &off, &hdr)) != NULL) {
+		// a relay is the origin's MAC, then the original message
+		if (hdr.type == MESH_MSG_RELAY) {
+			memcpy(&hdr, payload + 6, sizeof(hdr));
+			payload += 6 + MESH_FRAME_HDR_LEN;
+		}
+		uint32_t ms;
+		memcpy(&ms, payload, sizeof(ms));
+		uint32_t latency = sim_ms() - ms;
+		if (window)
+			sim.msgs++;
+		if (hdr.flags & MESH_FRAME_FLAG_URGENT) {
+			if (latency > sim.alarm_max_ms)
+				sim.alarm_max_ms = latency;
+			continue;
+		}
+		sim.received++;
+		sim.latency[latency < MAX_LATENCY_MS ? latency : MAX_LATENCY_MS]++;
+	}
+}
+
+static void at_parent(const packet_t* p)
+{
+	size_t off = 0;
+	mesh_frame_hdr_t hdr;
+	const uint8_t* payload;
+	mesh_addr_t from = addr_of(p->from);
+	load(p->to);
+	while ((payload = mesh_frame_next(p->data, p->len, &off, &hdr)) != NULL)
+		if (mesh_outbox_relay(&from, &hdr, payload) != ESP_OK)
+			sim.refused++;
+	save();
+}
+
+static uint32_t percentile(double q)
+{
+	uint32_t want = (uint32_t)(q * sim.received), seen = 0;
+	for (int ms = 0; ms <= MAX_LATENCY_MS; ms++) {
+		seen += sim.latency[ms];
+		if (seen > want)
+			return ms;
+	}
+	return MAX_LATENCY_MS;
+}
+
+static void run(int count)
+{
+	const mesh_outbox_config_t cfg = MESH_OUTBOX_CONFIG_DEFAULT();
+	memset(&sim, 0, sizeof(sim));
+	node_count = count;
+	flight_head = flight_used = 0;
+	sim_us = 0;
+
+	// node 0 is the root, it only receives
+	for (int n = 0; n < count; n++) {
+		node_t* node = &nodes[n];
+		for (int c = 0; c < MESH_CLASS_MAX; c++)
+			free(node->outbox.queues[c].ring);
+		memset(node, 0, sizeof(*node));
+		node->parent = n ? (n - 1) / FANOUT : -1;
+		node->layer = n ? nodes[node->parent].layer + 1 : 1;
+		node->phase_ms = next_rand() % 1000;
+		node->next_ms = UINT32_MAX;
+		if (n == 0)
+			continue;
+		memset(s_queues, 0, sizeof(s_queues));
+		memset(&s_stats, 0, sizeof(s_stats));
+		s_queued_bytes = 0;
+		s_drr_next = MESH_CLASS_TELEMETRY;
+		s_task = NULL;
+		CHECK(mesh_outbox_init(&cfg) == ESP_OK);
+		current = n;
+		mesh_addr_t parent = addr_of(node->parent);
+		mesh_outbox_set_parent(&parent);
+		save();
+	}
+
+	const uint32_t window_start = 10000;
+	for (uint32_t now = 0; now < RUN_MS + DRAIN_MS; now++) {
+		sim_us = now * 1000LL;
+		bool window = now >= window_start && now < RUN_MS;
+
+		while (flight_used && flight[flight_head].at_ms <= now) {
+			const packet_t* p = &flight[flight_head];
+			if (p->to == 0)
+				at_root(p, window);
+			else
+				at_parent(p);
+			flight_head = (flight_head + 1) % FLIGHT_LEN;
+			flight_used--;
+		}
+
+		if (now < RUN_MS) {
+			for (int n = 1; n < count; n++) {
+				if (now % 1000 != nodes[n].phase_ms)
+					continue;
+				load(n);
+				put_stamped(MESH_MSG_LIGHT, 0, LIGHT_LEN);
+				put_stamped(MESH_MSG_PING, 0, PING_LEN);
+				sim.heartbeats += 2;
+				save();
+			}
+			if (now % ALARM_EVERY_MS == ALARM_EVERY_MS / 2) {
+				load(1 + next_rand() % (count - 1));
+				put_stamped(MESH_MSG_EVENT, MESH_FRAME_FLAG_URGENT, sizeof(event_record_t));
+				save();
+			}
+		}
+
+		for (int n = 1; n < count; n++) {
+			node_t* node = &nodes[n];
+			while (node->next_ms <= now) {
+				load(n);
+				uint32_t wait_ms = outbox_pass();
+				save();
+				node->next_ms = wait_ms == UINT32_MAX ? UINT32_MAX : now + wait_ms;
+			}
+		}
+	}
+
+	uint32_t shaped = 0, dropped = 0;
+	for (int n = 1; n < count; n++) {
+		for (int c = 0; c < MESH_CLASS_MAX; c++) {
+			shaped += nodes[n].outbox.queues[c].stats.shaped;
+			dropped += nodes[n].outbox.queues[c].stats.dropped;
+		}
+		dropped += nodes[n].outbox.stats.dropped;
+	}
+	int layers = 0;
+	for (int n = 0; n < count; n++)
+		layers = nodes[n].layer > layers ? nodes[n].layer : layers;
+	double seconds = (RUN_MS - window_start) / 1000.0;
+
+	printf("%5d %6d  %8.1f  %10.1f  %6u ms  %6u ms  %6u ms  %7u  %4u\n",
+			count, layers, sim.frames / seconds, sim.msgs / seconds,
+			percentile(0.5), percentile(0.99), sim.alarm_max_ms, shaped, sim.heartbeats - sim.received);
+	CHECK(sim.heartbeats == sim.received);
+	CHECK(dropped == 0 && sim.refused == 0);
+	CHECK(sim.frames < sim.msgs / 4);
+	// the latency budget holds end to end, give or take the hops themselves
+	CHECK(percentile(0.99) <= cfg.max_latency_ms + (uint32_t)(layers - 1) * 2 * HOP_MS);
+	// an alarm waits for at most the packet already in flight on each hop
+	CHECK(sim.alarm_max_ms <= (uint32_t)(layers - 1) * 2 * HOP_MS);
+}
+
+int main(int argc, char** argv)
+{
+	const int sizes[] = {50, 100, 200, 300};
+	const mesh_outbox_config_t cfg = MESH_OUTBOX_CONFIG_DEFAULT();
+	// a class that never earns credit is refused
+	mesh_outbox_config_t stuck = cfg;
+	stuck.classes[MESH_CLASS_BULK].quantum = 0;
+	CHECK(mesh_outbox_init(&stuck) == ESP_ERR_INVALID_ARG);
+
+	printf("fanout %d, %d ms a hop, heartbeat of two messages a second, %u ms max latency\n",
+			FANOUT, HOP_MS, cfg.max_latency_ms);
+	printf("nodes layers  frames/s  unbatched/s  median     p99        alarm max  shaped  lost\n");
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+		run(sizes[s]);
+	return host_done("sim_mesh_outbox");
+}
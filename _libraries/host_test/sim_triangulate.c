@@ -0,0 +1,192 @@
+/*
+ * sim_triangulate.c
+ *
+ *  Synthetic towers and fires for the triangulation service. Towers sit
+ *  on a jittered grid 4 km apart, every tower within range of a fire
+ *  reports its bearing with Gaussian noise, and a few bearings are wild.
+ *  For 10 to 300 towers this prints the location error, false tracks,
+ *  how often the fire falls inside the reported 95% ellipse, and the time
+ *  tri_add() and tri_update() take on this host. The last rows pack 300
+ *  towers 1 km apart so every one of them sees every fire and the store
+ *  is full.
+ */
+
+#include <stdlib.h>
+#include "triangulate.h"
+#include "bearing_math.h"
+#include "host_test.h"
+
+#define SPACING_M       (4000.0)
+#define DENSE_M         (1000.0)
+#define RANGE_M         (20000.0)
+#define NOISE_DEG       (2.0)
+#define POS_NOISE_M     (5.0)
+#define WILD_PCT        (3)         // bearings off by up to 30 degrees
+#define TRIALS          (100)
+#define CHI2_95         (5.991)     // two degrees of freedom
+
+#define M_PER_DEG       (111320.0)
+#define LAT0            (35.2)
+#define LON0            (-120.66)
+
+static uint32_t rng = 88172645;
+
+static double uniform(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return (rng >> 8) / 16777216.0;
+}
+
+static double gauss(void)
+{
+	double u = uniform() + 1e-12, v = uniform();
+	return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+typedef struct {
+	double east;
+	double north;
+} point_t;
+
+static int32_t lat_e7(double north)
+{
+	return (int32_t)lround((LAT0 + north / M_PER_DEG) * 1e7);
+}
+
+static int32_t lon_e7(double east)
+{
+	return (int32_t)lround((LON0 + east / (M_PER_DEG * cos(LAT0 * M_PI / 180))) * 1e7);
+}
+
+// track position against the truth, both on the simulation's plane
+static void track_offset(const tri_track_t* t, point_t fire, double* de, double* dn)
+{
+	double north = (t->latitude * 1e-7 - LAT0) * M_PER_DEG;
+	double east = (t->longitude * 1e-7 - LON0) * M_PER_DEG * cos(LAT0 * M_PI / 180);
+	*de = east - fire.east;
+	*dn = north - fire.north;
+}
+
+typedef struct {
+	int runs;
+	int found;
+	int false_tracks;
+	int inside;                 // truth inside the 95% ellipse
+	double err_sum;
+	double err_max;
+	double ellipse_sum;         // 1 sigma major axis
+	double add_s;
+	double update_s;
+	int reports;
+} result_t;
+
+static void trial(int nodes, double spacing, int fires, tri_t* tri, result_t* r)
+{
+	static point_t towers[1024];
+	int side = (int)ceil(sqrt(nodes));
+	for (int i = 0; i < nodes; i++) {
+		towers[i].east = (i % side) * spacing + (uniform() - 0.5) * 1000;
+		towers[i].north = (i / side) * spacing + (uniform() - 0.5) * 1000;
+	}
+	point_t fire[4];
+	for (int f = 0; f < fires; f++) {
+		fire[f].east = uniform() * (side - 1) * spacing;
+		fire[f].north = uniform() * ((nodes - 1) / side) * spacing;
+	}
+
+	tri_config_t cfg = TRI_CONFIG_DEFAULT();
+	tri_init(tri, &cfg);
+	int64_t now = 1792413296LL * 1000000;
+
+	// one sweep: each tower reports every fire it can see, in tower order
+	double t0 = host_seconds();
+	for (int i = 0; i < nodes; i++) {
+		for (int f = 0; f < fires; f++) {
+			double de = fire[f].east - towers[i].east;
+			double dn = fire[f].north - towers[i].north;
+			if (hypot(de, dn) > RANGE_M)
+				continue;
+			double deg = atan2(de, dn) * 180 / M_PI + NOISE_DEG * gauss();
+			if ((int)(uniform() * 100) < WILD_PCT)
+				deg += (uniform() - 0.5) * 60;
+			tri_report_t rep = {
+				.node = i + 1,
+				.time_us = now + i * 1000,
+				.latitude = lat_e7(towers[i].north + POS_NOISE_M * gauss()),
+				.longitude = lon_e7(towers[i].east + POS_NOISE_M * gauss()),
+				.bearing = bm_deg_to_bam((float)deg),
+			};
+			tri_add(tri, &rep);
+			r->reports++;
+		}
+	}
+	double t1 = host_seconds();
+	int count = tri_update(tri, now + nodes * 1000);
+	double t2 = host_seconds();
+	r->add_s += t1 - t0;
+	r->update_s += t2 - t1;
+
+	// each fire takes the nearest track, tracks left over are false
+	int used = 0;
+	for (int f = 0; f < fires; f++) {
+		r->runs++;
+		int best = -1;
+		double best_d = 1e30;
+		for (int k = 0; k < count; k++) {
+			double de, dn;
+			track_offset(tri_track(tri, k), fire[f], &de, &dn);
+			double d = hypot(de, dn);
+			if (!(used & 1 << k) && d < best_d) {
+				best_d = d;
+				best = k;
+			}
+		}
+		if (best < 0 || best_d > 2000)
+			continue;
+		used |= 1 << best;
+		const tri_track_t* t = tri_track(tri, best);
+		double de, dn;
+		track_offset(t, fire[f], &de, &dn);
+		// Mahalanobis distance against the reported covariance
+		double det = (double)t->cov[0] * t->cov[2] - (double)t->cov[1] * t->cov[1];
+		double m2 = (t->cov[2] * de * de - 2 * t->cov[1] * de * dn + t->cov[0] * dn * dn) / det;
+		r->found++;
+		r->inside += m2 <= CHI2_95;
+		r->err_sum += best_d;
+		if (best_d > r->err_max)
+			r->err_max = best_d;
+		r->ellipse_sum += t->major_m;
+	}
+	for (int k = 0; k < count; k++)
+		if (!(used & 1 << k))
+			r->false_tracks++;
+}
+
+int main(int argc, char** argv)
+{
+	static tri_t tri;
+	const struct {
+		int nodes;
+		double spacing;
+	} meshes[] = {{10, SPACING_M}, {30, SPACING_M}, {100, SPACING_M}, {300, SPACING_M}, {300, DENSE_M}};
+
+	printf("%d towers max, %d reports max, bearings %.0f deg 1 sigma, %d%% wild\n",
+			TRI_MAX_NODES, TRI_MAX_REPORTS, NOISE_DEG, WILD_PCT);
+	printf("towers fires  found  false  mean err  max err  1s major  in 95%%  add us  update ms\n");
+	for (size_t s = 0; s < sizeof(meshes) / sizeof(meshes[0]); s++) {
+		for (int fires = 1; fires <= 3; fires += 2) {
+			result_t r = {0};
+			for (int k = 0; k < TRIALS; k++)
+				trial(meshes[s].nodes, meshes[s].spacing, fires, &tri, &r);
+			printf("%6d %5d  %4.0f%%  %5d  %6.0f m  %5.0f m  %6.0f m  %4.0f%%  %6.2f  %9.2f\n",
+					meshes[s].nodes, fires, 100.0 * r.found / r.runs, r.false_tracks,
+					r.err_sum / r.found, r.err_max, r.ellipse_sum / r.found,
+					100.0 * r.inside / r.found, r.add_s / r.reports * 1e6, r.update_s / TRIALS * 1e3);
+			CHECK(r.found >= r.runs * 9 / 10);
+			CHECK(r.false_tracks <= TRIALS / 10);
+		}
+	}
+	return host_done("sim_triangulate");
+}
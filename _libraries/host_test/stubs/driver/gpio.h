@@ -0,0 +1,12 @@
+/*
+ * driver/gpio.h
+ *
+ *  Host stand-in, only the types the tested headers mention.
+ */
+
+#ifndef DRIVER_GPIO_H_
+#define DRIVER_GPIO_H_
+
+typedef int gpio_num_t;
+
+#endif /* DRIVER_GPIO_H_ */
@@ -0,0 +1,12 @@
+/*
+ * driver/i2c.h
+ *
+ *  Host stand-in, only the types the tested headers mention.
+ */
+
+#ifndef DRIVER_I2C_H_
+#define DRIVER_I2C_H_
+
+typedef int i2c_port_t;
+
+#endif /* DRIVER_I2C_H_ */
@@ -0,0 +1,31 @@
+/*
+ * esp_err.h
+ *
+ *  Host stand-in for the ESP-IDF error codes the tested components use.
+ */
+
+#ifndef ESP_ERR_H_
+#define ESP_ERR_H_
+
+#include <stdint.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_INVALID_STATE   0x103
+#define ESP_ERR_INVALID_SIZE    0x104
+#define ESP_ERR_NOT_FOUND       0x105
+#define ESP_ERR_INVALID_CRC     0x109
+#define ESP_ERR_TIMEOUT         0x107
+#define ESP_ERR_NVS_BASE        0x1100
+#define ESP_ERR_NVS_NOT_FOUND   (ESP_ERR_NVS_BASE + 0x02)
+
+static inline const char* esp_err_to_name(esp_err_t err)
+{
+	return err == ESP_OK ? "ESP_OK" : "error";
+}
+
+#endif /* ESP_ERR_H_ */
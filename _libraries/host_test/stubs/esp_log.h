@@ -0,0 +1,20 @@
+/*
+ * esp_log.h
+ *
+ *  Host stand-in, the format is still checked but nothing is printed; the
+ *  tests report through CHECK.
+ */
+
+#ifndef ESP_LOG_H_
+#define ESP_LOG_H_
+
+#include <stdio.h>
+
+#define HOST_LOG(tag, fmt, ...) do { if (0) printf("%s" fmt, tag, ##__VA_ARGS__); } while (0)
+
+#define ESP_LOGE HOST_LOG
+#define ESP_LOGW HOST_LOG
+#define ESP_LOGI HOST_LOG
+#define ESP_LOGD HOST_LOG
+
+#endif /* ESP_LOG_H_ */
@@ -0,0 +1,47 @@
+/*
+ * esp_mesh.h
+ *
+ *  Host stand-in for the ESP-MESH names the mesh framing uses, the
+ *  simulation and tests supply esp_mesh_send() and esp_mesh_get_layer().
+ */
+
+#ifndef ESP_MESH_H_
+#define ESP_MESH_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef union {
+	uint8_t addr[6];
+} mesh_addr_t;
+
+typedef enum {
+	MESH_PROTO_BIN,
+} mesh_proto_t;
+
+typedef enum {
+	MESH_TOS_P2P,
+} mesh_tos_t;
+
+#define MESH_DATA_P2P   (0x02)
+
+// from the Wi-Fi headers the real esp_mesh.h pulls in
+#define MACSTR          "%02x:%02x:%02x:%02x:%02x:%02x"
+#define MAC2STR(a)      (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+
+typedef struct {
+	uint8_t* data;
+	uint16_t size;
+	mesh_proto_t proto;
+	mesh_tos_t tos;
+} mesh_data_t;
+
+typedef struct {
+	int val;
+} mesh_opt_t;
+
+esp_err_t esp_mesh_send(const mesh_addr_t* to, const mesh_data_t* data, int flag, const mesh_opt_t opt[], int opt_count);
+
+int esp_mesh_get_layer(void);
+
+#endif /* ESP_MESH_H_ */
@@ -0,0 +1,12 @@
+/*
+ * esp_spi_flash.h
+ *
+ *  Host stand-in, only the sector size.
+ */
+
+#ifndef ESP_SPI_FLASH_H_
+#define ESP_SPI_FLASH_H_
+
+#define SPI_FLASH_SEC_SIZE      4096
+
+#endif /* ESP_SPI_FLASH_H_ */
@@ -0,0 +1,18 @@
+/*
+ * esp_system.h
+ *
+ *  Host stand-in for the random number source.
+ */
+
+#ifndef ESP_SYSTEM_H_
+#define ESP_SYSTEM_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+static inline uint32_t esp_random(void)
+{
+	return (uint32_t)rand() << 16 ^ (uint32_t)rand();
+}
+
+#endif /* ESP_SYSTEM_H_ */
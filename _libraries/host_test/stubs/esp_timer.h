@@ -0,0 +1,20 @@
+/*
+ * esp_timer.h
+ *
+ *  Host stand-in, microseconds from the monotonic clock.
+ */
+
+#ifndef ESP_TIMER_H_
+#define ESP_TIMER_H_
+
+#include <stdint.h>
+#include <time.h>
+
+static inline int64_t esp_timer_get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+#endif /* ESP_TIMER_H_ */
@@ -0,0 +1,29 @@
+/*
+ * FreeRTOS.h
+ *
+ *  Host stand-in for the few FreeRTOS names the tested components use.
+ *  The host tests are single threaded.
+ */
+
+#ifndef FREERTOS_H_
+#define FREERTOS_H_
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define portMAX_DELAY   ((TickType_t)0xFFFFFFFF)
+#define pdTRUE          1
+#define pdFALSE         0
+#define pdPASS          pdTRUE
+
+#define portTICK_PERIOD_MS              1
+#define pdMS_TO_TICKS(ms)               ((TickType_t)(ms))
+
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED    0
+#define portENTER_CRITICAL(mux)         ((void)(mux))
+#define portEXIT_CRITICAL(mux)          ((void)(mux))
+
+#endif /* FREERTOS_H_ */
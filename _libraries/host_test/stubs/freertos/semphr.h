@@ -0,0 +1,31 @@
+/*
+ * semphr.h
+ *
+ *  Host stand-in, a mutex that is always free; the host tests are single
+ *  threaded.
+ */
+
+#ifndef SEMPHR_H_
+#define SEMPHR_H_
+
+#include "freertos/FreeRTOS.h"
+
+typedef int* SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	static int mutex;
+	return &mutex;
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+	return pdTRUE;
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+	return pdTRUE;
+}
+
+#endif /* SEMPHR_H_ */
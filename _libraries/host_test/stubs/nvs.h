@@ -0,0 +1,28 @@
+/*
+ * nvs.h
+ *
+ *  Host stand-in for the NVS calls; tests that use them provide the
+ *  functions, usually over a RAM blob.
+ */
+
+#ifndef NVS_H_
+#define NVS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef uint32_t nvs_handle;
+typedef nvs_handle nvs_handle_t;
+typedef enum {
+	NVS_READONLY,
+	NVS_READWRITE,
+} nvs_open_mode;
+
+esp_err_t nvs_open(const char* name, nvs_open_mode mode, nvs_handle* out);
+esp_err_t nvs_set_blob(nvs_handle handle, const char* key, const void* value, size_t length);
+esp_err_t nvs_get_blob(nvs_handle handle, const char* key, void* out, size_t* length);
+esp_err_t nvs_commit(nvs_handle handle);
+void nvs_close(nvs_handle handle);
+
+#endif /* NVS_H_ */
@@ -0,0 +1,151 @@
+/*
+ * test_bearing_math.c
+ *
+ *  Checks the error bounds documented in bearing_math.h against libm and,
+ *  with "bench", times each kernel against its libm counterpart.
+ */
+
+#include <stdint.h>
+#include "bearing_math.h"
+#include "host_test.h"
+
+#define BENCH_N     (10000000)
+
+// angle difference in degrees, folded into [0, 180]
+static double deg_err(double a, double b)
+{
+	double d = fmod(fabs(a - b), 360.0);
+	return d > 180.0 ? 360.0 - d : d;
+}
+
+static double rad_to_deg360(double rad)
+{
+	double d = fmod(rad * 180.0 / M_PI, 360.0);
+	return d < 0 ? d + 360.0 : d;
+}
+
+static void test_sin_cos(void)
+{
+	double near = 0, far = 0;
+	for (int i = 0; i <= 2000000; i++) {
+		float r = -2 * M_PI + 4 * M_PI * i / 2000000.0;
+		near = fmax(near, fabs(bm_sinf(r) - sin(r)));
+		near = fmax(near, fabs(bm_cosf(r) - cos(r)));
+	}
+	for (int i = 0; i <= 4000000; i++) {
+		float r = -64 + 128.0 * i / 4000000.0;
+		far = fmax(far, fabs(bm_sinf(r) - sin(r)));
+		far = fmax(far, fabs(bm_cosf(r) - cos(r)));
+	}
+	printf("  bm_sinf/cosf     %.2g within 2 pi, %.2g at 64 rad\n", near, far);
+	CHECK(near <= 1e-6);
+	CHECK(far <= 6e-6);
+}
+
+static void test_atan2(void)
+{
+	double f = 0, bam = 0, q15 = 0;
+	for (int i = 0; i < 4000000; i++) {
+		double a = 2 * M_PI * i / 4000000.0;
+		float x = cos(a) * (1 + i % 7);
+		float y = sin(a) * (1 + i % 7);
+		double ref = atan2(y, x);
+		f = fmax(f, deg_err(bm_atan2f(y, x) * 180.0 / M_PI, ref * 180.0 / M_PI));
+		bam = fmax(bam, deg_err(bm_bam_to_deg(bm_atan2_bam(y, x)), rad_to_deg360(ref)));
+	}
+	for (int y = -2000; y <= 2000; y += 7) {
+		for (int x = -2000; x <= 2000; x += 7) {
+			if (x == 0 && y == 0)
+				continue;
+			q15 = fmax(q15, deg_err(bm_bam_to_deg(bm_atan2_q15(y, x)), rad_to_deg360(atan2(y, x))));
+		}
+	}
+	printf("  bm_atan2f        %.2g deg\n", f);
+	printf("  bm_atan2_bam     %.2g deg\n", bam);
+	printf("  bm_atan2_q15     %.2g deg\n", q15);
+	CHECK(f <= 0.0007);
+	CHECK(bam <= 0.004);
+	CHECK(q15 <= 0.1);
+	CHECK(bm_atan2f(0, 0) == 0.0f);
+	CHECK(bm_atan2_q15(0, 0) == 0);
+}
+
+static void test_acos(void)
+{
+	double e = 0;
+	for (int i = 0; i <= 2000000; i++) {
+		float x = -1 + 2.0 * i / 2000000;
+		e = fmax(e, fabs(bm_acosf(x) - acos(x)) * 180.0 / M_PI);
+	}
+	printf("  bm_acosf         %.2g deg\n", e);
+	CHECK(e <= 0.004);
+	// out of range input is clamped rather than NaN
+	CHECK(bm_acosf(1.5f) == bm_acosf(1.0f));
+}
+
+static void test_q15(void)
+{
+	double e = 0;
+	for (int b = 0; b < 65536; b++) {
+		double r = b * 2 * M_PI / 65536;
+		e = fmax(e, fabs(bm_sin_q15(b) / 32768.0 - sin(r)));
+		e = fmax(e, fabs(bm_cos_q15(b) / 32768.0 - cos(r)));
+	}
+	printf("  bm_sin_q15/cos   %.2g (%.1f LSB)\n", e, e * 32768);
+	CHECK(e <= 1.3e-4);
+}
+
+static void test_wrap(void)
+{
+	for (int i = -100000; i <= 100000; i++) {
+		float deg = i * 0.037f;
+		float w = bm_wrap360f(deg);
+		CHECK(w >= 0.0f && w < 360.0f);
+		if (host_failures)
+			return;
+	}
+	CHECK(bm_wrap360f(-1e-8f) < 360.0f);
+	CHECK(bm_deg_to_bam(360.0f) == 0);
+	CHECK(bm_deg_to_bam(-90.0f) == 0xC000);
+}
+
+// volatile sinks keep the loops from being optimised away
+static volatile float sink_f;
+static volatile int32_t sink_i;
+
+#define BENCH(label, expr, sink) do { \
+	double t0 = host_seconds(); \
+	for (int i = 0; i < BENCH_N; i++) \
+		sink = (expr); \
+	double t = host_seconds() - t0; \
+	printf("  %-16s %6.1f ns\n", label, t * 1e9 / BENCH_N); \
+} while (0)
+
+static void bench(void)
+{
+	// inputs vary with i so nothing folds to a constant
+	printf("bench, per call:\n");
+	BENCH("atan2f", atan2f(i & 1023, 517 - (i & 511)), sink_f);
+	BENCH("bm_atan2f", bm_atan2f(i & 1023, 517 - (i & 511)), sink_f);
+	BENCH("bm_atan2_q15", bm_atan2_q15(i & 1023, 517 - (i & 511)), sink_i);
+	BENCH("acosf", acosf((i & 1023) / 1024.0f), sink_f);
+	BENCH("bm_acosf", bm_acosf((i & 1023) / 1024.0f), sink_f);
+	BENCH("sinf", sinf((i & 4095) * 0.01f), sink_f);
+	BENCH("bm_sinf", bm_sinf((i & 4095) * 0.01f), sink_f);
+	BENCH("bm_sin_q15", bm_sin_q15(i * 37), sink_i);
+	BENCH("fmodf 360", fmodf((i & 8191) * 0.7f, 360.0f), sink_f);
+	BENCH("bm_wrap360f", bm_wrap360f((i & 8191) * 0.7f), sink_f);
+}
+
+int main(int argc, char** argv)
+{
+	printf("worst case error against libm:\n");
+	test_sin_cos();
+	test_atan2();
+	test_acos();
+	test_q15();
+	test_wrap();
+	if (host_bench(argc, argv))
+		bench();
+	return host_done("bearing_math");
+}
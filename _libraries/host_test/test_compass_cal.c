@@ -0,0 +1,198 @@
+/*
+ * test_compass_cal.c
+ *
+ *  Fits a synthetic calibration sweep with known hard and soft iron and
+ *  checks the resulting headings; with "bench", times compass_heading
+ *  against the same math done with libm.
+ */
+
+#include <stdlib.h>
+#include "compass_cal.h"
+#include "nvs.h"
+#include "bearing_math.h"
+#include "host_test.h"
+
+#define FIELD       (300.0)     // horizontal field, raw counts
+#define NOISE       (2.0)       // counts, uniform
+#define BENCH_N     (10000000)
+
+// NVS as one RAM blob
+static uint8_t nvs_blob[256];
+static size_t nvs_len = 0;
+
+esp_err_t nvs_open(const char* name, nvs_open_mode mode, nvs_handle* out)
+{
+	*out = 1;
+	return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle handle, const char* key, const void* value, size_t length)
+{
+	if (length > sizeof(nvs_blob))
+		return ESP_ERR_NO_MEM;
+	memcpy(nvs_blob, value, length);
+	nvs_len = length;
+	return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle handle, const char* key, void* out, size_t* length)
+{
+	if (nvs_len == 0)
+		return ESP_ERR_NVS_NOT_FOUND;
+	memcpy(out, nvs_blob, nvs_len < *length ? nvs_len : *length);
+	*length = nvs_len;
+	return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle handle)
+{
+	return ESP_OK;
+}
+
+void nvs_close(nvs_handle handle)
+{
+}
+
+// hard iron offset and a symmetric soft iron distortion
+static const double offset[2] = {-143.0, 87.0};
+static const double distort[2][2] = {{1.25, 0.18}, {0.18, 0.85}};
+
+static compass_sample_t synth(double theta)
+{
+	double hx = FIELD * cos(theta), hy = FIELD * sin(theta);
+	double nx = NOISE * (2.0 * rand() / RAND_MAX - 1);
+	double ny = NOISE * (2.0 * rand() / RAND_MAX - 1);
+	compass_sample_t s = {
+		.x = (int16_t)lrint(offset[0] + distort[0][0] * hx + distort[0][1] * hy + nx),
+		.y = (int16_t)lrint(offset[1] + distort[1][0] * hx + distort[1][1] * hy + ny),
+		.z = -410,
+	};
+	return s;
+}
+
+static double heading_err_deg(const compass_cal_t* cal, double theta)
+{
+	compass_sample_t s = synth(theta);
+	double got = bm_bam_to_deg(compass_heading(cal, &s));
+	double d = fmod(fabs(got - theta * 180.0 / M_PI), 360.0);
+	return d > 180.0 ? 360.0 - d : d;
+}
+
+static void test_fit(void)
+{
+	compass_cal_t cal;
+	compass_cal_fit_t fit;
+	compass_cal_identity(&cal);
+	// one turn at 10 Hz over the 30 s sweep
+	compass_cal_begin(&fit);
+	for (int i = 0; i < 300; i++) {
+		compass_sample_t s = synth(2 * M_PI * i / 300);
+		compass_cal_add(&fit, &s);
+	}
+	CHECK(compass_cal_finish(&fit, &cal) == ESP_OK);
+	CHECK_NEAR(cal.offset[0], offset[0], 1.0);
+	CHECK_NEAR(cal.offset[1], offset[1], 1.0);
+
+	double worst = 0, raw = 0;
+	compass_cal_t none;
+	compass_cal_identity(&none);
+	for (int i = 0; i < 3600; i++) {
+		double theta = 2 * M_PI * i / 3600;
+		worst = fmax(worst, heading_err_deg(&cal, theta));
+		raw = fmax(raw, heading_err_deg(&none, theta));
+	}
+	printf("  heading error %.2f deg calibrated, %.1f deg raw\n", worst, raw);
+	CHECK(worst < 1.0);
+	CHECK(raw > 20.0);
+
+	// the blob survives a save and load
+	compass_cal_t loaded;
+	CHECK(compass_cal_save(&cal) == ESP_OK);
+	CHECK(compass_cal_load(&loaded) == ESP_OK);
+	CHECK(memcmp(&loaded, &cal, sizeof(cal)) == 0);
+}
+
+static void test_coverage(void)
+{
+	compass_cal_t cal;
+	compass_cal_fit_t fit;
+	compass_cal_identity(&cal);
+
+	// a half turn cannot pin down the ellipse and is refused
+	compass_cal_begin(&fit);
+	for (int i = 0; i < 300; i++) {
+		compass_sample_t s = synth(M_PI * i / 300);
+		compass_cal_add(&fit, &s);
+	}
+	CHECK(!compass_cal_covered(&fit));
+	CHECK(compass_cal_finish(&fit, &cal) == ESP_ERR_INVALID_SIZE);
+
+	// a sweep that stops on coverage has gone most of the way round and fits
+	compass_cal_begin(&fit);
+	int i = 0;
+	for (; i < 600 && !compass_cal_covered(&fit); i++) {
+		compass_sample_t s = synth(2 * M_PI * i / 300);
+		compass_cal_add(&fit, &s);
+	}
+	printf("  coverage after %.0f degrees\n", 360.0 * i / 300);
+	CHECK(i > 225 && i <= 300);
+	CHECK(compass_cal_finish(&fit, &cal) == ESP_OK);
+	CHECK_NEAR(cal.offset[0], offset[0], 2.0);
+	CHECK_NEAR(cal.offset[1], offset[1], 2.0);
+
+	compass_cal_begin(&fit);
+	for (int i = 0; i < COMPASS_CAL_MIN_SAMPLES - 1; i++) {
+		compass_sample_t s = synth(2 * M_PI * i / (COMPASS_CAL_MIN_SAMPLES - 1));
+		compass_cal_add(&fit, &s);
+	}
+	CHECK(compass_cal_finish(&fit, &cal) == ESP_ERR_INVALID_SIZE);
+}
+
+// the same heading through libm, for the comparison
+static uint16_t heading_libm(const compass_cal_t* cal, const compass_sample_t* sample)
+{
+	float v[3] = {
+		sample->x - cal->offset[0],
+		sample->y - cal->offset[1],
+		sample->z - cal->offset[2],
+	};
+	float xh = cal->xform[0][0] * v[0] + cal->xform[0][1] * v[1] + cal->xform[0][2] * v[2];
+	float yh = cal->xform[1][0] * v[0] + cal->xform[1][1] * v[1] + cal->xform[1][2] * v[2];
+	float deg = fmodf((atan2f(yh, xh) + cal->declination) * 180.0f / (float)M_PI + 360.0f, 360.0f);
+	return (uint16_t)lrintf(deg * BM_BAM_PER_DEG);
+}
+
+static volatile uint16_t sink;
+
+static void bench(void)
+{
+	compass_cal_t cal;
+	compass_cal_identity(&cal);
+	cal.pitch = 0.02f;
+	cal.roll = -0.01f;
+	compass_cal_update(&cal);
+
+	compass_sample_t samples[256];
+	for (int i = 0; i < 256; i++)
+		samples[i] = synth(2 * M_PI * i / 256);
+
+	double t0 = host_seconds();
+	for (int i = 0; i < BENCH_N; i++)
+		sink = compass_heading(&cal, &samples[i & 255]);
+	double t1 = host_seconds();
+	for (int i = 0; i < BENCH_N; i++)
+		sink = heading_libm(&cal, &samples[i & 255]);
+	double t2 = host_seconds();
+	printf("bench, per heading: compass_heading %.1f ns, libm %.1f ns\n",
+			(t1 - t0) * 1e9 / BENCH_N, (t2 - t1) * 1e9 / BENCH_N);
+}
+
+int main(int argc, char** argv)
+{
+	srand(1);
+	test_fit();
+	test_coverage();
+	if (host_bench(argc, argv))
+		bench();
+	return host_done("compass_cal");
+}
@@ -0,0 +1,336 @@
+/*
+ * test_event_journal.c
+ *
+ *  The event journal over a RAM image of NOR flash: writes can only clear
+ *  bits, erases set whole sectors back to 0xFF, and any write can be made
+ *  to fail or to tear part way through. The journal source is included so
+ *  a test can reboot it by clearing its state and scanning the image again.
+ */
+
+#include <stdlib.h>
+#include "../event_journal/event_journal.c"
+#include "host_test.h"
+
+#define SECTORS     (4)
+#define SLOTS       (SECTORS * SPI_FLASH_SEC_SIZE / EVENT_JOURNAL_SLOT_SIZE)
+
+static uint8_t flash[SECTORS * SPI_FLASH_SEC_SIZE];
+static const esp_partition_t events = {
+	.type = ESP_PARTITION_TYPE_DATA,
+	.subtype = ESP_PARTITION_SUBTYPE_ANY,
+	.size = sizeof(flash),
+	.label = "events",
+};
+
+static struct {
+	int fail_in;                // the nth write from now fails, 0 never
+	size_t torn;                // bytes a failing write still programs
+	bool fail_erase;
+	uint32_t raised_bits;       // writes that needed a 0 turned back to 1
+	uint32_t erases[SECTORS];
+} nor;
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label)
+{
+	return strcmp(label, events.label) == 0 ? &events : NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* p, size_t offset, void* dst, size_t size)
+{
+	if (offset + size > p->size)
+		return ESP_ERR_INVALID_SIZE;
+	memcpy(dst, flash + offset, size);
+	return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* p, size_t offset, const void* src, size_t size)
+{
+	if (offset + size > p->size)
+		return ESP_ERR_INVALID_SIZE;
+	bool fail = nor.fail_in > 0 && --nor.fail_in == 0;
+	if (fail)
+		size = nor.torn < size ? nor.torn : size;
+	const uint8_t* s = src;
+	for (size_t i = 0; i < size; i++) {
+		if (s[i] & ~flash[offset + i])
+			nor.raised_bits++;
+		flash[offset + i] &= s[i];
+	}
+	return fail ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* p, size_t offset, size_t size)
+{
+	if (offset % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE || offset + size > p->size)
+		return ESP_ERR_INVALID_ARG;
+	if (nor.fail_erase)
+		return ESP_FAIL;
+	memset(flash + offset, 0xFF, size);
+	for (size_t s = offset / SPI_FLASH_SEC_SIZE; s < (offset + size) / SPI_FLASH_SEC_SIZE; s++)
+		nor.erases[s]++;
+	return ESP_OK;
+}
+
+// a reset: RAM state is gone, the flash image stays
+static void reboot(void)
+{
+	part = NULL;
+	nor.fail_in = 0;
+	nor.fail_erase = false;
+	event_journal_config_t cfg = EVENT_JOURNAL_CONFIG_DEFAULT();
+	CHECK(event_journal_init(&cfg) == ESP_OK);
+}
+
+static void format(void)
+{
+	memset(flash, 0xFF, sizeof(flash));
+	memset(&nor, 0, sizeof(nor));
+	reboot();
+}
+
+static esp_err_t append(uint32_t n)
+{
+	event_record_t ev = {
+		.status = EVENT_FIRE,
+		.sequence = n,
+		.node = 0xC48102FE,
+		.bearing = n * 97,
+		.peak_temp = EVENT_TEMP_UNKNOWN,
+	};
+	event_record_seal(&ev);
+	return event_journal_append(&ev);
+}
+
+// collects what replay hands over, refuses once full
+typedef struct {
+	uint32_t seq[4 * SLOTS];
+	int count;
+	int accept;
+} sink_t;
+
+static esp_err_t collect(const event_record_t* ev, void* arg)
+{
+	sink_t* sink = arg;
+	if (sink->count >= sink->accept)
+		return ESP_FAIL;
+	CHECK(event_record_view(ev, sizeof(*ev)) == ev);
+	CHECK(ev->bearing == (uint16_t)(ev->sequence * 97));
+	sink->seq[sink->count++] = ev->sequence;
+	return ESP_OK;
+}
+
+// the hand off's side, after format() record n has journal sequence n
+static esp_err_t take(const event_record_t* ev, uint32_t seq, void* arg)
+{
+	sink_t* sink = arg;
+	if (sink->count >= sink->accept)
+		return ESP_FAIL;
+	CHECK(ev->sequence == seq);
+	sink->seq[sink->count++] = seq;
+	return ESP_OK;
+}
+
+static bool in_order(const sink_t* sink, uint32_t first)
+{
+	for (int i = 0; i < sink->count; i++)
+		if (sink->seq[i] != first + i)
+			return false;
+	return true;
+}
+
+static void test_replay_and_reboot(void)
+{
+	format();
+	for (uint32_t i = 0; i < 10; i++)
+		CHECK(append(i) == ESP_OK);
+	CHECK(event_journal_pending() == 10);
+
+	sink_t sink = {.accept = 4};
+	CHECK(event_journal_replay(collect, &sink, 100) == 4);
+	CHECK(in_order(&sink, 0));
+	CHECK(event_journal_pending() == 6);
+
+	// delivered records stay delivered, the rest come back in order
+	reboot();
+	CHECK(event_journal_pending() == 6);
+	sink = (sink_t){.accept = 100};
+	CHECK(event_journal_replay(collect, &sink, 100) == 6);
+	CHECK(sink.count == 6 && in_order(&sink, 4));
+	CHECK(event_journal_pending() == 0);
+
+	// the writer resumes after the newest record
+	CHECK(append(10) == ESP_OK);
+	reboot();
+	sink = (sink_t){.accept = 100};
+	CHECK(event_journal_replay(collect, &sink, 100) == 1);
+	CHECK(sink.count == 1 && sink.seq[0] == 10);
+	CHECK(nor.raised_bits == 0);
+}
+
+static void test_mark_failure(void)
+{
+	format();
+	for (uint32_t i = 0; i < 3; i++)
+		CHECK(append(i) == ESP_OK);
+
+	// the record went out but its slot could not be marked: it is not
+	// counted, stays pending, and the replay stops there
+	nor.fail_in = 1;
+	sink_t sink = {.accept = 100};
+	CHECK(event_journal_replay(collect, &sink, 100) == 0);
+	CHECK(sink.count == 1);
+	CHECK(event_journal_pending() == 3);
+	event_journal_stats_t stats;
+	event_journal_stats(&stats);
+	CHECK(stats.replayed == 0);
+
+	// the next replay sends it again, a duplicate the receiver drops by sequence
+	CHECK(event_journal_replay(collect, &sink, 100) == 3);
+	CHECK(sink.count == 4 && sink.seq[0] == 0 && in_order(&sink, sink.seq[0]) == false);
+	CHECK(sink.seq[1] == 0 && sink.seq[2] == 1 && sink.seq[3] == 2);
+	CHECK(event_journal_pending() == 0);
+
+	// and the marks survive a reset
+	reboot();
+	CHECK(event_journal_pending() == 0);
+}
+
+static void test_hand_off(void)
+{
+	format();
+	for (uint32_t i = 0; i < 6; i++)
+		CHECK(append(i) == ESP_OK);
+	sink_t sink = {.accept = 100};
+	CHECK(event_journal_hand_off(take, &sink, 100) == 6);
+	CHECK(in_order(&sink, 0));
+
+	// handed off is not delivered, and not handed off twice
+	sink = (sink_t){.accept = 100};
+	CHECK(event_journal_hand_off(take, &sink, 100) == 0);
+	CHECK(event_journal_pending() == 6);
+
+	// deliveries come back out of order, the tail waits for the oldest
+	CHECK(event_journal_delivered(1) == ESP_OK);
+	CHECK(event_journal_delivered(3) == ESP_OK);
+	CHECK(event_journal_pending() == 6);
+	CHECK(event_journal_delivered(0) == ESP_OK);
+	CHECK(event_journal_pending() == 4);
+	CHECK(event_journal_delivered(0) == ESP_ERR_NOT_FOUND);
+	CHECK(event_journal_delivered(6) == ESP_ERR_NOT_FOUND);
+
+	// a failed record goes again in order, without the one delivered since
+	event_journal_retry(2);
+	sink = (sink_t){.accept = 100};
+	CHECK(event_journal_hand_off(take, &sink, 100) == 3);
+	CHECK(sink.seq[0] == 2 && sink.seq[1] == 4 && sink.seq[2] == 5);
+
+	// a reset keeps everything not delivered, holes and all
+	reboot();
+	CHECK(event_journal_pending() == 4);
+	sink = (sink_t){.accept = 100};
+	CHECK(event_journal_replay(collect, &sink, 100) == 3);
+	CHECK(sink.seq[0] == 2 && sink.seq[1] == 4 && sink.seq[2] == 5);
+	CHECK(event_journal_pending() == 0);
+	CHECK(nor.raised_bits == 0);
+}
+
+static void test_wrap(void)
+{
+	format();
+	// three laps with nothing delivered, only the newest lap can survive
+	const uint32_t total = 3 * SLOTS;
+	for (uint32_t i = 0; i < total; i++)
+		CHECK(append(i) == ESP_OK);
+	event_journal_stats_t stats;
+	event_journal_stats(&stats);
+	uint32_t pending = event_journal_pending();
+	CHECK(pending <= SLOTS && pending > SLOTS - 2 * SPI_FLASH_SEC_SIZE / EVENT_JOURNAL_SLOT_SIZE);
+	CHECK(stats.dropped == total - pending);
+
+	// erases are spread evenly over the sectors
+	uint32_t lo = nor.erases[0], hi = nor.erases[0];
+	for (int s = 1; s < SECTORS; s++) {
+		if (nor.erases[s] < lo)
+			lo = nor.erases[s];
+		if (nor.erases[s] > hi)
+			hi = nor.erases[s];
+	}
+	CHECK(hi - lo <= 1);
+
+	reboot();
+	CHECK(event_journal_pending() == pending);
+	sink_t sink = {.accept = 4 * SLOTS};
+	CHECK(event_journal_replay(collect, &sink, 4 * SLOTS) == (int)pending);
+	CHECK(in_order(&sink, total - pending));
+	CHECK(nor.raised_bits == 0);
+}
+
+static void test_torn_append(void)
+{
+	format();
+	for (uint32_t i = 0; i < 5; i++)
+		CHECK(append(i) == ESP_OK);
+
+	// power fails half way through programming the sixth slot
+	nor.fail_in = 1;
+	nor.torn = 20;
+	CHECK(append(5) != ESP_OK);
+
+	// the next append goes past the torn slot, which counts as pending
+	// until the replay steps over it
+	reboot();
+	CHECK(event_journal_pending() == 6);
+	CHECK(append(6) == ESP_OK);
+	sink_t sink = {.accept = 100};
+	CHECK(event_journal_replay(collect, &sink, 100) == 6);
+	CHECK(sink.count == 6 && in_order(&sink, 0) == false);
+	CHECK(sink.seq[4] == 4 && sink.seq[5] == 6);
+	event_journal_stats_t stats;
+	event_journal_stats(&stats);
+	CHECK(stats.corrupt >= 1);
+	CHECK(nor.raised_bits == 0);
+}
+
+static void test_erase_failure(void)
+{
+	format();
+	// the first append erases ahead, it must not write into unerased flash
+	memset(flash, 0x00, sizeof(flash));
+	reboot();
+	nor.fail_erase = true;
+	CHECK(append(0) != ESP_OK);
+	CHECK(event_journal_pending() == 0);
+	nor.fail_erase = false;
+	CHECK(append(0) == ESP_OK);
+	CHECK(event_journal_pending() == 1);
+}
+
+static void bench(void)
+{
+	format();
+	const int rounds = 20 * SLOTS;
+	double t0 = host_seconds();
+	for (int i = 0; i < rounds; i++)
+		append(i);
+	double t1 = host_seconds();
+	sink_t sink = {.accept = 4 * SLOTS};
+	int sent = event_journal_replay(collect, &sink, 4 * SLOTS);
+	double t2 = host_seconds();
+	event_journal_stats_t stats;
+	event_journal_stats(&stats);
+	printf("event_journal: %.0f ns per append, %.0f ns per replayed record, %u bytes written per event\n",
+			(t1 - t0) / rounds * 1e9, (t2 - t1) / sent * 1e9, stats.bytes_written / stats.appended);
+}
+
+int main(int argc, char** argv)
+{
+	test_replay_and_reboot();
+	test_mark_failure();
+	test_hand_off();
+	test_wrap();
+	test_torn_append();
+	test_erase_failure();
+	if (host_bench(argc, argv))
+		bench();
+	return host_done("test_event_journal");
+}
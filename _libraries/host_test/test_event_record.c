@@ -0,0 +1,196 @@
+/*
+ * test_event_record.c
+ *
+ *  The event record is its own wire format: field offsets, byte order and
+ *  the CRC must match on every side. Checks a sealed record byte by byte,
+ *  the reader's rejections, that every single bit error is caught, the
+ *  serial framing read back from a noisy stream in odd chunks, and the
+ *  node id from a MAC with the top bits set. `bench` gives the seal and
+ *  view rate.
+ */
+
+#include <stdlib.h>
+#include "event_record.h"
+#include "host_test.h"
+
+static uint32_t get32(const uint8_t* p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static event_record_t sample(void)
+{
+	event_record_t ev = {
+		.status = EVENT_FIRE | EVENT_TIME_VALID | EVENT_POSITION_VALID,
+		.sequence = 0x01020304,
+		.node = 0xA1B2C3D4,
+		.time_us = 1792413296LL * 1000000 + 123456,
+		.latitude = 352057611,
+		.longitude = -1206646090,
+		.bearing = 0x4000,
+		.peak_temp = -125,
+		.battery_mv = 12480,
+	};
+	event_record_seal(&ev);
+	return ev;
+}
+
+static void test_crc(void)
+{
+	// CRC-16/CCITT-FALSE check value
+	CHECK(event_crc16("123456789", 9) == 0x29B1);
+	CHECK(event_crc16("", 0) == 0xFFFF);
+}
+
+static void test_layout(void)
+{
+	event_record_t ev = sample();
+	const uint8_t* b = (const uint8_t*)&ev;
+
+	CHECK(b[0] == EVENT_RECORD_VERSION);
+	CHECK(b[1] == ev.status);
+	CHECK(get32(b + 2) == 0x01020304);
+	CHECK(get32(b + 6) == 0xA1B2C3D4);
+	CHECK((get32(b + 10) | (uint64_t)get32(b + 14) << 32) == (uint64_t)ev.time_us);
+	CHECK((int32_t)get32(b + 18) == 352057611);
+	CHECK((int32_t)get32(b + 22) == -1206646090);
+	CHECK(b[26] == 0x00 && b[27] == 0x40);
+	CHECK((int16_t)(b[28] | b[29] << 8) == -125);
+	CHECK((b[30] | b[31] << 8) == 12480);
+	CHECK((b[32] | b[33] << 8) == event_crc16(b, 32));
+}
+
+static void test_view(void)
+{
+	event_record_t ev = sample();
+	uint8_t buf[sizeof(ev) + 4];
+	memcpy(buf, &ev, sizeof(ev));
+
+	const event_record_t* rec = event_record_view(buf, sizeof(ev));
+	CHECK(rec == (const event_record_t*)buf);
+	CHECK(rec && memcmp(rec, &ev, sizeof(ev)) == 0);
+	// trailing bytes are the transport's business
+	CHECK(event_record_view(buf, sizeof(buf)) != NULL);
+
+	CHECK(event_record_view(NULL, sizeof(ev)) == NULL);
+	CHECK(event_record_view(buf, sizeof(ev) - 1) == NULL);
+
+	// a newer version is refused even with a good CRC
+	event_record_t next = ev;
+	next.version = EVENT_RECORD_VERSION + 1;
+	next.crc = event_crc16(&next, sizeof(next) - sizeof(next.crc));
+	CHECK(event_record_view(&next, sizeof(next)) == NULL);
+
+	// every single bit error, the version byte included
+	int missed = 0;
+	for (size_t bit = 0; bit < sizeof(ev) * 8; bit++) {
+		memcpy(buf, &ev, sizeof(ev));
+		buf[bit / 8] ^= 1 << bit % 8;
+		if (event_record_view(buf, sizeof(ev)) != NULL)
+			missed++;
+	}
+	CHECK(missed == 0);
+}
+
+// reads a stream the way the external UI does, a chunk at a time into a
+// buffer two frames long, and returns the records found
+static int read_stream(const uint8_t* stream, size_t len, event_record_t* out, int max)
+{
+	uint8_t rx[2 * EVENT_FRAME_LEN];
+	size_t fill = 0, used;
+	int found = 0;
+	for (size_t i = 0, n = 1; i < len; i += n, n = n % 13 + 5) {
+		if (n > len - i)
+			n = len - i;
+		CHECK(fill + n <= sizeof(rx));
+		memcpy(rx + fill, stream + i, n);
+		fill += n;
+		for (;;) {
+			const event_record_t* ev = event_record_unframe(rx, fill, &used);
+			if (ev && found < max)
+				out[found++] = *ev;
+			if (used == 0)
+				break;
+			fill -= used;
+			memmove(rx, rx + used, fill);
+		}
+	}
+	return found;
+}
+
+static void test_frame(void)
+{
+	event_record_t ev = sample();
+	uint8_t stream[6 * EVENT_FRAME_LEN];
+	size_t len = 0;
+
+	CHECK(event_record_frame(&ev, stream, EVENT_FRAME_LEN - 1) == 0);
+	CHECK(EVENT_FRAME_LEN == 37);
+
+	// console noise, a lone sync byte and a sync pair with a wrong length
+	const uint8_t noise[] = {'I', ' ', '(', 0xE5, '1', 0xE5, 0x7C, 200, 0x7C, 0xE5};
+	memcpy(stream, noise, sizeof(noise));
+	len += sizeof(noise);
+	len += event_record_frame(&ev, stream + len, sizeof(stream) - len);
+	CHECK(stream[sizeof(noise)] == EVENT_FRAME_SYNC_1 && stream[sizeof(noise) + 2] == sizeof(ev));
+
+	// a frame with a flipped bit is dropped, the one after it still found
+	size_t bad = len;
+	len += event_record_frame(&ev, stream + len, sizeof(stream) - len);
+	stream[bad + EVENT_FRAME_HDR_LEN + 5] ^= 0x10;
+	event_record_t next = ev;
+	next.sequence++;
+	event_record_seal(&next);
+	len += event_record_frame(&next, stream + len, sizeof(stream) - len);
+	// cut short, the last frame waits for the rest
+	len += event_record_frame(&next, stream + len, sizeof(stream) - len) - 1;
+
+	event_record_t got[4];
+	CHECK(read_stream(stream, len, got, 4) == 2);
+	CHECK(memcmp(&got[0], &ev, sizeof(ev)) == 0);
+	CHECK(memcmp(&got[1], &next, sizeof(next)) == 0);
+
+	// a partial header is kept, noise alone is dropped
+	size_t used;
+	CHECK(event_record_unframe(stream + sizeof(noise), 2, &used) == NULL && used == 0);
+	CHECK(event_record_unframe(noise, 3, &used) == NULL && used == 3);
+	CHECK(event_record_unframe(noise, 4, &used) == NULL && used == 3);
+}
+
+static void test_node_id(void)
+{
+	const uint8_t mac[6] = {0x24, 0x0A, 0xC4, 0x81, 0x02, 0xFE};
+	CHECK(event_node_id(mac) == 0xC48102FE);
+	const uint8_t low[6] = {0xFF, 0xFF, 0x00, 0x00, 0x00, 0x01};
+	CHECK(event_node_id(low) == 1);
+}
+
+static void bench(void)
+{
+	const int rounds = 2000000;
+	event_record_t ev = sample();
+	int valid = 0;
+
+	double t0 = host_seconds();
+	for (int r = 0; r < rounds; r++) {
+		ev.sequence = r;
+		event_record_seal(&ev);
+		valid += event_record_view(&ev, sizeof(ev)) != NULL;
+	}
+	double dt = host_seconds() - t0;
+	CHECK(valid == rounds);
+	printf("event_record: %.0f ns per seal and view, %.1f MB/s of CRC\n",
+			dt / rounds * 1e9, rounds * 2.0 * (sizeof(ev) - 2) / dt / 1e6);
+}
+
+int main(int argc, char** argv)
+{
+	test_crc();
+	test_layout();
+	test_view();
+	test_frame();
+	test_node_id();
+	if (host_bench(argc, argv))
+		bench();
+	return host_done("test_event_record");
+}
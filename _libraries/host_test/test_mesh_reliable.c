@@ -0,0 +1,260 @@
+/*
+ * test_mesh_reliable.c
+ *
+ *  Reliable delivery without a radio. As the root, wrapped messages are
+ *  fed to mesh_reliable_receive() in any order and the ACKs it owes are
+ *  read back off the send path; as a node, messages land in a stand-in
+ *  outbox and ACKs come back out of order, twice, or from an old boot.
+ *  The source is included so the test can run its task's steps on a
+ *  clock it moves by hand.
+ */
+
+#include <stdlib.h>
+#include "esp_timer.h"
+
+static int64_t sim_us;
+#define esp_timer_get_time() (sim_us)
+
+#include "../../wifi_mesh_transceiver/main/mesh_reliable.c"
+#include "host_test.h"
+
+#define OUT_LEN     (64)
+
+int host_notified;
+
+// what the node put in its outbox, reliable header first
+static struct {
+	uint8_t data[sizeof(reliable_hdr_t) + MESH_FRAME_HDR_LEN + MESH_RELIABLE_MAX_PAYLOAD];
+	uint16_t len;
+} out[OUT_LEN];
+static int out_count;
+
+// the last packet the root sent down
+static uint8_t sent[64];
+static uint16_t sent_len;
+
+// messages the root handed on, by their one byte payload
+static int delivered[256];
+
+static struct {
+	uint32_t tags[64];
+	int count;
+	uint32_t failed_tag;
+	int failed;
+} node;
+
+esp_err_t mesh_outbox_put(uint8_t type, uint8_t flags, const void* payload, uint16_t len)
+{
+	CHECK(type == MESH_MSG_RELIABLE && len <= sizeof(out[0].data));
+	if (out_count == OUT_LEN)
+		return ESP_ERR_NO_MEM;
+	memcpy(out[out_count].data, payload, len);
+	out[out_count++].len = len;
+	return ESP_OK;
+}
+
+esp_err_t esp_mesh_send(const mesh_addr_t* to, const mesh_data_t* data, int flag, const mesh_opt_t opt[], int opt_count)
+{
+	CHECK(to != NULL && data->size <= sizeof(sent));
+	memcpy(sent, data->data, data->size);
+	sent_len = data->size;
+	return ESP_OK;
+}
+
+int esp_mesh_get_layer(void)
+{
+	return 1;
+}
+
+static void on_ping(const mesh_addr_t* from, const mesh_frame_hdr_t* hdr, const uint8_t* payload, void* arg)
+{
+	delivered[payload[0]]++;
+}
+
+static void on_acked(uint8_t type, uint32_t tag, void* arg)
+{
+	node.tags[node.count++] = tag;
+}
+
+static void on_failed(uint8_t type, uint32_t tag, const uint8_t* payload, uint16_t len, void* arg)
+{
+	node.failed_tag = tag;
+	node.failed++;
+}
+
+static mesh_addr_t addr_of(int n)
+{
+	mesh_addr_t a = {{0x24, 0x0A, 0xC4, 0x00, n >> 8, n & 0xFF}};
+	return a;
+}
+
+// a ping carrying id, wrapped the way a node sends it
+static void receive(int from, uint16_t boot, uint16_t seq, uint16_t floor, uint8_t id)
+{
+	uint8_t buf[sizeof(reliable_hdr_t) + MESH_FRAME_HDR_LEN + 1];
+	reliable_hdr_t rh = {.boot = boot, .seq = seq, .floor = floor};
+	memcpy(buf, &rh, sizeof(rh));
+	mesh_frame_put(buf + sizeof(rh), sizeof(buf) - sizeof(rh), MESH_MSG_PING, 0, &id, 1);
+	mesh_frame_hdr_t hdr = {.type = MESH_MSG_RELIABLE, .len = sizeof(buf)};
+	mesh_addr_t a = addr_of(from);
+	mesh_reliable_receive(&a, &hdr, buf);
+}
+
+// sends the ACK the root owes, false when it owes none
+static bool owed(reliable_ack_t* ack)
+{
+	mesh_addr_t to;
+	if (!ack_take(sim_us + s_cfg.ack_delay_ms * 1000, &to, ack))
+		return false;
+	ack_send(&to, ack);
+	size_t off = 0;
+	mesh_frame_hdr_t hdr;
+	const uint8_t* payload = mesh_frame_next(sent, sent_len, &off, &hdr);
+	CHECK(payload != NULL && hdr.type == MESH_MSG_ACK && hdr.len == sizeof(*ack));
+	if (payload)
+		memcpy(ack, payload, sizeof(*ack));
+	return true;
+}
+
+static void ack_node(uint16_t boot, uint16_t next, uint32_t bitmap)
+{
+	reliable_ack_t ack = {.boot = boot, .next = next, .bitmap = bitmap};
+	mesh_frame_hdr_t hdr = {.type = MESH_MSG_ACK, .len = sizeof(ack)};
+	mesh_addr_t root = addr_of(0);
+	mesh_reliable_ack(&root, &hdr, (const uint8_t*)&ack);
+}
+
+static void test_root(void)
+{
+	mesh_reliable_stats_t st;
+	reliable_ack_t ack;
+
+	// nothing is held for other nodes until the first message arrives
+	CHECK(s_peers == NULL);
+	CHECK(!owed(&ack));
+
+	// out of order: 1 and 2 wait in the bitmap for 0
+	receive(1, 7, 1, 0, 1);
+	receive(1, 7, 2, 0, 2);
+	CHECK(s_peers != NULL);
+	CHECK(delivered[1] == 1 && delivered[2] == 1);
+	CHECK(owed(&ack) && ack.boot == 7 && ack.next == 0 && ack.bitmap == 0x6);
+	CHECK(!owed(&ack));
+	receive(1, 7, 0, 0, 0);
+	CHECK(delivered[0] == 1);
+	CHECK(owed(&ack) && ack.next == 3 && ack.bitmap == 0);
+
+	// a duplicate is acknowledged again but not handed on
+	receive(1, 7, 1, 0, 1);
+	CHECK(delivered[1] == 1);
+	CHECK(owed(&ack) && ack.next == 3);
+	mesh_reliable_stats(&st);
+	CHECK(st.received == 3 && st.duplicates == 1);
+
+	// 32 past the gap is beyond the bitmap and refused, 31 still fits
+	receive(1, 7, 3 + ACK_BITS, 3, 35);
+	CHECK(delivered[35] == 0);
+	receive(1, 7, 3 + ACK_BITS - 1, 3, 34);
+	CHECK(delivered[34] == 1);
+	CHECK(owed(&ack) && ack.next == 3 && ack.bitmap == 1u << 31);
+	mesh_reliable_stats(&st);
+	CHECK(st.refused == 1);
+
+	// the node gives up on 3 to 33: its floor moves the window up to 35,
+	// which it sends again and is now taken
+	receive(1, 7, 3 + ACK_BITS, 3 + ACK_BITS, 35);
+	CHECK(delivered[35] == 1);
+	CHECK(owed(&ack) && ack.next == 36 && ack.bitmap == 0);
+	// anything below the floor that turns up late is a duplicate
+	receive(1, 7, 20, 36, 20);
+	CHECK(delivered[20] == 0);
+	mesh_reliable_stats(&st);
+	CHECK(st.duplicates == 2);
+	CHECK(owed(&ack) && ack.next == 36);
+
+	// a new boot starts over from its floor, 0 is new again
+	receive(1, 8, 0, 0, 100);
+	CHECK(delivered[100] == 1);
+	CHECK(owed(&ack) && ack.boot == 8 && ack.next == 1 && ack.bitmap == 0);
+
+	// a node first heard mid-stream starts at its floor
+	receive(2, 3, 5, 5, 105);
+	CHECK(delivered[105] == 1);
+	CHECK(owed(&ack) && ack.boot == 3 && ack.next == 6);
+
+	// ACKs to one node are gathered for ack_delay_ms
+	receive(2, 3, 6, 5, 106);
+	mesh_addr_t to;
+	CHECK(!ack_take(sim_us, &to, &ack));
+	CHECK(owed(&ack) && ack.next == 7);
+}
+
+static void test_node(void)
+{
+	mesh_reliable_stats_t st;
+	const uint8_t payload[4] = {1, 2, 3, 4};
+	for (int i = 0; i < 4; i++)
+		CHECK(mesh_reliable_send(MESH_MSG_EVENT, 0, payload, sizeof(payload), 100 + i) == ESP_OK);
+	CHECK(out_count == 4);
+	reliable_hdr_t rh;
+	memcpy(&rh, out[3].data, sizeof(rh));
+	CHECK(rh.boot == s_boot && rh.seq == 3 && rh.floor == 0);
+
+	// out of order: 1 and 3 arrive, 0 and 2 are still missing
+	ack_node(s_boot, 0, 0xA);
+	CHECK(node.count == 2 && node.tags[0] == 101 && node.tags[1] == 103);
+	// the same ACK again, and one from an earlier boot, change nothing
+	ack_node(s_boot, 0, 0xA);
+	ack_node(s_boot + 1, 4, 0);
+	CHECK(node.count == 2);
+	mesh_reliable_stats(&st);
+	CHECK(st.pending == 2);
+
+	// the retransmit of 0 tells the root 0 is the oldest still waited for
+	sim_us += s_cfg.rto_batched_ms * 1000LL;
+	pending_t failed;
+	CHECK(!retransmit(sim_us, &failed));
+	CHECK(out_count == 6);
+	memcpy(&rh, out[4].data, sizeof(rh));
+	CHECK(rh.seq == 0 && rh.floor == 0);
+	memcpy(&rh, out[5].data, sizeof(rh));
+	CHECK(rh.seq == 2 && rh.floor == 0);
+
+	ack_node(s_boot, 4, 0);
+	CHECK(node.count == 4);
+	mesh_reliable_stats(&st);
+	CHECK(st.pending == 0 && st.acked == 4 && st.retries == 2);
+
+	// a full window refuses the next message
+	for (int i = 0; i < MESH_RELIABLE_WINDOW; i++)
+		CHECK(mesh_reliable_send(MESH_MSG_EVENT, 0, payload, sizeof(payload), 200 + i) == ESP_OK);
+	CHECK(mesh_reliable_send(MESH_MSG_EVENT, 0, payload, sizeof(payload), 300) == ESP_ERR_NO_MEM);
+
+	// all but the first are acknowledged, the first runs out of retries
+	// and the floor moves past it
+	ack_node(s_boot, 4, 0xFFFE);
+	int put = out_count;
+	for (uint32_t r = 0; r <= s_cfg.max_retries; r++) {
+		sim_us += s_cfg.max_backoff_ms * 1000LL;
+		if (retransmit(sim_us, &failed) && s_cfg.on_failed)
+			s_cfg.on_failed(failed.type, failed.tag, failed.data, failed.len, s_cfg.arg);
+	}
+	CHECK(out_count - put == (int)s_cfg.max_retries);
+	CHECK(node.failed == 1 && node.failed_tag == 200);
+	CHECK(mesh_reliable_send(MESH_MSG_EVENT, 0, payload, sizeof(payload), 301) == ESP_OK);
+	memcpy(&rh, out[out_count - 1].data, sizeof(rh));
+	CHECK(rh.seq == 4 + MESH_RELIABLE_WINDOW && rh.floor == rh.seq);
+}
+
+int main(int argc, char** argv)
+{
+	mesh_reliable_config_t cfg = MESH_RELIABLE_CONFIG_DEFAULT();
+	cfg.on_acked = on_acked;
+	cfg.on_failed = on_failed;
+	CHECK(mesh_reliable_init(&cfg) == ESP_OK);
+	CHECK(mesh_frame_register(MESH_MSG_PING, on_ping, NULL) == ESP_OK);
+
+	test_root();
+	test_node();
+	return host_done("test_mesh_reliable");
+}
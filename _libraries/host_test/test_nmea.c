@@ -0,0 +1,210 @@
+/*
+ * test_nmea.c
+ *
+ *  NMEA parser checks against a receiver log. `bench` measures nmea_feed()
+ *  over that log, and the fixed-point coordinates against the atof() path
+ *  the old gps/main used (`atof(lat) / 100.0` on the RMC fields).
+ */
+
+#include <stdlib.h>
+#include "nmea.h"
+#include "nmea_log.h"
+#include "host_test.h"
+
+#define EPOCHS 600
+
+static char log_buf[EPOCHS * 512];
+static size_t log_len;
+
+static uint32_t feed_str(nmea_parser_t* p, const char* s)
+{
+	return nmea_feed(p, (const uint8_t*)s, strlen(s));
+}
+
+static void test_log(void)
+{
+	nmea_parser_t p;
+	nmea_init(&p);
+
+	// odd chunk sizes, the way the UART hands them over
+	uint32_t bits = 0;
+	for (size_t i = 0, n = 1; i < log_len; i += n, n = n % 61 + 7)
+		bits |= nmea_feed(&p, (const uint8_t*)log_buf + i, i + n > log_len ? log_len - i : n);
+
+	CHECK(bits == (NMEA_RMC | NMEA_VTG | NMEA_GGA | NMEA_GSA));
+	CHECK(p.stats.sentences == EPOCHS * 4);
+	CHECK(p.stats.unknown == EPOCHS * 4);
+	CHECK(p.stats.checksum_errors == 0);
+	CHECK(p.stats.overflows == 0);
+
+	// the last epoch
+	int i = EPOCHS - 1;
+	CHECK(p.fix.valid);
+	CHECK(p.fix.time.hour == 12 && p.fix.time.minute == 43 && p.fix.time.second == 59);
+	CHECK(p.fix.date.day == 19 && p.fix.date.month == 10 && p.fix.date.year == 2026);
+	CHECK_NEAR(nmea_deg(p.fix.latitude), 35 + (12.34567 + i * 7e-5) / 60, 1e-7);
+	CHECK_NEAR(nmea_deg(p.fix.longitude), -(120 + (39.87654 - i * 11e-5) / 60), 1e-7);
+	CHECK(p.fix.quality == 1 && p.fix.satellites == 7 + i % 3);
+	CHECK(p.fix.fix_mode == 3 && p.fix.sat_ids[7] == 25 && p.fix.sat_ids[8] == 0);
+	CHECK_NEAR(p.fix.hdop, 0.92, 1e-6);
+}
+
+static void test_malformed(void)
+{
+	nmea_parser_t p;
+	char s[128];
+	nmea_init(&p);
+	nmea_log_put(s, 0, "GPGGA,123400.00,3512.34567,N,12039.87654,W,1,08,0.92,94.5,M,-32.1,M,,");
+	feed_str(&p, s);
+	nmea_fix_t good = p.fix;
+
+	// whole parts too long for any field are refused, not overflowed
+	nmea_log_put(s, 0, "GPGGA,123401,3512.3,N,12039.8,W,1,08,0.9,12345678901234567890,M,,M,,");
+	CHECK(feed_str(&p, s) == NMEA_GGA);
+	CHECK(p.fix.altitude == good.altitude);
+	CHECK(p.fix.time.second == 1);
+	int32_t lat = p.fix.latitude;
+
+	nmea_log_put(s, 0, "GPGGA,123402,99999999999999999999.1,N,12039.8,W,1,08,,,,,");
+	feed_str(&p, s);
+	CHECK(p.fix.latitude == lat);
+	int32_t lon = p.fix.longitude;
+	CHECK_NEAR(nmea_deg(lon), -(120 + 39.8 / 60), 1e-7);
+
+	nmea_log_put(s, 0, "GPGGA,123403,,,,,99999999999999999999,99999999999999999999,,,,,");
+	feed_str(&p, s);
+	CHECK(p.fix.quality == 0 && p.fix.satellites == 0);
+
+	// degrees out of range
+	nmea_log_put(s, 0, "GPGGA,123403,3512.3,N,99939.8,W,1,08,,,,,");
+	feed_str(&p, s);
+	CHECK(p.fix.longitude == lon);
+	nmea_log_put(s, 0, "GPGGA,123403,9112.3,N,12039.8,W,1,08,,,,,");
+	feed_str(&p, s);
+	CHECK(p.fix.latitude == lat);
+	int32_t e7;
+	CHECK(!nmea_coordinate("9000.01", 'N', NMEA_MAX_LATITUDE, &e7));
+	CHECK(nmea_coordinate("9000.00", 'S', NMEA_MAX_LATITUDE, &e7) && e7 == -900000000);
+	CHECK(nmea_coordinate("17959.99", 'E', NMEA_MAX_LONGITUDE, &e7));
+
+	// time and date digits are checked before they are used
+	nmea_log_put(s, 0, "GPRMC,1a:4 5.00,A,3512.34567,N,12039.87654,W,0.1,40.0,1x10-6,,,A");
+	feed_str(&p, s);
+	CHECK(p.fix.time.hour == 12 && p.fix.time.minute == 34 && p.fix.time.second == 3);
+	CHECK(p.fix.date.year == 0);
+
+	nmea_log_put(s, 0, "GPZDA,123404.00,32,13,2026,00,00");
+	feed_str(&p, s);
+	CHECK(p.fix.date.year == 0);
+	nmea_log_put(s, 0, "GPZDA,123404.00,19,10,2026,00,00");
+	feed_str(&p, s);
+	CHECK(p.fix.date.day == 19 && p.fix.date.month == 10 && p.fix.date.year == 2026);
+}
+
+// the old conversion, ddmm.mmmm read as if it were decimal degrees
+static uint32_t old_rmc(const char* s, float* lat, float* lon)
+{
+	char field[20];
+	int comma = 0;
+	size_t n = 0;
+	for (; *s && *s != '*'; s++) {
+		if (*s != ',') {
+			if (n < sizeof(field) - 1)
+				field[n++] = *s;
+			continue;
+		}
+		field[n] = '\0';
+		if (comma == 3)
+			*lat = atof(field) / 100.0;
+		else if (comma == 5)
+			*lon = atof(field) / 100.0;
+		else if (comma == 4 && field[0] == 'S')
+			*lat = -*lat;
+		else if (comma == 6 && field[0] == 'W')
+			*lon = -*lon;
+		comma++;
+		n = 0;
+	}
+	return comma >= 6 ? NMEA_RMC : 0;
+}
+
+static void bench_coordinate(void)
+{
+	// the RMC sentences alone, the only ones the old code looked at
+	static char rmc[EPOCHS * 96];
+	size_t rmc_len = 0;
+	for (const char* s = strstr(log_buf, "$GPRMC"); s; s = strstr(s + 1, "$GPRMC")) {
+		size_t n = strchr(s, '\n') + 1 - s;
+		memcpy(rmc + rmc_len, s, n);
+		rmc_len += n;
+	}
+	rmc[rmc_len] = '\0';
+
+	const int rounds = 2000;
+	nmea_parser_t p;
+	nmea_init(&p);
+	double t0 = host_seconds();
+	for (int r = 0; r < rounds; r++)
+		nmea_feed(&p, (const uint8_t*)rmc, rmc_len);
+	double t_new = host_seconds() - t0;
+
+	volatile float sink;
+	float lat = 0, lon = 0;
+	t0 = host_seconds();
+	for (int r = 0; r < rounds; r++) {
+		for (const char* s = rmc; *s; s = strchr(s, '\n') + 1) {
+			old_rmc(s, &lat, &lon);
+			sink = lat + lon;
+		}
+	}
+	double t_old = host_seconds() - t0;
+	(void)sink;
+
+	double sentences = (double)rounds * EPOCHS;
+	printf("RMC sentences/s: %.0f nmea_feed, %.0f atof (x%.1f)\n",
+			sentences / t_new, sentences / t_old, t_old / t_new);
+	printf("  last latitude %.7f, atof path %.7f\n", nmea_deg(p.fix.latitude), lat);
+
+	// the conversion on its own
+	int32_t e7 = 0;
+	t0 = host_seconds();
+	for (int r = 0; r < 1000000; r++) {
+		nmea_coordinate(r & 1 ? "3512.34567" : "12039.87654", 'N', NMEA_MAX_LONGITUDE, &e7);
+		sink = e7;
+	}
+	double t_fixed = host_seconds() - t0;
+	t0 = host_seconds();
+	for (int r = 0; r < 1000000; r++)
+		sink = atof(r & 1 ? "3512.34567" : "12039.87654") / 100.0;
+	double t_atof = host_seconds() - t0;
+	printf("coordinate: %.0f ns nmea_coordinate, %.0f ns atof\n", t_fixed * 1e3, t_atof * 1e3);
+}
+
+static void bench(void)
+{
+	const int rounds = 200;
+	nmea_parser_t p;
+	nmea_init(&p);
+
+	double t0 = host_seconds();
+	for (int r = 0; r < rounds; r++)
+		nmea_feed(&p, (const uint8_t*)log_buf, log_len);
+	double dt = host_seconds() - t0;
+
+	uint32_t total = p.stats.sentences + p.stats.unknown;
+	printf("nmea_feed: %.1f MB/s, %.0f sentences/s (%u sentences, %.0f ns each)\n",
+			rounds * log_len / dt / 1e6, total / dt, total, dt / total * 1e9);
+}
+
+int main(int argc, char** argv)
+{
+	log_len = nmea_log(log_buf, EPOCHS);
+
+	test_log();
+	test_malformed();
+	if (host_bench(argc, argv)) {
+		bench();
+		bench_coordinate();
+	}
+	return host_done("test_nmea");
+}
@@ -0,0 +1,130 @@
+/*
+ * test_pps_clock.c
+ *
+ *  PPS discipline against a simulated source: a local counter that runs
+ *  30 ppm fast, edges with capture jitter, missing edges and glitches,
+ *  then the GPS off for four hours while the crystal warms up. The
+ *  holdover bound has to cover the real error the whole time.
+ */
+
+#include <stdlib.h>
+#include "pps_clock.h"
+#include "host_test.h"
+
+#define US          (1000000LL)
+#define UTC_START   (1792413296LL)  // 2026-10-19 12:34:56
+
+typedef struct {
+	double rate;                // local seconds per true second
+	double local;               // local counter at true time 0, us
+	uint32_t seed;
+} source_t;
+
+static int64_t local_at(const source_t* src, double true_us)
+{
+	return (int64_t)(src->local + true_us * src->rate);
+}
+
+static int jitter(source_t* src)
+{
+	src->seed = src->seed * 1103515245 + 12345;
+	return (int)(src->seed >> 16) % 7 - 3;
+}
+
+static void test_epoch(void)
+{
+	nmea_date_t d = {19, 10, 2026};
+	nmea_time_t t = {12, 34, 56, 0};
+	CHECK(pps_clock_epoch(&d, &t) == UTC_START);
+	nmea_date_t leap = {29, 2, 2000};
+	nmea_time_t midnight = {0, 0, 0, 0};
+	CHECK(pps_clock_epoch(&leap, &midnight) == 951782400LL);
+	nmea_date_t far = {1, 3, 2100};
+	nmea_time_t last = {23, 59, 59, 0};
+	CHECK(pps_clock_epoch(&far, &last) == 4107628799LL);
+}
+
+static void test_discipline(void)
+{
+	source_t src = {1.0 + 30e-6, 5e6, 1};
+	pps_clock_t clk;
+	pps_clock_init(&clk);
+
+	CHECK(pps_clock_utc(&clk, 0) == 0);
+	CHECK(pps_clock_error_us(&clk, 0) == -1);
+
+	double worst = 0;
+	uint32_t glitches = 0, missing = 0;
+	for (int s = 0; s <= 600; s++) {
+		// every 50th edge goes missing, every 70th has a glitch before it
+		if (s % 50 == 49) {
+			missing++;
+			continue;
+		}
+		if (s % 70 == 69) {
+			CHECK(!pps_clock_edge(&clk, local_at(&src, (s - 0.4) * US)));
+			glitches++;
+		}
+		CHECK(pps_clock_edge(&clk, local_at(&src, s * US) + jitter(&src)));
+		if (s == 2)
+			pps_clock_label(&clk, UTC_START + s);
+
+		// the middle of the second, compared against true time
+		if (s > 60) {
+			int64_t local = local_at(&src, (s + 0.5) * US);
+			double err = fabs((double)pps_clock_utc(&clk, local) - ((UTC_START + s) * US + 0.5 * US));
+			if (err > worst)
+				worst = err;
+			CHECK(err <= pps_clock_error_us(&clk, local));
+		}
+	}
+
+	CHECK_NEAR(clk.stats.drift_ppb, 30000, 300);
+	CHECK(worst < 10);
+	CHECK(clk.stats.rejected == glitches);
+	CHECK(clk.stats.missed == missing);
+	CHECK(clk.stats.steps == 0);
+
+	// a fix with the wrong second is a step
+	pps_clock_label(&clk, UTC_START + 1000);
+	CHECK(clk.stats.steps == 1);
+}
+
+static void test_holdover(void)
+{
+	source_t src = {1.0 - 12e-6, 0, 7};
+	pps_clock_t clk;
+	pps_clock_init(&clk);
+	for (int s = 0; s < 300; s++) {
+		pps_clock_edge(&clk, local_at(&src, s * US) + jitter(&src));
+		if (s == 1)
+			pps_clock_label(&clk, UTC_START + s);
+	}
+
+	// GPS off for four hours while the rate wanders by 1.5 ppm
+	double true_us = 299.0 * US;
+	int64_t local = local_at(&src, true_us);
+	double worst_ratio = 0;
+	for (int m = 1; m <= 240; m++) {
+		double rate = 1.0 - 12e-6 + 1.5e-6 * m / 240;
+		true_us += 60.0 * US;
+		local += (int64_t)(60.0 * US * rate);
+		double err = fabs((double)pps_clock_utc(&clk, local) - (UTC_START * US + true_us));
+		int64_t bound = pps_clock_error_us(&clk, local);
+		CHECK(err <= bound);
+		if (err / bound > worst_ratio)
+			worst_ratio = err / bound;
+	}
+	int64_t bound = pps_clock_error_us(&clk, local);
+	printf("  holdover: %lld us bound after 4 h, real error up to %.0f%% of it\n",
+			(long long)bound, worst_ratio * 100);
+	CHECK(bound < 100000);
+}
+
+int main(int argc, char** argv)
+{
+	test_epoch();
+	test_discipline();
+	test_holdover();
+	return host_done("test_pps_clock");
+}
@@ -0,0 +1,116 @@
+/*
+ * test_sweep.c
+ *
+ *  Sweep planner checks: direction alternates without returning home,
+ *  hot zone sectors, cable-wrap limits, and wrap ranges wide enough to
+ *  give every bearing more positions than the planner keeps.
+ */
+
+#include "sweep.h"
+#include "bearing_math.h"
+#include "host_test.h"
+
+static void init(heading_est_t* est, int32_t position)
+{
+	heading_config_t cfg = HEADING_CONFIG_DEFAULT();
+	heading_init(est, &cfg);
+	heading_compass(est, 0);
+	est->step_count = position;
+}
+
+static void eight_headings(sweep_set_t* set)
+{
+	sweep_set_clear(set);
+	for (int i = 0; i < 8; i++)
+		sweep_set_add(set, bm_deg_to_bam(i * 45.0f));
+}
+
+static void test_alternates(void)
+{
+	heading_est_t est;
+	sweep_limits_t limits = {-300, 300};
+	sweep_set_t set;
+	sweep_plan_t plan;
+	init(&est, 0);
+	eight_headings(&set);
+
+	sweep_plan(&limits, &est, &set, &plan);
+	CHECK(plan.count == 8);
+	CHECK(plan.unreachable == 0);
+	// 315 degrees of travel, not 315 out and 315 back
+	CHECK_NEAR(sweep_travel_deg(&plan, &est), 315.0, 0.5);
+
+	// the next cycle starts where this one ended and runs the other way
+	int32_t end = plan.position[plan.count - 1];
+	int dir = plan.position[1] > plan.position[0] ? 1 : -1;
+	est.step_count = end;
+	sweep_plan(&limits, &est, &set, &plan);
+	CHECK(plan.position[0] == end);
+	CHECK((plan.position[1] > plan.position[0] ? 1 : -1) == -dir);
+	CHECK_NEAR(sweep_travel_deg(&plan, &est), 315.0, 0.5);
+}
+
+static void test_sector(void)
+{
+	heading_est_t est;
+	sweep_limits_t limits = {-300, 300};
+	sweep_set_t set;
+	sweep_plan_t plan;
+	init(&est, 0);
+
+	// a 30 degree hot zone every 5 degrees, rounded onto whole steps
+	sweep_set_clear(&set);
+	CHECK(sweep_set_add_sector(&set, bm_deg_to_bam(100), bm_deg_to_bam(30), bm_deg_to_bam(5)));
+	CHECK(set.count == 7);
+	sweep_plan(&limits, &est, &set, &plan);
+	CHECK(plan.count == 7);
+	CHECK(sweep_travel_deg(&plan, &est) < 135.0f);
+}
+
+static void test_limits(void)
+{
+	heading_est_t est;
+	sweep_limits_t limits = {0, 100};   // half a turn of cable
+	sweep_set_t set;
+	sweep_plan_t plan;
+	init(&est, 0);
+	eight_headings(&set);
+
+	sweep_plan(&limits, &est, &set, &plan);
+	CHECK(plan.unreachable == 3);
+	CHECK(plan.count == 5);
+	for (int i = 0; i < plan.count; i++)
+		CHECK(plan.position[i] >= limits.wrap_min && plan.position[i] <= limits.wrap_max);
+}
+
+static void test_wide_wrap(void)
+{
+	heading_est_t est;
+	// a hundred turns each way, far more positions than the planner keeps
+	sweep_limits_t limits = {-20000, 20000};
+	sweep_set_t set;
+	sweep_plan_t plan;
+	init(&est, 7000);
+
+	sweep_set_clear(&set);
+	for (int i = 0; i < SWEEP_MAX_STOPS; i++)
+		sweep_set_add(&set, (heading_bam_t)(i * 2048));
+	sweep_plan(&limits, &est, &set, &plan);
+	CHECK(plan.count == SWEEP_MAX_STOPS);
+	CHECK(plan.unreachable == 0);
+	CHECK(sweep_travel_deg(&plan, &est) < 360.0f);
+
+	eight_headings(&set);
+	sweep_plan(&limits, &est, &set, &plan);
+	CHECK(plan.count == 8);
+	CHECK_NEAR(sweep_travel_deg(&plan, &est), 315.0, 0.5);
+}
+
+int main(int argc, char** argv)
+{
+	test_alternates();
+	test_sector();
+	test_limits();
+	test_wide_wrap();
+	return host_done("sweep");
+}
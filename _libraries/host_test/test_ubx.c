@@ -0,0 +1,246 @@
+/*
+ * test_ubx.c
+ *
+ *  Replays UBX streams through the decoder the way gps.c reads them:
+ *  NAV-PVT at 1 Hz with ACKs and leftover NMEA text in between, cut into
+ *  UART sized chunks, then the same stream with corrupted, oversized and
+ *  truncated frames. `bench` gives the decode rate.
+ */
+
+#include <stdlib.h>
+#include "ubx.h"
+#include "host_test.h"
+
+#define EPOCHS 300
+
+static uint8_t stream[EPOCHS * 200];
+static size_t stream_len;
+
+static void put16(uint8_t* p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static int32_t lat_at(int i)
+{
+	return 352057611 + i * 13;
+}
+
+static int32_t lon_at(int i)
+{
+	return -1206646090 - i * 21;
+}
+
+static void nav_pvt(uint8_t* p, int i)
+{
+	memset(p, 0, UBX_NAV_PVT_LEN);
+	int t = 12 * 3600 + 34 * 60 + i;
+	put32(p, t * 1000);                 // iTOW
+	put16(p + 4, 2026);
+	p[6] = 10;
+	p[7] = 19;
+	p[8] = t / 3600 % 24;
+	p[9] = t / 60 % 60;
+	p[10] = t % 60;
+	p[11] = 0x07;                       // date, time, fully resolved
+	put32(p + 16, i % 2 ? 250000000 : -1200);
+	p[20] = 3;
+	p[21] = 0x01;
+	p[23] = 9;
+	put32(p + 24, lon_at(i));
+	put32(p + 28, lat_at(i));
+	put32(p + 32, 62100);               // height above ellipsoid, mm
+	put32(p + 36, 94300);               // above mean sea level
+	put32(p + 60, 514);                 // ground speed, mm/s
+	put32(p + 64, 4012345);             // heading, 1e-5 degrees
+	put16(p + 76, 171);
+}
+
+static size_t append(uint8_t msg_class, uint8_t msg_id, const uint8_t* payload, uint16_t len)
+{
+	size_t n = ubx_build(stream + stream_len, sizeof(stream) - stream_len, msg_class, msg_id, payload, len);
+	stream_len += n;
+	return n;
+}
+
+static void build_stream(void)
+{
+	uint8_t pvt[UBX_NAV_PVT_LEN];
+	stream_len = 0;
+	// text still in flight from before the switch to UBX
+	const char* text = "$GPRMC,123359.00,A,3512.34567,N,12039.87654,W,0.1,40.0,191026,,,A*55\r\n";
+	memcpy(stream, text, strlen(text));
+	stream_len = strlen(text);
+
+	const uint8_t ack[2] = {UBX_CLASS_CFG, UBX_CFG_MSG};
+	append(UBX_CLASS_ACK, UBX_ACK_ACK, ack, sizeof(ack));
+	for (int i = 0; i < EPOCHS; i++) {
+		nav_pvt(pvt, i);
+		append(UBX_CLASS_NAV, UBX_NAV_PVT, pvt, sizeof(pvt));
+	}
+}
+
+typedef struct {
+	ubx_decoder_t dec;
+	nmea_fix_t fix;
+	int pvt;                    // NAV-PVT frames seen
+	int acks;
+	int last;                   // epoch of the last NAV-PVT, from its time
+	int order_errors;
+} replay_t;
+
+static void replay(replay_t* r, const uint8_t* data, size_t len, unsigned seed)
+{
+	srand(seed);
+	for (size_t at = 0; at < len; ) {
+		size_t chunk = 1 + rand() % 120;
+		if (chunk > len - at)
+			chunk = len - at;
+		for (size_t off = 0; off < chunk; ) {
+			bool complete;
+			off += ubx_feed(&r->dec, data + at + off, chunk - off, &complete);
+			if (!complete)
+				continue;
+			if (r->dec.msg_class == UBX_CLASS_ACK)
+				r->acks++;
+			if (r->dec.msg_class == UBX_CLASS_NAV && r->dec.msg_id == UBX_NAV_PVT
+					&& ubx_nav_pvt_to_fix(r->dec.payload, r->dec.len, &r->fix)) {
+				int epoch = (r->fix.time.hour * 3600 + r->fix.time.minute * 60 + r->fix.time.second)
+						- (12 * 3600 + 34 * 60);
+				if (epoch <= r->last)
+					r->order_errors++;
+				r->last = epoch;
+				r->pvt++;
+			}
+		}
+		at += chunk;
+	}
+}
+
+static void replay_init(replay_t* r)
+{
+	memset(r, 0, sizeof(*r));
+	ubx_init(&r->dec);
+	r->last = -1;
+}
+
+static void test_clean(void)
+{
+	replay_t r;
+	replay_init(&r);
+	replay(&r, stream, stream_len, 1);
+
+	CHECK(r.pvt == EPOCHS);
+	CHECK(r.acks == 1);
+	CHECK(r.order_errors == 0);
+	CHECK(r.dec.stats.frames == EPOCHS + 1);
+	CHECK(r.dec.stats.checksum_errors == 0);
+	CHECK(r.dec.stats.oversize == 0);
+
+	int i = EPOCHS - 1;
+	CHECK(r.fix.valid && r.fix.fix_mode == 3 && r.fix.satellites == 9);
+	CHECK(r.fix.latitude == lat_at(i) && r.fix.longitude == lon_at(i));
+	CHECK(r.fix.date.year == 2026 && r.fix.date.month == 10 && r.fix.date.day == 19);
+	CHECK(r.fix.time.millis == 250);
+	CHECK_NEAR(r.fix.altitude, 94.3, 1e-4);
+	CHECK_NEAR(r.fix.geoid_sep, -32.2, 1e-4);
+	CHECK_NEAR(r.fix.speed_knots, 0.514 * 1.94384, 1e-3);
+	CHECK_NEAR(r.fix.course, 40.12345, 1e-4);
+	CHECK_NEAR(r.fix.pdop, 1.71, 1e-5);
+}
+
+static void test_damaged(void)
+{
+	static uint8_t bad[sizeof(stream) + 64];
+	const size_t frame = UBX_NAV_PVT_LEN + UBX_FRAME_OVERHEAD;
+	// the NMEA line and the ACK come first, NAV-PVT frames follow back to back
+	const size_t first = stream_len - EPOCHS * frame;
+	memcpy(bad, stream, stream_len);
+	size_t len = stream_len;
+
+	// a payload byte in frame 10, the checksum in frame 20
+	bad[first + 10 * frame + 40] ^= 0x10;
+	bad[first + 20 * frame + frame - 1] ^= 0x01;
+	// frame 30 claims a payload too long for the decoder
+	bad[first + 30 * frame + 5] = 0x40;
+	// frame 40 loses its tail, swallowing part of frame 41
+	memmove(bad + first + 40 * frame + 50, bad + first + 41 * frame, len - (first + 41 * frame));
+	len -= frame - 50;
+	// a stray sync byte before frame 60, which moved up with the cut
+	size_t at = first + 60 * frame - (frame - 50);
+	memmove(bad + at + 1, bad + at, len - at);
+	bad[at] = UBX_SYNC_1;
+	len++;
+
+	replay_t r;
+	replay_init(&r);
+	replay(&r, bad, len, 2);
+
+	// 10, 20, 30 and 40 are gone, 41 is damaged by the cut
+	CHECK(r.pvt == EPOCHS - 5);
+	CHECK(r.order_errors == 0);
+	CHECK(r.dec.stats.checksum_errors >= 3);
+	CHECK(r.dec.stats.oversize == 1);
+	CHECK(r.last == EPOCHS - 1);
+	CHECK(r.fix.latitude == lat_at(EPOCHS - 1));
+}
+
+static void test_no_fix(void)
+{
+	uint8_t pvt[UBX_NAV_PVT_LEN];
+	nmea_fix_t fix;
+	memset(&fix, 0, sizeof(fix));
+	nav_pvt(pvt, 0);
+	CHECK(ubx_nav_pvt_to_fix(pvt, sizeof(pvt), &fix));
+	CHECK(fix.time.millis == 0);        // negative nano belongs to the second before
+	int32_t lat = fix.latitude;
+
+	// no fix: the position is kept, the time still moves
+	nav_pvt(pvt, 5);
+	pvt[20] = 0;
+	CHECK(ubx_nav_pvt_to_fix(pvt, sizeof(pvt), &fix));
+	CHECK(!fix.valid && fix.quality == 0 && fix.fix_mode == 1);
+	CHECK(fix.latitude == lat);
+	CHECK(fix.time.second == 5);
+
+	CHECK(!ubx_nav_pvt_to_fix(pvt, UBX_NAV_PVT_LEN - 1, &fix));
+}
+
+static void bench(void)
+{
+	const int rounds = 2000;
+	ubx_decoder_t dec;
+	nmea_fix_t fix;
+	ubx_init(&dec);
+
+	double t0 = host_seconds();
+	for (int r = 0; r < rounds; r++) {
+		for (size_t off = 0; off < stream_len; ) {
+			bool complete;
+			off += ubx_feed(&dec, stream + off, stream_len - off, &complete);
+			if (complete && dec.msg_class == UBX_CLASS_NAV)
+				ubx_nav_pvt_to_fix(dec.payload, dec.len, &fix);
+		}
+	}
+	double dt = host_seconds() - t0;
+	printf("ubx_feed: %.1f MB/s, %.0f NAV-PVT/s (%.0f ns each)\n",
+			rounds * stream_len / dt / 1e6, rounds * EPOCHS / dt, dt / (rounds * EPOCHS) * 1e9);
+}
+
+int main(int argc, char** argv)
+{
+	build_stream();
+	test_clean();
+	test_damaged();
+	test_no_fix();
+	if (host_bench(argc, argv))
+		bench();
+	return host_done("test_ubx");
+}
@@ -0,0 +1,99 @@
+/*
+ * power.h
+ *
+ *  Power governor. Picks an operating profile from the battery voltage,
+ *  projected forward along its recent trend, and applies it: sweep
+ *  interval and headings for the application to use, Wi-Fi modem sleep,
+ *  and the sleep mode between sweeps. The Lepton has no ESP32 driver in
+ *  this tree yet, so camera power is not part of a profile.
+ */
+
+#ifndef POWER_H_
+#define POWER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_wifi_types.h"
+
+#define POWER_TREND_LEN     (60)
+
+typedef enum {
+	POWER_SLEEP_NONE = 0,       // stay awake, task delay only
+	POWER_SLEEP_LIGHT,          // light sleep, RAM and tasks kept
+	POWER_SLEEP_DEEP,           // deep sleep through sleep_cycle, restarts from app_main
+} power_sleep_t;
+
+typedef struct {
+	const char* name;
+	uint32_t enter_mv;          // applies at or above this voltage, table is highest first
+	uint32_t sweep_interval_s;
+	uint8_t headings;           // stops per sweep
+	wifi_ps_type_t wifi_ps;
+	power_sleep_t sleep;
+	uint16_t current_ma;        // average draw, for the runtime estimate
+} power_profile_t;
+
+// called when the profile changes, and once from power_init()
+typedef void (*power_cb_t)(const power_profile_t* profile, void* arg);
+
+typedef struct {
+	const power_profile_t* profiles;
+	size_t profile_count;
+	uint32_t hysteresis_mv;     // extra margin needed to step back up
+	float lookahead_h;          // how far ahead the trend is projected
+	uint32_t trend_period_s;    // spacing of the samples the trend is fitted to
+	uint32_t empty_mv;          // state of charge is linear between these
+	uint32_t full_mv;
+	uint32_t capacity_mah;
+	uint32_t wake_mv;           // measured during deep sleep, stands in until the first reading
+	int wake_pin;               // a change on this input ends light sleep early, -1 for none
+	power_cb_t on_change;
+	void* arg;
+} power_config_t;
+
+// profiles for the 12 V tower battery
+extern const power_profile_t power_default_profiles[];
+extern const size_t power_default_profile_count;
+
+#define POWER_CONFIG_DEFAULT() {                            \
+	.profiles = power_default_profiles,                     \
+	.profile_count = power_default_profile_count,           \
+	.hysteresis_mv = 200,                                   \
+	.lookahead_h = 1.0f,                                    \
+	.trend_period_s = 60,                                   \
+	.empty_mv = 11000,                                      \
+	.full_mv = 12800,                                       \
+	.capacity_mah = 20000,                                  \
+	.wake_mv = 0,                                           \
+	.wake_pin = -1,                                         \
+	.on_change = NULL,                                      \
+	.arg = NULL,                                            \
+}
+
+typedef struct {
+	const power_profile_t* profile;
+	uint32_t battery_mv;
+	float trend_mv_h;           // least squares slope of the trend samples
+	uint8_t soc_pct;
+	float runtime_h;            // at the current profile's draw
+	uint32_t changes;
+} power_status_t;
+
+// needs sleep_cycle_begin() and battery_init() first
+esp_err_t power_init(const power_config_t* cfg);
+
+// re-evaluates the profile from the latest battery reading, or wake_mv before one
+const power_profile_t* power_update(void);
+
+// waits out the sweep interval in the current profile's sleep mode, call
+// power_update() first to move with the battery; deep sleep does not return,
+// light sleep also ends on a change of wake_pin, and without sleep a task
+// notification to the caller ends the wait early
+void power_idle(void);
+
+const power_profile_t* power_profile(void);
+void power_status(power_status_t* out);
+
+#endif /* POWER_H_ */
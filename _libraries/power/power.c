@@ -0,0 +1,220 @@
+/*
+ * power.c
+ *
+ *  Battery driven power governor, see power.h.
+ */
+
+#include "power.h"
+#include "battery.h"
+#include "sleep_cycle.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "esp_sleep.h"
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char* tag = "power";
+
+const power_profile_t power_default_profiles[] = {
+	{"full",     12400,   6, 8, WIFI_PS_NONE,      POWER_SLEEP_NONE,  450},
+	{"eco",      12000,  30, 8, WIFI_PS_MIN_MODEM, POWER_SLEEP_NONE,  250},
+	{"saver",    11600, 120, 4, WIFI_PS_MAX_MODEM, POWER_SLEEP_LIGHT, 120},
+	{"survival",     0, 600, 2, WIFI_PS_MAX_MODEM, POWER_SLEEP_DEEP,   40},
+};
+const size_t power_default_profile_count = sizeof(power_default_profiles) / sizeof(power_default_profiles[0]);
+
+static power_config_t config;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static power_status_t status;
+
+// profile and trend carry over deep sleep, times are sleep_cycle_time_us()
+static RTC_DATA_ATTR size_t current;
+static RTC_DATA_ATTR struct {
+	int64_t time_us;
+	uint32_t mv;
+} trend[POWER_TREND_LEN];
+static RTC_DATA_ATTR size_t trend_head;
+static RTC_DATA_ATTR size_t trend_count;
+
+// least squares slope over the trend ring, mV per hour
+static float trend_slope(void)
+{
+	if (trend_count < 2)
+		return 0;
+	int64_t t0 = trend[(trend_head + POWER_TREND_LEN - trend_count) % POWER_TREND_LEN].time_us;
+	float st = 0, sv = 0, stt = 0, stv = 0;
+	for (size_t i = 0; i < trend_count; i++) {
+		size_t k = (trend_head + POWER_TREND_LEN - trend_count + i) % POWER_TREND_LEN;
+		float t = (trend[k].time_us - t0) / 3600e6f;
+		st += t;
+		sv += trend[k].mv;
+		stt += t * t;
+		stv += t * trend[k].mv;
+	}
+	float n = trend_count;
+	float den = n * stt - st * st;
+	return den > 0 ? (n * stv - st * sv) / den : 0;
+}
+
+static void apply(const power_profile_t* p)
+{
+	esp_err_t err = esp_wifi_set_ps(p->wifi_ps);
+	if (err != ESP_OK)
+		ESP_LOGD(tag, "modem sleep not set (%s)", esp_err_to_name(err));
+	if (config.on_change)
+		config.on_change(p, config.arg);
+}
+
+// lowest profile the projected voltage supports, stepping up needs the margin
+static size_t select(uint32_t mv, float slope)
+{
+	float projected = mv;
+	// only a falling trend is projected, charging is taken as it comes
+	if (slope < 0)
+		projected += slope * config.lookahead_h;
+
+	size_t best = config.profile_count - 1;
+	for (size_t i = 0; i < config.profile_count; i++) {
+		uint32_t need = config.profiles[i].enter_mv;
+		if (i < current)
+			need += config.hysteresis_mv;
+		if (projected >= need) {
+			best = i;
+			break;
+		}
+	}
+	return best;
+}
+
+// the ADC needs a decimation block after a wake, until then the voltage
+// measured while asleep keeps the profile moving
+static bool battery_mv(uint32_t* mv)
+{
+	battery_reading_t reading;
+	if (battery_latest(&reading)) {
+		*mv = reading.battery_mv;
+		return true;
+	}
+	*mv = config.wake_mv;
+	return config.wake_mv != 0;
+}
+
+const power_profile_t* power_update(void)
+{
+	uint32_t mv;
+	if (!battery_mv(&mv))
+		return power_profile();
+
+	int64_t now = sleep_cycle_time_us();
+	size_t last = (trend_head + POWER_TREND_LEN - 1) % POWER_TREND_LEN;
+	if (trend_count == 0 || now - trend[last].time_us >= config.trend_period_s * 1000000LL) {
+		trend[trend_head].time_us = now;
+		trend[trend_head].mv = mv;
+		trend_head = (trend_head + 1) % POWER_TREND_LEN;
+		if (trend_count < POWER_TREND_LEN)
+			trend_count++;
+	}
+
+	float slope = trend_slope();
+	size_t next = select(mv, slope);
+	const power_profile_t* p = &config.profiles[next];
+
+	uint32_t span = config.full_mv - config.empty_mv;
+	uint32_t above = mv > config.empty_mv ? mv - config.empty_mv : 0;
+	uint8_t soc = above >= span ? 100 : above * 100 / span;
+
+	portENTER_CRITICAL(&lock);
+	bool changed = next != current;
+	current = next;
+	status.profile = p;
+	status.battery_mv = mv;
+	status.trend_mv_h = slope;
+	status.soc_pct = soc;
+	status.runtime_h = p->current_ma ? (float)config.capacity_mah * soc / 100 / p->current_ma : 0;
+	if (changed)
+		status.changes++;
+	portEXIT_CRITICAL(&lock);
+
+	if (changed) {
+		ESP_LOGI(tag, "profile %s at %u mV, %.0f mV/h, about %.1f h left",
+				p->name, mv, slope, status.runtime_h);
+		apply(p);
+	}
+	return p;
+}
+
+// light sleep ends on the timer, or when the wake pin leaves its current level;
+// GPIO wake is level triggered, so the pin's edge interrupt is set back after
+static void light_sleep(uint64_t us)
+{
+	esp_sleep_enable_timer_wakeup(us);
+	if (config.wake_pin < 0) {
+		esp_light_sleep_start();
+		return;
+	}
+
+	gpio_num_t pin = config.wake_pin;
+	gpio_intr_disable(pin);
+	gpio_wakeup_enable(pin, gpio_get_level(pin) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+	esp_sleep_enable_gpio_wakeup();
+	esp_light_sleep_start();
+	gpio_wakeup_disable(pin);
+	gpio_set_intr_type(pin, GPIO_INTR_ANYEDGE);
+	gpio_intr_enable(pin);
+}
+
+void power_idle(void)
+{
+	const power_profile_t* p = power_profile();
+	uint64_t us = p->sweep_interval_s * 1000000ULL;
+
+	switch (p->sleep) {
+	case POWER_SLEEP_LIGHT:
+		light_sleep(us);
+		break;
+	case POWER_SLEEP_DEEP:
+		sleep_cycle_sleep(us);
+		break;
+	default:
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(p->sweep_interval_s * 1000));
+		break;
+	}
+}
+
+esp_err_t power_init(const power_config_t* cfg)
+{
+	if (cfg == NULL || cfg->profiles == NULL || cfg->profile_count == 0 || cfg->full_mv <= cfg->empty_mv)
+		return ESP_ERR_INVALID_ARG;
+	if (cfg->wake_pin >= 0 && !GPIO_IS_VALID_GPIO(cfg->wake_pin))
+		return ESP_ERR_INVALID_ARG;
+	config = *cfg;
+
+	// cold start in the top profile, the first reading moves it down if needed;
+	// after deep sleep carry on in the profile that put us to sleep
+	if (!sleep_cycle_warm() || current >= config.profile_count) {
+		current = 0;
+		trend_head = 0;
+		trend_count = 0;
+	}
+	status.profile = &config.profiles[current];
+	apply(status.profile);
+	power_update();
+	return ESP_OK;
+}
+
+const power_profile_t* power_profile(void)
+{
+	portENTER_CRITICAL(&lock);
+	const power_profile_t* p = &config.profiles[current];
+	portEXIT_CRITICAL(&lock);
+	return p;
+}
+
+void power_status(power_status_t* out)
+{
+	portENTER_CRITICAL(&lock);
+	*out = status;
+	portEXIT_CRITICAL(&lock);
+}
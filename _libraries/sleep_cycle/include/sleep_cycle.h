@@ -0,0 +1,55 @@
+/*
+ * sleep_cycle.h
+ *
+ *  Deep sleep between sweeps. Works out why the chip woke, keeps counters
+ *  and a monotonic clock in RTC memory across sleeps, and measures the
+ *  wake to result latency of every cycle. Modules keep their own state in
+ *  RTC_DATA_ATTR variables and trust it when sleep_cycle_warm() is true.
+ */
+
+#ifndef SLEEP_CYCLE_H_
+#define SLEEP_CYCLE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+	SLEEP_CYCLE_COLD = 0,       // power on or reset, RTC state is not valid
+	SLEEP_CYCLE_TIMER,          // the sweep interval ran out
+	SLEEP_CYCLE_ULP,            // the ULP coprocessor woke us for an event
+	SLEEP_CYCLE_OTHER,          // some other deep sleep wake source
+} sleep_cycle_wake_t;
+
+typedef struct {
+	uint32_t boots;             // cold starts
+	uint32_t wakes;             // deep sleep wakes, any source
+	uint32_t ulp_wakes;
+	uint32_t results;           // cycles that reached sleep_cycle_result()
+	uint32_t last_latency_us;   // wake to result, this cycle
+	uint32_t min_latency_us;
+	uint32_t max_latency_us;
+	uint32_t avg_latency_us;    // running average, 1/8 per cycle
+	uint64_t slept_us;          // total deep sleep, on the RTC slow clock
+} sleep_cycle_stats_t;
+
+// call first thing in app_main
+sleep_cycle_wake_t sleep_cycle_begin(void);
+
+// woke from deep sleep, RTC_DATA_ATTR state from the last cycle is valid
+bool sleep_cycle_warm(void);
+
+// microseconds since the first cold boot, carried across deep sleeps
+int64_t sleep_cycle_time_us(void);
+
+// marks the cycle's first result, logs and records the latency since wake
+void sleep_cycle_result(void);
+
+// ULP wake is enabled on the next sleep once the ULP program is running
+void sleep_cycle_enable_ulp(bool enable);
+
+// deep sleep for at most us, does not return
+void sleep_cycle_sleep(uint64_t us);
+
+void sleep_cycle_stats(sleep_cycle_stats_t* out);
+
+#endif /* SLEEP_CYCLE_H_ */
@@ -0,0 +1,122 @@
+/*
+ * sleep_cycle.c
+ *
+ *  Deep sleep cycle bookkeeping, see sleep_cycle.h.
+ */
+
+#include <string.h>
+#include "sleep_cycle.h"
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp32/clk.h"
+
+#define RTC_MAGIC   (0x5EEC7C1E)
+
+static const char* tag = "sleep_cycle";
+
+// RTC slow memory, survives deep sleep but not a reset
+static RTC_DATA_ATTR uint32_t magic;
+static RTC_DATA_ATTR sleep_cycle_stats_t stats;
+static RTC_DATA_ATTR int64_t time_offset_us;
+static RTC_DATA_ATTR uint64_t sleep_rtc_us;   // esp_clk_rtc_time() going to sleep
+static RTC_DATA_ATTR bool ulp_enabled;
+
+static bool warm = false;
+static bool result_seen = false;
+
+sleep_cycle_wake_t sleep_cycle_begin(void)
+{
+	warm = esp_reset_reason() == ESP_RST_DEEPSLEEP && magic == RTC_MAGIC;
+	if (!warm) {
+		magic = RTC_MAGIC;
+		memset(&stats, 0, sizeof(stats));
+		time_offset_us = 0;
+		ulp_enabled = false;
+		stats.boots = 1;
+		return SLEEP_CYCLE_COLD;
+	}
+
+	// a ULP or other early wake cuts the sleep short; the RTC slow clock ran
+	// through it, esp_timer starts over with the app. The gap takes in the
+	// ROM boot as well, time the new esp_timer has not counted.
+	int64_t now = esp_timer_get_time();
+	uint64_t rtc = esp_clk_rtc_time();
+	if (rtc >= sleep_rtc_us) {
+		uint64_t gap = rtc - sleep_rtc_us;
+		time_offset_us += (int64_t)gap - now;
+		stats.slept_us += gap > (uint64_t)now ? gap - now : 0;
+	}
+
+	stats.wakes++;
+	switch (esp_sleep_get_wakeup_cause()) {
+	case ESP_SLEEP_WAKEUP_TIMER:
+		return SLEEP_CYCLE_TIMER;
+	case ESP_SLEEP_WAKEUP_ULP:
+		stats.ulp_wakes++;
+		return SLEEP_CYCLE_ULP;
+	default:
+		return SLEEP_CYCLE_OTHER;
+	}
+}
+
+bool sleep_cycle_warm(void)
+{
+	return warm;
+}
+
+int64_t sleep_cycle_time_us(void)
+{
+	return time_offset_us + esp_timer_get_time();
+}
+
+void sleep_cycle_result(void)
+{
+	if (result_seen)
+		return;
+	result_seen = true;
+
+	// esp_timer starts with the app, so this leaves out the ROM boot
+	uint32_t latency = esp_timer_get_time();
+	stats.results++;
+	stats.last_latency_us = latency;
+	if (stats.results == 1) {
+		stats.min_latency_us = latency;
+		stats.max_latency_us = latency;
+		stats.avg_latency_us = latency;
+	} else {
+		if (latency < stats.min_latency_us)
+			stats.min_latency_us = latency;
+		if (latency > stats.max_latency_us)
+			stats.max_latency_us = latency;
+		stats.avg_latency_us += ((int32_t)latency - (int32_t)stats.avg_latency_us) / 8;
+	}
+	ESP_LOGI(tag, "%s to result in %u ms (min %u, avg %u, max %u)",
+			warm ? "wake" : "boot", latency / 1000, stats.min_latency_us / 1000,
+			stats.avg_latency_us / 1000, stats.max_latency_us / 1000);
+}
+
+void sleep_cycle_enable_ulp(bool enable)
+{
+	ulp_enabled = enable;
+}
+
+void sleep_cycle_sleep(uint64_t us)
+{
+	// the time asleep is measured on the wake, it may be shorter than us
+	time_offset_us += esp_timer_get_time();
+	sleep_rtc_us = esp_clk_rtc_time();
+
+	esp_sleep_enable_timer_wakeup(us);
+	if (ulp_enabled)
+		esp_sleep_enable_ulp_wakeup();
+	ESP_LOGI(tag, "deep sleep for %llu ms after %lld ms awake", us / 1000, esp_timer_get_time() / 1000);
+	esp_deep_sleep_start();
+}
+
+void sleep_cycle_stats(sleep_cycle_stats_t* out)
+{
+	*out = stats;
+}
@@ -0,0 +1,51 @@
+/*
+ * sweep.h
+ *
+ *  Sweep planner for the camera turret. Given the bearings to image and the
+ *  cable-wrap limits, picks the motor positions and visiting order with the
+ *  least travel from where the turret is now. Because a plan always ends at
+ *  one end of its range and the next one starts from the nearer end, the
+ *  sweep naturally alternates direction instead of returning home.
+ */
+
+#ifndef SWEEP_H_
+#define SWEEP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "heading.h"
+
+#define SWEEP_MAX_STOPS (32)
+
+typedef struct {
+	uint8_t count;
+	heading_bam_t bearing[SWEEP_MAX_STOPS];
+} sweep_set_t;
+
+typedef struct {
+	// motor positions the cable allows, in steps from power-up
+	int32_t wrap_min;
+	int32_t wrap_max;
+} sweep_limits_t;
+
+typedef struct {
+	uint8_t count;
+	heading_bam_t bearing[SWEEP_MAX_STOPS];
+	int32_t position[SWEEP_MAX_STOPS];  // motor position for each stop, in visiting order
+	uint8_t unreachable;                // bearings outside the cable-wrap limits
+	uint32_t travel;                    // steps from the current position to the last stop
+} sweep_plan_t;
+
+void sweep_set_clear(sweep_set_t* set);
+// adds one bearing, duplicates are ignored; false when the set is full
+bool sweep_set_add(sweep_set_t* set, heading_bam_t bearing);
+// adds bearings every spacing from start through start + width, for hot zones
+bool sweep_set_add_sector(sweep_set_t* set, heading_bam_t start, heading_bam_t width, heading_bam_t spacing);
+
+void sweep_plan(const sweep_limits_t* limits, const heading_est_t* est,
+		const sweep_set_t* set, sweep_plan_t* plan);
+
+// plan travel in degrees, for comparing plans
+float sweep_travel_deg(const sweep_plan_t* plan, const heading_est_t* est);
+
+#endif /* SWEEP_H_ */
@@ -0,0 +1,151 @@
+/*
+ * sweep.c
+ *
+ *  Minimum-travel sweep ordering, see sweep.h.
+ *
+ *  The turret moves along a line of motor positions, so visiting a set of
+ *  points costs the span of the points plus the approach to whichever end
+ *  is nearer. Each bearing can be reached at every position that faces it
+ *  within the wrap limits; a sliding window over the sorted candidates
+ *  finds the cheapest span that contains every bearing once.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sweep.h"
+
+#define MAX_CANDIDATES (SWEEP_MAX_STOPS * 4)
+
+typedef struct {
+	int32_t position;
+	uint8_t index;
+} candidate_t;
+
+void sweep_set_clear(sweep_set_t* set)
+{
+	set->count = 0;
+}
+
+bool sweep_set_add(sweep_set_t* set, heading_bam_t bearing)
+{
+	for (uint8_t i = 0; i < set->count; i++)
+		if (set->bearing[i] == bearing)
+			return true;
+	if (set->count >= SWEEP_MAX_STOPS)
+		return false;
+	set->bearing[set->count++] = bearing;
+	return true;
+}
+
+bool sweep_set_add_sector(sweep_set_t* set, heading_bam_t start, heading_bam_t width, heading_bam_t spacing)
+{
+	if (spacing == 0)
+		return sweep_set_add(set, start);
+	for (uint32_t offset = 0; offset <= width; offset += spacing)
+		if (!sweep_set_add(set, (heading_bam_t)(start + offset)))
+			return false;
+	return true;
+}
+
+static int compare_candidates(const void* a, const void* b)
+{
+	int32_t pa = ((const candidate_t*)a)->position;
+	int32_t pb = ((const candidate_t*)b)->position;
+	return (pa > pb) - (pa < pb);
+}
+
+static uint32_t span_cost(int32_t from, int32_t lo, int32_t hi)
+{
+	uint32_t to_lo = abs(from - lo);
+	uint32_t to_hi = abs(from - hi);
+	return (uint32_t)(hi - lo) + (to_lo < to_hi ? to_lo : to_hi);
+}
+
+void sweep_plan(const sweep_limits_t* limits, const heading_est_t* est,
+		const sweep_set_t* set, sweep_plan_t* plan)
+{
+	candidate_t cand[MAX_CANDIDATES];
+	uint8_t covered[SWEEP_MAX_STOPS];
+	uint8_t wanted = 0;
+	size_t n = 0;
+	int32_t rev = est->cfg.rev_steps;
+	int32_t from = est->step_count;
+
+	memset(plan, 0, sizeof(*plan));
+	if (set->count == 0)
+		return;
+	// an equal share each, so a wide wrap range cannot starve later bearings
+	size_t share = MAX_CANDIDATES / set->count;
+
+	// every motor position within the limits that faces each bearing
+	for (uint8_t i = 0; i < set->count; i++) {
+		int32_t p = from + heading_steps_to(est, set->bearing[i]);
+		while (p - rev >= limits->wrap_min)
+			p -= rev;
+		while (p < limits->wrap_min)
+			p += rev;
+		if (p > limits->wrap_max) {
+			plan->unreachable++;
+			continue;
+		}
+		// the turns nearest the turret now, the far ones never win
+		int32_t turns = (limits->wrap_max - p) / rev + 1;
+		if ((size_t)turns > share) {
+			int32_t skip = (from - p) / rev - (int32_t)share / 2;
+			if (skip > turns - (int32_t)share)
+				skip = turns - (int32_t)share;
+			if (skip > 0)
+				p += skip * rev;
+		}
+		for (size_t k = 0; k < share && p <= limits->wrap_max; k++, p += rev) {
+			cand[n].position = p;
+			cand[n].index = i;
+			n++;
+		}
+		wanted++;
+	}
+	if (wanted == 0)
+		return;
+
+	qsort(cand, n, sizeof(cand[0]), compare_candidates);
+
+	// smallest-cost window [lo, hi] holding at least one candidate per bearing
+	memset(covered, 0, sizeof(covered));
+	size_t best_lo = 0, best_hi = n - 1;
+	uint32_t best_cost = UINT32_MAX;
+	uint8_t have = 0;
+	for (size_t lo = 0, hi = 0; hi < n; hi++) {
+		if (covered[cand[hi].index]++ == 0)
+			have++;
+		while (have == wanted) {
+			uint32_t cost = span_cost(from, cand[lo].position, cand[hi].position);
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_lo = lo;
+				best_hi = hi;
+			}
+			if (--covered[cand[lo].index] == 0)
+				have--;
+			lo++;
+		}
+	}
+
+	// start from the nearer end, take each bearing the first time it is passed
+	bool forward = abs(from - cand[best_lo].position) <= abs(from - cand[best_hi].position);
+	memset(covered, 0, sizeof(covered));
+	for (size_t k = 0; k <= best_hi - best_lo; k++) {
+		const candidate_t* c = &cand[forward ? best_lo + k : best_hi - k];
+		if (covered[c->index])
+			continue;
+		covered[c->index] = 1;
+		plan->bearing[plan->count] = set->bearing[c->index];
+		plan->position[plan->count] = c->position;
+		plan->count++;
+	}
+	plan->travel = best_cost;
+}
+
+float sweep_travel_deg(const sweep_plan_t* plan, const heading_est_t* est)
+{
+	return plan->travel * 360.0f / est->cfg.rev_steps;
+}
@@ -0,0 +1,74 @@
+/*
+ * system_state.h
+ *
+ *  Table driven system state engine shared by the controller and the
+ *  external UI. Inputs arrive as events from any task or ISR, a single
+ *  engine task applies each one to the condition flags and then takes the
+ *  first transition row whose state, event and guard match. Subscribers
+ *  hear about every state change and every flag change, so nothing has
+ *  to poll the inputs.
+ *
+ *  States follow the external UI: reset, acquiring position, searching,
+ *  fire alert, communication error and internal error. The internal error
+ *  latches until a reset event.
+ */
+
+#ifndef SYSTEM_STATE_H_
+#define SYSTEM_STATE_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#define SYSTEM_STATE_MAX_SUBSCRIBERS    (4)
+
+typedef enum {
+	SYSTEM_RESET,
+	SYSTEM_ACQUIRE,             // waiting for a position
+	SYSTEM_SEARCH,
+	SYSTEM_FIRE_ALERT,
+	SYSTEM_COMM_ERROR,
+	SYSTEM_INTERNAL_ERROR,
+	SYSTEM_STATE_COUNT,
+} system_state_t;
+
+typedef enum {
+	SYSTEM_EV_RESET,
+	SYSTEM_EV_START,            // reset released
+	SYSTEM_EV_POSITION,         // position known
+	SYSTEM_EV_FIRE,
+	SYSTEM_EV_FIRE_CLEAR,
+	SYSTEM_EV_COMM_LOST,
+	SYSTEM_EV_COMM_OK,
+	SYSTEM_EV_FAULT,
+	SYSTEM_EV_BATTERY_LOW,
+	SYSTEM_EV_BATTERY_OK,
+	SYSTEM_EVENT_COUNT,
+} system_event_t;
+
+// condition flags, the inputs as last reported
+#define SYSTEM_FLAG_LOW_VOLTAGE (1 << 0)
+#define SYSTEM_FLAG_FIRE        (1 << 1)
+#define SYSTEM_FLAG_FAULT       (1 << 2)    // latched until reset
+#define SYSTEM_FLAG_COMM_LOST   (1 << 3)
+
+// called from the engine task, from == to when only the flags changed; the
+// task has a 3 KB stack, enough for a printf but not for large buffers
+typedef void (*system_state_cb_t)(system_state_t from, system_state_t to, uint32_t flags, void* arg);
+
+// starts the engine in the given state, e.g. one kept over deep sleep
+esp_err_t system_state_init(system_state_t state, uint32_t flags);
+
+esp_err_t system_state_subscribe(system_state_cb_t cb, void* arg);
+
+esp_err_t system_state_post(system_event_t ev);
+
+void system_state_post_from_isr(system_event_t ev, BaseType_t* woken);
+
+system_state_t system_state_get(void);
+
+uint32_t system_state_flags(void);
+
+const char* system_state_name(system_state_t state);
+
+#endif /* SYSTEM_STATE_H_ */
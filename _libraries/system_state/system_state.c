@@ -0,0 +1,204 @@
+/*
+ * system_state.c
+ *
+ *  Table driven system state engine, see system_state.h.
+ */
+
+#include <string.h>
+#include "system_state.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#define QUEUE_LEN   (16)
+#define ANY         (SYSTEM_STATE_COUNT)
+
+static const char* tag = "system_state";
+
+static const char* names[SYSTEM_STATE_COUNT] = {
+	"reset", "acquire", "search", "fire alert", "comm error", "internal error",
+};
+
+// what each event does to the flags, applied before the transition
+static const struct {
+	uint8_t set;
+	uint8_t clear;
+} effects[SYSTEM_EVENT_COUNT] = {
+	[SYSTEM_EV_RESET]       = {0, SYSTEM_FLAG_FAULT},
+	[SYSTEM_EV_FIRE]        = {SYSTEM_FLAG_FIRE, 0},
+	[SYSTEM_EV_FIRE_CLEAR]  = {0, SYSTEM_FLAG_FIRE},
+	[SYSTEM_EV_COMM_LOST]   = {SYSTEM_FLAG_COMM_LOST, 0},
+	[SYSTEM_EV_COMM_OK]     = {0, SYSTEM_FLAG_COMM_LOST},
+	[SYSTEM_EV_FAULT]       = {SYSTEM_FLAG_FAULT, 0},
+	[SYSTEM_EV_BATTERY_LOW] = {SYSTEM_FLAG_LOW_VOLTAGE, 0},
+	[SYSTEM_EV_BATTERY_OK]  = {0, SYSTEM_FLAG_LOW_VOLTAGE},
+};
+
+// a guard passes when all of its flags are set
+#define ALWAYS      (0)
+#define IF_FIRE     (SYSTEM_FLAG_FIRE)
+#define IF_COMM     (SYSTEM_FLAG_COMM_LOST)
+
+typedef struct {
+	uint8_t from;
+	uint8_t event;
+	uint8_t guard;
+	uint8_t to;
+} transition_t;
+
+// first match wins, a communication error outranks a fire alert like the
+// UI's buttons did
+static const transition_t rows[] = {
+	// from                 event                   guard       to
+	{ANY,                   SYSTEM_EV_RESET,        ALWAYS,     SYSTEM_RESET},
+	{ANY,                   SYSTEM_EV_FAULT,        ALWAYS,     SYSTEM_INTERNAL_ERROR},
+	{SYSTEM_RESET,          SYSTEM_EV_START,        ALWAYS,     SYSTEM_ACQUIRE},
+	{SYSTEM_ACQUIRE,        SYSTEM_EV_POSITION,     IF_COMM,    SYSTEM_COMM_ERROR},
+	{SYSTEM_ACQUIRE,        SYSTEM_EV_POSITION,     IF_FIRE,    SYSTEM_FIRE_ALERT},
+	{SYSTEM_ACQUIRE,        SYSTEM_EV_POSITION,     ALWAYS,     SYSTEM_SEARCH},
+	{SYSTEM_SEARCH,         SYSTEM_EV_COMM_LOST,    ALWAYS,     SYSTEM_COMM_ERROR},
+	{SYSTEM_SEARCH,         SYSTEM_EV_FIRE,         ALWAYS,     SYSTEM_FIRE_ALERT},
+	{SYSTEM_FIRE_ALERT,     SYSTEM_EV_COMM_LOST,    ALWAYS,     SYSTEM_COMM_ERROR},
+	{SYSTEM_FIRE_ALERT,     SYSTEM_EV_FIRE_CLEAR,   ALWAYS,     SYSTEM_SEARCH},
+	{SYSTEM_COMM_ERROR,     SYSTEM_EV_COMM_OK,      IF_FIRE,    SYSTEM_FIRE_ALERT},
+	{SYSTEM_COMM_ERROR,     SYSTEM_EV_COMM_OK,      ALWAYS,     SYSTEM_SEARCH},
+};
+#define ROW_COUNT   (sizeof(rows) / sizeof(rows[0]))
+
+// rows compiled per state and event, candidates for cell i are
+// order[start[i]] up to order[start[i + 1]]
+static uint8_t start[SYSTEM_STATE_COUNT * SYSTEM_EVENT_COUNT + 1];
+static uint8_t order[ROW_COUNT * SYSTEM_STATE_COUNT];
+
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static system_state_t current;
+static uint32_t flags;
+static QueueHandle_t queue;
+
+static struct {
+	system_state_cb_t cb;
+	void* arg;
+} subscribers[SYSTEM_STATE_MAX_SUBSCRIBERS];
+static size_t subscriber_count = 0;
+
+static void compile(void)
+{
+	size_t n = 0;
+	for (int s = 0; s < SYSTEM_STATE_COUNT; s++) {
+		for (int e = 0; e < SYSTEM_EVENT_COUNT; e++) {
+			start[s * SYSTEM_EVENT_COUNT + e] = n;
+			for (size_t r = 0; r < ROW_COUNT; r++)
+				if ((rows[r].from == s || rows[r].from == ANY) && rows[r].event == e)
+					order[n++] = r;
+		}
+	}
+	start[SYSTEM_STATE_COUNT * SYSTEM_EVENT_COUNT] = n;
+}
+
+static system_state_t step(system_state_t s, system_event_t e, uint32_t f)
+{
+	size_t cell = s * SYSTEM_EVENT_COUNT + e;
+	for (size_t i = start[cell]; i < start[cell + 1]; i++) {
+		const transition_t* t = &rows[order[i]];
+		if ((f & t->guard) == t->guard)
+			return t->to;
+	}
+	return s;
+}
+
+static void engine_task(void* arg)
+{
+	uint8_t ev;
+	while (1) {
+		xQueueReceive(queue, &ev, portMAX_DELAY);
+
+		portENTER_CRITICAL(&lock);
+		system_state_t from = current;
+		uint32_t old_flags = flags;
+		flags = (flags | effects[ev].set) & ~effects[ev].clear;
+		current = step(current, ev, flags);
+		system_state_t to = current;
+		uint32_t f = flags;
+		size_t count = subscriber_count;
+		portEXIT_CRITICAL(&lock);
+
+		if (from == to && f == old_flags)
+			continue;
+		if (from != to)
+			ESP_LOGI(tag, "%s -> %s", names[from], names[to]);
+		for (size_t i = 0; i < count; i++)
+			subscribers[i].cb(from, to, f, subscribers[i].arg);
+	}
+}
+
+esp_err_t system_state_init(system_state_t state, uint32_t initial_flags)
+{
+	if (queue != NULL)
+		return ESP_ERR_INVALID_STATE;
+	if (state >= SYSTEM_STATE_COUNT)
+		return ESP_ERR_INVALID_ARG;
+
+	compile();
+	current = state;
+	flags = initial_flags;
+	queue = xQueueCreate(QUEUE_LEN, sizeof(uint8_t));
+	if (queue == NULL)
+		return ESP_ERR_NO_MEM;
+	if (xTaskCreate(engine_task, "system_state", 3072, NULL, 6, NULL) != pdPASS)
+		return ESP_ERR_NO_MEM;
+	return ESP_OK;
+}
+
+esp_err_t system_state_subscribe(system_state_cb_t cb, void* arg)
+{
+	esp_err_t err = ESP_OK;
+	portENTER_CRITICAL(&lock);
+	if (subscriber_count == SYSTEM_STATE_MAX_SUBSCRIBERS) {
+		err = ESP_ERR_NO_MEM;
+	} else {
+		subscribers[subscriber_count].cb = cb;
+		subscribers[subscriber_count].arg = arg;
+		subscriber_count++;
+	}
+	portEXIT_CRITICAL(&lock);
+	return err;
+}
+
+esp_err_t system_state_post(system_event_t ev)
+{
+	if (queue == NULL)
+		return ESP_ERR_INVALID_STATE;
+	if (ev >= SYSTEM_EVENT_COUNT)
+		return ESP_ERR_INVALID_ARG;
+	uint8_t e = ev;
+	return xQueueSend(queue, &e, 0) == pdTRUE ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+void IRAM_ATTR system_state_post_from_isr(system_event_t ev, BaseType_t* woken)
+{
+	uint8_t e = ev;
+	if (queue != NULL)
+		xQueueSendFromISR(queue, &e, woken);
+}
+
+system_state_t system_state_get(void)
+{
+	portENTER_CRITICAL(&lock);
+	system_state_t s = current;
+	portEXIT_CRITICAL(&lock);
+	return s;
+}
+
+uint32_t system_state_flags(void)
+{
+	portENTER_CRITICAL(&lock);
+	uint32_t f = flags;
+	portEXIT_CRITICAL(&lock);
+	return f;
+}
+
+const char* system_state_name(system_state_t state)
+{
+	return state < SYSTEM_STATE_COUNT ? names[state] : "unknown";
+}
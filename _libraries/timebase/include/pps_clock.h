@@ -0,0 +1,58 @@
+/*
+ * pps_clock.h
+ *
+ *  Disciplines a free running microsecond counter against a 1 Hz PPS edge.
+ *  Hardware free so it can be driven from a simulated PPS source on the
+ *  host; timebase.c feeds it edges captured in the GPIO interrupt and
+ *  labels them from the GPS fix.
+ */
+
+#ifndef PPS_CLOCK_H_
+#define PPS_CLOCK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "nmea.h"
+
+#define PPS_CLOCK_MAX_PPM   (200)   // edges further off than this are glitches
+#define PPS_CLOCK_GAIN      (3)     // drift filter gain is 1 / 2^gain per edge
+#define PPS_CLOCK_CAPTURE_US    (10)    // spread of the edge capture, interrupt latency
+#define PPS_CLOCK_HOLDOVER_PPB  (2000)  // rate change the drift estimate can miss, mostly temperature
+
+typedef struct {
+	uint32_t edges;             // accepted PPS edges
+	uint32_t missed;            // seconds without an edge between accepted ones
+	uint32_t rejected;          // edges outside PPS_CLOCK_MAX_PPM
+	uint32_t steps;             // times the UTC label jumped, leap second or bad fix
+	int32_t drift_ppb;          // local counter rate error, positive runs fast
+	int32_t residual_us;        // last edge against the disciplined prediction
+	int32_t max_residual_us;
+} pps_clock_stats_t;
+
+typedef struct {
+	int64_t local_edge;         // counter value at the last accepted edge
+	int64_t utc_edge;           // UTC microseconds since 1970 at that edge
+	bool have_edge;
+	bool labelled;              // utc_edge is known
+	pps_clock_stats_t stats;
+} pps_clock_t;
+
+void pps_clock_init(pps_clock_t* clk);
+
+// PPS edge captured at local_us, false if rejected as a glitch
+bool pps_clock_edge(pps_clock_t* clk, int64_t local_us);
+
+// names the last edge: the UTC second it marked
+void pps_clock_label(pps_clock_t* clk, int64_t utc_s);
+
+// UTC microseconds for a counter value, 0 until labelled
+int64_t pps_clock_utc(const pps_clock_t* clk, int64_t local_us);
+
+// bound on the error of pps_clock_utc() at local_us, -1 until labelled;
+// grows with the time since the last edge while the PPS is gone
+int64_t pps_clock_error_us(const pps_clock_t* clk, int64_t local_us);
+
+// seconds since 1970 for an NMEA date and time, ignores millis
+int64_t pps_clock_epoch(const nmea_date_t* date, const nmea_time_t* time);
+
+#endif /* PPS_CLOCK_H_ */
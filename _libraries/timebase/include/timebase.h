@@ -0,0 +1,48 @@
+/*
+ * timebase.h
+ *
+ *  GPS disciplined UTC clock. The PPS edge is captured in a GPIO interrupt
+ *  against esp_timer and named from the GPS fix that follows it, so
+ *  now_utc_us() agrees between towers to well under a millisecond.
+ *
+ *  The GPS is only on for a few minutes every few hours, so most of the
+ *  time the clock is in holdover: esp_timer runs on at the measured drift,
+ *  and across deep sleep the last sync is carried on the RTC slow clock.
+ *  Both come with an error bound, and the time counts as synced while the
+ *  bound is under TIMEBASE_MAX_ERROR_US.
+ */
+
+#ifndef TIMEBASE_H_
+#define TIMEBASE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "pps_clock.h"
+
+// sightings are grouped over a minute at the root, a second is plenty
+#define TIMEBASE_MAX_ERROR_US   (1000000LL)
+// the RTC slow clock through deep sleep, calibrated RC oscillator over temperature
+#define TIMEBASE_RTC_PPM        (500)
+
+// call after gps_init(), the fix is read from the GPS driver
+esp_err_t timebase_init(int pps_pin);
+
+// UTC microseconds since 1970. Before the first labelled PPS edge of this
+// boot the last sync is carried over deep sleep, without one this falls back
+// on the system clock if an earlier boot set it, otherwise 0. Works before
+// timebase_init().
+int64_t now_utc_us(void);
+
+// converts an earlier esp_timer_get_time() value, e.g. compass_sample_t.time_us
+int64_t timebase_utc_us(int64_t local_us);
+
+// bound on the error of now_utc_us(), -1 when it has no sync to go on
+int64_t timebase_error_us(void);
+
+// the error bound is within TIMEBASE_MAX_ERROR_US
+bool timebase_synced(void);
+
+void timebase_stats(pps_clock_stats_t* out);
+
+#endif /* TIMEBASE_H_ */
@@ -0,0 +1,97 @@
+/*
+ * pps_clock.c
+ *
+ *  PPS discipline, see pps_clock.h.
+ */
+
+#include <string.h>
+#include "pps_clock.h"
+
+#define US_PER_S    (1000000LL)
+
+void pps_clock_init(pps_clock_t* clk)
+{
+	memset(clk, 0, sizeof(*clk));
+}
+
+bool pps_clock_edge(pps_clock_t* clk, int64_t local_us)
+{
+	if (!clk->have_edge) {
+		clk->local_edge = local_us;
+		clk->have_edge = true;
+		clk->stats.edges++;
+		return true;
+	}
+
+	int64_t dt = local_us - clk->local_edge;
+	int64_t seconds = (dt + US_PER_S / 2) / US_PER_S;
+	int64_t error = dt - seconds * US_PER_S;
+	if (seconds <= 0 || error > seconds * PPS_CLOCK_MAX_PPM || error < -seconds * PPS_CLOCK_MAX_PPM) {
+		clk->stats.rejected++;
+		return false;
+	}
+
+	// error in us over whole seconds is ppm, keep it in ppb
+	int32_t measured = error * 1000 / seconds;
+	int32_t residual = error - (int64_t)clk->stats.drift_ppb * seconds / 1000;
+	if (clk->stats.edges == 1)
+		clk->stats.drift_ppb = measured;
+	else
+		clk->stats.drift_ppb += (measured - clk->stats.drift_ppb) / (1 << PPS_CLOCK_GAIN);
+
+	clk->stats.residual_us = residual;
+	if (residual < 0)
+		residual = -residual;
+	if (residual > clk->stats.max_residual_us)
+		clk->stats.max_residual_us = residual;
+	clk->stats.edges++;
+	clk->stats.missed += seconds - 1;
+
+	clk->local_edge = local_us;
+	if (clk->labelled)
+		clk->utc_edge += seconds * US_PER_S;
+	return true;
+}
+
+void pps_clock_label(pps_clock_t* clk, int64_t utc_s)
+{
+	int64_t utc = utc_s * US_PER_S;
+	if (clk->labelled && clk->utc_edge != utc)
+		clk->stats.steps++;
+	clk->utc_edge = utc;
+	clk->labelled = true;
+}
+
+int64_t pps_clock_utc(const pps_clock_t* clk, int64_t local_us)
+{
+	if (!clk->labelled)
+		return 0;
+	int64_t elapsed = local_us - clk->local_edge;
+	return clk->utc_edge + elapsed - elapsed * clk->stats.drift_ppb / 1000000000LL;
+}
+
+int64_t pps_clock_error_us(const pps_clock_t* clk, int64_t local_us)
+{
+	if (!clk->labelled)
+		return -1;
+	int64_t elapsed = local_us - clk->local_edge;
+	if (elapsed < 0)
+		elapsed = -elapsed;
+	// the last edge is as good as its capture, then the rate error adds up
+	int32_t residual = clk->stats.residual_us < 0 ? -clk->stats.residual_us : clk->stats.residual_us;
+	return residual + PPS_CLOCK_CAPTURE_US + elapsed * PPS_CLOCK_HOLDOVER_PPB / 1000000000LL;
+}
+
+int64_t pps_clock_epoch(const nmea_date_t* date, const nmea_time_t* time)
+{
+	// days from civil, proleptic Gregorian with March as the first month
+	int32_t y = date->year - (date->month <= 2);
+	int32_t era = (y >= 0 ? y : y - 399) / 400;
+	uint32_t yoe = y - era * 400;
+	uint32_t mp = (date->month + 9) % 12;
+	uint32_t doy = (153 * mp + 2) / 5 + date->day - 1;
+	uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	int64_t days = (int64_t)era * 146097 + doe - 719468;
+
+	return days * 86400 + time->hour * 3600 + time->minute * 60 + time->second;
+}
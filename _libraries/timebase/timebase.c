@@ -0,0 +1,190 @@
+/*
+ * timebase.c
+ *
+ *  PPS capture and GPS labelling, see timebase.h.
+ */
+
+#include <sys/time.h>
+#include "timebase.h"
+#include "gps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp32/clk.h"
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define LABEL_DELAY_MS  (600)       // the fix for an epoch follows its PPS edge
+#define SET_CLOCK_S     (60)        // system clock refresh while synced
+#define VALID_CLOCK_S   (1577836800LL)  // 2020-01-01, anything earlier was never set
+#define HELD_MAGIC      (0x71BEBA5E)
+
+static const char* tag = "timebase";
+
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static pps_clock_t pps;
+static TaskHandle_t label_task_handle;
+static int64_t edge_us;
+
+// RTC slow memory: the last labelled edge against esp_clk_rtc_time(),
+// which keeps counting through deep sleep where esp_timer starts over
+static RTC_DATA_ATTR struct {
+	uint32_t magic;
+	int64_t utc_us;
+	uint64_t rtc_us;
+	int64_t error_us;
+} held;
+
+// only the capture happens here, pps_clock and its 64-bit divides are not in IRAM
+static void IRAM_ATTR pps_isr(void* arg)
+{
+	int64_t now = esp_timer_get_time();
+	portENTER_CRITICAL_ISR(&lock);
+	edge_us = now;
+	portEXIT_CRITICAL_ISR(&lock);
+
+	BaseType_t woken = pdFALSE;
+	vTaskNotifyGiveFromISR(label_task_handle, &woken);
+	if (woken)
+		portYIELD_FROM_ISR();
+}
+
+static bool held_valid(void)
+{
+	// a power on clears the RTC counter, so an older record is from before it
+	return held.magic == HELD_MAGIC && esp_clk_rtc_time() >= held.rtc_us;
+}
+
+static void hold(void)
+{
+	portENTER_CRITICAL(&lock);
+	int64_t local_edge = pps.local_edge;
+	int64_t utc_edge = pps.utc_edge;
+	int64_t error = pps_clock_error_us(&pps, local_edge);
+	portEXIT_CRITICAL(&lock);
+
+	uint64_t rtc = esp_clk_rtc_time();
+	held.rtc_us = rtc - (esp_timer_get_time() - local_edge);
+	held.utc_us = utc_edge;
+	held.error_us = error;
+	held.magic = HELD_MAGIC;
+}
+
+// takes each edge, then names it from the fix that reports it
+static void label_task(void* arg)
+{
+	nmea_fix_t fix;
+	int64_t last = 0;
+
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		portENTER_CRITICAL(&lock);
+		bool accepted = pps_clock_edge(&pps, edge_us);
+		portEXIT_CRITICAL(&lock);
+		if (!accepted)
+			continue;
+
+		vTaskDelay(pdMS_TO_TICKS(LABEL_DELAY_MS));
+		if (!gps_latest(&fix) || !fix.valid || fix.date.year == 0)
+			continue;
+
+		int64_t utc_s = pps_clock_epoch(&fix.date, &fix.time);
+		// a fix that did not move on is stale, the next edge will get it
+		if (utc_s == last)
+			continue;
+		last = utc_s;
+
+		portENTER_CRITICAL(&lock);
+		bool first = !pps.labelled;
+		pps_clock_label(&pps, utc_s);
+		portEXIT_CRITICAL(&lock);
+		hold();
+		if (first)
+			ESP_LOGI(tag, "synced to UTC %lld", utc_s);
+
+		// the system clock runs on through deep sleep, keep it close for
+		// the wakes that do not bring the GPS up
+		if (first || utc_s % SET_CLOCK_S == 0) {
+			int64_t utc = now_utc_us();
+			struct timeval tv = {
+				.tv_sec = utc / 1000000,
+				.tv_usec = utc % 1000000,
+			};
+			settimeofday(&tv, NULL);
+		}
+	}
+}
+
+esp_err_t timebase_init(int pps_pin)
+{
+	pps_clock_init(&pps);
+	if (xTaskCreate(label_task, "timebase", 3072, NULL, 7, &label_task_handle) != pdPASS)
+		return ESP_ERR_NO_MEM;
+
+	gpio_config_t io_conf = {
+		.pin_bit_mask = 1ULL << pps_pin,
+		.mode = GPIO_MODE_INPUT,
+		.intr_type = GPIO_INTR_POSEDGE,
+	};
+	esp_err_t err = gpio_config(&io_conf);
+	if (err != ESP_OK)
+		return err;
+	// the ISR service may already be installed by another driver
+	err = gpio_install_isr_service(0);
+	if (err != ESP_OK && err != ESP_ERR_INVALID_STATE)
+		return err;
+	return gpio_isr_handler_add(pps_pin, pps_isr, NULL);
+}
+
+int64_t timebase_utc_us(int64_t local_us)
+{
+	portENTER_CRITICAL(&lock);
+	int64_t utc = pps_clock_utc(&pps, local_us);
+	portEXIT_CRITICAL(&lock);
+	if (utc != 0)
+		return utc;
+
+	// not disciplined this boot, carry the last sync over deep sleep
+	if (held_valid())
+		return held.utc_us + (esp_clk_rtc_time() - held.rtc_us) - (esp_timer_get_time() - local_us);
+
+	// nothing held, fall back on the clock set by an earlier boot
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	if (tv.tv_sec < VALID_CLOCK_S)
+		return 0;
+	return tv.tv_sec * 1000000LL + tv.tv_usec - (esp_timer_get_time() - local_us);
+}
+
+int64_t now_utc_us(void)
+{
+	return timebase_utc_us(esp_timer_get_time());
+}
+
+int64_t timebase_error_us(void)
+{
+	portENTER_CRITICAL(&lock);
+	int64_t error = pps_clock_error_us(&pps, esp_timer_get_time());
+	portEXIT_CRITICAL(&lock);
+	if (error >= 0)
+		return error;
+
+	if (!held_valid())
+		return -1;
+	uint64_t since = esp_clk_rtc_time() - held.rtc_us;
+	return held.error_us + since * TIMEBASE_RTC_PPM / 1000000;
+}
+
+bool timebase_synced(void)
+{
+	int64_t error = timebase_error_us();
+	return error >= 0 && error <= TIMEBASE_MAX_ERROR_US;
+}
+
+void timebase_stats(pps_clock_stats_t* out)
+{
+	portENTER_CRITICAL(&lock);
+	*out = pps.stats;
+	portEXIT_CRITICAL(&lock);
+}
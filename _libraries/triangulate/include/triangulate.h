@@ -0,0 +1,144 @@
+/*
+ * triangulate.h
+ *
+ *  Fire location from bearings reported by several towers, run on the mesh
+ *  root. Each report is a line on a local east/north plane centred on the
+ *  first tower heard; lines are grouped into tracks, one per fire, and each
+ *  track is solved by iteratively reweighted least squares (Huber weights)
+ *  so a bad bearing only pulls the fix as far as its residual allows. A
+ *  track also has to be seen by most of the towers in range that could
+ *  tell it apart, so stray bearings that happen to cross are not a fire.
+ *
+ *  No hardware access, the root calls tri_add() for every report received
+ *  and tri_update() periodically. The report store is sized for
+ *  TRI_MAX_NODES towers each holding TRI_LINES_PER_NODE bearings at once,
+ *  about 36 bytes a report; all three and TRI_MAX_TRACKS can be set from
+ *  the build.
+ */
+
+#ifndef TRIANGULATE_H_
+#define TRIANGULATE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef TRI_MAX_NODES
+#define TRI_MAX_NODES       (300)
+#endif
+#ifndef TRI_LINES_PER_NODE
+#define TRI_LINES_PER_NODE  (3)         // fires one tower can report at the same time
+#endif
+#ifndef TRI_MAX_REPORTS
+#define TRI_MAX_REPORTS     (TRI_MAX_NODES * TRI_LINES_PER_NODE)
+#endif
+#ifndef TRI_MAX_TRACKS
+#define TRI_MAX_TRACKS      (8)
+#endif
+
+typedef struct {
+	uint32_t node;              // reporting tower, e.g. low bytes of its MAC
+	int64_t time_us;            // UTC microseconds, from now_utc_us()
+	int32_t latitude;           // tower position, degrees x 1e7
+	int32_t longitude;
+	uint16_t bearing;           // BAM, clockwise from north
+} tri_report_t;
+
+typedef struct {
+	int64_t window_us;          // reports older than this are dropped
+	int64_t sweep_us;           // a tower that reported since and did not repeat a bearing lost it
+	float bearing_sigma_deg;    // 1 sigma bearing error of a tower
+	float position_sigma_m;     // 1 sigma tower position error
+	float gate_sigma;           // lines further than this many sigma are not associated
+	float huber_sigma;          // residuals beyond this many sigma are down weighted
+	float min_angle_deg;        // shallower crossings do not seed a track
+	float max_range_m;          // no fire is seen further than this
+	uint8_t min_nodes;          // distinct towers needed to create a track
+	float min_seen;             // share of the reporting towers in range that must see a track
+	uint8_t iterations;         // IRLS passes per solve
+} tri_config_t;
+
+#define TRI_CONFIG_DEFAULT() {          \
+	.window_us = 60 * 1000000LL,        \
+	.sweep_us = 30 * 1000000LL,         \
+	.bearing_sigma_deg = 2.0f,          \
+	.position_sigma_m = 5.0f,           \
+	.gate_sigma = 3.0f,                 \
+	.huber_sigma = 1.5f,                \
+	.min_angle_deg = 10.0f,             \
+	.max_range_m = 20000.0f,            \
+	.min_nodes = 3,                     \
+	.min_seen = 0.5f,                   \
+	.iterations = 5,                    \
+}
+
+typedef struct {
+	uint16_t id;
+	bool active;
+	float east;                 // metres from the plane origin
+	float north;
+	float cov[3];               // east/east, east/north, north/north, m^2
+	int32_t latitude;           // degrees x 1e7
+	int32_t longitude;
+	float major_m;              // 1 sigma error ellipse
+	float minor_m;
+	uint16_t orientation;       // major axis, BAM clockwise from north
+	uint16_t nodes;             // distinct towers in the last solve
+	float rms_m;                // RMS line distance from the estimate
+	int64_t created_us;
+	int64_t updated_us;
+} tri_track_t;
+
+typedef struct {
+	uint32_t reports;
+	uint32_t replaced;          // a newer bearing from the same tower and fire
+	uint32_t superseded;        // not repeated by a later sweep of the same tower
+	uint32_t dropped;           // store full, oldest report discarded
+	uint32_t expired;
+	uint32_t tracks_created;
+	uint32_t tracks_lost;
+	uint32_t ghosts;            // tracks dropped as crossings of other fires' lines
+	uint32_t unseen;            // seeds and tracks most towers in range did not see
+	uint32_t solves;
+} tri_stats_t;
+
+// internal, one per stored report, the position is kept only on the plane
+typedef struct {
+	int64_t time_us;
+	uint32_t node;
+	float east;
+	float north;
+	float sin_b;                // bearing direction is (sin_b, cos_b)
+	float cos_b;
+	uint16_t bearing;
+	int8_t track;               // index into tracks, negative if unassigned
+	bool first;                 // the tower's first stored line, counts it once
+} tri_line_t;
+
+typedef struct {
+	tri_config_t cfg;
+	bool have_origin;
+	int32_t origin_lat;
+	int32_t origin_lon;
+	float m_per_e7_lat;
+	float m_per_e7_lon;
+	tri_line_t lines[TRI_MAX_REPORTS];
+	uint16_t line_count;
+	float along[TRI_MAX_REPORTS];   // seed search scratch
+	tri_track_t tracks[TRI_MAX_TRACKS];
+	uint16_t next_id;
+	tri_stats_t stats;
+} tri_t;
+
+void tri_init(tri_t* tri, const tri_config_t* cfg);
+
+// stores a report, a newer bearing from the same tower near an old one replaces it
+// and bearings that tower has not repeated for a sweep are forgotten
+void tri_add(tri_t* tri, const tri_report_t* report);
+
+// expires old reports, re-solves tracks and seeds new ones, returns active tracks
+int tri_update(tri_t* tri, int64_t now_us);
+
+// active track by index, NULL past the end
+const tri_track_t* tri_track(const tri_t* tri, int index);
+
+#endif /* TRIANGULATE_H_ */
@@ -0,0 +1,537 @@
+/*
+ * triangulate.c
+ *
+ *  Bearing triangulation, see triangulate.h.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "triangulate.h"
+#include "bearing_math.h"
+
+#define M_PER_DEG_LAT   (111320.0f)
+#define MIN_RANGE_M     (10.0f)
+#define SEED_FAILED     (-2)
+
+void tri_init(tri_t* tri, const tri_config_t* cfg)
+{
+	memset(tri, 0, sizeof(*tri));
+	tri->cfg = *cfg;
+	tri->next_id = 1;
+}
+
+// equirectangular projection, plenty for the few tens of km a mesh spans
+static void to_plane(const tri_t* tri, int32_t lat, int32_t lon, float* east, float* north)
+{
+	*east = (float)(lon - tri->origin_lon) * tri->m_per_e7_lon;
+	*north = (float)(lat - tri->origin_lat) * tri->m_per_e7_lat;
+}
+
+static void from_plane(const tri_t* tri, float east, float north, int32_t* lat, int32_t* lon)
+{
+	*lat = tri->origin_lat + (int32_t)lroundf(north / tri->m_per_e7_lat);
+	*lon = tri->origin_lon + (int32_t)lroundf(east / tri->m_per_e7_lon);
+}
+
+// 1 sigma cross-track error of a line at the given range
+static float line_sigma(const tri_t* tri, float range)
+{
+	float angular = tri->cfg.bearing_sigma_deg * (BM_PI / 180.0f) * range;
+	return sqrtf(angular * angular + tri->cfg.position_sigma_m * tri->cfg.position_sigma_m);
+}
+
+// signed distance of a point from the line and how far along it the point lies
+static void line_offset(const tri_line_t* l, float east, float north, float* across, float* along)
+{
+	float de = east - l->east;
+	float dn = north - l->north;
+	*across = de * l->cos_b - dn * l->sin_b;
+	*along = de * l->sin_b + dn * l->cos_b;
+}
+
+void tri_add(tri_t* tri, const tri_report_t* report)
+{
+	if (!tri->have_origin) {
+		tri->origin_lat = report->latitude;
+		tri->origin_lon = report->longitude;
+		tri->m_per_e7_lat = M_PER_DEG_LAT * 1e-7f;
+		tri->m_per_e7_lon = M_PER_DEG_LAT * 1e-7f
+				* cosf((float)report->latitude * 1e-7f * (BM_PI / 180.0f));
+		tri->have_origin = true;
+	}
+	tri->stats.reports++;
+
+	// same tower, same fire: keep only the newest bearing. Anything else the
+	// tower has not seen again within a sweep was a glitch or has gone out.
+	uint16_t merge = bm_deg_to_bam(tri->cfg.bearing_sigma_deg * tri->cfg.gate_sigma);
+	tri_line_t* l = NULL;
+	uint16_t kept = 0;
+	for (uint16_t i = 0; i < tri->line_count; i++) {
+		tri_line_t* old = &tri->lines[i];
+		if (old->node == report->node) {
+			int16_t diff = old->bearing - report->bearing;
+			if (l == NULL && (diff < 0 ? -diff : diff) <= merge) {
+				tri->stats.replaced++;
+				l = &tri->lines[kept];
+			} else if (report->time_us - old->time_us > tri->cfg.sweep_us) {
+				tri->stats.superseded++;
+				continue;
+			}
+		}
+		tri->lines[kept++] = *old;
+	}
+	tri->line_count = kept;
+	if (l == NULL) {
+		if (tri->line_count == TRI_MAX_REPORTS) {
+			uint16_t oldest = 0;
+			for (uint16_t i = 1; i < tri->line_count; i++)
+				if (tri->lines[i].time_us < tri->lines[oldest].time_us)
+					oldest = i;
+			l = &tri->lines[oldest];
+			tri->stats.dropped++;
+		} else {
+			l = &tri->lines[tri->line_count++];
+		}
+		l->track = -1;
+	}
+
+	l->time_us = report->time_us;
+	l->node = report->node;
+	l->bearing = report->bearing;
+	to_plane(tri, report->latitude, report->longitude, &l->east, &l->north);
+	float rad = report->bearing / BM_BAM_PER_RAD;
+	l->sin_b = bm_sinf(rad);
+	l->cos_b = bm_cosf(rad);
+}
+
+// IRLS over the lines assigned to track t, false if they do not constrain a point
+static bool solve(tri_t* tri, int t)
+{
+	tri_track_t* tr = &tri->tracks[t];
+	float e = tr->east;
+	float n = tr->north;
+	float a00 = 0, a01 = 0, a11 = 0;
+	float rms = 0;
+	uint16_t count = 0;
+
+	for (uint8_t iter = 0; iter < tri->cfg.iterations; iter++) {
+		float b0 = 0, b1 = 0;
+		a00 = a01 = a11 = 0;
+		rms = 0;
+		count = 0;
+		for (uint16_t i = 0; i < tri->line_count; i++) {
+			const tri_line_t* l = &tri->lines[i];
+			if (l->track != t)
+				continue;
+			float across, along;
+			line_offset(l, e, n, &across, &along);
+			float sigma = line_sigma(tri, along > MIN_RANGE_M ? along : MIN_RANGE_M);
+			float w = 1.0f / (sigma * sigma);
+			float k = tri->cfg.huber_sigma * sigma;
+			if (fabsf(across) > k)
+				w *= k / fabsf(across);
+
+			// normal to the line is (cos_b, -sin_b)
+			float nx = l->cos_b;
+			float ny = -l->sin_b;
+			float c = nx * l->east + ny * l->north;
+			a00 += w * nx * nx;
+			a01 += w * nx * ny;
+			a11 += w * ny * ny;
+			b0 += w * nx * c;
+			b1 += w * ny * c;
+			rms += across * across;
+			count++;
+		}
+
+		float det = a00 * a11 - a01 * a01;
+		if (count < 2 || det <= 1e-12f * (a00 + a11) * (a00 + a11))
+			return false;
+		e = (a11 * b0 - a01 * b1) / det;
+		n = (a00 * b1 - a01 * b0) / det;
+	}
+
+	// near parallel lines give a fix smeared along them, not a location
+	float det = a00 * a11 - a01 * a01;
+	if ((a00 + a11) / det > tri->cfg.max_range_m * tri->cfg.max_range_m)
+		return false;
+
+	// the normal matrix assumes the configured bearing error; lines that
+	// scatter wider than that (a compass off, refraction) show it in the
+	// residuals, so grow the covariance by chi^2 per degree of freedom
+	float chi2 = 0;
+	for (uint16_t i = 0; i < tri->line_count; i++) {
+		const tri_line_t* l = &tri->lines[i];
+		if (l->track != t)
+			continue;
+		float across, along;
+		line_offset(l, e, n, &across, &along);
+		float sigma = line_sigma(tri, along > MIN_RANGE_M ? along : MIN_RANGE_M);
+		chi2 += across * across / (sigma * sigma);
+	}
+	float scale = count > 2 ? chi2 / (count - 2) : 1;
+	if (scale < 1)
+		scale = 1;
+
+	tr->east = e;
+	tr->north = n;
+	tr->cov[0] = scale * a11 / det;
+	tr->cov[1] = scale * -a01 / det;
+	tr->cov[2] = scale * a00 / det;
+	tr->rms_m = sqrtf(rms / count);
+	from_plane(tri, e, n, &tr->latitude, &tr->longitude);
+
+	// error ellipse from the covariance eigenvalues
+	float mid = 0.5f * (tr->cov[0] + tr->cov[2]);
+	float half = sqrtf(0.25f * (tr->cov[0] - tr->cov[2]) * (tr->cov[0] - tr->cov[2])
+			+ tr->cov[1] * tr->cov[1]);
+	float l1 = mid + half;
+	float l2 = mid - half;
+	tr->major_m = sqrtf(l1);
+	tr->minor_m = sqrtf(l2 > 0 ? l2 : 0);
+	if (fabsf(tr->cov[1]) > 1e-9f || tr->cov[0] != tr->cov[2])
+		tr->orientation = tr->cov[0] >= tr->cov[2]
+				? bm_atan2_bam(l1 - tr->cov[2], tr->cov[1])
+				: bm_atan2_bam(tr->cov[1], l1 - tr->cov[0]);
+	else
+		tr->orientation = 0;
+
+	tri->stats.solves++;
+	return true;
+}
+
+static uint16_t distinct_nodes(const tri_t* tri, int t)
+{
+	uint16_t nodes = 0;
+	for (uint16_t i = 0; i < tri->line_count; i++) {
+		if (tri->lines[i].track != t)
+			continue;
+		bool seen = false;
+		for (uint16_t j = 0; j < i && !seen; j++)
+			seen = tri->lines[j].track == t && tri->lines[j].node == tri->lines[i].node;
+		if (!seen)
+			nodes++;
+	}
+	return nodes;
+}
+
+// flags one line per tower, so towers can be counted in a single pass
+static void mark_first(tri_t* tri)
+{
+	for (uint16_t i = 0; i < tri->line_count; i++) {
+		tri_line_t* l = &tri->lines[i];
+		l->first = true;
+		for (uint16_t j = 0; j < i && l->first; j++)
+			l->first = tri->lines[j].node != l->node;
+	}
+}
+
+// true if the directions from the tower at (east, north) to the two points
+// are further apart than tan_merge, so the tower would report them apart
+static bool resolves(float east, float north, float e1, float n1, float e2, float n2, float tan_merge)
+{
+	float x1 = e1 - east, y1 = n1 - north;
+	float x2 = e2 - east, y2 = n2 - north;
+	float dot = x1 * x2 + y1 * y2;
+	return dot <= 0 || fabsf(x1 * y2 - y1 * x2) > tan_merge * dot;
+}
+
+// Every tower in range of a fire reports it, but stray bearings can cross
+// near a spot that the towers around it look straight past. Only towers
+// that would tell the spot from every other track count, as two fires
+// closer than the angle tri_add() merges at share one line; at least
+// min_seen of those must have a bearing pointing at the track.
+static bool seen_enough(const tri_t* tri, int t)
+{
+	const tri_track_t* tr = &tri->tracks[t];
+	float range2 = tri->cfg.max_range_m * tri->cfg.max_range_m;
+	float tan_merge = tanf(tri->cfg.bearing_sigma_deg * tri->cfg.gate_sigma * (BM_PI / 180.0f));
+	uint16_t heard = 0, seeing = 0;
+	for (uint16_t i = 0; i < tri->line_count; i++) {
+		const tri_line_t* l = &tri->lines[i];
+		float de = tr->east - l->east;
+		float dn = tr->north - l->north;
+		if (de * de + dn * dn > range2)
+			continue;
+		bool apart = true;
+		for (int u = 0; u < TRI_MAX_TRACKS && apart; u++) {
+			const tri_track_t* other = &tri->tracks[u];
+			if (u != t && other->active)
+				apart = resolves(l->east, l->north, tr->east, tr->north,
+						other->east, other->north, tan_merge);
+		}
+		if (!apart)
+			continue;
+		float across, along;
+		line_offset(l, tr->east, tr->north, &across, &along);
+		if (along > 0 && fabsf(across) <= tan_merge * along
+				+ tri->cfg.gate_sigma * tri->cfg.position_sigma_m)
+			seeing++;
+		if (l->first)
+			heard++;
+	}
+	return seeing >= tri->cfg.min_seen * heard;
+}
+
+// gate test, returns the distance in sigma or a negative value if outside
+static float gate(const tri_t* tri, const tri_line_t* l, float east, float north)
+{
+	float across, along;
+	line_offset(l, east, north, &across, &along);
+	if (along <= 0 || along > tri->cfg.max_range_m)
+		return -1;
+	float d = fabsf(across) / line_sigma(tri, along);
+	return d <= tri->cfg.gate_sigma ? d : -1;
+}
+
+// A tower sees a fire along one bearing. Its other lines all cross that one
+// at the tower itself, tightly, and would pull the solve onto the tower;
+// each track keeps the line from a tower that passes closest.
+static void one_line_per_node(tri_t* tri)
+{
+	for (uint16_t i = 0; i < tri->line_count; i++) {
+		tri_line_t* a = &tri->lines[i];
+		if (a->track < 0)
+			continue;
+		const tri_track_t* tr = &tri->tracks[a->track];
+		for (uint16_t j = i + 1; j < tri->line_count && a->track >= 0; j++) {
+			tri_line_t* b = &tri->lines[j];
+			if (b->track != a->track || b->node != a->node)
+				continue;
+			if (gate(tri, b, tr->east, tr->north) < gate(tri, a, tr->east, tr->north))
+				a->track = -1;
+			else
+				b->track = -1;
+		}
+	}
+}
+
+// assigns the free lines that pass close to track t, and only those
+static void gather(tri_t* tri, int t)
+{
+	const tri_track_t* tr = &tri->tracks[t];
+	for (uint16_t i = 0; i < tri->line_count; i++) {
+		tri_line_t* l = &tri->lines[i];
+		if (l->track == t || l->track == -1)
+			l->track = gate(tri, l, tr->east, tr->north) >= 0 ? t : -1;
+	}
+	one_line_per_node(tri);
+}
+
+static void associate(tri_t* tri)
+{
+	for (uint16_t i = 0; i < tri->line_count; i++) {
+		tri_line_t* l = &tri->lines[i];
+		float best = -1;
+		l->track = -1;
+		for (int t = 0; t < TRI_MAX_TRACKS; t++) {
+			if (!tri->tracks[t].active)
+				continue;
+			float d = gate(tri, l, tri->tracks[t].east, tri->tracks[t].north);
+			if (d >= 0 && (best < 0 || d < best)) {
+				best = d;
+				l->track = t;
+			}
+		}
+	}
+	one_line_per_node(tri);
+}
+
+static int compare_float(const void* a, const void* b)
+{
+	float x = *(const float*)a;
+	float y = *(const float*)b;
+	return (x > y) - (x < y);
+}
+
+// Strongest crossing of two unassigned lines, measured by how many others
+// agree. Counting support for every pair is O(n^3), too slow for a full
+// store; instead the crossings along each line are sorted and only the
+// densest run, about a gate wide, is counted. O(n^2 log n) in all.
+static bool best_seed(tri_t* tri, float* east, float* north)
+{
+	float min_sin = bm_sinf(tri->cfg.min_angle_deg * (BM_PI / 180.0f));
+	uint16_t best = 0;
+
+	for (uint16_t i = 0; i < tri->line_count; i++) {
+		const tri_line_t* a = &tri->lines[i];
+		if (a->track != -1)
+			continue;
+		uint16_t m = 0;
+		for (uint16_t j = 0; j < tri->line_count; j++) {
+			const tri_line_t* b = &tri->lines[j];
+			if (j == i || b->track != -1 || b->node == a->node)
+				continue;
+			float cross = a->sin_b * b->cos_b - a->cos_b * b->sin_b;
+			if (fabsf(cross) < min_sin)
+				continue;
+			float de = b->east - a->east;
+			float dn = b->north - a->north;
+			float t = (de * b->cos_b - dn * b->sin_b) / cross;
+			if (t <= 0 || t > tri->cfg.max_range_m)
+				continue;
+			if (gate(tri, b, a->east + t * a->sin_b, a->north + t * a->cos_b) < 0)
+				continue;
+			tri->along[m++] = t;
+		}
+		if (m == 0)
+			continue;
+
+		qsort(tri->along, m, sizeof(tri->along[0]), compare_float);
+		uint16_t run = 0, start = 0;
+		for (uint16_t lo = 0, hi = 0; lo < m; lo++) {
+			float width = tri->cfg.gate_sigma * line_sigma(tri, tri->along[lo]);
+			while (hi < m && tri->along[hi] - tri->along[lo] <= width)
+				hi++;
+			if (hi - lo > run) {
+				run = hi - lo;
+				start = lo;
+			}
+		}
+		float t = tri->along[start + run / 2];
+		float e = a->east + t * a->sin_b;
+		float n = a->north + t * a->cos_b;
+
+		uint16_t support = 0;
+		for (uint16_t k = 0; k < tri->line_count; k++)
+			if (tri->lines[k].track == -1 && gate(tri, &tri->lines[k], e, n) >= 0)
+				support++;
+		if (support > best) {
+			best = support;
+			*east = e;
+			*north = n;
+		}
+	}
+	return best >= tri->cfg.min_nodes;
+}
+
+// Lines run on past the fire they saw, so where lines of two real fires
+// cross behind them a phantom track forms. A phantom lives on lines that a
+// better supported track explains as well; drop it.
+static void cull_ghosts(tri_t* tri)
+{
+	for (int t = 0; t < TRI_MAX_TRACKS; t++) {
+		tri_track_t* tr = &tri->tracks[t];
+		if (!tr->active)
+			continue;
+		uint16_t lines = 0, shared = 0;
+		for (uint16_t i = 0; i < tri->line_count; i++) {
+			if (tri->lines[i].track != t)
+				continue;
+			lines++;
+			for (int u = 0; u < TRI_MAX_TRACKS; u++) {
+				const tri_track_t* other = &tri->tracks[u];
+				if (u != t && other->active && other->nodes > tr->nodes
+						&& gate(tri, &tri->lines[i], other->east, other->north) >= 0) {
+					shared++;
+					break;
+				}
+			}
+		}
+		if (shared * 2 > lines) {
+			tr->active = false;
+			tri->stats.ghosts++;
+		}
+	}
+}
+
+static int free_track(const tri_t* tri)
+{
+	for (int t = 0; t < TRI_MAX_TRACKS; t++)
+		if (!tri->tracks[t].active)
+			return t;
+	return -1;
+}
+
+int tri_update(tri_t* tri, int64_t now_us)
+{
+	// drop expired reports, keeping the array packed
+	uint16_t kept = 0;
+	for (uint16_t i = 0; i < tri->line_count; i++) {
+		if (now_us - tri->lines[i].time_us > tri->cfg.window_us) {
+			tri->stats.expired++;
+			continue;
+		}
+		tri->lines[kept++] = tri->lines[i];
+	}
+	tri->line_count = kept;
+	mark_first(tri);
+
+	associate(tri);
+	for (int t = 0; t < TRI_MAX_TRACKS; t++) {
+		tri_track_t* tr = &tri->tracks[t];
+		if (!tr->active)
+			continue;
+		tr->nodes = distinct_nodes(tri, t);
+		if (tr->nodes >= tri->cfg.min_nodes && solve(tri, t)) {
+			tr->updated_us = now_us;
+			if (!seen_enough(tri, t)) {
+				tr->active = false;
+				tri->stats.unseen++;
+			}
+		} else if (now_us - tr->updated_us > tri->cfg.window_us) {
+			tr->active = false;
+			tri->stats.tracks_lost++;
+		}
+	}
+	cull_ghosts(tri);
+	// a track may have moved onto lines that belonged to another
+	associate(tri);
+
+	float east = 0, north = 0;
+	int t;
+	while ((t = free_track(tri)) >= 0 && best_seed(tri, &east, &north)) {
+		tri_track_t* tr = &tri->tracks[t];
+		memset(tr, 0, sizeof(*tr));
+		tr->active = true;
+		tr->id = tri->next_id++;
+		tr->east = east;
+		tr->north = north;
+		tr->created_us = now_us;
+		tr->updated_us = now_us;
+		gather(tri, t);
+		tr->nodes = distinct_nodes(tri, t);
+		bool solved = tr->nodes >= tri->cfg.min_nodes && solve(tri, t);
+		// a seed between two fires takes lines of both; gathered again
+		// where the solve put it, it keeps those of the nearer one
+		if (solved) {
+			gather(tri, t);
+			tr->nodes = distinct_nodes(tri, t);
+			solved = tr->nodes >= tri->cfg.min_nodes && solve(tri, t);
+		}
+		if (solved && !seen_enough(tri, t)) {
+			tri->stats.unseen++;
+			solved = false;
+		}
+		if (!solved) {
+			// park the lines for this pass so the seed is not retried
+			for (uint16_t i = 0; i < tri->line_count; i++)
+				if (tri->lines[i].track == t)
+					tri->lines[i].track = SEED_FAILED;
+			tr->active = false;
+			continue;
+		}
+		tri->stats.tracks_created++;
+	}
+	for (uint16_t i = 0; i < tri->line_count; i++)
+		if (tri->lines[i].track == SEED_FAILED)
+			tri->lines[i].track = -1;
+
+	int active = 0;
+	for (int i = 0; i < TRI_MAX_TRACKS; i++)
+		if (tri->tracks[i].active)
+			active++;
+	return active;
+}
+
+const tri_track_t* tri_track(const tri_t* tri, int index)
+{
+	for (int t = 0; t < TRI_MAX_TRACKS; t++) {
+		if (!tri->tracks[t].active)
+			continue;
+		if (index-- == 0)
+			return &tri->tracks[t];
+	}
+	return NULL;
+}
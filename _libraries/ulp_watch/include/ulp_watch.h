@@ -0,0 +1,59 @@
+/*
+ * ulp_watch.h
+ *
+ *  Battery and switch watchdog on the ULP coprocessor. While the main
+ *  cores are in deep sleep the ULP samples the battery divider and the
+ *  watched RTC GPIOs every period, applies the same low/recovered
+ *  hysteresis as battery_subscribe(), and wakes the SoC only on a change.
+ *
+ *  The ADC channel is CONFIG_ULP_WATCH_ADC_CHANNEL, the ULP cannot take it
+ *  at run time. Watched pins must be RTC capable (0, 2, 4, 12-15, 25-27,
+ *  32-39). Needs CONFIG_ESP32_ULP_COPROC_ENABLED.
+ */
+
+#ifndef ULP_WATCH_H_
+#define ULP_WATCH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "driver/gpio.h"
+#include "driver/adc.h"
+
+#define ULP_WATCH_MAX_PINS  (4)
+
+// wake reasons
+#define ULP_WATCH_BATTERY   (1 << 0)
+#define ULP_WATCH_GPIO      (1 << 1)
+
+typedef struct {
+	adc_atten_t atten;
+	uint32_t default_vref;      // mV, used when eFuse holds no calibration
+	float scale;                // divider ratio back to battery volts
+	uint32_t low_mv;            // battery thresholds, as battery_subscribe()
+	uint32_t high_mv;
+	gpio_num_t pins[ULP_WATCH_MAX_PINS];
+	size_t pin_count;
+	uint32_t period_ms;
+} ulp_watch_config_t;
+
+// loads and starts the ULP program just before deep sleep; battery_low is
+// the state the main cores last saw, so only a change from it wakes them
+esp_err_t ulp_watch_start(const ulp_watch_config_t* cfg, bool battery_low);
+
+// stops sampling, call after a wake before the ADC is used from the CPU
+void ulp_watch_stop(void);
+
+// ULP_WATCH_* bits behind the last wake, cleared by the call
+uint32_t ulp_watch_reason(void);
+
+bool ulp_watch_battery_low(void);
+
+// battery voltage the ULP last measured, 0 if it has not since ulp_watch_start()
+uint32_t ulp_watch_battery_mv(void);
+
+// level of a watched pin as the ULP last saw it
+bool ulp_watch_level(gpio_num_t pin);
+
+#endif /* ULP_WATCH_H_ */
@@ -0,0 +1,144 @@
+/*
+ * ulp_watch.c
+ *
+ *  Loads and talks to the ULP watchdog program, see ulp_watch.h.
+ */
+
+#include "ulp_watch.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_adc_cal.h"
+#include "esp32/ulp.h"
+#include "driver/rtc_io.h"
+#include "soc/rtc_cntl_reg.h"
+#include "soc/rtc_io_reg.h"
+#include "sdkconfig.h"
+#include "watch_ulp.h"
+
+#define ADC_CHANNEL     ((adc1_channel_t)CONFIG_ULP_WATCH_ADC_CHANNEL)
+#define ADC_MAX_RAW     (4095)
+
+static const char* tag = "ulp_watch";
+
+extern const uint8_t ulp_bin_start[] asm("_binary_watch_ulp_bin_start");
+extern const uint8_t ulp_bin_end[]   asm("_binary_watch_ulp_bin_end");
+
+// needed again after a wake to read the ULP's results back
+static RTC_DATA_ATTR ulp_watch_config_t config;
+static esp_adc_cal_characteristics_t adc_chars;
+static bool characterized = false;
+
+static void characterize(void)
+{
+	if (characterized)
+		return;
+	esp_adc_cal_characterize(ADC_UNIT_1, config.atten, ADC_WIDTH_BIT_12, config.default_vref, &adc_chars);
+	characterized = true;
+}
+
+// smallest raw code that reads at least mv at the pin
+static uint32_t mv_to_raw(uint32_t mv)
+{
+	uint32_t lo = 0, hi = ADC_MAX_RAW;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (esp_adc_cal_raw_to_voltage(mid, &adc_chars) < mv)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static uint32_t rtc_levels(uint32_t mask)
+{
+	return REG_GET_FIELD(RTC_GPIO_IN_REG, RTC_GPIO_IN_NEXT) & mask;
+}
+
+esp_err_t ulp_watch_start(const ulp_watch_config_t* cfg, bool battery_low)
+{
+	if (cfg == NULL || cfg->pin_count > ULP_WATCH_MAX_PINS || cfg->high_mv < cfg->low_mv || cfg->scale <= 0)
+		return ESP_ERR_INVALID_ARG;
+	config = *cfg;
+	characterized = false;
+	characterize();
+
+	uint32_t mask = 0;
+	for (size_t i = 0; i < config.pin_count; i++) {
+		gpio_num_t pin = config.pins[i];
+		if (!rtc_gpio_is_valid_gpio(pin))
+			return ESP_ERR_INVALID_ARG;
+		rtc_gpio_init(pin);
+		rtc_gpio_set_direction(pin, RTC_GPIO_MODE_INPUT_ONLY);
+		// GPIO34-39 have no pulls, the divider or switch must provide one
+		rtc_gpio_pullup_en(pin);
+		mask |= 1 << rtc_gpio_desc[pin].rtc_num;
+	}
+
+	esp_err_t err = adc1_config_width(ADC_WIDTH_BIT_12);
+	if (err == ESP_OK)
+		err = adc1_config_channel_atten(ADC_CHANNEL, config.atten);
+	if (err != ESP_OK)
+		return err;
+	adc1_ulp_enable();
+
+	err = ulp_load_binary(0, ulp_bin_start, (ulp_bin_end - ulp_bin_start) / sizeof(uint32_t));
+	if (err != ESP_OK)
+		return err;
+
+	ulp_low_thr = mv_to_raw(config.low_mv / config.scale);
+	ulp_high_thr = mv_to_raw(config.high_mv / config.scale);
+	uint32_t levels = rtc_levels(mask);
+	ulp_gpio_mask = mask & 0xFFFF;
+	ulp_gpio_mask_high = mask >> 16;
+	ulp_gpio_state = levels & 0xFFFF;
+	ulp_gpio_state_high = levels >> 16;
+	ulp_battery_low = battery_low;
+	ulp_wake_reason = 0;
+	ulp_last_raw = 0;
+
+	ulp_set_wakeup_period(0, config.period_ms * 1000);
+	err = ulp_run(&ulp_entry - RTC_SLOW_MEM);
+	if (err == ESP_OK)
+		ESP_LOGI(tag, "watching ADC1 channel %d (%u..%u mV) and RTC GPIO mask 0x%04x every %u ms",
+				CONFIG_ULP_WATCH_ADC_CHANNEL, config.low_mv, config.high_mv, mask, config.period_ms);
+	return err;
+}
+
+void ulp_watch_stop(void)
+{
+	// there is no driver call for this in IDF 4.0
+	CLEAR_PERI_REG_MASK(RTC_CNTL_STATE0_REG, RTC_CNTL_ULP_CP_SLP_TIMER_EN);
+	for (size_t i = 0; i < config.pin_count; i++)
+		rtc_gpio_deinit(config.pins[i]);
+}
+
+uint32_t ulp_watch_reason(void)
+{
+	uint32_t reason = ulp_wake_reason & 0xFFFF;
+	ulp_wake_reason = 0;
+	return reason;
+}
+
+bool ulp_watch_battery_low(void)
+{
+	return ulp_battery_low & 0xFFFF;
+}
+
+uint32_t ulp_watch_battery_mv(void)
+{
+	// the ULP's st fills the upper half with its own address, zero means no sample yet
+	if ((ulp_last_raw >> 16) == 0)
+		return 0;
+	characterize();
+	return esp_adc_cal_raw_to_voltage(ulp_last_raw & 0xFFFF, &adc_chars) * config.scale;
+}
+
+bool ulp_watch_level(gpio_num_t pin)
+{
+	if (!rtc_gpio_is_valid_gpio(pin))
+		return false;
+	// the upper half of each word is the ULP's, not ours
+	uint32_t levels = (ulp_gpio_state & 0xFFFF) | (ulp_gpio_state_high & 0xFFFF) << 16;
+	return (levels >> rtc_gpio_desc[pin].rtc_num) & 1;
+}
@@ -7,34 +7,62 @@
 #include "nvs_flash.h"
 #include "driver/gpio.h"
 
-#include <math.h>
+#include "bearing_math.h"
+#include "heading.h"
+#include "sweep.h"
+#include "battery.h"
+#include "sleep_cycle.h"
+#include "ulp_watch.h"
+#include "esp_attr.h"
 
 // simulation variables
 //
 // offset to north from motor angle
 static float compass_sim_offset = 69.420;
+// actual motor position in steps, including any the motor failed to take
+// RTC memory, like a real stepper the turret holds position while we sleep
+static RTC_DATA_ATTR int32_t motor_sim_steps = 0;
 
+// camera heading, fused from motor steps and compass readings
+// RTC memory, so a deep sleep wake skips re-seeding from the compass
+static RTC_DATA_ATTR heading_est_t heading;
+
+// sweep and detection counters, kept across deep sleep
+static RTC_DATA_ATTR uint32_t sweep_count;
+static RTC_DATA_ATTR uint32_t fire_count;
+
+// cable wrap allows 270 degrees either side of the power-up position
+static const sweep_limits_t wrap_limits = {-150, 150};
+// bearings imaged every cycle, add sectors here to watch hot zones closer
+static sweep_set_t sweep_set;
+
+
+// set while the battery is too low to keep driving the motor
+static volatile bool battery_low = false;
 
 // log tags
 static const char* MOTOR_TAG = "det_motor";
 static const char* THERMAL_TAG = "det_thermal";
 static const char* COMPASS_TAG = "det_compass";
 static const char* MAIN_TAG = "det_main";
+static const char* BATTERY_TAG = "det_battery";
 
 // TODO: remove after integration
 void init_GPIO(void);
 
 bool error_check(bool*);
-void motor_move(int);
+void motor_move(int32_t);
 bool thermal_snapshot(float*);
-void compass_read(float*, int);
+void compass_update(void);
+void compass_read(float*);
+void battery_changed(const battery_reading_t*, bool, void*);
 
 void app_main(void)
 {
 	// variable declarations
 	//
-	// motor angle, in degrees
-	static int motor_ang = 0;
+	// planned stops for this cycle
+	static sweep_plan_t plan;
 	// fire angle, in degrees
 	static float fire_ang = 0;
 	// fire detected flag
@@ -42,34 +70,72 @@ void app_main(void)
 	// error flag
 	static bool err_flag = false;
 
+	sleep_cycle_wake_t wake = sleep_cycle_begin();
+	if(sleep_cycle_warm()){
+		// hand the ADC and error pin back from the ULP
+		ulp_watch_stop();
+		battery_low = ulp_watch_battery_low();
+		if(wake == SLEEP_CYCLE_ULP)
+			ESP_LOGI(MAIN_TAG, "ULP wake, reason 0x%x, battery %u mV",
+					ulp_watch_reason(), ulp_watch_battery_mv());
+	}
+
 	// TODO: remove after integration
 	init_GPIO();
 
+	// GPIO34 is the simulated error input here, so the battery divider is on GPIO35
+	battery_config_t battery_cfg = BATTERY_CONFIG_DEFAULT();
+	battery_cfg.channel = ADC1_CHANNEL_7;
+	ESP_ERROR_CHECK(battery_init(&battery_cfg));
+	ESP_ERROR_CHECK(battery_subscribe(10000, 10500, battery_changed, NULL));
+
+	if(sleep_cycle_warm()){
+		ESP_LOGI(MAIN_TAG, "woke by %s, sweep %u, %u fires so far, facing %.2f",
+				wake == SLEEP_CYCLE_ULP ? "ULP" : "timer", sweep_count, fire_count,
+				bm_bam_to_deg(heading_get(&heading)));
+	}
+	else{
+		// seed the heading estimator with an absolute bearing before moving
+		heading_config_t heading_cfg = HEADING_CONFIG_DEFAULT();
+		heading_init(&heading, &heading_cfg);
+		compass_update();
+	}
+
+	sweep_set_clear(&sweep_set);
+	for(int ang=0; ang<360; ang+=45)
+		sweep_set_add(&sweep_set, bm_deg_to_bam(ang));
+
 	while(true)
 	{
 		fire_flag = false;
 		fire_ang = 0;
 		err_flag = 0;
-		for(motor_ang=0; motor_ang<360; motor_ang+=45){
+
+		// visit order alternates direction, starting from wherever the last cycle ended
+		sweep_plan(&wrap_limits, &heading, &sweep_set, &plan);
+		ESP_LOGI(MAIN_TAG, "sweep of %d stops, %.1f degrees of travel, %d out of reach",
+				plan.count, sweep_travel_deg(&plan, &heading), plan.unreachable);
+
+		for(int stop=0; stop<plan.count; stop++){
 			if(error_check(&err_flag))
 				break;
 
-			// command motor to move to motor_ang
-			motor_move(motor_ang);
+			// command motor to the planned stop
+			motor_move(plan.position[stop]);
 
 			if(error_check(&err_flag))
 				break;
 
 			// command camera to take image, waits for result
 			fire_flag = thermal_snapshot(&fire_ang);
+			sleep_cycle_result();
 
 			if(error_check(&err_flag))
 				break;
 
 			if(fire_flag){
 				// read compass to determine bearing to north
-				// TODO: remove motor dependency
-				compass_read(&fire_ang, motor_ang);
+				compass_read(&fire_ang);
 
 				if(error_check(&err_flag))
 					break;
@@ -83,8 +149,24 @@ void app_main(void)
 				fire_flag ? "true" : "false",
 				fire_ang);
 
-		motor_move(0);
-		vTaskDelay(pdMS_TO_TICKS(5000));
+		sweep_count++;
+		if(fire_flag)
+			fire_count++;
+
+		// nothing to do until the next sweep, sleep rather than idle awake;
+		// the ULP wakes us early if the battery or error input changes
+		const ulp_watch_config_t watch_cfg = {
+			.atten = battery_cfg.atten,
+			.default_vref = battery_cfg.default_vref,
+			.scale = battery_cfg.scale,
+			.low_mv = 10000,
+			.high_mv = 10500,
+			.pins = {34},
+			.pin_count = 1,
+			.period_ms = 500,
+		};
+		sleep_cycle_enable_ulp(ulp_watch_start(&watch_cfg, battery_low) == ESP_OK);
+		sleep_cycle_sleep(5000 * 1000ULL);
 	}
 }
 
@@ -103,17 +185,23 @@ void init_GPIO(void)
 
 bool error_check(bool* flag)
 {
-	bool err = gpio_get_level(34);
+	bool err = gpio_get_level(34) || battery_low;
 	*flag = err;
 	return err;
 }
 
-void motor_move(int angle)
+// moves to an absolute motor position, in steps from power-up
+void motor_move(int32_t position)
 {
-	ESP_LOGI(MOTOR_TAG, "running motor");
+	int32_t steps = position - heading.step_count;
+	ESP_LOGI(MOTOR_TAG, "running motor %d steps", steps);
 	// TODO: integrate motor controls
+	motor_sim_steps += steps;
 	vTaskDelay(pdMS_TO_TICKS(2000));
-	ESP_LOGI(MOTOR_TAG, "motor position changed to %d degrees", angle);
+	heading_step(&heading, steps);
+	// confirm the move against the compass, this also catches missed steps
+	compass_update();
+	ESP_LOGI(MOTOR_TAG, "motor now facing %.2f degrees", bm_bam_to_deg(heading_get(&heading)));
 }
 
 bool thermal_snapshot(float* angle_ptr)
@@ -164,18 +252,37 @@ bool thermal_snapshot(float* angle_ptr)
 		return false;
 }
 
-// TODO: remove motor dependency
-void compass_read(float* angle_ptr, int motor)
+void compass_update(void)
 {
 	// TODO: integrate digital compass
 	vTaskDelay(pdMS_TO_TICKS(500));
-	float angle_ref = fmod((float)motor + compass_sim_offset, 360);
+	float motor = motor_sim_steps * 360.0f / heading.cfg.rev_steps;
+	float measured = bm_wrap360f(motor + compass_sim_offset);
+
+	int32_t lost = heading_compass(&heading, bm_deg_to_bam(measured));
+	if(lost != 0)
+		ESP_LOGW(COMPASS_TAG, "motor missed %d steps, %u corrected so far", lost, heading.missed_steps);
+}
+
+void compass_read(float* angle_ptr)
+{
+	compass_update();
+	float angle_ref = bm_bam_to_deg(heading_get(&heading));
 
 	ESP_LOGI(COMPASS_TAG, "camera currently facing %.2f", angle_ref);
 	float angle_therm = *angle_ptr;
 
-	float angle = fmod(angle_ref + angle_therm, 360);
+	float angle = bm_wrap360f(angle_ref + angle_therm);
 	ESP_LOGI(COMPASS_TAG, "fire at %.2f clockwise from north", angle);
 
 	*angle_ptr = angle;
 }
+
+void battery_changed(const battery_reading_t* reading, bool low, void* arg)
+{
+	battery_low = low;
+	if(low)
+		ESP_LOGW(BATTERY_TAG, "battery at %d mV, stopping the sweep", reading->battery_mv);
+	else
+		ESP_LOGI(BATTERY_TAG, "battery at %d mV", reading->battery_mv);
+}
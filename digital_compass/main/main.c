@@ -4,129 +4,152 @@
  *  Created on: Oct 22, 2019
  *      Author: sanfordij
  */
-#include "driver/i2c.h"
-#include "ESP_I2C.h"
+#include "compass.h"
+#include "compass_cal.h"
+#include "bearing_math.h"
 #include "esp_log.h"
+#include "nvs_flash.h"
+#include "driver/gpio.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include <math.h>
+#include "freertos/semphr.h"
 #include "sdkconfig.h"
 
 #define PIN_SDA 14
 #define PIN_CLK 16
-#define I2C_ADDRESS 0b0011110
-#define a 283
+#define PIN_DRDY 27
+
+// turret stepper, wired as in camera_motor with B moved off the compass clock
+#define PIN_A 4
+#define PIN_B 17
+#define PIN_C 5
+#define PIN_D 18
+#define REV_STEPS 200
+
+// the sweep turns a step at a time and lets the compass sample each one,
+// it stops once every sector is covered or after two full turns
+#define CAL_STEP_MS 150
+#define CAL_MAX_STEPS (2 * REV_STEPS)
+
+// log roughly once a second at the default output rate
+#define LOG_EVERY 10
 
 static char *tag = "compass";
 
-#undef ESP_ERROR_CHECK
-#define ESP_ERROR_CHECK(x) do { esp_err_t rc = (x); if (rc != ESP_OK) { ESP_LOGE("err", "esp_err_t = %d", rc); assert(0 && #x);} } while(0);
+static compass_cal_t cal;
+static compass_cal_fit_t fit;
+static bool calibrating = false;
+// the compass task adds to the fit while app_main finishes it
+static SemaphoreHandle_t cal_lock;
+
+static void on_sample(const compass_sample_t* sample, void* arg)
+{
+	static int count = 0;
+
+	xSemaphoreTake(cal_lock, portMAX_DELAY);
+	if (calibrating || ++count % LOG_EVERY) {
+		if (calibrating)
+			compass_cal_add(&fit, sample);
+		xSemaphoreGive(cal_lock);
+		return;
+	}
+	uint16_t heading = compass_heading(&cal, sample);
+	xSemaphoreGive(cal_lock);
+
+	ESP_LOGI(tag, "heading: %.2f, x: %d, y: %d, z: %d, t: %lld us", bm_bam_to_deg(heading),
+			sample->x, sample->y, sample->z, sample->time_us);
+}
+
+static void motor_init(void)
+{
+	const gpio_config_t io_conf = {
+		.pin_bit_mask = 1ULL << PIN_A | 1ULL << PIN_B | 1ULL << PIN_C | 1ULL << PIN_D,
+		.mode = GPIO_MODE_OUTPUT,
+	};
+	ESP_ERROR_CHECK(gpio_config(&io_conf));
+}
+
+// one full step either way, coil pattern A B C D: 1010 0110 0101 1001
+static void motor_step(int dir)
+{
+	static const uint8_t phases[4] = {0xA, 0x6, 0x5, 0x9};
+	static int phase = 0;
+
+	phase = (phase + dir) & 3;
+	gpio_set_level(PIN_A, phases[phase] >> 3 & 1);
+	gpio_set_level(PIN_B, phases[phase] >> 2 & 1);
+	gpio_set_level(PIN_C, phases[phase] >> 1 & 1);
+	gpio_set_level(PIN_D, phases[phase] & 1);
+}
+
+static void calibrate(void)
+{
+	ESP_LOGI(tag, "calibrating, sweeping the turret");
+	xSemaphoreTake(cal_lock, portMAX_DELAY);
+	compass_cal_begin(&fit);
+	calibrating = true;
+	xSemaphoreGive(cal_lock);
+
+	int steps = 0;
+	bool covered = false;
+	while (!covered && steps < CAL_MAX_STEPS) {
+		motor_step(1);
+		steps++;
+		vTaskDelay(pdMS_TO_TICKS(CAL_STEP_MS));
+		xSemaphoreTake(cal_lock, portMAX_DELAY);
+		covered = compass_cal_covered(&fit);
+		xSemaphoreGive(cal_lock);
+	}
+
+	xSemaphoreTake(cal_lock, portMAX_DELAY);
+	calibrating = false;
+	esp_err_t err = compass_cal_finish(&fit, &cal);
+	if (err != ESP_OK)
+		compass_cal_identity(&cal);
+	xSemaphoreGive(cal_lock);
+
+	// unwind the cable
+	for (int i = 0; i < steps; i++) {
+		motor_step(-1);
+		vTaskDelay(pdMS_TO_TICKS(10));
+	}
+
+	if (err != ESP_OK) {
+		ESP_LOGE(tag, "calibration failed after %d steps, %d samples: %s",
+				steps, fit.count, esp_err_to_name(err));
+		return;
+	}
+	ESP_LOGI(tag, "covered in %d steps", steps);
+	ESP_LOGI(tag, "hard iron: %.1f %.1f, soft iron: %.3f %.3f %.3f",
+			cal.offset[0], cal.offset[1], cal.soft[0][0], cal.soft[0][1], cal.soft[1][1]);
+	ESP_ERROR_CHECK(compass_cal_save(&cal));
+}
 
 void app_main(void) {
 	ESP_LOGD(tag, ">> LIS2MDLTR");
-	i2c_config_t conf;
-	conf.mode = I2C_MODE_MASTER;
-	conf.sda_io_num = PIN_SDA;
-	conf.scl_io_num = PIN_CLK;
-	conf.sda_pullup_en = GPIO_PULLUP_ENABLE;
-	conf.scl_pullup_en = GPIO_PULLUP_ENABLE;
-	conf.master.clk_speed = 100000;
-	ESP_ERROR_CHECK(i2c_param_config(I2C_NUM_0, &conf));
-	ESP_ERROR_CHECK(i2c_driver_install(I2C_NUM_0, I2C_MODE_MASTER, 0, 0, 0));
-
-	uint8_t data[6];
-
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (I2C_ADDRESS << 1) | I2C_MASTER_WRITE, 1);
-	i2c_master_write_byte(cmd, 0x60, 1); // Config A
-	i2c_master_write_byte(cmd, 0x80, 1); // Enable temp compensation and setup configuration register A according to datasheet guidelines
-	i2c_master_stop(cmd);
-	i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(1000));
-	i2c_cmd_link_delete(cmd);
-
-	//maybe delete config B if not necessary
-	//Set value in "Configuration Register B"
-	cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (I2C_ADDRESS << 1) | I2C_MASTER_WRITE, 1);
-	i2c_master_write_byte(cmd, 0x61, 1); // "Configuration Register B"
-	i2c_master_write_byte(cmd, 0x07, 1); // default setting check for later to know registers
-	i2c_master_stop(cmd);
-	i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(1000));
-	i2c_cmd_link_delete(cmd);
-
-	//Set value in "Configuration Register C"
-	cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (I2C_ADDRESS << 1) | I2C_MASTER_WRITE, 1);
-	i2c_master_write_byte(cmd, 0x62, 1); // "Configuration Register C"
-	i2c_master_write_byte(cmd, 0x01, 1); // Setup configuration register C according to datasheet guidelines
-	i2c_master_stop(cmd);
-	i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(1000));
-	i2c_cmd_link_delete(cmd);
-
-	//Set active register to "Identification Register"
-	cmd = i2c_cmd_link_create();
-	ESP_ERROR_CHECK(i2c_master_start(cmd));
-	ESP_ERROR_CHECK(i2c_master_write_byte(cmd, (I2C_ADDRESS << 1) | I2C_MASTER_WRITE, 1));
-	ESP_ERROR_CHECK(i2c_master_write_byte(cmd, 0x4F, 1)); //"Identification Register"
-	ESP_ERROR_CHECK(i2c_master_stop(cmd));
-	ESP_ERROR_CHECK(i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(100)));
-	i2c_cmd_link_delete(cmd);
-
-	//Get data from Identification Register A, B and C
-	cmd = i2c_cmd_link_create();
-	ESP_ERROR_CHECK(i2c_master_start(cmd));
-	ESP_ERROR_CHECK(i2c_master_write_byte(cmd, (I2C_ADDRESS << 1) | I2C_MASTER_READ, 1));
-	i2c_master_read_byte(cmd, data, 0);
-	i2c_master_read_byte(cmd, data + 1, 0);
-	i2c_master_read_byte(cmd, data + 2, 1);
-	ESP_ERROR_CHECK(i2c_master_stop(cmd));
-	ESP_ERROR_CHECK(i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(100)));
-	i2c_cmd_link_delete(cmd);
-
-	while (1) {
-		//Set active register to "Data Output X MSB Register"
-		cmd = i2c_cmd_link_create();
-		i2c_master_start(cmd);
-		i2c_master_write_byte(cmd, (I2C_ADDRESS << 1) | I2C_MASTER_WRITE, 1);
-		i2c_master_write_byte(cmd, 0x68 + 0x80, 1); //0x69 = "Data Output X MSB Register" 0x80 = Auto increment
-//		i2c_master_stop(cmd);
-//		i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(1000));
-//		i2c_cmd_link_delete(cmd);
-
-		//Read values for X, Y and Z
-//		cmd = i2c_cmd_link_create();
-		i2c_master_start(cmd);
-		i2c_master_write_byte(cmd, (I2C_ADDRESS << 1) | I2C_MASTER_READ, 1);
-		i2c_master_read_byte(cmd, data, 0); //"Data Output X LSB Register"
-		i2c_master_read_byte(cmd, data + 1, 0); //"Data Output X MSB Register"
-		i2c_master_read_byte(cmd, data + 2, 0); //"Data Output Y LSB Register"
-		i2c_master_read_byte(cmd, data + 3, 0); //"Data Output Y MSB Register"
-		i2c_master_read_byte(cmd, data + 4, 0); //"Data Output Z LSB Register"
-		i2c_master_read_byte(cmd, data + 5, 1); //"Data Output Z MSB Register"
-		i2c_master_stop(cmd);
-		i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(1000));
-		i2c_cmd_link_delete(cmd);
-
-		short x = data[1] << 8 | data[0];
-		short y = data[3] << 8 | data[2];
-		short z = data[5] << 8 | data[4];
-		if(x>a){
-			x=a;
-		}
-		else if(x<(-a)){
-			x=-a;
-		}
-		int angle = (acos((double)x/a))*(180/M_PI);
-		//int angle = atan2((double)y,(double)x) * (180 / 3.14159265) + 180; // angle in degrees
-		//ESP_LOGD(tag, "angle: %d, x: %d, y: %d, z: %d", angle, x, y, z);
-		printf("angle: %d, x: %d, y: %d, z: %d \n", angle, x, y, z);
-		// int angle = atan2((double) y, (double) x) * (180 / 3.14159265) + 180; // angle in degrees
-		ESP_LOGI(tag, "angle: %d, x: %d, y: %d, z: %d", angle, x, y, z);
-		vTaskDelay(pdMS_TO_TICKS(1000));
+	esp_err_t err = nvs_flash_init();
+	if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+		ESP_ERROR_CHECK(nvs_flash_erase());
+		err = nvs_flash_init();
 	}
+	ESP_ERROR_CHECK(err);
+
+	cal_lock = xSemaphoreCreateMutex();
+	compass_cal_identity(&cal);
+	bool have_cal = compass_cal_load(&cal) == ESP_OK;
+
+	compass_config_t conf = {
+		.port = I2C_NUM_0,
+		.sda = PIN_SDA,
+		.scl = PIN_CLK,
+		.clk_speed = 100000,
+		.drdy = PIN_DRDY,
+		.odr = COMPASS_ODR_10HZ,
+	};
+	ESP_ERROR_CHECK(compass_init(&conf));
+	ESP_ERROR_CHECK(compass_subscribe(on_sample, NULL));
+	motor_init();
 
-	vTaskDelete(NULL);
+	if (!have_cal)
+		calibrate();
 }
@@ -7,13 +7,14 @@
  This lab focuses on creating an External UI to display output and
  state logic, which the final design will incorporate
 
- The main loop will handle the next state logic and the current state
- logic, while the function external_update will display the state
- information to a laptop screen.
-
- The variables state and next_state are used to properly update the
- state logic, and 5 pushbuttons that will be read by the ESP32 will
- update these variables.
+ The next state logic is the shared system_state transition table,
+ driven by button edges. The main loop handles the current state logic,
+ while the function external_update will display the state information
+ to a laptop screen whenever the state changes or two seconds pass.
+
+ The variable state holds the engine's state (system_state_t, same
+ numbering as below), and the edges of 4 of the 5 pushbuttons read by
+ the ESP32 are the events that move it.
  //========================================================================//
  States and state variable value:
  ->Reset = 0x00
@@ -69,6 +70,10 @@
 
  ->Pin 16 will be connected to the GPS button.
  -- Non-Priority (doesn't decide state logic)
+
+ ->Pin 18 (UART1 RX) takes framed event records (event_record.h) from the
+ -- controller's GPIO17. Once one has arrived its position replaces the GPS
+ -- options and a fire record adds its bearing to the fire alert line.
  //========================================================================//
  Display:
 
@@ -101,14 +106,17 @@
 
 #include "nvs_flash.h"
 #include "driver/gpio.h"
+#include "driver/uart.h"
+#include "event_record.h"
+#include "system_state.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 const char* MAIN_TAG = "main";
 
 int state = 0;
-int next_state = 0;
 
 int clr = 0;
 int GPS = 0;
@@ -116,16 +124,14 @@ int fire_alert = 0;
 int comm_error = 0;
 int intern_error = 0;
 
-int clr_read = 0;
-int GPS_read = 0;
-int fire_alert_read = 0;
-int comm_error_read = 0;
-int intern_error_read = 0;
-
 int cam_angle = 0;
 int cam_print = 0;
 int tilt_print = 21; //degrees out of 57 degrees
 
+event_record_t last_event;
+int have_event = 0;
+int event_uart_ok = 0;
+
 #define GPIO_INPUT_IO_0          15
 #define GPIO_INPUT_IO_1          4
 #define GPIO_INPUT_IO_2          17
@@ -133,102 +139,136 @@ int tilt_print = 21; //degrees out of 57 degrees
 #define GPIO_INPUT_IO_4          16
 #define GPIO_INPUT_PIN_SEL  ((1ULL<<GPIO_INPUT_IO_0) | (1ULL<<GPIO_INPUT_IO_1) | (1ULL<<GPIO_INPUT_IO_2) |(1ULL<<GPIO_INPUT_IO_3) | (1ULL<<GPIO_INPUT_IO_4))
 
+#define EVENT_UART               UART_NUM_1
+#define EVENT_RX_PIN             18
+#define EVENT_BAUD               115200
+#define EVENT_RX_BUF             1024   // a controller replay of 16 frames between redraws
+#define DEBOUNCE_MS              30
+
 void external_update(void);
 void init_gpio(void);
+void post_buttons(void);
+void init_event_uart(void);
+void read_events(void);
+
+TaskHandle_t main_task;
+
+// Button edges as engine events, active low, listed in priority order
+const struct {
+	int pin;
+	system_event_t press;
+	int release;                // -1 for none
+} buttons[] = {
+	{GPIO_INPUT_IO_0, SYSTEM_EV_RESET,     SYSTEM_EV_START},
+	{GPIO_INPUT_IO_1, SYSTEM_EV_FAULT,     -1},
+	{GPIO_INPUT_IO_2, SYSTEM_EV_COMM_LOST, SYSTEM_EV_COMM_OK},
+	{GPIO_INPUT_IO_3, SYSTEM_EV_FIRE,      SYSTEM_EV_FIRE_CLEAR},
+};
+#define BUTTON_COUNT             ((int) (sizeof(buttons) / sizeof(buttons[0])))
+
+// Current state outputs, fire_alert -1 keeps the last known value
+const struct {
+	int clr;
+	int fire_alert;
+	int comm_error;
+	int intern_error;
+	int cam_moves;
+} outputs[SYSTEM_STATE_COUNT] = {
+	[SYSTEM_RESET]          = {1,  0, 0, 0, 0},
+	[SYSTEM_ACQUIRE]        = {1,  0, 0, 0, 0},
+	[SYSTEM_SEARCH]         = {0,  0, 0, 0, 1},
+	[SYSTEM_FIRE_ALERT]     = {0,  1, 0, 0, 0},
+	[SYSTEM_COMM_ERROR]     = {0, -1, 1, 0, 0},
+	[SYSTEM_INTERNAL_ERROR] = {1,  0, 0, 1, 0},
+};
+
+// Tick of the last edge each button posted
+TickType_t last_edge[BUTTON_COUNT];
+
+// Contact bounce would fill the engine's queue and the final edge could be
+// lost, so edges are only posted a debounce time apart. The main loop posts
+// every button's level again on each pass, which catches the settled level.
+void button_isr(void* arg) {
+	int i = (int) arg;
+	BaseType_t woken = pdFALSE;
+	TickType_t now = xTaskGetTickCountFromISR();
+	if (now - last_edge[i] < pdMS_TO_TICKS(DEBOUNCE_MS)) {
+		return;
+	}
+	last_edge[i] = now;
+	if (gpio_get_level(buttons[i].pin) == 0) {
+		system_state_post_from_isr(buttons[i].press, &woken);
+	} else if (buttons[i].release >= 0) {
+		system_state_post_from_isr(buttons[i].release, &woken);
+	}
+	if (woken) {
+		portYIELD_FROM_ISR();
+	}
+}
+
+void state_changed(system_state_t from, system_state_t to, uint32_t flags, void* arg) {
+	xTaskNotifyGive(main_task);
+}
+
+// A level posted again is a no-op for the engine
+void post_buttons(void) {
+	for (int i = 0; i < BUTTON_COUNT; i++) {
+		if (gpio_get_level(buttons[i].pin) == 0) {
+			system_state_post(buttons[i].press);
+		} else if (buttons[i].release >= 0) {
+			system_state_post(buttons[i].release);
+		}
+	}
+}
 
 //========================================================================//
 
 void app_main(void) {
+	main_task = xTaskGetCurrentTaskHandle();
+	ESP_ERROR_CHECK(system_state_init(SYSTEM_RESET, 0));
+	ESP_ERROR_CHECK(system_state_subscribe(state_changed, NULL));
 	init_gpio();
+	init_event_uart();
 	vTaskDelay(pdMS_TO_TICKS(2000));
 
+	// buttons already held at power up count as pressed
+	post_buttons();
+
 	//====================================================================//
-	//======================== Next State Logic ==========================//
+	//==================== Next State Logic (engine) =====================//
+	// The system_state transition table replaces the nested ifs, button
+	// edges post events and every change wakes this loop to redraw.
 	while (1) {
-		//input reads
-		clr_read = gpio_get_level(GPIO_INPUT_IO_0);
-		intern_error_read = gpio_get_level(GPIO_INPUT_IO_1);
-		comm_error_read = gpio_get_level(GPIO_INPUT_IO_2);
-		fire_alert_read = gpio_get_level(GPIO_INPUT_IO_3);
-		GPS_read = gpio_get_level(GPIO_INPUT_IO_4);
-
-		if (clr_read == 0) {
-			next_state = 0;
-		} else {
-			if (intern_error_read == 0) {
-				next_state = 5;
-			} else {
-				if (comm_error_read == 0) {
-					if (state == 0) {
-						next_state = 1;
-					} else if (state == 5) {
-						next_state = 5;
-					} else {
-						next_state = 4;
-					}
-				} else {
-					if (fire_alert_read == 0) {
-						if (state == 0) {
-							next_state = 1;
-						} else if (state == 5) {
-							next_state = 5;
-						} else {
-							next_state = 3;
-						}
-					} else {
-						if (state == 0) {
-							next_state = 1;
-						} else if (state == 5) {
-							next_state = 5;
-						} else {
-							next_state = 2;
-						}
-					}
-				}
-			}
-		}
+		read_events();
+		post_buttons();
+		state = system_state_get();
 
-		//====================== End Next State Logic ========================//
-		//====================================================================//
-		//--------------------------------------------------------------------//
 		//====================================================================//
 		//======================= Current State Logic ========================//
-		if (state == 0) {
-			if (GPS_read == 0) { // GPS button press                  Non-Priority
-				GPS = 1;
-			} else {
-				GPS = 0;
-			}
-			clr = 1;
-			intern_error = 0;
-			fire_alert = 0;
-			comm_error = 0;
-		} else if (state == 1) {
-			clr = 0;
-		} else if (state == 2) {
-			clr = 0;
-			fire_alert = 0;
-			comm_error = 0;
+		if (state == SYSTEM_RESET || state == SYSTEM_ACQUIRE) {
+			GPS = gpio_get_level(GPIO_INPUT_IO_4) == 0; // GPS button press    Non-Priority
+		}
+		clr = outputs[state].clr;
+		intern_error = outputs[state].intern_error;
+		comm_error = outputs[state].comm_error;
+		if (outputs[state].fire_alert >= 0) {
+			fire_alert = outputs[state].fire_alert;
+		}
+		if (outputs[state].cam_moves) {
 			if (cam_angle <= 7) {
 				cam_angle = cam_angle + 1;
 			} else {
 				cam_angle = 0;
 			}
-		} else if (state == 3) {             // fire alert state
-			fire_alert = 1;
-			comm_error = 0;
-		} else if (state == 4) {             // communication error state
-			comm_error = 1;
-		} else {        // internal error state
-			clr = 1;
-			intern_error = 1;
-			fire_alert = 0;
-			comm_error = 0;
 		}
 		//===================== End Current State Logic ======================//
 		//====================================================================//
-		state = next_state;       //state update
 		external_update();         //print update
+
+		// the GPS screen has been shown, go on searching
+		if (state == SYSTEM_ACQUIRE) {
+			system_state_post(SYSTEM_EV_POSITION);
+		}
 	}
 }
 
@@ -248,11 +288,14 @@ void app_main(void) {
 void external_update() {
 	if (clr == 1) {
 		//clear screen                            lines[1-5]
-		if (state != 1) {
+		if (state != SYSTEM_ACQUIRE) {
 			ESP_LOGI(MAIN_TAG, "\n\n\n\n\n");
-		} else if (state == 1) {  //display GPS         lines[1-5]
+		} else if (state == SYSTEM_ACQUIRE) {  //display GPS  lines[1-5]
 			ESP_LOGI(MAIN_TAG, " ");
-			if (GPS == 1) {
+			if (have_event) {
+				//display "[event position] degrees"    line [2]
+				ESP_LOGI(MAIN_TAG, "%.4f, %.4f", last_event.latitude * 1e-7, last_event.longitude * 1e-7);
+			} else if (GPS == 1) {
 				//display "[GPS Option #1] degrees"     line [2]
 				ESP_LOGI(MAIN_TAG, "12.3456");
 			} else {
@@ -277,7 +320,10 @@ void external_update() {
 		}
 		//display "[tilt_print] degrees"              line [1]
 		ESP_LOGI(MAIN_TAG, "0 degrees");
-		if (GPS == 1) {
+		if (have_event) {
+			//display "[event position] degrees"    line [2]
+			ESP_LOGI(MAIN_TAG, "%.4f, %.4f", last_event.latitude * 1e-7, last_event.longitude * 1e-7);
+		} else if (GPS == 1) {
 			//display "[GPS Option #1] degrees"     line [2]
 			ESP_LOGI(MAIN_TAG, "12.3456");
 		} else {
@@ -293,7 +339,10 @@ void external_update() {
 		}
 		//display "              "              line [4]
 		ESP_LOGI(MAIN_TAG, "\n");
-		if (fire_alert == 1) {
+		if (have_event && (last_event.status & EVENT_FIRE)) {
+			//display "fire_alert [bearing] degrees" line [5]
+			ESP_LOGI(MAIN_TAG, "fire_alert %d degrees", last_event.bearing * 360 / 65536);
+		} else if (fire_alert == 1) {
 			//display "fire_alert"                  line [5]
 			ESP_LOGI(MAIN_TAG, "fire_alert");
 		} else {
@@ -301,11 +350,69 @@ void external_update() {
 			ESP_LOGI(MAIN_TAG, "nothing detected");
 		}
 	}
-	vTaskDelay(pdMS_TO_TICKS(2000));
+	ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(2000));
 }
 
 //========================= End Printing Logic ===========================//
 //========================================================================//
+//=========================== Event Records ==============================//
+
+/* Without the event UART the display still follows the buttons, it just
+ * never shows a controller's position or bearing.
+ */
+
+void init_event_uart(void) {
+	const uart_config_t uart_config = {
+		.baud_rate = EVENT_BAUD,
+		.data_bits = UART_DATA_8_BITS,
+		.parity = UART_PARITY_DISABLE,
+		.stop_bits = UART_STOP_BITS_1,
+		.flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+	};
+	esp_err_t err = uart_param_config(EVENT_UART, &uart_config);
+	if (err == ESP_OK) {
+		err = uart_set_pin(EVENT_UART, UART_PIN_NO_CHANGE, EVENT_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+	}
+	if (err == ESP_OK) {
+		err = uart_driver_install(EVENT_UART, EVENT_RX_BUF, 0, 0, NULL, 0);
+	}
+	if (err != ESP_OK) {
+		ESP_LOGE(MAIN_TAG, "event UART not available: %s", esp_err_to_name(err));
+		return;
+	}
+	event_uart_ok = 1;
+}
+
+/* Each record comes behind two sync bytes and its length. Bytes before a
+ * sync pair are dropped, and so is a frame whose length or CRC is wrong,
+ * a byte at a time until the stream lines up again.
+ */
+
+void read_events(void) {
+	static uint8_t rx[2 * EVENT_FRAME_LEN];
+	static size_t fill = 0;
+	size_t used;
+
+	if (!event_uart_ok) {
+		return;
+	}
+	int got = uart_read_bytes(EVENT_UART, rx + fill, sizeof(rx) - fill, 0);
+	if (got > 0) {
+		fill += got;
+	}
+	do {
+		const event_record_t* ev = event_record_unframe(rx, fill, &used);
+		if (ev != NULL) {
+			last_event = *ev;
+			have_event = 1;
+		}
+		fill -= used;
+		memmove(rx, rx + used, fill);
+	} while (used > 0);
+}
+
+//========================= End Event Records ============================//
+//========================================================================//
 
 void init_gpio(void) {
 	// pin [15,2,0,4,16] setup
@@ -317,7 +424,14 @@ void init_gpio(void) {
 	io_conf.mode = GPIO_MODE_INPUT;
 	//enable pull-up mode
 	io_conf.pull_up_en = 1;
+	io_conf.pull_down_en = 0;
+	//both edges, presses and releases are events
+	io_conf.intr_type = GPIO_INTR_ANYEDGE;
 	gpio_config(&io_conf);
+	gpio_install_isr_service(0);
+	for (int i = 0; i < BUTTON_COUNT; i++) {
+		gpio_isr_handler_add(buttons[i].pin, button_isr, (void*) i);
+	}
 }
 
 //========================================================================//
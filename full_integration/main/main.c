@@ -5,6 +5,13 @@
 #include "esp_event_loop.h"
 #include "nvs_flash.h"
 #include "driver/gpio.h"
+#include "esp_log.h"
+#include "battery.h"
+
+static void battery_changed(const battery_reading_t *reading, bool low, void *arg)
+{
+    ESP_LOGI("battery", "%d mV%s", reading->battery_mv, low ? ", LOW VOLTAGE" : "");
+}
 
 esp_err_t event_handler(void *ctx, system_event_t *event)
 {
@@ -14,6 +21,9 @@ esp_err_t event_handler(void *ctx, system_event_t *event)
 void app_main(void)
 {
     nvs_flash_init();
+    battery_config_t battery_config = BATTERY_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK( battery_init(&battery_config) );
+    ESP_ERROR_CHECK( battery_subscribe(10000, 10500, battery_changed, NULL) );
     tcpip_adapter_init();
     ESP_ERROR_CHECK( esp_event_loop_init(event_handler, NULL) );
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
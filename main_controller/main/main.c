@@ -4,8 +4,12 @@
  * Date: Feb. 10th, 2020
  *
  * GPIO status:
- * GPIO17: input, pulled up, connected to switch 2.
+ * GPIO25: input, pulled up, connected to switch 2 (was GPIO17, moved to an
+ *         RTC pin so the ULP can watch it during deep sleep).
  * GPIO34: ADC for voltage monitoring.
+ * GPIO16/GPIO4: GPS UART RX/TX.
+ * GPIO5: GPS PPS input.
+ * GPIO17: UART1 TX, framed event records to the external UI.
  *
  * Update: Integrate voltage monitoring into main controller.
  * Date: May 16th, 2020
@@ -19,6 +23,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "driver/gpio.h"
+#include "driver/uart.h"
 
 #include "esp_wifi.h"
 #include "esp_system.h"
@@ -26,144 +31,321 @@
 #include "nvs_flash.h"
 
 #include "esp_log.h"
-#include "driver/adc.h"
-#include "esp_adc_cal.h"
+#include "battery.h"
+#include "power.h"
+#include "sleep_cycle.h"
+#include "ulp_watch.h"
+#include "esp_attr.h"
+#include "gps_manager.h"
+#include "timebase.h"
+#include "event_record.h"
+#include "event_journal.h"
+#include "system_state.h"
 
 unsigned int fireDetect(unsigned int angle);
 
-#define DEFAULT_VREF    1100        //Use adc2_vref_to_gpio() to obtain a better estimate
-#define NO_OF_SAMPLES   8192        //Multisampling
+// Fire switch, RTC capable so the ULP can watch it
+#define FIRE_SWITCH_PIN 25
+
+#define GPS_RX_PIN      16
+#define GPS_TX_PIN      4
+#define GPS_PPS_PIN     5
+
+// Events leave on their own UART, the console stays text only
+#define EVENT_UART      UART_NUM_1
+#define EVENT_TX_PIN    17
+#define EVENT_BAUD      115200
+// Time for a full replay to leave the FIFO before the clocks stop
+#define EVENT_TX_WAIT_MS    100
+
+// battery is low under 10 V, and only counts as recovered above 10.5 V
+#define LOW_VOLTAGE_MV      10000
+#define RECOVERED_MV        10500
 
 static const char* VM_TAG = "vm";
 
-static esp_adc_cal_characteristics_t *adc_chars;
-static const adc_channel_t channel = ADC_CHANNEL_6;     //GPIO34
-static const adc_atten_t atten = ADC_ATTEN_DB_0;
-static const adc_unit_t unit = ADC_UNIT_1;
+static TaskHandle_t main_task;
 
-static const float SSF = 23.14;
+// Kept in RTC memory so a deep sleep wake can skip NVS and the GPS wait
+static RTC_DATA_ATTR gps_cache_t rtc_position;
+static RTC_DATA_ATTR uint32_t rtc_events;
+static RTC_DATA_ATTR system_state_t rtc_state;
+static RTC_DATA_ATTR uint32_t rtc_flags;
 
-static void check_efuse(void)
+static bool gps_started = false;
+
+static void battery_changed(const battery_reading_t* reading, bool low, void* arg)
 {
-    //Check TP is burned into eFuse
-    if (esp_adc_cal_check_efuse(ESP_ADC_CAL_VAL_EFUSE_TP) == ESP_OK) {
-        ESP_LOGI(VM_TAG, "eFuse Two Point: Supported");
-    } else {
-        ESP_LOGI(VM_TAG, "eFuse Two Point: NOT supported");
-    }
+    ESP_LOGI(VM_TAG, "Raw: %d\tVoltage: %d mV\tUpscaled: %d mV", reading->raw, reading->adc_mv, reading->battery_mv);
+    if (low)
+        ESP_LOGI(VM_TAG, "LOW VOLTAGE");
+    system_state_post(low ? SYSTEM_EV_BATTERY_LOW : SYSTEM_EV_BATTERY_OK);
+}
 
-    //Check Vref is burned into eFuse
-    if (esp_adc_cal_check_efuse(ESP_ADC_CAL_VAL_EFUSE_VREF) == ESP_OK) {
-        ESP_LOGI(VM_TAG, "eFuse Vref: Supported\n");
-    } else {
-        ESP_LOGI(VM_TAG, "eFuse Vref: NOT supported");
-    }
+static void fire_switch_isr(void* arg)
+{
+    BaseType_t woken = pdFALSE;
+    system_state_post_from_isr(gpio_get_level(FIRE_SWITCH_PIN) ? SYSTEM_EV_FIRE : SYSTEM_EV_FIRE_CLEAR, &woken);
+    if (woken)
+        portYIELD_FROM_ISR();
 }
 
-static void print_char_val_type(esp_adc_cal_value_t val_type)
+// Any change in state or inputs makes an event now instead of next sweep
+static void state_changed(system_state_t from, system_state_t to, uint32_t flags, void* arg)
 {
-    if (val_type == ESP_ADC_CAL_VAL_EFUSE_TP) {
-        ESP_LOGI(VM_TAG, "Characterized using Two Point Value");
-    } else if (val_type == ESP_ADC_CAL_VAL_EFUSE_VREF) {
-        ESP_LOGI(VM_TAG, "Characterized using eFuse Vref");
-    } else {
-        ESP_LOGI(VM_TAG, "Characterized using Default Vref");
+    rtc_state = to;
+    rtc_flags = flags;
+    if (from != to)
+        printf("State: %s\n", system_state_name(to));
+    xTaskNotifyGive(main_task);
+}
+
+static void power_changed(const power_profile_t* profile, void* arg)
+{
+    ESP_LOGI(VM_TAG, "Power profile %s: sweep every %d s, %d headings",
+             profile->name, profile->sweep_interval_s, profile->headings);
+}
+
+// The external UI reads events as framed records off the event UART, the
+// console gets them as text. Both are fed through the flash journal, so a
+// reset between creating and reporting one does not lose it
+static esp_err_t report_event(const event_record_t* ev, void* arg)
+{
+    uint8_t frame[EVENT_FRAME_LEN];
+    size_t len = event_record_frame(ev, frame, sizeof(frame));
+    printf("Event %u. status 0x%.2X bearing %d %lld\n", ev->sequence, ev->status, ev->bearing * 360 / 65536, ev->time_us);
+    ESP_LOG_BUFFER_HEX(VM_TAG, ev, sizeof(*ev));
+    printf("\n");
+    if (uart_write_bytes(EVENT_UART, (const char*)frame, len) != (int)len)
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
+static void event_uart_init(void)
+{
+    const uart_config_t uart_config = {
+        .baud_rate = EVENT_BAUD,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+    };
+    ESP_ERROR_CHECK(uart_param_config(EVENT_UART, &uart_config));
+    ESP_ERROR_CHECK(uart_set_pin(EVENT_UART, EVENT_TX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+    // The driver wants an RX buffer even though nothing is read back
+    ESP_ERROR_CHECK(uart_driver_install(EVENT_UART, 256, 0, 0, NULL, 0));
+}
+
+// The held clock aids the receiver on each wake, together with the position
+static bool held_utc(int64_t* utc_us, int64_t* error_us)
+{
+    *error_us = timebase_error_us();
+    *utc_us = now_utc_us();
+    return *error_us >= 0;
+}
+
+// The tower does not move, a cached position is good immediately and the
+// receiver only wakes every few hours to keep time and ephemeris fresh
+static const gps_manager_config_t gps_config = {
+    .gps = {
+        .port = UART_NUM_2,
+        .baud_rate = 9600,
+        .ubx_baud_rate = 115200,
+        .rx_pin = GPS_RX_PIN,
+        .tx_pin = GPS_TX_PIN,
+    },
+    .power_pin = GPS_NO_POWER_PIN,
+    .fix_timeout_s = 300,
+    .on_time_s = 30,
+    .refresh_interval_s = 4 * 3600,
+    .utc_time = held_utc,
+};
+
+// Longest refresh, the manager also waits a second for the receiver to boot
+#define GPS_REFRESH_MS  ((gps_config.fix_timeout_s + gps_config.on_time_s + 5) * 1000)
+
+// A hot start from backup has the PPS labelled within seconds
+#define TIME_WAIT_MS    10000
+
+static void start_gps(void)
+{
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
     }
+    ESP_ERROR_CHECK(err);
+
+    ESP_ERROR_CHECK(gps_manager_start(&gps_config));
+    ESP_ERROR_CHECK(timebase_init(GPS_PPS_PIN));
+    gps_started = true;
 }
 
 void app_main(void){
-	gpio_set_direction(17, GPIO_MODE_INPUT);
+    main_task = xTaskGetCurrentTaskHandle();
+    sleep_cycle_wake_t wake = sleep_cycle_begin();
+    if (sleep_cycle_warm()) {
+        // Hand the ADC and switch pin back from the ULP, its battery
+        // verdict stands until the first reading
+        ulp_watch_stop();
+        ESP_ERROR_CHECK(system_state_init(rtc_state, rtc_flags));
+        system_state_post(ulp_watch_battery_low() ? SYSTEM_EV_BATTERY_LOW : SYSTEM_EV_BATTERY_OK);
+        if (wake == SLEEP_CYCLE_ULP)
+            printf("ULP wake:%s%s, battery %d mV\n",
+                   ulp_watch_reason() & ULP_WATCH_BATTERY ? " battery" : "",
+                   ulp_watch_level(FIRE_SWITCH_PIN) ? " fire switch" : "",
+                   ulp_watch_battery_mv());
+    } else {
+        rtc_state = SYSTEM_RESET;
+        rtc_flags = 0;
+        ESP_ERROR_CHECK(system_state_init(SYSTEM_RESET, 0));
+        system_state_post(SYSTEM_EV_START);
+    }
+    ESP_ERROR_CHECK(system_state_subscribe(state_changed, NULL));
+
+	gpio_set_direction(FIRE_SWITCH_PIN, GPIO_MODE_INPUT);
+	gpio_set_pull_mode(FIRE_SWITCH_PIN, GPIO_PULLUP_ONLY);
+	gpio_set_intr_type(FIRE_SWITCH_PIN, GPIO_INTR_ANYEDGE);
+	esp_err_t isr_err = gpio_install_isr_service(0);
+	if (isr_err != ESP_OK && isr_err != ESP_ERR_INVALID_STATE)
+		ESP_ERROR_CHECK(isr_err);
+	ESP_ERROR_CHECK(gpio_isr_handler_add(FIRE_SWITCH_PIN, fire_switch_isr, NULL));
 
-    printf("Start GPS fix\n");
-    // Generate a random waiting time for GPS to fix
-    int delayTime = rand() % 30;
-    vTaskDelay(pdMS_TO_TICKS(delayTime * 1000));
-    printf("GPS locked to the satellite\nWaiting time = %d seconds\n", delayTime);
+    gps_cache_t position;
+    if (sleep_cycle_warm()) {
+        // Fast path: while the GPS is in backup mode NVS is not touched
+        position = rtc_position;
+        printf("Woke by %s after %d events, position from RTC memory\n",
+               wake == SLEEP_CYCLE_ULP ? "ULP" : "timer", rtc_events);
+        // The receiver came out of backup when its period ran out and stays
+        // on until the manager refreshes it and sends it back. The root drops
+        // events without time, so a clock that drifted too far over deep
+        // sleep brings the refresh forward and the event waits for the PPS
+        bool need_time = !timebase_synced();
+        if (gps_manager_due() || need_time)
+            start_gps();
+        if (need_time) {
+            gps_manager_refresh();
+            for (int waited = 0; waited < TIME_WAIT_MS && !timebase_synced(); waited += 100)
+                vTaskDelay(pdMS_TO_TICKS(100));
+        }
+    } else {
+        start_gps();
+        printf("Start GPS fix\n");
+        while (!gps_manager_wait(&position, 30000))
+            printf("Still waiting for GPS fix\n");
+        rtc_position = position;
+        system_state_post(SYSTEM_EV_POSITION);
+    }
 
-    unsigned int gpsLat;
-    unsigned int gpsLong;
-    unsigned int status = 0;
+    // Station MAC identifies the tower in its events
+    uint8_t mac[6];
+    ESP_ERROR_CHECK(esp_efuse_mac_get_default(mac));
+    const uint32_t node = event_node_id(mac);
 
-    // Generate random latitude and longitude values
-	gpsLat = rand() % (180 + 1 - 0) + 0;
-	gpsLong = rand() % (360 + 1 - 0) + 0;
-    printf("Latitude: %d\n", gpsLat);
-    printf("Longitude: %d\n", gpsLong);
+    printf("Latitude: %.7f\n", nmea_deg(position.latitude));
+    printf("Longitude: %.7f\n", nmea_deg(position.longitude));
 
-    unsigned int voltFlag = 0;
     unsigned int fireAngle = 0;
     unsigned int fireFlag;
 
-    //Check if Two Point or Vref are burned into eFuse
-    check_efuse();
+    // ADC sampling runs in the battery component, only crossings come back
+    const battery_config_t battery_config = BATTERY_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(battery_init(&battery_config));
+    ESP_ERROR_CHECK(battery_subscribe(LOW_VOLTAGE_MV, RECOVERED_MV, battery_changed, NULL));
 
-    //Configure ADC
-    adc1_config_width(ADC_WIDTH_BIT_12);
-    adc1_config_channel_atten(channel, atten);
+    // Cycle rate, modem and camera power follow the battery
+    power_config_t power_config = POWER_CONFIG_DEFAULT();
+    power_config.on_change = power_changed;
+    // The fire switch cuts a light sleep short
+    power_config.wake_pin = FIRE_SWITCH_PIN;
+    // The first ADC reading is a decimation block away, the ULP's stands in
+    if (sleep_cycle_warm())
+        power_config.wake_mv = ulp_watch_battery_mv();
+    ESP_ERROR_CHECK(power_init(&power_config));
 
-    //Characterize ADC
-    adc_chars = calloc(1, sizeof(esp_adc_cal_characteristics_t));
-    esp_adc_cal_value_t val_type = esp_adc_cal_characterize(unit, atten, ADC_WIDTH_BIT_12, DEFAULT_VREF, adc_chars);
-    print_char_val_type(val_type);
+    event_uart_init();
+    const event_journal_config_t journal_config = EVENT_JOURNAL_CONFIG_DEFAULT();
+    if (event_journal_init(&journal_config) != ESP_OK)
+        ESP_LOGW(VM_TAG, "No event journal, events are not kept");
 
     while(1){
-        printf("Check voltage level\n");
-        uint32_t adc_reading = 0;
-        //Multisampling
-        for (int i = 0; i < NO_OF_SAMPLES; i++) {
-            if (unit == ADC_UNIT_1)
-                adc_reading += adc1_get_raw((adc1_channel_t)channel);
-        }
-        adc_reading /= NO_OF_SAMPLES;
-        //Convert adc_reading to voltage in mV
-        uint32_t voltage = esp_adc_cal_raw_to_voltage(adc_reading, adc_chars);
-        //Upscale to pre-divided voltage
-        uint32_t upscaled = voltage * SSF;
-        ESP_LOGI(VM_TAG, "Raw: %d\tVoltage: %d mV\tUpscaled: %d mV", adc_reading, voltage, upscaled);
-        if(upscaled < 10000){
-        	ESP_LOGI(VM_TAG, "LOW VOLTAGE");
-        	voltFlag = 1;
-        }
-        else{
-        	voltFlag = 0;
-        }
-
     	// Get fire detection info
         fireFlag = fireDetect(fireAngle);
         printf("Check fire detection\n");
 
+    	// An edge lost to switch bounce is caught up here, a repeat is a no-op
+    	system_state_post(fireFlag ? SYSTEM_EV_FIRE : SYSTEM_EV_FIRE_CLEAR);
 
-    	// fireFlag switch is off, voltage level normal
-    	if((voltFlag == 0) && (fireFlag == 0)){
-    		printf("Nothing wrong\n");
-    		status = 0;
-    	}
-
-    	// Low voltage level
-    	if(voltFlag == 1){
-    		status = 1;
-    	}
-
-    	// Fire detection switch on, fire detected
-    	if(fireFlag != 0){
+    	// Flags as the engine last reported them; it may not have taken the
+    	// post above yet, so this sweep's own reading stands in for fire
+    	uint32_t flags = rtc_flags & ~SYSTEM_FLAG_FIRE;
+    	if (fireFlag)
+    		flags |= SYSTEM_FLAG_FIRE;
+    	uint8_t status = 0;
+    	if (flags & SYSTEM_FLAG_LOW_VOLTAGE)
+    		status |= EVENT_LOW_VOLTAGE;
+    	if (flags & SYSTEM_FLAG_FIRE) {
     		printf("Fire detected\nFire direction: %d degrees\n", fireFlag);
-    		status = 2;
+    		status |= EVENT_FIRE;
     	}
+    	if (status == 0)
+    		printf("Nothing wrong\n");
+    	// This event covers any change signalled so far
+    	ulTaskNotifyTake(pdTRUE, 0);
 
-    	// Voltage is low and fire detected
-    	if((voltFlag == 1) && (fireFlag != 0)){
-    		status = 3;
-    	}
+    	// UTC stamp lets the root match sightings from different towers
+    	power_status_t power;
+    	power_update();
+    	power_status(&power);
+    	event_record_t event = {
+    		.status = status | EVENT_POSITION_VALID | (timebase_synced() ? EVENT_TIME_VALID : 0),
+    		.sequence = rtc_events,
+    		.node = node,
+    		.time_us = now_utc_us(),
+    		.latitude = position.latitude,
+    		.longitude = position.longitude,
+    		.bearing = fireFlag * 65536 / 360,
+    		.peak_temp = EVENT_TEMP_UNKNOWN,
+    		.battery_mv = power.battery_mv,
+    	};
+    	event_record_seal(&event);
+    	if (event_journal_append(&event) != ESP_OK)
+    		report_event(&event, NULL);
+    	event_journal_replay(report_event, NULL, 16);
+    	rtc_events++;
+    	sleep_cycle_result();
 
-    	printf("Event created. 0x%.4X %.4X %.2X %.4X\n\n", gpsLat, gpsLong, status, fireFlag);
+    	// Leaving the deep sleep profile brings the GPS and timebase back
+    	if (!gps_started && power_profile()->sleep != POWER_SLEEP_DEEP)
+    		start_gps();
 
-    	// Wait 6 seconds to restart the detection cycle
-    	vTaskDelay(pdMS_TO_TICKS(6000));
+    	// Wait out the profile's sweep interval to restart the detection cycle
+    	// In deep sleep the ULP keeps checking the battery and switch
+    	if (power_profile()->sleep == POWER_SLEEP_DEEP) {
+    		// A refresh cut short by deep sleep would leave the receiver on
+    		if (gps_started && !gps_manager_wait_idle(GPS_REFRESH_MS))
+    			ESP_LOGW(VM_TAG, "GPS refresh still running, sleeping anyway");
+    		const ulp_watch_config_t watch_config = {
+    			.atten = battery_config.atten,
+    			.default_vref = battery_config.default_vref,
+    			.scale = battery_config.scale,
+    			.low_mv = LOW_VOLTAGE_MV,
+    			.high_mv = RECOVERED_MV,
+    			.pins = {FIRE_SWITCH_PIN},
+    			.pin_count = 1,
+    			.period_ms = 1000,
+    		};
+    		bool low = rtc_flags & SYSTEM_FLAG_LOW_VOLTAGE;
+    		sleep_cycle_enable_ulp(ulp_watch_start(&watch_config, low) == ESP_OK);
+    	}
+    	uart_wait_tx_done(EVENT_UART, pdMS_TO_TICKS(EVENT_TX_WAIT_MS));
+    	power_idle();
     }
 }
 
 unsigned int fireDetect(unsigned int angle){
-	if(gpio_get_level(17) == 0){
+	if(gpio_get_level(FIRE_SWITCH_PIN) == 0){
 		angle = 0;
 	}
 	else{
@@ -12,82 +12,26 @@
 #include <stdlib.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "driver/gpio.h"
-#include "driver/adc.h"
-#include "esp_adc_cal.h"
-
-#define DEFAULT_VREF    1100        //Use adc2_vref_to_gpio() to obtain a better estimate
-#define NO_OF_SAMPLES   8192        //Multisampling
+#include "battery.h"
 
 static const char* VM_TAG = "vm";
 
-static esp_adc_cal_characteristics_t *adc_chars;
-static const adc_channel_t channel = ADC_CHANNEL_6;     //GPIO34
-static const adc_atten_t atten = ADC_ATTEN_DB_0;
-static const adc_unit_t unit = ADC_UNIT_1;
-
-static const float SSF = 23.14;
-
-static void check_efuse(void)
-{
-    //Check TP is burned into eFuse
-    if (esp_adc_cal_check_efuse(ESP_ADC_CAL_VAL_EFUSE_TP) == ESP_OK) {
-        ESP_LOGI(VM_TAG, "eFuse Two Point: Supported");
-    } else {
-        ESP_LOGI(VM_TAG, "eFuse Two Point: NOT supported");
-    }
-
-    //Check Vref is burned into eFuse
-    if (esp_adc_cal_check_efuse(ESP_ADC_CAL_VAL_EFUSE_VREF) == ESP_OK) {
-        ESP_LOGI(VM_TAG, "eFuse Vref: Supported\n");
-    } else {
-        ESP_LOGI(VM_TAG, "eFuse Vref: NOT supported");
-    }
-}
-
-static void print_char_val_type(esp_adc_cal_value_t val_type)
-{
-    if (val_type == ESP_ADC_CAL_VAL_EFUSE_TP) {
-        ESP_LOGI(VM_TAG, "Characterized using Two Point Value");
-    } else if (val_type == ESP_ADC_CAL_VAL_EFUSE_VREF) {
-        ESP_LOGI(VM_TAG, "Characterized using eFuse Vref");
-    } else {
-        ESP_LOGI(VM_TAG, "Characterized using Default Vref");
-    }
-}
-
 void app_main(void)
 {
-    //Check if Two Point or Vref are burned into eFuse
-    check_efuse();
-
-    //Configure ADC
-    adc1_config_width(ADC_WIDTH_BIT_12);
-    adc1_config_channel_atten(channel, atten);
+    //ADC1 channel 6 (GPIO34) sampled continuously by the I2S DMA
+    const battery_config_t config = BATTERY_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(battery_init(&config));
 
-    //Characterize ADC
-    adc_chars = calloc(1, sizeof(esp_adc_cal_characteristics_t));
-    esp_adc_cal_value_t val_type = esp_adc_cal_characterize(unit, atten, ADC_WIDTH_BIT_12, DEFAULT_VREF, adc_chars);
-    print_char_val_type(val_type);
-
-    //Continuously sample ADC1
+    //Report the latest reading, sampling carries on in the background
     while (1) {
-        uint32_t adc_reading = 0;
-        //Multisampling
-        for (int i = 0; i < NO_OF_SAMPLES; i++) {
-            if (unit == ADC_UNIT_1)
-                adc_reading += adc1_get_raw((adc1_channel_t)channel);
+        battery_reading_t reading;
+        if (battery_latest(&reading)) {
+            ESP_LOGI(VM_TAG, "Raw: %d\tVoltage: %d mV\tUpscaled: %d mV",
+                     reading.raw, reading.adc_mv, reading.battery_mv);
+            if(reading.battery_mv < 10000)
+            	ESP_LOGI(VM_TAG, "LOW VOLTAGE");
         }
-        adc_reading /= NO_OF_SAMPLES;
-        //Convert adc_reading to voltage in mV
-        uint32_t voltage = esp_adc_cal_raw_to_voltage(adc_reading, adc_chars);
-        //Upscale to pre-divided voltage
-        uint32_t upscaled = voltage * SSF;
-        ESP_LOGI(VM_TAG, "Raw: %d\tVoltage: %d mV\tUpscaled: %d mV", adc_reading, voltage, upscaled);
-        if(upscaled < 10000)
-        	ESP_LOGI(VM_TAG, "LOW VOLTAGE");
 
         vTaskDelay(pdMS_TO_TICKS(1000));
     }
 }
-
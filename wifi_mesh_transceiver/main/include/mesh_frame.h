@@ -0,0 +1,97 @@
+/* Mesh message framing
+
+   A mesh packet carries one or more messages, each a 6 byte header
+   (type, flags, payload length, age) followed by exactly that many
+   payload bytes, so a send is only as long as what it carries. The age
+   adds up the time the message has waited in outboxes on its way, so
+   every hop works against what is left of one latency budget. Byte
+   counters per message type show what each kind of traffic costs on air.
+
+   Received packets are walked in place and each message is handed to
+   the handler registered for its type, with the payload still in the
+   receive buffer.
+*/
+
+#ifndef __MESH_FRAME_H__
+#define __MESH_FRAME_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_mesh.h"
+
+/*******************************************************
+ *                Constants
+ *******************************************************/
+#define MESH_FRAME_HDR_LEN   (sizeof(mesh_frame_hdr_t))
+
+#define MESH_FRAME_FLAG_URGENT   (1 << 0)   /* alarm class, flush at once on every hop */
+#define MESH_FRAME_FLAG_BULK     (1 << 1)   /* bulk class, shaped behind telemetry */
+
+/*******************************************************
+ *                Type Definitions
+ *******************************************************/
+typedef enum {
+    MESH_MSG_LIGHT = 1,         /* mesh_light_ctl_t */
+    MESH_MSG_PING,              /* 8 byte test pattern */
+    MESH_MSG_EVENT,             /* event_record_t */
+    MESH_MSG_RELAY,             /* origin MAC then one message, forwarded by a parent */
+    MESH_MSG_RELIABLE,          /* sequence header then one message, acked by the root */
+    MESH_MSG_ACK,               /* root to node, selective ack */
+    MESH_MSG_TYPE_MAX,
+} mesh_msg_type_t;
+
+/*******************************************************
+ *                Structures
+ *******************************************************/
+typedef struct {
+    uint8_t type;               /* mesh_msg_type_t */
+    uint8_t flags;
+    uint16_t len;               /* payload bytes after the header */
+    uint16_t age_ms;            /* queued on earlier hops, saturates at 65535 */
+} __attribute__((packed)) mesh_frame_hdr_t;
+
+typedef struct {
+    uint32_t tx_msgs;
+    uint32_t tx_bytes;          /* header and payload, first hop */
+    uint32_t tx_hop_bytes;      /* tx_bytes times the hops to the root */
+    uint32_t tx_errors;
+    uint32_t rx_msgs;
+    uint32_t rx_bytes;
+    uint32_t rx_errors;         /* no handler, or truncated packets under unknown */
+} mesh_frame_stats_t;
+
+/* payload points into the receive buffer and is only valid during the
+   call, from is the node that wrote the message */
+typedef void (*mesh_frame_handler_t)(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr,
+                                     const uint8_t *payload, void *arg);
+
+/*******************************************************
+ *                Function Definitions
+ *******************************************************/
+/* appends a message, returns the bytes used or 0 if it does not fit */
+size_t mesh_frame_put(uint8_t *buf, size_t cap, uint8_t type, uint8_t flags,
+                      const void *payload, uint16_t len);
+
+/* walks the messages of a received packet in place, returns the payload
+   of the message at *off and moves *off past it, NULL at the end or on a
+   truncated message */
+const uint8_t *mesh_frame_next(const uint8_t *buf, size_t size, size_t *off, mesh_frame_hdr_t *hdr);
+
+/* sends len bytes of framed messages, to NULL means the root */
+esp_err_t mesh_frame_send(const mesh_addr_t *to, const uint8_t *buf, size_t len);
+
+/* handlers are set up before the receive task starts and not changed after */
+esp_err_t mesh_frame_register(uint8_t type, mesh_frame_handler_t handler, void *arg);
+
+/* hands every message of a received packet to its handler, returns
+   ESP_ERR_INVALID_SIZE if the packet ends in a truncated message */
+esp_err_t mesh_frame_dispatch(const mesh_addr_t *from, const uint8_t *buf, size_t size);
+
+/* hands one message to its handler, for messages unwrapped by another */
+void mesh_frame_deliver(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr, const uint8_t *payload);
+
+void mesh_frame_stats(uint8_t type, mesh_frame_stats_t *out);
+const char *mesh_frame_type_name(uint8_t type);
+
+#endif /* __MESH_FRAME_H__ */
@@ -0,0 +1,120 @@
+/* Mesh outbound queue
+
+   Messages wait in one queue per traffic class and are packed into MTU
+   sized packets. Alarms are served first and flush at once; telemetry
+   and bulk share what is left by deficit round robin, and are sent when
+   one is due or a packet is full. A message's age travels in its frame
+   header from the first outbox on. What is left of max_latency_ms is
+   split evenly between the hops still to go, so the bound holds end to
+   end and every layer still batches. A token
+   bucket per class shapes the node's own messages; relays were shaped
+   where they were queued and pass through. The class travels in the
+   frame flags, so every hop keeps it.
+
+   With a parent set, packets go to the parent rather than straight to
+   the root, so each layer folds its children's traffic into its own
+   packets on the way up.
+*/
+
+#ifndef __MESH_OUTBOX_H__
+#define __MESH_OUTBOX_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_mesh.h"
+#include "mesh_frame.h"
+
+/*******************************************************
+ *                Constants
+ *******************************************************/
+#define MESH_OUTBOX_MTU      (1456)     /* under MESH_MPS with room to spare */
+#define MESH_OUTBOX_HIST_LEN (8)
+
+/*******************************************************
+ *                Type Definitions
+ *******************************************************/
+typedef enum {
+    MESH_CLASS_ALARM,           /* strict priority */
+    MESH_CLASS_TELEMETRY,
+    MESH_CLASS_BULK,
+    MESH_CLASS_MAX,
+} mesh_class_t;
+
+typedef enum {
+    MESH_DROP_TAIL,             /* refuse the new message */
+    MESH_DROP_HEAD,             /* evict the oldest to make room */
+} mesh_drop_policy_t;
+
+/*******************************************************
+ *                Structures
+ *******************************************************/
+typedef struct {
+    uint32_t capacity;          /* queued bytes */
+    uint32_t quantum;           /* DRR bytes per round, not 0, unused for alarms */
+    uint32_t rate;              /* bytes per second of the node's own messages, 0 for no limit */
+    uint32_t burst;             /* token bucket depth in bytes */
+    mesh_drop_policy_t policy;
+} mesh_class_config_t;
+
+typedef struct {
+    uint32_t max_latency_ms;    /* longest telemetry or bulk waits for company, all hops together */
+    mesh_class_config_t classes[MESH_CLASS_MAX];
+} mesh_outbox_config_t;
+
+#define MESH_OUTBOX_CONFIG_DEFAULT() {                                              \
+    .max_latency_ms = 2000,                                                         \
+    .classes = {                                                                    \
+        [MESH_CLASS_ALARM]     = { 1024,    0,    0,    0, MESH_DROP_TAIL },        \
+        [MESH_CLASS_TELEMETRY] = { 4096, 1024, 2048, 4096, MESH_DROP_TAIL },        \
+        [MESH_CLASS_BULK]      = { 8192,  512, 4096, 2912, MESH_DROP_HEAD },        \
+    },                                                                              \
+}
+
+typedef struct {
+    uint32_t frames;            /* packets sent */
+    uint32_t msgs;
+    uint32_t bytes;
+    uint32_t urgent_flushes;
+    uint32_t full_flushes;
+    uint32_t latency_flushes;
+    uint32_t relayed;           /* children's messages folded in */
+    uint32_t send_errors;
+    uint32_t dropped;           /* messages lost with a failed send */
+} mesh_outbox_stats_t;
+
+typedef struct {
+    uint32_t queued;
+    uint32_t sent;
+    uint32_t sent_bytes;
+    uint32_t dropped;           /* by the drop policy */
+    uint32_t shaped;            /* rounds held back by the token bucket */
+    uint32_t depth;             /* messages waiting now */
+    uint32_t depth_hist[MESH_OUTBOX_HIST_LEN];   /* depth seen on enqueue: 0, 1, 2-3, 4-7, ... */
+    uint32_t latency_hist[MESH_OUTBOX_HIST_LEN]; /* age when sent, earlier hops included: <10, <50, <100, <250, <500, <1000, <2000 ms, more */
+} mesh_class_stats_t;
+
+/*******************************************************
+ *                Function Definitions
+ *******************************************************/
+/* ESP_ERR_INVALID_ARG for a telemetry or bulk quantum of 0; refused puts
+   return ESP_ERR_NO_MEM; a head drop loses a message that
+   was already accepted, so anything the journal tracks must sit in a
+   tail dropping class */
+esp_err_t mesh_outbox_init(const mesh_outbox_config_t *cfg);
+
+/* queues one message in the class its flags pick */
+esp_err_t mesh_outbox_put(uint8_t type, uint8_t flags, const void *payload, uint16_t len);
+
+/* queues a child's message for the root, wrapped with its origin */
+esp_err_t mesh_outbox_relay(const mesh_addr_t *origin, const mesh_frame_hdr_t *hdr, const uint8_t *payload);
+
+/* next hop for queued packets, NULL sends straight to the root */
+void mesh_outbox_set_parent(const mesh_addr_t *parent);
+
+esp_err_t mesh_outbox_flush(void);
+
+void mesh_outbox_stats(mesh_outbox_stats_t *out);
+void mesh_outbox_class_stats(mesh_class_t cls, mesh_class_stats_t *out);
+
+#endif /* __MESH_OUTBOX_H__ */
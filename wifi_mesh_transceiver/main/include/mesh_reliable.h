@@ -0,0 +1,104 @@
+/* Mesh reliable delivery
+
+   Messages sent through here are wrapped as MESH_MSG_RELIABLE with a
+   per-node sequence number and kept until the root acknowledges them.
+   Unacknowledged messages are sent again with exponential back-off and
+   handed to on_failed after max_retries, so the caller can keep them
+   for later. The caller's tag for each message comes back with on_acked
+   or on_failed, so it can mark its own copy only once the root has it.
+
+   The root drops duplicates against a window per node. Every message it
+   receives is acknowledged, duplicates included, because the duplicate
+   means the node missed the ACK. A message too far ahead of the lowest
+   one missing for the ACK bitmap to cover is refused, and accepted when
+   it is sent again after the gap has filled or the node gave up on it.
+   The ACK is selective: it carries the lowest sequence still missing
+   plus a bitmap of the ones received after it. ACKs owed to one node are
+   gathered for ack_delay_ms, then go down in one packet addressed to
+   that node. The root's table of nodes is allocated on the first
+   message it receives, so a leaf does not carry it.
+*/
+
+#ifndef __MESH_RELIABLE_H__
+#define __MESH_RELIABLE_H__
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_mesh.h"
+#include "mesh_frame.h"
+
+/*******************************************************
+ *                Constants
+ *******************************************************/
+#define MESH_RELIABLE_WINDOW       (16)     /* unacknowledged messages per node, at most 32 */
+#define MESH_RELIABLE_MAX_PAYLOAD  (48)
+#define MESH_RELIABLE_PEERS        (300)    /* nodes the root tracks, the mesh's target size;
+                                               past it the least recent is replaced */
+
+/*******************************************************
+ *                Type Definitions
+ *******************************************************/
+/* a message that ran out of retries, payload is only valid during the call */
+typedef void (*mesh_reliable_failed_t)(uint8_t type, uint32_t tag, const uint8_t *payload, uint16_t len, void *arg);
+
+/* the root acknowledged a message */
+typedef void (*mesh_reliable_acked_t)(uint8_t type, uint32_t tag, void *arg);
+
+/*******************************************************
+ *                Structures
+ *******************************************************/
+typedef struct {
+    uint32_t rto_ms;            /* first retransmit of an urgent message */
+    uint32_t rto_batched_ms;    /* the same for messages that wait in the outbox */
+    uint32_t max_backoff_ms;
+    uint32_t max_retries;
+    uint32_t ack_delay_ms;      /* root: how long acks for one node are gathered */
+    mesh_reliable_acked_t on_acked;
+    mesh_reliable_failed_t on_failed;
+    void *arg;
+} mesh_reliable_config_t;
+
+#define MESH_RELIABLE_CONFIG_DEFAULT() {    \
+    .rto_ms = 1000,                         \
+    .rto_batched_ms = 6000,                 \
+    .max_backoff_ms = 30000,                \
+    .max_retries = 5,                       \
+    .ack_delay_ms = 100,                    \
+}
+
+typedef struct {
+    /* node */
+    uint32_t sent;              /* messages, first transmissions */
+    uint32_t retries;           /* retransmissions */
+    uint32_t acked;
+    uint32_t failed;            /* out of retries */
+    uint32_t pending;           /* waiting for an ack now */
+    uint32_t latency_avg_ms;    /* first send to ack */
+    uint32_t latency_max_ms;
+    /* root */
+    uint32_t received;
+    uint32_t duplicates;
+    uint32_t refused;           /* beyond the ack bitmap, left for a retransmit */
+    uint32_t acks_sent;
+    uint32_t ack_errors;
+} mesh_reliable_stats_t;
+
+/*******************************************************
+ *                Function Definitions
+ *******************************************************/
+esp_err_t mesh_reliable_init(const mesh_reliable_config_t *cfg);
+
+/* queues one message for the root, ESP_ERR_NO_MEM while the window is full;
+   tag is the caller's and only handed back */
+esp_err_t mesh_reliable_send(uint8_t type, uint8_t flags, const void *payload, uint16_t len, uint32_t tag);
+
+/* root: a MESH_MSG_RELIABLE from the node that wrote it; a new message
+   is handed to its own handler, and the node is owed an ack either way */
+void mesh_reliable_receive(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr, const uint8_t *payload);
+
+/* node: a MESH_MSG_ACK from the root */
+void mesh_reliable_ack(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr, const uint8_t *payload);
+
+void mesh_reliable_stats(mesh_reliable_stats_t *out);
+
+#endif /* __MESH_RELIABLE_H__ */
@@ -0,0 +1,149 @@
+/* Mesh message framing, see mesh_frame.h */
+
+#include <string.h>
+#include <stdbool.h>
+#include "mesh_frame.h"
+#include "freertos/FreeRTOS.h"
+
+/*******************************************************
+ *                Variable Definitions
+ *******************************************************/
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static mesh_frame_stats_t s_stats[MESH_MSG_TYPE_MAX];
+
+static struct {
+    mesh_frame_handler_t handler;
+    void *arg;
+} s_handlers[MESH_MSG_TYPE_MAX];
+
+static const char *s_type_names[MESH_MSG_TYPE_MAX] = {
+    "unknown", "light", "ping", "event", "relay", "reliable", "ack",
+};
+
+/*******************************************************
+ *                Function Definitions
+ *******************************************************/
+size_t mesh_frame_put(uint8_t *buf, size_t cap, uint8_t type, uint8_t flags,
+                      const void *payload, uint16_t len)
+{
+    if (cap < MESH_FRAME_HDR_LEN + len) {
+        return 0;
+    }
+    mesh_frame_hdr_t hdr = {
+        .type = type,
+        .flags = flags,
+        .len = len,
+        .age_ms = 0,
+    };
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), payload, len);
+    return sizeof(hdr) + len;
+}
+
+const uint8_t *mesh_frame_next(const uint8_t *buf, size_t size, size_t *off, mesh_frame_hdr_t *hdr)
+{
+    if (*off + MESH_FRAME_HDR_LEN > size) {
+        return NULL;
+    }
+    memcpy(hdr, buf + *off, sizeof(*hdr));
+    if (*off + MESH_FRAME_HDR_LEN + hdr->len > size) {
+        return NULL;
+    }
+    const uint8_t *payload = buf + *off + MESH_FRAME_HDR_LEN;
+    *off += MESH_FRAME_HDR_LEN + hdr->len;
+    return payload;
+}
+
+esp_err_t mesh_frame_send(const mesh_addr_t *to, const uint8_t *buf, size_t len)
+{
+    mesh_data_t data = {
+        .data = (uint8_t *) buf,
+        .size = len,
+        .proto = MESH_PROTO_BIN,
+        .tos = MESH_TOS_P2P,
+    };
+    esp_err_t err = esp_mesh_send(to, &data, MESH_DATA_P2P, NULL, 0);
+
+    /* upward traffic crosses every layer on the way to the root */
+    int hops = 1;
+    if (to == NULL && esp_mesh_get_layer() > 1) {
+        hops = esp_mesh_get_layer() - 1;
+    }
+    size_t off = 0;
+    mesh_frame_hdr_t hdr;
+    portENTER_CRITICAL(&s_stats_lock);
+    while (mesh_frame_next(buf, len, &off, &hdr)) {
+        mesh_frame_stats_t *s = &s_stats[hdr.type < MESH_MSG_TYPE_MAX ? hdr.type : 0];
+        if (err != ESP_OK) {
+            s->tx_errors++;
+            continue;
+        }
+        s->tx_msgs++;
+        s->tx_bytes += MESH_FRAME_HDR_LEN + hdr.len;
+        s->tx_hop_bytes += (MESH_FRAME_HDR_LEN + hdr.len) * hops;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+    return err;
+}
+
+static void count_rx(uint8_t type, uint16_t len, bool handled)
+{
+    portENTER_CRITICAL(&s_stats_lock);
+    mesh_frame_stats_t *s = &s_stats[type < MESH_MSG_TYPE_MAX ? type : 0];
+    s->rx_msgs++;
+    s->rx_bytes += MESH_FRAME_HDR_LEN + len;
+    if (!handled) {
+        s->rx_errors++;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+esp_err_t mesh_frame_register(uint8_t type, mesh_frame_handler_t handler, void *arg)
+{
+    if (type == 0 || type >= MESH_MSG_TYPE_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_handlers[type].handler = handler;
+    s_handlers[type].arg = arg;
+    return ESP_OK;
+}
+
+void mesh_frame_deliver(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr, const uint8_t *payload)
+{
+    if (hdr->type < MESH_MSG_TYPE_MAX && s_handlers[hdr->type].handler) {
+        s_handlers[hdr->type].handler(from, hdr, payload, s_handlers[hdr->type].arg);
+    }
+}
+
+esp_err_t mesh_frame_dispatch(const mesh_addr_t *from, const uint8_t *buf, size_t size)
+{
+    size_t off = 0;
+    mesh_frame_hdr_t hdr;
+    const uint8_t *payload;
+    while ((payload = mesh_frame_next(buf, size, &off, &hdr)) != NULL) {
+        bool handled = hdr.type < MESH_MSG_TYPE_MAX && s_handlers[hdr.type].handler;
+        count_rx(hdr.type, hdr.len, handled);
+        if (handled) {
+            s_handlers[hdr.type].handler(from, &hdr, payload, s_handlers[hdr.type].arg);
+        }
+    }
+    if (off != size) {
+        portENTER_CRITICAL(&s_stats_lock);
+        s_stats[0].rx_errors++;
+        portEXIT_CRITICAL(&s_stats_lock);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+void mesh_frame_stats(uint8_t type, mesh_frame_stats_t *out)
+{
+    portENTER_CRITICAL(&s_stats_lock);
+    *out = s_stats[type < MESH_MSG_TYPE_MAX ? type : 0];
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+const char *mesh_frame_type_name(uint8_t type)
+{
+    return s_type_names[type < MESH_MSG_TYPE_MAX ? type : 0];
+}
@@ -7,14 +7,23 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #include <string.h>
+#include <stdlib.h>
 #include "esp_wifi.h"
 #include "esp_system.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_mesh.h"
 #include "esp_mesh_internal.h"
 #include "mesh_light.h"
+#include "mesh_frame.h"
+#include "mesh_outbox.h"
+#include "mesh_reliable.h"
 #include "nvs_flash.h"
+#include "triangulate.h"
+#include "event_record.h"
+#include "event_journal.h"
+#include "freertos/queue.h"
 
 #define ROUTER_SSID "PhilPhone"
 #define ROUTER_PASSWD "a1b2c3p0"
@@ -27,7 +36,13 @@
  *                Constants
  *******************************************************/
 #define RX_SIZE          (1500)
-#define TX_SIZE          (1460)
+#define HEARTBEAT_MS     (1000)   /* tx loop period */
+#define STATUS_PERIOD_US (60 * 1000 * 1000LL) /* between node status events */
+#define REPLAY_BATCH     (8)      /* journalled events sent per tx loop */
+#define NO_JOURNAL_SEQ   (UINT32_MAX) /* reliable tag of an event sent without the journal */
+#define RX_LOG_SAMPLE    (100)    /* packets between receive log lines */
+#define TRI_QUEUE_LEN    (128)    /* reports waiting for the triangulation task */
+#define TRI_PERIOD_MS    (10 * 1000) /* between solves */
 
 /*******************************************************
  *                Variable Definitions
@@ -35,13 +50,21 @@
 static const char* MESH_TAG = "mesh_main";
 static const char* WIFI_TAG = "wifi_main";
 static const uint8_t MESH_ID[6] = { 0x77, 0x77, 0x77, 0x77, 0x77, 0x77};
-static uint8_t tx_buf[TX_SIZE] = { 0, };
 static uint8_t rx_buf[RX_SIZE] = { 0, };
 static bool is_running = true;
 static bool is_mesh_connected = false;
 static mesh_addr_t mesh_parent_addr;
 static int mesh_layer = -1;
 
+/* node only: events wait in the flash journal until the root has them */
+static uint32_t event_sequence = 0;
+
+/* root only: bearings from every tower, located into fires by the MPTRI
+   task, which alone touches tri; allocated with the task on the first report */
+static tri_t *tri = NULL;
+static QueueHandle_t tri_queue = NULL;
+static uint32_t tri_dropped = 0;
+
 // message to be sent
 static const uint8_t message[8] = {255, 0, 255, 0, 75, 93, 2, 42};
 
@@ -66,18 +89,197 @@ mesh_light_ctl_t light_off = {
 /*******************************************************
  *                Function Definitions
  *******************************************************/
+static void tri_print(int64_t now_us)
+{
+    int count = tri_update(tri, now_us);
+    for (int i = 0; i < count; i++) {
+        const tri_track_t *t = tri_track(tri, i);
+        ESP_LOGW(MESH_TAG, "[FIRE %d] %.7f, %.7f +/-%.0f m x %.0f m, towers:%d",
+                 t->id, t->latitude * 1e-7, t->longitude * 1e-7,
+                 t->major_m, t->minor_m, t->nodes);
+    }
+    if (tri_dropped) {
+        ESP_LOGW(MESH_TAG, "triangulation queue full, %u reports dropped", tri_dropped);
+    }
+}
+
+/* runs below the mesh tasks, so a long solve never holds up receiving */
+static void tri_task(void *arg)
+{
+    int64_t latest_us = 0;
+    tri_report_t report;
+    TickType_t next = xTaskGetTickCount() + TRI_PERIOD_MS / portTICK_RATE_MS;
+    while (true) {
+        TickType_t now = xTaskGetTickCount();
+        if ((int32_t)(next - now) <= 0) {
+            tri_print(latest_us);
+            next = now + TRI_PERIOD_MS / portTICK_RATE_MS;
+            continue;
+        }
+        if (xQueueReceive(tri_queue, &report, next - now) == pdTRUE) {
+            tri_add(tri, &report);
+            if (report.time_us > latest_us) {
+                latest_us = report.time_us;
+            }
+        }
+    }
+}
+
+static esp_err_t tri_start(void)
+{
+    tri_config_t tri_cfg = TRI_CONFIG_DEFAULT();
+    tri = calloc(1, sizeof(tri_t));
+    tri_queue = xQueueCreate(TRI_QUEUE_LEN, sizeof(tri_report_t));
+    if (tri != NULL && tri_queue != NULL) {
+        tri_init(tri, &tri_cfg);
+        if (xTaskCreate(tri_task, "MPTRI", 3072, NULL, 2, NULL) == pdPASS) {
+            return ESP_OK;
+        }
+    }
+    free(tri);
+    tri = NULL;
+    if (tri_queue != NULL) {
+        vQueueDelete(tri_queue);
+        tri_queue = NULL;
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+static void event_report(const mesh_addr_t *from, const uint8_t *buf, uint16_t len)
+{
+    /* the record is read in place from the receive buffer */
+    const event_record_t *ev = event_record_view(buf, len);
+    if (ev == NULL || len != sizeof(*ev)) {
+        ESP_LOGW(MESH_TAG, "bad event record from "MACSTR", size:%d", MAC2STR(from->addr), len);
+        return;
+    }
+    ESP_LOGI(MESH_TAG, "[EVENT %08x #%u] status:0x%02x, %.7f, %.7f, bearing:%d, battery:%d mV",
+             ev->node, ev->sequence, ev->status, ev->latitude * 1e-7, ev->longitude * 1e-7,
+             ev->bearing * 360 / 65536, ev->battery_mv);
+
+    /* only timed sightings can be matched across towers */
+    const uint8_t needed = EVENT_FIRE | EVENT_TIME_VALID | EVENT_POSITION_VALID;
+    if ((ev->status & needed) != needed) {
+        return;
+    }
+    if (tri_queue == NULL && tri_start() != ESP_OK) {
+        ESP_LOGE(MESH_TAG, "no memory for triangulation");
+        return;
+    }
+    tri_report_t report = {
+        .node = ev->node,
+        .time_us = ev->time_us,
+        .latitude = ev->latitude,
+        .longitude = ev->longitude,
+        .bearing = ev->bearing,
+    };
+    if (xQueueSend(tri_queue, &report, 0) != pdTRUE) {
+        tri_dropped++;
+    }
+}
+
+static void frame_stats_print(void)
+{
+    mesh_frame_stats_t fs;
+    for (int type = 0; type < MESH_MSG_TYPE_MAX; type++) {
+        mesh_frame_stats(type, &fs);
+        if (fs.tx_msgs || fs.rx_msgs || fs.tx_errors || fs.rx_errors) {
+            ESP_LOGI(MESH_TAG, "[%s] tx:%u msgs %u B (%u B on air) err:%u, rx:%u msgs %u B err:%u",
+                     mesh_frame_type_name(type), fs.tx_msgs, fs.tx_bytes, fs.tx_hop_bytes,
+                     fs.tx_errors, fs.rx_msgs, fs.rx_bytes, fs.rx_errors);
+        }
+    }
+}
+
+static void outbox_stats_print(void)
+{
+    mesh_outbox_stats_t os;
+    mesh_outbox_stats(&os);
+    ESP_LOGI(MESH_TAG, "outbox frames:%u, msgs:%u, bytes:%u, flush urgent/full/latency:%u/%u/%u, relayed:%u, err:%u, dropped:%u",
+             os.frames, os.msgs, os.bytes, os.urgent_flushes, os.full_flushes,
+             os.latency_flushes, os.relayed, os.send_errors, os.dropped);
+
+    mesh_reliable_stats_t rs;
+    mesh_reliable_stats(&rs);
+    ESP_LOGI(MESH_TAG, "reliable sent:%u, retries:%u, acked:%u, failed:%u, pending:%u, latency avg/max:%u/%u ms,"
+             " received:%u, duplicates:%u, refused:%u, acks:%u, ack err:%u",
+             rs.sent, rs.retries, rs.acked, rs.failed, rs.pending, rs.latency_avg_ms, rs.latency_max_ms,
+             rs.received, rs.duplicates, rs.refused, rs.acks_sent, rs.ack_errors);
+
+    static const char *class_names[MESH_CLASS_MAX] = { "alarm", "telemetry", "bulk" };
+    for (int c = 0; c < MESH_CLASS_MAX; c++) {
+        mesh_class_stats_t cs;
+        mesh_outbox_class_stats(c, &cs);
+        if (cs.queued == 0) {
+            continue;
+        }
+        const uint32_t *d = cs.depth_hist, *l = cs.latency_hist;
+        ESP_LOGI(MESH_TAG, "  %s queued:%u, sent:%u/%uB, dropped:%u, shaped:%u, depth:%u"
+                 " [%u %u %u %u %u %u %u %u], wait [%u %u %u %u %u %u %u %u]",
+                 class_names[c], cs.queued, cs.sent, cs.sent_bytes, cs.dropped, cs.shaped, cs.depth,
+                 d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7],
+                 l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7]);
+    }
+}
+
+/* the journal sequence rides along as the reliable tag, so the slot is
+   only marked once the root has the event */
+static esp_err_t event_send(const event_record_t *ev, uint32_t seq, void *arg)
+{
+    if (!is_mesh_connected) {
+        return ESP_ERR_MESH_DISCONNECTED;
+    }
+    /* a fire does not wait for the batch */
+    uint8_t flags = (ev->status & EVENT_FIRE) ? MESH_FRAME_FLAG_URGENT : 0;
+    return mesh_reliable_send(MESH_MSG_EVENT, flags, ev, sizeof(*ev), seq);
+}
+
+static void event_delivered(uint8_t type, uint32_t tag, void *arg)
+{
+    if (type == MESH_MSG_EVENT && tag != NO_JOURNAL_SEQ) {
+        event_journal_delivered(tag);
+    }
+}
+
+/* still pending in the journal, it goes again in order with the rest */
+static void event_undelivered(uint8_t type, uint32_t tag, const uint8_t *payload, uint16_t len, void *arg)
+{
+    const event_record_t *ev = event_record_view(payload, len);
+    if (type != MESH_MSG_EVENT || ev == NULL) {
+        return;
+    }
+    if (tag == NO_JOURNAL_SEQ) {
+        ESP_LOGW(MESH_TAG, "event #%u lost, no journal to keep it", ev->sequence);
+    } else {
+        event_journal_retry(tag);
+    }
+}
+
+static void event_post(uint8_t status)
+{
+    uint8_t mac[6];
+    esp_wifi_get_mac(ESP_IF_WIFI_STA, mac);
+    event_record_t ev = {
+        .status = status,
+        .sequence = event_sequence++,
+        .node = event_node_id(mac),
+        .time_us = esp_timer_get_time(),      /* uptime, no EVENT_TIME_VALID */
+        .peak_temp = EVENT_TEMP_UNKNOWN,
+    };
+    event_record_seal(&ev);
+    /* without a journal the event gets one chance */
+    if (event_journal_append(&ev) != ESP_OK) {
+        event_send(&ev, NO_JOURNAL_SEQ, NULL);
+    }
+}
+
 void esp_mesh_p2p_tx_main(void *arg)
 {
 //    int i;
-    esp_err_t err;
     int send_count = 0;
+    int64_t status_us = 0;
     mesh_addr_t route_table[CONFIG_MESH_ROUTE_TABLE_SIZE];
     int route_table_size = 0;
-    mesh_data_t data;
-    data.data = tx_buf;
-    data.size = sizeof(tx_buf);
-    data.proto = MESH_PROTO_BIN;
-    data.tos = MESH_TOS_P2P;
     is_running = true;
 
     while (is_running) {
@@ -86,61 +288,130 @@ void esp_mesh_p2p_tx_main(void *arg)
             ESP_LOGI(MESH_TAG, "layer:%d, rtableSize:%d, %s", mesh_layer,
                      esp_mesh_get_routing_table_size(),
                      (is_mesh_connected && esp_mesh_is_root()) ? "ROOT" : is_mesh_connected ? "NODE" : "DISCONNECT");
+            frame_stats_print();
+            outbox_stats_print();
             vTaskDelay(10 * 1000 / portTICK_RATE_MS);
             continue;
         }
         esp_mesh_get_routing_table((mesh_addr_t *) &route_table,
                                    CONFIG_MESH_ROUTE_TABLE_SIZE * 6, &route_table_size);
         if (send_count && !(send_count % 100)) {
+            event_journal_stats_t js;
+            event_journal_stats(&js);
             ESP_LOGI(MESH_TAG, "size:%d/%d,send_count:%d", route_table_size,
                      esp_mesh_get_routing_table_size(), send_count);
+            ESP_LOGI(MESH_TAG, "journal pending:%u, appended:%u, replayed:%u, dropped:%u, erases:%u, append:%u/%u us, cycles:%u",
+                     js.pending, js.appended, js.replayed, js.dropped, js.erases,
+                     js.append_avg_us, js.append_max_us, js.sector_cycles);
+            frame_stats_print();
+            outbox_stats_print();
         }
-        send_count++;
-        tx_buf[29] = message[7];
-        tx_buf[28] = message[6];
-        tx_buf[27] = message[5];
-        tx_buf[26] = message[4];
-        tx_buf[25] = message[3];
-        tx_buf[24] = message[2];
-        tx_buf[23] = message[1];
-        tx_buf[22] = message[0];
-        if (send_count % 2) {
-            memcpy(tx_buf, (uint8_t *)&light_on, sizeof(light_on));
-        } else {
-            memcpy(tx_buf, (uint8_t *)&light_off, sizeof(light_off));
+        int64_t now = esp_timer_get_time();
+        if (send_count == 0 || now - status_us >= STATUS_PERIOD_US) {
+            status_us = now;
+            event_post(0);
         }
-
-		err = esp_mesh_send(NULL, &data, MESH_DATA_P2P, NULL, 0);
-//		if (err) {
-//			ESP_LOGE(MESH_TAG,
-//					 "[ROOT-2-UNICAST:%d][L:%d]parent:"MACSTR" to "MACSTR", heap:%d[err:0x%x, proto:%d, tos:%d]",
-//					 send_count, mesh_layer, MAC2STR(mesh_parent_addr.addr),
-//					 MAC2STR(route_table[i].addr), esp_get_free_heap_size(),
-//					 err, data.proto, data.tos);
-//		} else if (!(send_count % 100)) {
-//			ESP_LOGW(MESH_TAG,
-//					 "[ROOT-2-UNICAST:%d][L:%d][rtableSize:%d]parent:"MACSTR" to "MACSTR", heap:%d[err:0x%x, proto:%d, tos:%d]",
-//					 send_count, mesh_layer,
-//					 esp_mesh_get_routing_table_size(),
-//					 MAC2STR(mesh_parent_addr.addr),
-//					 MAC2STR(route_table[i].addr), esp_get_free_heap_size(),
-//					 err, data.proto, data.tos);
-//		}
-
-        /* if route_table_size is less than 10, add delay to avoid watchdog in this task. */
-        if (route_table_size < 10) {
-            vTaskDelay(1 * 1000 / portTICK_RATE_MS);
+        /* oldest first, whatever queued up while the parent was gone */
+        if (is_mesh_connected) {
+            event_journal_hand_off(event_send, NULL, REPLAY_BATCH);
         }
+        send_count++;
+        /* light control and test pattern as the heartbeat, batched with
+           whatever else is queued */
+        mesh_outbox_put(MESH_MSG_LIGHT, 0, (send_count % 2) ? &light_on : &light_off,
+                        sizeof(mesh_light_ctl_t));
+        mesh_outbox_put(MESH_MSG_PING, 0, message, sizeof(message));
+
+        /* the outbox batches on its own clock, this only paces the heartbeat */
+        vTaskDelay(HEARTBEAT_MS / portTICK_RATE_MS);
     }
     vTaskDelete(NULL);
 }
 
+/* a node passes its children's messages on up in its own packets */
+static bool relay_up(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr, const uint8_t *payload)
+{
+    if (esp_mesh_is_root()) {
+        return false;
+    }
+    mesh_outbox_relay(from, hdr, payload);
+    return true;
+}
+
+static void rx_light(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr,
+                     const uint8_t *payload, void *arg)
+{
+    if (!relay_up(from, hdr, payload)) {
+        mesh_light_process((mesh_addr_t *) from, (uint8_t *) payload, hdr->len);
+    }
+}
+
+static void rx_ping(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr,
+                    const uint8_t *payload, void *arg)
+{
+    if (relay_up(from, hdr, payload)) {
+        return;
+    }
+    /* counted by the dispatcher, only every RX_LOG_SAMPLE-th is shown */
+    static uint32_t pings = 0;
+    if (++pings % RX_LOG_SAMPLE == 0 && hdr->len == sizeof(message)) {
+        ESP_LOGI(MESH_TAG, "[#PING:%u] from "MACSTR" [%d %d %d %d %d %d %d %d]",
+                 pings, MAC2STR(from->addr), payload[0], payload[1], payload[2], payload[3],
+                 payload[4], payload[5], payload[6], payload[7]);
+    }
+}
+
+static void rx_event(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr,
+                     const uint8_t *payload, void *arg)
+{
+    if (!relay_up(from, hdr, payload)) {
+        event_report(from, payload, hdr->len);
+    }
+}
+
+static void rx_reliable(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr,
+                        const uint8_t *payload, void *arg)
+{
+    if (!relay_up(from, hdr, payload)) {
+        mesh_reliable_receive(from, hdr, payload);
+    }
+}
+
+/* addressed to this node by the root, never passed on */
+static void rx_ack(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr,
+                   const uint8_t *payload, void *arg)
+{
+    mesh_reliable_ack(from, hdr, payload);
+}
+
+static void rx_relay(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr,
+                     const uint8_t *payload, void *arg)
+{
+    if (relay_up(from, hdr, payload)) {
+        return;
+    }
+    /* the root unwraps to the message and the node that wrote it */
+    mesh_addr_t origin;
+    mesh_frame_hdr_t inner;
+    size_t off = 0;
+    if (hdr->len < sizeof(origin.addr)) {
+        return;
+    }
+    memcpy(origin.addr, payload, sizeof(origin.addr));
+    payload = mesh_frame_next(payload + sizeof(origin.addr), hdr->len - sizeof(origin.addr),
+                              &off, &inner);
+    if (payload != NULL && inner.type != MESH_MSG_RELAY) {
+        mesh_frame_deliver(&origin, &inner, payload);
+    }
+}
+
 void esp_mesh_p2p_rx_main(void *arg)
 {
-    int recv_count = 0;
+    uint32_t recv_count = 0;
+    uint32_t recv_bytes = 0;
+    uint32_t truncated = 0;
     esp_err_t err;
     mesh_addr_t from;
-    uint8_t received_msg[8];
     mesh_data_t data;
     int flag = 0;
     data.data = rx_buf;
@@ -154,29 +425,15 @@ void esp_mesh_p2p_rx_main(void *arg)
             ESP_LOGE(MESH_TAG, "err:0x%x, size:%d", err, data.size);
             continue;
         }
-        /* extract send count */
-        if (data.size >= sizeof(received_msg)) {
-            received_msg[7] = data.data[29];
-            received_msg[6] = data.data[28];
-            received_msg[5] = data.data[27];
-            received_msg[4] = data.data[26];
-            received_msg[3] = data.data[25];
-            received_msg[2] = data.data[24];
-            received_msg[1] = data.data[23];
-            received_msg[0] = data.data[22];
-        }
         recv_count++;
-        /* process light control */
-        mesh_light_process(&from, data.data, data.size);
-        if (!(recv_count % 1)) {
-            ESP_LOGW(MESH_TAG,
-                     "[#RX:%d][L:%d] [MSG: %d %d %d %d %d %d %d %d] parent:"MACSTR", receive from "MACSTR", size:%d, heap:%d, flag:%d[err:0x%x, proto:%d, tos:%d]",
-                     recv_count, mesh_layer,
-					 received_msg[0], received_msg[1], received_msg[2], received_msg[3],
-					 received_msg[4], received_msg[5], received_msg[6], received_msg[7],
-                     MAC2STR(mesh_parent_addr.addr), MAC2STR(from.addr),
-                     data.size, esp_get_free_heap_size(), flag, err, data.proto,
-                     data.tos);
+        recv_bytes += data.size;
+        if (mesh_frame_dispatch(&from, data.data, data.size) != ESP_OK) {
+            truncated++;
+        }
+        if (recv_count % RX_LOG_SAMPLE == 0) {
+            ESP_LOGI(MESH_TAG, "[#RX:%u][L:%d] %u B, truncated:%u, last from "MACSTR", heap:%d",
+                     recv_count, mesh_layer, recv_bytes, truncated,
+                     MAC2STR(from.addr), esp_get_free_heap_size());
         }
     }
     vTaskDelete(NULL);
@@ -187,6 +444,12 @@ esp_err_t esp_mesh_comm_p2p_start(void)
     static bool is_comm_p2p_started = false;
     if (!is_comm_p2p_started) {
         is_comm_p2p_started = true;
+        mesh_frame_register(MESH_MSG_LIGHT, rx_light, NULL);
+        mesh_frame_register(MESH_MSG_PING, rx_ping, NULL);
+        mesh_frame_register(MESH_MSG_EVENT, rx_event, NULL);
+        mesh_frame_register(MESH_MSG_RELAY, rx_relay, NULL);
+        mesh_frame_register(MESH_MSG_RELIABLE, rx_reliable, NULL);
+        mesh_frame_register(MESH_MSG_ACK, rx_ack, NULL);
         xTaskCreate(esp_mesh_p2p_tx_main, "MPTX", 3072, NULL, 5, NULL);
         xTaskCreate(esp_mesh_p2p_rx_main, "MPRX", 3072, NULL, 5, NULL);
     }
@@ -262,7 +525,19 @@ void mesh_event_handler(void *arg, esp_event_base_t event_base,
         mesh_connected_indicator(mesh_layer);
         is_mesh_connected = true;
         if (esp_mesh_is_root()) {
+            mesh_outbox_set_parent(NULL);
             tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_STA);
+        } else {
+            /* packets go to the parent's station address, one below its
+               softAP BSSID on the ESP32, as a 48 bit number */
+            mesh_addr_t parent = mesh_parent_addr;
+            for (int i = 5; i >= 0 && parent.addr[i]-- == 0; i--) {
+                /* borrow from the next byte up */
+            }
+            mesh_outbox_set_parent(&parent);
+        }
+        if (!esp_mesh_is_root() && event_journal_pending()) {
+            ESP_LOGI(MESH_TAG, "replaying %u journalled events", event_journal_pending());
         }
         esp_mesh_comm_p2p_start();
     }
@@ -273,6 +548,7 @@ void mesh_event_handler(void *arg, esp_event_base_t event_base,
                  "<MESH_EVENT_PARENT_DISCONNECTED>reason:%d",
                  disconnected->reason);
         is_mesh_connected = false;
+        mesh_outbox_set_parent(NULL);
         mesh_disconnected_indicator();
         mesh_layer = esp_mesh_get_layer();
     }
@@ -392,6 +668,16 @@ void app_main(void)
 {
     ESP_ERROR_CHECK(mesh_light_init());
     ESP_ERROR_CHECK(nvs_flash_init());
+    const event_journal_config_t journal_cfg = EVENT_JOURNAL_CONFIG_DEFAULT();
+    if (event_journal_init(&journal_cfg) != ESP_OK) {
+        ESP_LOGW(MESH_TAG, "no event journal, events are sent once");
+    }
+    const mesh_outbox_config_t outbox_cfg = MESH_OUTBOX_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(mesh_outbox_init(&outbox_cfg));
+    mesh_reliable_config_t reliable_cfg = MESH_RELIABLE_CONFIG_DEFAULT();
+    reliable_cfg.on_acked = event_delivered;
+    reliable_cfg.on_failed = event_undelivered;
+    ESP_ERROR_CHECK(mesh_reliable_init(&reliable_cfg));
     /*  tcpip initialization */
     tcpip_adapter_init();
     /* for mesh
@@ -0,0 +1,506 @@
+/* Mesh outbound queue, see mesh_outbox.h */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mesh_frame.h"
+#include "mesh_outbox.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+/*******************************************************
+ *                Constants
+ *******************************************************/
+#define ENTRY_HDR_LEN    (10)       /* u16 message length, u32 ms its age counts from, u32 due ms */
+#define SHAPED_POLL_MS   (50)       /* recheck while only shaped traffic waits */
+
+/*******************************************************
+ *                Structures
+ *******************************************************/
+/* messages of one class in a byte ring, each behind an entry header */
+typedef struct {
+    mesh_class_config_t cfg;
+    uint8_t *ring;
+    size_t head;
+    size_t used;
+    int32_t deficit;
+    uint32_t tokens;
+    int64_t refill_us;
+    mesh_class_stats_t stats;
+} class_queue_t;
+
+/*******************************************************
+ *                Variable Definitions
+ *******************************************************/
+static const char *OUTBOX_TAG = "mesh_outbox";
+
+static const uint32_t s_latency_edges_ms[MESH_OUTBOX_HIST_LEN - 1] = {
+    10, 50, 100, 250, 500, 1000, 2000,
+};
+
+static class_queue_t s_queues[MESH_CLASS_MAX];
+static size_t s_queued_bytes = 0;   /* messages only, as they would go out */
+static int s_drr_next = MESH_CLASS_TELEMETRY;
+static uint8_t s_packet[MESH_OUTBOX_MTU];
+
+static uint32_t s_latency_ms;
+static mesh_addr_t s_parent;
+static bool s_has_parent = false;
+static mesh_outbox_stats_t s_stats;
+
+static SemaphoreHandle_t s_lock;        /* queues and stats */
+static SemaphoreHandle_t s_send_lock;   /* s_packet, one packet in flight */
+static TaskHandle_t s_task;
+
+/*******************************************************
+ *                Function Definitions
+ *******************************************************/
+static uint32_t now_ms(void)
+{
+    return esp_timer_get_time() / 1000;
+}
+
+static void ring_write(class_queue_t *q, size_t pos, const void *src, size_t n)
+{
+    size_t cap = q->cfg.capacity;
+    pos %= cap;
+    size_t first = n < cap - pos ? n : cap - pos;
+    memcpy(q->ring + pos, src, first);
+    memcpy(q->ring, (const uint8_t *) src + first, n - first);
+}
+
+static void ring_read(const class_queue_t *q, size_t pos, void *dst, size_t n)
+{
+    size_t cap = q->cfg.capacity;
+    pos %= cap;
+    size_t first = n < cap - pos ? n : cap - pos;
+    memcpy(dst, q->ring + pos, first);
+    memcpy((uint8_t *) dst + first, q->ring, n - first);
+}
+
+/* length, age origin and send deadline of the message whose entry starts at pos */
+static void peek_at(const class_queue_t *q, size_t pos, uint16_t *len, uint32_t *enq_ms, uint32_t *due_ms)
+{
+    uint8_t h[ENTRY_HDR_LEN];
+    ring_read(q, pos, h, sizeof(h));
+    memcpy(len, h, sizeof(*len));
+    memcpy(enq_ms, h + 2, sizeof(*enq_ms));
+    memcpy(due_ms, h + 6, sizeof(*due_ms));
+}
+
+/* length and age origin of the message at the head, the next one to go */
+static void peek(const class_queue_t *q, uint16_t *len, uint32_t *enq_ms)
+{
+    uint32_t due_ms;
+    peek_at(q, q->head, len, enq_ms, &due_ms);
+}
+
+/* relays arrive with less budget left, so the head is not always the
+   first due; returns the earliest deadline in the queue */
+static uint32_t first_due(const class_queue_t *q)
+{
+    uint32_t first = 0;
+    size_t pos = q->head;
+    for (uint32_t i = 0; i < q->stats.depth; i++) {
+        uint16_t n;
+        uint32_t enq_ms, due_ms;
+        peek_at(q, pos, &n, &enq_ms, &due_ms);
+        if (i == 0 || (int32_t) (due_ms - first) < 0) {
+            first = due_ms;
+        }
+        pos += ENTRY_HDR_LEN + n;
+    }
+    return first;
+}
+
+static void pop(class_queue_t *q, uint8_t *dst, uint16_t len)
+{
+    if (dst) {
+        ring_read(q, q->head + ENTRY_HDR_LEN, dst, len);
+    }
+    q->head = (q->head + ENTRY_HDR_LEN + len) % q->cfg.capacity;
+    q->used -= ENTRY_HDR_LEN + len;
+    q->stats.depth--;
+    s_queued_bytes -= len;
+}
+
+static int hist_bucket_pow2(uint32_t v)
+{
+    int b = 0;
+    while (v && b < MESH_OUTBOX_HIST_LEN - 1) {
+        v >>= 1;
+        b++;
+    }
+    return b;
+}
+
+static int hist_bucket_latency(uint32_t ms)
+{
+    int b = 0;
+    while (b < MESH_OUTBOX_HIST_LEN - 1 && ms >= s_latency_edges_ms[b]) {
+        b++;
+    }
+    return b;
+}
+
+static class_queue_t *class_of(uint8_t flags)
+{
+    if (flags & MESH_FRAME_FLAG_URGENT) {
+        return &s_queues[MESH_CLASS_ALARM];
+    }
+    return &s_queues[(flags & MESH_FRAME_FLAG_BULK) ? MESH_CLASS_BULK : MESH_CLASS_TELEMETRY];
+}
+
+static void refill(class_queue_t *q, int64_t now_us)
+{
+    if (q->cfg.rate == 0) {
+        return;
+    }
+    uint64_t add = (uint64_t) (now_us - q->refill_us) * q->cfg.rate / 1000000;
+    if (add == 0) {
+        return;
+    }
+    q->refill_us = now_us;
+    q->tokens = q->tokens + add > q->cfg.burst ? q->cfg.burst : q->tokens + add;
+}
+
+/* relays were shaped by the node that queued them, they pass through
+   without tokens */
+static bool relayed(const class_queue_t *q)
+{
+    mesh_frame_hdr_t hdr;
+    ring_read(q, q->head + ENTRY_HDR_LEN, &hdr, sizeof(hdr));
+    return hdr.type == MESH_MSG_RELAY;
+}
+
+/* the bucket holds back the head message of n bytes */
+static bool shaped(const class_queue_t *q, uint16_t n)
+{
+    return q->cfg.rate && q->tokens < n && !relayed(q);
+}
+
+/* moves the head message into the packet if it fits and the bucket allows,
+   returns its length or 0 */
+static uint16_t take(class_queue_t *q, size_t *len, int *msgs, uint32_t now)
+{
+    uint16_t n;
+    uint32_t enq_ms;
+    if (q->stats.depth == 0) {
+        return 0;
+    }
+    peek(q, &n, &enq_ms);
+    if (*len + n > MESH_OUTBOX_MTU) {
+        return 0;
+    }
+    bool own = q->cfg.rate && !relayed(q);
+    if (own && q->tokens < n) {
+        q->stats.shaped++;
+        return 0;
+    }
+    pop(q, s_packet + *len, n);
+    if (own) {
+        q->tokens -= n;
+    }
+    /* the next hop carries on from the age it leaves with */
+    uint32_t age = now - enq_ms;
+    uint16_t age_ms = age < UINT16_MAX ? age : UINT16_MAX;
+    memcpy(s_packet + *len + offsetof(mesh_frame_hdr_t, age_ms), &age_ms, sizeof(age_ms));
+    *len += n;
+    (*msgs)++;
+    q->stats.sent++;
+    q->stats.sent_bytes += n;
+    q->stats.latency_hist[hist_bucket_latency(now - enq_ms)]++;
+    return n;
+}
+
+/* fills s_packet: alarms first, then deficit round robin over the rest */
+static size_t build(int *msgs)
+{
+    size_t len = 0;
+    uint32_t now = now_ms();
+    int64_t now_us = esp_timer_get_time();
+    *msgs = 0;
+
+    for (int c = 0; c < MESH_CLASS_MAX; c++) {
+        refill(&s_queues[c], now_us);
+    }
+    while (take(&s_queues[MESH_CLASS_ALARM], &len, msgs, now)) {
+    }
+
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (int i = 0; i < MESH_CLASS_MAX - 1; i++) {
+            int c = MESH_CLASS_TELEMETRY + (s_drr_next - MESH_CLASS_TELEMETRY + i) % (MESH_CLASS_MAX - 1);
+            class_queue_t *q = &s_queues[c];
+            if (q->stats.depth == 0) {
+                q->deficit = 0;
+                continue;
+            }
+            q->deficit += q->cfg.quantum;
+            uint16_t n;
+            uint32_t enq_ms;
+            peek(q, &n, &enq_ms);
+            while ((int32_t) n <= q->deficit && take(q, &len, msgs, now)) {
+                q->deficit -= n;
+                progress = true;
+                if (q->stats.depth == 0) {
+                    break;
+                }
+                peek(q, &n, &enq_ms);
+            }
+            if (q->stats.depth == 0) {
+                continue;
+            }
+            /* held by its bucket the class earns nothing, or the credit
+               of every retry would pile up and let it burst past the others */
+            if (shaped(q, n)) {
+                q->deficit = 0;
+            } else if ((int32_t) n > q->deficit && len + n <= MESH_OUTBOX_MTU) {
+                /* short of credit only, another round will earn it */
+                progress = true;
+            }
+        }
+        s_drr_next = MESH_CLASS_TELEMETRY + (s_drr_next - MESH_CLASS_TELEMETRY + 1) % (MESH_CLASS_MAX - 1);
+    }
+    return len;
+}
+
+static esp_err_t flush(uint32_t *reason)
+{
+    int msgs;
+    xSemaphoreTake(s_send_lock, portMAX_DELAY);
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    size_t len = build(&msgs);
+    mesh_addr_t to = s_parent;
+    bool via_parent = s_has_parent;
+    if (len) {
+        if (reason == NULL) {
+            reason = &s_stats.latency_flushes;
+        }
+        (*reason)++;
+    }
+    xSemaphoreGive(s_lock);
+    if (len == 0) {
+        xSemaphoreGive(s_send_lock);
+        return ESP_OK;
+    }
+
+    esp_err_t err = mesh_frame_send(via_parent ? &to : NULL, s_packet, len);
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (err == ESP_OK) {
+        s_stats.frames++;
+        s_stats.msgs += msgs;
+        s_stats.bytes += len;
+    } else {
+        s_stats.send_errors++;
+        s_stats.dropped += msgs;
+    }
+    xSemaphoreGive(s_lock);
+    xSemaphoreGive(s_send_lock);
+
+    if (err != ESP_OK) {
+        ESP_LOGW(OUTBOX_TAG, "send of %d messages failed: 0x%x", msgs, err);
+    }
+    return err;
+}
+
+/* one pass of the task: sends a packet if one is due and returns the ms
+   until the next pass, UINT32_MAX with nothing queued */
+static uint32_t outbox_pass(void)
+{
+    uint32_t left = UINT32_MAX;
+    uint32_t *reason = &s_stats.latency_flushes;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_queues[MESH_CLASS_ALARM].stats.depth) {
+        left = 0;
+        reason = &s_stats.urgent_flushes;
+    } else if (s_queued_bytes >= MESH_OUTBOX_MTU) {
+        left = 0;
+        reason = &s_stats.full_flushes;
+    } else if (s_queued_bytes) {
+        uint32_t now = now_ms();
+        int32_t due = s_latency_ms;
+        for (int c = MESH_CLASS_TELEMETRY; c < MESH_CLASS_MAX; c++) {
+            if (s_queues[c].stats.depth) {
+                int32_t l = first_due(&s_queues[c]) - now;
+                due = l < due ? l : due;
+            }
+        }
+        left = due <= 0 ? 0 : due;
+    }
+    xSemaphoreGive(s_lock);
+
+    if (left) {
+        return left;
+    }
+    size_t before = s_stats.frames + s_stats.send_errors;
+    flush(reason);
+    /* everything due is held by its bucket, let tokens build up */
+    if (s_stats.frames + s_stats.send_errors == before) {
+        return SHAPED_POLL_MS;
+    }
+    return 0;
+}
+
+/* every wait ends early on a put, so an alarm never sits out a shaped poll */
+static void outbox_task(void *arg)
+{
+    while (1) {
+        uint32_t wait_ms = outbox_pass();
+        if (wait_ms) {
+            ulTaskNotifyTake(pdTRUE, wait_ms == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(wait_ms) + 1);
+        }
+    }
+}
+
+static esp_err_t put(uint8_t type, uint8_t flags, uint16_t age_ms, const void *head, uint16_t head_len,
+                     const void *payload, uint16_t len)
+{
+    if (s_task == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    class_queue_t *q = class_of(flags);
+    uint16_t n = MESH_FRAME_HDR_LEN + head_len + len;
+    if (n > MESH_OUTBOX_MTU || ENTRY_HDR_LEN + (size_t) n > q->cfg.capacity) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    q->stats.depth_hist[hist_bucket_pow2(q->stats.depth)]++;
+    while (q->used + ENTRY_HDR_LEN + (size_t) n > q->cfg.capacity) {
+        q->stats.dropped++;
+        if (q->cfg.policy == MESH_DROP_TAIL) {
+            xSemaphoreGive(s_lock);
+            return ESP_ERR_NO_MEM;
+        }
+        uint16_t old;
+        uint32_t enq_ms;
+        peek(q, &old, &enq_ms);
+        pop(q, NULL, old);
+    }
+    /* every hop still to go gets an even share of what is left of the
+       budget, so the ones nearer the root can batch too */
+    int hops = esp_mesh_get_layer() - 1;
+    uint32_t left = age_ms < s_latency_ms ? s_latency_ms - age_ms : 0;
+    uint32_t now = now_ms();
+    uint32_t enq_ms = now - age_ms;
+    uint32_t due_ms = now + left / (hops > 1 ? hops : 1);
+    uint8_t entry[ENTRY_HDR_LEN];
+    memcpy(entry, &n, sizeof(n));
+    memcpy(entry + 2, &enq_ms, sizeof(enq_ms));
+    memcpy(entry + 6, &due_ms, sizeof(due_ms));
+    mesh_frame_hdr_t hdr = {
+        .type = type,
+        .flags = flags,
+        .len = head_len + len,
+    };
+    size_t pos = q->head + q->used;
+    ring_write(q, pos, entry, sizeof(entry));
+    ring_write(q, pos + sizeof(entry), &hdr, sizeof(hdr));
+    ring_write(q, pos + sizeof(entry) + sizeof(hdr), head, head_len);
+    ring_write(q, pos + sizeof(entry) + sizeof(hdr) + head_len, payload, len);
+    q->used += ENTRY_HDR_LEN + n;
+    q->stats.depth++;
+    q->stats.queued++;
+    s_queued_bytes += n;
+    xSemaphoreGive(s_lock);
+
+    /* the task sleeps until the oldest message is due, let it recheck */
+    xTaskNotifyGive(s_task);
+    return ESP_OK;
+}
+
+esp_err_t mesh_outbox_init(const mesh_outbox_config_t *cfg)
+{
+    if (s_task != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    /* a class without a quantum never earns credit and build() spins */
+    for (int c = MESH_CLASS_TELEMETRY; c < MESH_CLASS_MAX; c++) {
+        if (cfg->classes[c].quantum == 0) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    s_latency_ms = cfg->max_latency_ms;
+    for (int c = 0; c < MESH_CLASS_MAX; c++) {
+        class_queue_t *q = &s_queues[c];
+        q->cfg = cfg->classes[c];
+        q->ring = malloc(q->cfg.capacity);
+        if (q->ring == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        q->tokens = q->cfg.burst;
+        q->refill_us = esp_timer_get_time();
+    }
+    s_lock = xSemaphoreCreateMutex();
+    s_send_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL || s_send_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(outbox_task, "MPOUT", 3072, NULL, 5, &s_task) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t mesh_outbox_put(uint8_t type, uint8_t flags, const void *payload, uint16_t len)
+{
+    return put(type, flags, 0, NULL, 0, payload, len);
+}
+
+esp_err_t mesh_outbox_relay(const mesh_addr_t *origin, const mesh_frame_hdr_t *hdr, const uint8_t *payload)
+{
+    esp_err_t err;
+    if (hdr->type == MESH_MSG_RELAY) {
+        /* already wrapped further down the tree */
+        err = put(MESH_MSG_RELAY, hdr->flags, hdr->age_ms, NULL, 0, payload, hdr->len);
+    } else {
+        uint8_t head[6 + MESH_FRAME_HDR_LEN];
+        memcpy(head, origin->addr, 6);
+        memcpy(head + 6, hdr, MESH_FRAME_HDR_LEN);
+        err = put(MESH_MSG_RELAY, hdr->flags, hdr->age_ms, head, sizeof(head), payload, hdr->len);
+    }
+    if (err == ESP_OK) {
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        s_stats.relayed++;
+        xSemaphoreGive(s_lock);
+    }
+    return err;
+}
+
+void mesh_outbox_set_parent(const mesh_addr_t *parent)
+{
+    if (s_lock == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_has_parent = parent != NULL;
+    if (parent) {
+        s_parent = *parent;
+    }
+    xSemaphoreGive(s_lock);
+}
+
+esp_err_t mesh_outbox_flush(void)
+{
+    return flush(NULL);
+}
+
+void mesh_outbox_stats(mesh_outbox_stats_t *out)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *out = s_stats;
+    xSemaphoreGive(s_lock);
+}
+
+void mesh_outbox_class_stats(mesh_class_t cls, mesh_class_stats_t *out)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *out = s_queues[cls].stats;
+    xSemaphoreGive(s_lock);
+}
@@ -0,0 +1,449 @@
+/* Mesh reliable delivery, see mesh_reliable.h */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "mesh_frame.h"
+#include "mesh_outbox.h"
+#include "mesh_reliable.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+/*******************************************************
+ *                Constants
+ *******************************************************/
+#define ACK_BITS         (32)
+
+/*******************************************************
+ *                Structures
+ *******************************************************/
+/* ahead of the wrapped message */
+typedef struct {
+    uint16_t boot;              /* sender's boot, sequences restart with it */
+    uint16_t seq;
+    uint16_t floor;             /* oldest the sender still waits for */
+} __attribute__((packed)) reliable_hdr_t;
+
+typedef struct {
+    uint16_t boot;
+    uint16_t next;              /* lowest sequence not yet received */
+    uint32_t bitmap;            /* bit i: next + i received */
+} __attribute__((packed)) reliable_ack_t;
+
+/* node: a message waiting for its ack */
+typedef struct {
+    bool used;
+    uint16_t seq;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t len;
+    uint8_t data[MESH_RELIABLE_MAX_PAYLOAD];
+    uint32_t tag;
+    uint32_t retries;
+    int64_t first_us;
+    int64_t due_us;
+} pending_t;
+
+/* root: what one node has delivered */
+typedef struct {
+    bool used;
+    bool ack_owed;
+    mesh_addr_t addr;
+    uint16_t boot;
+    uint16_t next;
+    uint32_t bitmap;
+    int64_t seen_us;
+    int64_t ack_due_us;
+} peer_t;
+
+/*******************************************************
+ *                Variable Definitions
+ *******************************************************/
+static const char *RELIABLE_TAG = "mesh_reliable";
+
+static mesh_reliable_config_t s_cfg;
+static uint16_t s_boot;
+static uint16_t s_next_seq = 0;
+static pending_t s_pending[MESH_RELIABLE_WINDOW];
+static peer_t *s_peers = NULL;  /* MESH_RELIABLE_PEERS, allocated once the node is root */
+
+static mesh_reliable_stats_t s_stats;
+static uint64_t s_latency_sum_ms = 0;
+
+static SemaphoreHandle_t s_lock;
+static TaskHandle_t s_task;
+
+/*******************************************************
+ *                Function Definitions
+ *******************************************************/
+static int64_t rto_us(const pending_t *p)
+{
+    uint64_t ms = (p->flags & MESH_FRAME_FLAG_URGENT) ? s_cfg.rto_ms : s_cfg.rto_batched_ms;
+    ms <<= p->retries < 16 ? p->retries : 16;
+    if (ms > s_cfg.max_backoff_ms) {
+        ms = s_cfg.max_backoff_ms;
+    }
+    return ms * 1000;
+}
+
+static uint16_t floor_seq(void)
+{
+    uint16_t floor = s_next_seq;
+    for (int i = 0; i < MESH_RELIABLE_WINDOW; i++) {
+        if (s_pending[i].used && (int16_t) (s_pending[i].seq - floor) < 0) {
+            floor = s_pending[i].seq;
+        }
+    }
+    return floor;
+}
+
+/* called with s_lock held, the outbox copies the message */
+static esp_err_t transmit(const pending_t *p)
+{
+    uint8_t buf[sizeof(reliable_hdr_t) + MESH_FRAME_HDR_LEN + MESH_RELIABLE_MAX_PAYLOAD];
+    reliable_hdr_t rh = {
+        .boot = s_boot,
+        .seq = p->seq,
+        .floor = floor_seq(),
+    };
+    memcpy(buf, &rh, sizeof(rh));
+    size_t n = sizeof(rh) + mesh_frame_put(buf + sizeof(rh), sizeof(buf) - sizeof(rh),
+                                           p->type, p->flags, p->data, p->len);
+    return mesh_outbox_put(MESH_MSG_RELIABLE, p->flags, buf, n);
+}
+
+/* sends what is due again, returns true with a copy of one message that
+   ran out of retries, which is then forgotten */
+static bool retransmit(int64_t now, pending_t *failed)
+{
+    bool out = false;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < MESH_RELIABLE_WINDOW; i++) {
+        pending_t *p = &s_pending[i];
+        if (!p->used || p->due_us > now) {
+            continue;
+        }
+        if (p->retries >= s_cfg.max_retries) {
+            *failed = *p;
+            p->used = false;
+            s_stats.failed++;
+            out = true;
+            break;
+        }
+        p->retries++;
+        s_stats.retries++;
+        /* a refused put waits for the next back-off like a lost packet */
+        transmit(p);
+        p->due_us = now + rto_us(p);
+    }
+    xSemaphoreGive(s_lock);
+    return out;
+}
+
+/* returns true with one ack that is due, clearing it */
+static bool ack_take(int64_t now, mesh_addr_t *to, reliable_ack_t *ack)
+{
+    bool out = false;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; s_peers && i < MESH_RELIABLE_PEERS; i++) {
+        peer_t *peer = &s_peers[i];
+        if (!peer->used || !peer->ack_owed || peer->ack_due_us > now) {
+            continue;
+        }
+        peer->ack_owed = false;
+        *to = peer->addr;
+        ack->boot = peer->boot;
+        ack->next = peer->next;
+        ack->bitmap = peer->bitmap;
+        out = true;
+        break;
+    }
+    xSemaphoreGive(s_lock);
+    return out;
+}
+
+static void ack_send(const mesh_addr_t *to, const reliable_ack_t *ack)
+{
+    uint8_t buf[MESH_FRAME_HDR_LEN + sizeof(*ack)];
+    size_t n = mesh_frame_put(buf, sizeof(buf), MESH_MSG_ACK, 0, ack, sizeof(*ack));
+    esp_err_t err = mesh_frame_send(to, buf, n);
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (err == ESP_OK) {
+        s_stats.acks_sent++;
+    } else {
+        s_stats.ack_errors++;
+    }
+    xSemaphoreGive(s_lock);
+    if (err != ESP_OK) {
+        ESP_LOGW(RELIABLE_TAG, "ack to "MACSTR" failed: 0x%x", MAC2STR(to->addr), err);
+    }
+}
+
+static TickType_t next_wait(int64_t now)
+{
+    int64_t due = INT64_MAX;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < MESH_RELIABLE_WINDOW; i++) {
+        if (s_pending[i].used && s_pending[i].due_us < due) {
+            due = s_pending[i].due_us;
+        }
+    }
+    for (int i = 0; s_peers && i < MESH_RELIABLE_PEERS; i++) {
+        if (s_peers[i].used && s_peers[i].ack_owed && s_peers[i].ack_due_us < due) {
+            due = s_peers[i].ack_due_us;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    if (due == INT64_MAX) {
+        return portMAX_DELAY;
+    }
+    return due <= now ? 0 : pdMS_TO_TICKS((due - now) / 1000) + 1;
+}
+
+static void reliable_task(void *arg)
+{
+    pending_t failed;
+    mesh_addr_t to;
+    reliable_ack_t ack;
+
+    while (1) {
+        int64_t now = esp_timer_get_time();
+        while (retransmit(now, &failed)) {
+            ESP_LOGW(RELIABLE_TAG, "%s #%u undelivered after %u retries",
+                     mesh_frame_type_name(failed.type), failed.seq, failed.retries);
+            if (s_cfg.on_failed) {
+                s_cfg.on_failed(failed.type, failed.tag, failed.data, failed.len, s_cfg.arg);
+            }
+        }
+        while (ack_take(now, &to, &ack)) {
+            ack_send(&to, &ack);
+        }
+        TickType_t wait = next_wait(esp_timer_get_time());
+        if (wait) {
+            ulTaskNotifyTake(pdTRUE, wait);
+        }
+    }
+}
+
+esp_err_t mesh_reliable_init(const mesh_reliable_config_t *cfg)
+{
+    if (s_task != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_cfg = *cfg;
+    /* a root that still remembers the last boot must not take the new
+       sequences for old ones */
+    s_boot = esp_random();
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(reliable_task, "MPREL", 3072, NULL, 5, &s_task) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t mesh_reliable_send(uint8_t type, uint8_t flags, const void *payload, uint16_t len, uint32_t tag)
+{
+    if (s_task == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (len > MESH_RELIABLE_MAX_PAYLOAD) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    pending_t *p = NULL;
+    for (int i = 0; i < MESH_RELIABLE_WINDOW && p == NULL; i++) {
+        if (!s_pending[i].used) {
+            p = &s_pending[i];
+        }
+    }
+    if (p == NULL) {
+        xSemaphoreGive(s_lock);
+        return ESP_ERR_NO_MEM;
+    }
+    p->seq = s_next_seq;
+    p->type = type;
+    p->flags = flags;
+    p->len = len;
+    memcpy(p->data, payload, len);
+    p->tag = tag;
+    p->retries = 0;
+    p->first_us = esp_timer_get_time();
+    p->due_us = p->first_us + rto_us(p);
+    esp_err_t err = transmit(p);
+    if (err == ESP_OK) {
+        p->used = true;
+        s_next_seq++;
+        s_stats.sent++;
+    }
+    xSemaphoreGive(s_lock);
+
+    if (err == ESP_OK) {
+        xTaskNotifyGive(s_task);
+    }
+    return err;
+}
+
+static void peer_advance(peer_t *peer, uint16_t next)
+{
+    uint16_t shift = next - peer->next;
+    peer->bitmap = shift >= ACK_BITS ? 0 : peer->bitmap >> shift;
+    peer->next = next;
+    while (peer->bitmap & 1) {
+        peer->bitmap >>= 1;
+        peer->next++;
+    }
+}
+
+static peer_t *peer_find(const mesh_addr_t *addr, uint16_t boot, uint16_t floor, int64_t now)
+{
+    peer_t *peer = NULL;
+    peer_t *spare = NULL;
+    for (int i = 0; i < MESH_RELIABLE_PEERS && peer == NULL; i++) {
+        peer_t *p = &s_peers[i];
+        if (!p->used) {
+            spare = spare && !spare->used ? spare : p;
+        } else if (memcmp(p->addr.addr, addr->addr, sizeof(addr->addr)) == 0) {
+            peer = p;
+        } else if (spare == NULL || (spare->used && p->seen_us < spare->seen_us)) {
+            spare = p;
+        }
+    }
+    /* a new node, or a new boot of one, starts from what it still waits for */
+    if (peer == NULL || peer->boot != boot) {
+        if (peer == NULL) {
+            peer = spare;
+            memset(peer, 0, sizeof(*peer));
+            peer->used = true;
+            peer->addr = *addr;
+        }
+        peer->boot = boot;
+        peer->next = floor;
+        peer->bitmap = 0;
+    }
+    peer->seen_us = now;
+    return peer;
+}
+
+void mesh_reliable_receive(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr, const uint8_t *payload)
+{
+    reliable_hdr_t rh;
+    mesh_frame_hdr_t inner;
+    size_t off = 0;
+    if (hdr->len < sizeof(rh)) {
+        return;
+    }
+    memcpy(&rh, payload, sizeof(rh));
+    const uint8_t *msg = mesh_frame_next(payload + sizeof(rh), hdr->len - sizeof(rh), &off, &inner);
+    if (msg == NULL) {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    /* only the root receives, a leaf never carries the table */
+    if (s_peers == NULL) {
+        s_peers = calloc(MESH_RELIABLE_PEERS, sizeof(peer_t));
+        if (s_peers == NULL) {
+            xSemaphoreGive(s_lock);
+            ESP_LOGE(RELIABLE_TAG, "no memory for the peer table");
+            return;
+        }
+    }
+    peer_t *peer = peer_find(from, rh.boot, rh.floor, now);
+    /* the sender gave up on everything below its floor */
+    if ((int16_t) (rh.floor - peer->next) > 0) {
+        peer_advance(peer, rh.floor);
+    }
+    int16_t d = rh.seq - peer->next;
+    /* moving next up to fit it in would give up on sequences below it
+       that the node still sends, so it waits for its retransmit */
+    bool refused = d >= ACK_BITS;
+    bool duplicate = d < 0 || (!refused && (peer->bitmap & (1u << d)));
+    if (refused) {
+        s_stats.refused++;
+    } else if (!duplicate) {
+        peer->bitmap |= 1u << d;
+        peer_advance(peer, peer->next);
+        s_stats.received++;
+    } else {
+        s_stats.duplicates++;
+    }
+    if (!peer->ack_owed) {
+        peer->ack_owed = true;
+        peer->ack_due_us = now + s_cfg.ack_delay_ms * 1000;
+    }
+    xSemaphoreGive(s_lock);
+    xTaskNotifyGive(s_task);
+
+    if (!refused && !duplicate && inner.type != MESH_MSG_RELIABLE && inner.type != MESH_MSG_ACK
+            && inner.type != MESH_MSG_RELAY) {
+        mesh_frame_deliver(from, &inner, msg);
+    }
+}
+
+void mesh_reliable_ack(const mesh_addr_t *from, const mesh_frame_hdr_t *hdr, const uint8_t *payload)
+{
+    reliable_ack_t ack;
+    if (hdr->len != sizeof(ack)) {
+        return;
+    }
+    memcpy(&ack, payload, sizeof(ack));
+    if (ack.boot != s_boot) {
+        return;
+    }
+
+    /* reported once the lock is released, the caller may write flash */
+    struct {
+        uint8_t type;
+        uint32_t tag;
+    } acked[MESH_RELIABLE_WINDOW];
+    int count = 0;
+
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < MESH_RELIABLE_WINDOW; i++) {
+        pending_t *p = &s_pending[i];
+        if (!p->used) {
+            continue;
+        }
+        int16_t d = p->seq - ack.next;
+        if (d >= 0 && (d >= ACK_BITS || !(ack.bitmap & (1u << d)))) {
+            continue;
+        }
+        p->used = false;
+        acked[count].type = p->type;
+        acked[count].tag = p->tag;
+        count++;
+        uint32_t ms = (now - p->first_us) / 1000;
+        s_stats.acked++;
+        s_latency_sum_ms += ms;
+        if (ms > s_stats.latency_max_ms) {
+            s_stats.latency_max_ms = ms;
+        }
+    }
+    xSemaphoreGive(s_lock);
+
+    for (int i = 0; i < count && s_cfg.on_acked; i++) {
+        s_cfg.on_acked(acked[i].type, acked[i].tag, s_cfg.arg);
+    }
+}
+
+void mesh_reliable_stats(mesh_reliable_stats_t *out)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *out = s_stats;
+    out->pending = 0;
+    for (int i = 0; i < MESH_RELIABLE_WINDOW; i++) {
+        out->pending += s_pending[i].used;
+    }
+    out->latency_avg_ms = s_stats.acked ? s_latency_sum_ms / s_stats.acked : 0;
+    xSemaphoreGive(s_lock);
+}